@@ -23,15 +23,30 @@ class Instruction;
 enum class InstructionEncodeKind {
   STAGED,
   COMMIT,
-  COMMIT_ATOMIC
+  COMMIT_ATOMIC,
+
+  // Commit an instruction by re-using the bytes produced when it was stage
+  // encoded, and only re-encode it if those bytes depend on where the
+  // instruction was staged in a way that can't be patched. The staged bytes
+  // come from the encoder's staged bytes buffer; without one, this is the same
+  // as `COMMIT`.
+  //
+  // Note: Instructions must not be changed between being stage encoded and
+  //       being committed, except for their branch targets.
+  COMMIT_STAGED
 };
 
 // Manages encoding and decoding of instructions.
 class InstructionEncoder {
  public:
-  // Initialize the instruction decoder.
-  inline explicit InstructionEncoder(InstructionEncodeKind encode_kind_)
-      : encode_kind(encode_kind_) {}
+  // Initialize the instruction encoder. If `staged_bytes_` is non-null, then
+  // `STAGED` encoding appends the bytes of each encoded instruction to it, and
+  // `COMMIT_STAGED` encoding consumes those bytes in the same order. The
+  // buffer must have room for `MAX_INSTRUCTION_SIZE_BYTES` per instruction.
+  inline explicit InstructionEncoder(InstructionEncodeKind encode_kind_,
+                                     uint8_t *staged_bytes_=nullptr)
+      : encode_kind(encode_kind_),
+        staged_bytes(staged_bytes_) {}
 
   // Encode an instruction, and update the program counter by reference
   // to point to the next logical instruction. Returns `true` if the
@@ -51,6 +66,10 @@ class InstructionEncoder {
 
   InstructionEncodeKind encode_kind;
 
+  // The staged bytes of the next instruction to be encoded. This is `nullptr`
+  // if the encoder doesn't have a staged bytes buffer.
+  uint8_t *staged_bytes;
+
   GRANARY_DISALLOW_COPY_AND_ASSIGN(InstructionEncoder);
 };
 
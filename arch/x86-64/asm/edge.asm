@@ -53,6 +53,31 @@ DEFINE_FUNC(granary_arch_enter_direct_edge)
     ret
 END_FUNC(granary_arch_enter_direct_edge)
 
+// Count an execution of a profiled direct edge. When the edge's target becomes
+// hot, the edge is redirected back into Granary, so that the next jump through
+// `DirectEdge::entry_target_pc` enters Granary and translates a hot trace.
+//
+// Note: This does not modify the flags.
+//
+// Note: On entry, `RDI` is a pointer to a `DirectEdge` data structure.
+DEFINE_FUNC(granary_arch_profile_direct_edge)
+    push    rcx
+    movzx   ecx, word ptr [rdi + 48]  // `DirectEdge::num_executions_until_hot`.
+    jrcxz   L(direct_edge_done)  // Already hot.
+    lea     ecx, [rcx - 1]
+    mov     word ptr [rdi + 48], cx
+    jrcxz   L(direct_edge_hot)
+L(direct_edge_done):
+    pop     rcx
+    ret
+
+L(direct_edge_hot):
+    mov     rcx, qword ptr [rdi + 40]  // `DirectEdge::enter_granary_pc`.
+    mov     qword ptr [rdi], rcx  // `DirectEdge::entry_target_pc`.
+    pop     rcx
+    ret
+END_FUNC(granary_arch_profile_direct_edge)
+
 // Context switch into granary. This is used by `edge.asm` to generate a
 // profiled and an unprofiled version of the edge entrypoint code. The profiled
 // version will increment edge counters, whereas the unprofiled version will
@@ -64,7 +89,41 @@ END_FUNC(granary_arch_enter_direct_edge)
 //       `RSI` is the native target PC.
 //
 // Note: `RDI` is live on exit, and so must be saved/restored.
+//
+// Note: On exit, `RSI` is the address of the out-edge template that matches
+//       the native target PC.
 DEFINE_FUNC(granary_arch_enter_indirect_edge)
+    // Try to find the target in the `IndirectBranchCache` of the edge before
+    // entering Granary. The target can be in one of two entries, starting at
+    // `IndirectBranchCache::IndexOf(RSI)`. Empty entries have a null
+    // `app_pc`, so a null target must always miss.
+    push    rax
+    push    rcx
+    test    rsi, rsi
+    jz      L(indirect_cache_miss)
+    mov     rax, [rdi + 8]  // `IndirectEdge::cache`.
+    mov     rcx, rsi
+    shr     rcx, 4
+    xor     rcx, rsi
+    and     rcx, 127  // `IndirectBranchCache::kNumEntries - 1`.
+    shl     rcx, 4  // `sizeof(IndirectBranchCacheEntry)`.
+    lea     rcx, [rax + rcx + 16]  // `IndirectBranchCache::entries`.
+    cmp     rsi, [rcx]
+    je      L(indirect_cache_hit)
+    add     rcx, 16
+    cmp     rsi, [rcx]
+    jne     L(indirect_cache_miss)
+L(indirect_cache_hit):
+    inc     qword ptr [rax]  // `IndirectBranchCache::num_hits`.
+    mov     rsi, [rcx + 8]  // `IndirectBranchCacheEntry::cache_pc`.
+    pop     rcx
+    pop     rax
+    ret
+
+L(indirect_cache_miss):
+    pop     rcx
+    pop     rax
+
     push    rax
     push    rdi
     push    rcx
@@ -83,6 +142,7 @@ DEFINE_FUNC(granary_arch_enter_indirect_edge)
     ALIGN_STACK_16(r15)
 
     call    granary_enter_indirect_edge
+    mov     rsi, rax
 
     UNALIGN_STACK
 
@@ -103,4 +163,82 @@ DEFINE_FUNC(granary_arch_enter_indirect_edge)
     ret
 END_FUNC(granary_arch_enter_indirect_edge)
 
+// Offset of the `os::ShadowStack` from the base of the `FS` (user) or `GS`
+// (kernel) segment. Initialized by `Context::Context`.
+DEFINE_UINT64(granary_shadow_stack_offset)
+
+#define SHADOW_STACK(disp) GRANARY_IF_USER_ELSE(fs, gs):[rax + disp]
+
+// Push a `ReturnSite` onto the shadow stack of the current thread.
+//
+// Note: This does not modify the flags.
+//
+// Note: On entry, `[RSP + 8]` is the `ReturnSite` to push. It is popped on
+//       exit.
+DEFINE_FUNC(granary_arch_push_return_site)
+    push    rax
+    push    rcx
+    mov     rax, qword ptr [rip + granary_shadow_stack_offset]
+    movzx   ecx, byte ptr SHADOW_STACK(0)  // `ShadowStack::top`.
+    lea     ecx, [rcx + 1]
+    mov     byte ptr SHADOW_STACK(0), cl
+    movzx   ecx, cl  // Wrap around.
+    lea     rcx, [rax + rcx * 8 + 16]  // `ShadowStack::entries`.
+    mov     rax, qword ptr [rsp + 24]
+    mov     qword ptr GRANARY_IF_USER_ELSE(fs, gs):[rcx], rax
+    pop     rcx
+    pop     rax
+    ret     8
+END_FUNC(granary_arch_push_return_site)
+
+// Pop a `ReturnSite` off of the shadow stack of the current thread, and try to
+// return directly to its code cache address.
+//
+// Note: On entry, `[RSP]` is the return address of the fall-back code, which
+//       returns through an indirect edge, and `[RSP + 8]` is the native return
+//       address of the function return being translated.
+//
+// Note: If the native return address matches the popped `ReturnSite`, then
+//       both return addresses are popped, and control transfers to
+//       `ReturnSite::cache_pc`. Otherwise this returns to the fall-back code.
+DEFINE_FUNC(granary_arch_pop_return_site)
+    pushfq
+    push    rax
+    push    rcx
+    mov     rax, qword ptr [rip + granary_shadow_stack_offset]
+    movzx   ecx, byte ptr SHADOW_STACK(0)  // `ShadowStack::top`.
+    dec     byte ptr SHADOW_STACK(0)
+    lea     rcx, [rax + rcx * 8 + 16]  // `ShadowStack::entries`.
+    mov     rcx, qword ptr GRANARY_IF_USER_ELSE(fs, gs):[rcx]
+    test    rcx, rcx
+    jz      L(return_site_miss)
+    mov     rax, qword ptr [rcx]  // `ReturnSite::native_pc`.
+    cmp     rax, qword ptr [rsp + 32]
+    jne     L(return_site_miss)
+    mov     rax, qword ptr [rcx + 8]  // `ReturnSite::cache_pc`.
+    test    rax, rax
+    jz      L(return_site_unresolved)
+
+    // Replace the native return address with the cache return address, and
+    // skip over the fall-back code.
+    mov     qword ptr [rsp + 32], rax
+    pop     rcx
+    pop     rax
+    popfq
+    lea     rsp, [rsp + 8]
+    ret
+
+    // Let Granary resolve `ReturnSite::cache_pc` when the fall-back code
+    // enters the indirect edge.
+L(return_site_unresolved):
+    mov     rax, qword ptr [rip + granary_shadow_stack_offset]
+    mov     qword ptr SHADOW_STACK(8), rcx  // `ShadowStack::unresolved_site`.
+
+L(return_site_miss):
+    pop     rcx
+    pop     rax
+    popfq
+    ret
+END_FUNC(granary_arch_pop_return_site)
+
 END_FILE
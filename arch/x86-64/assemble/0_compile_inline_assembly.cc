@@ -3,6 +3,8 @@
 #define GRANARY_INTERNAL
 #define GRANARY_ARCH_INTERNAL
 
+#include "granary/base/lock.h"
+#include "granary/base/new.h"
 #include "granary/base/string.h"
 
 #include "granary/cfg/block.h"
@@ -31,90 +33,249 @@ extern FlagsSet IFORM_FLAGS[];
 
 namespace {
 
+enum : uint8_t {
+  kInvalidInlineVar = 0xFF
+};
+
+enum : size_t {
+  kNumInlineAssemblyTemplateBuckets = 256
+};
+
+// Describes how an inline assembly instruction is instantiated.
+enum InlineInstructionKind : uint8_t {
+  kInlineInstructionNative,  // E.g. `MOV r64 %0, r64 %1;`.
+  kInlineInstructionLabel,  // `@LABEL %n:`.
+  kInlineInstructionCold,  // `@COLD;`.
+  kInlineInstructionFrozen  // `@FROZEN;`.
+};
+
+// Describes how an explicit operand of an inline assembly instruction is
+// instantiated.
+enum InlineOperandKind : uint8_t {
+  // The operand is fully specified by the assembly, e.g. `r64 RAX`, `i8 1`,
+  // or `m64 [RSP + 8]`.
+  kInlineOperandLiteral,
+
+  // The operand is a variable, e.g. `r64 %0`, `i32 %1`, `m64 %2`, or `l %3`.
+  kInlineOperandRegisterVar,
+  kInlineOperandImmediateVar,
+  kInlineOperandMemoryVar,
+  kInlineOperandLabelVar,
+
+  // The operand is a memory operand where some of the segment, base, index,
+  // or displacement come from variables, e.g. `m64 [%0 + 8]`.
+  kInlineOperandCompoundMemory
+};
+
+// Template for an explicit operand of an inline assembly instruction.
+struct InlineOperandTemplate {
+  InlineOperandKind kind;
+
+  // Variable referenced by a register, immediate, memory, or label operand.
+  uint8_t var_num;
+
+  // Variables referenced by the components of a compound memory operand.
+  uint8_t segment_var;
+  uint8_t base_var;
+  uint8_t index_var;
+  uint8_t disp_var;
+
+  // Variable that is either the index or the displacement of a compound
+  // memory operand, e.g. `%1` in `[%0 + %1]`. Which one it is depends on
+  // whether `%1` is bound to a register or to an immediate.
+  uint8_t index_or_disp_var;
+};
+
+// Template for a single inline assembly instruction.
+class InlineInstructionTemplate {
+ public:
+  InlineInstructionTemplate(void);
+
+  GRANARY_DECLARE_NEW_ALLOCATOR(InlineInstructionTemplate, {
+    kAlignment = 1
+  })
+
+  // The next instruction of the template.
+  InlineInstructionTemplate *next;
+
+  InlineInstructionKind kind;
+
+  // The label variable defined by a `@LABEL`.
+  uint8_t label_var;
+
+  // How each explicit operand of `instr` is instantiated.
+  InlineOperandTemplate ops[arch::Instruction::MAX_NUM_EXPLICIT_OPERANDS];
+
+  // Partially instantiated instruction. The iclass, iform, prefixes, literal
+  // operands, and operand actions are all filled in. Variable operands are
+  // filled in with placeholders having the right types and widths.
+  arch::Instruction instr;
+
+ private:
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(InlineInstructionTemplate);
+};
+
+// Cheap summary of the contents of some inline assembly. Templates are found
+// by the addresses of their assembly, and this makes sure that the contents
+// at an address haven't changed since they were parsed, e.g. because the
+// assembly is in a buffer rather than in a string literal.
+struct InlineAssemblyFingerprint {
+  size_t length;
+  uint64_t first_word;
+  uint64_t last_word;
+};
+
+// Template for a block of inline assembly. Parsing inline assembly (and
+// selecting the XED instructions for it) is expensive, so each block of
+// inline assembly is parsed once into a template, and each later use of that
+// assembly only substitutes in the variables of the current scope.
+class InlineAssemblyTemplate {
+ public:
+  InlineAssemblyTemplate(const char *assembly_,
+                         const InlineAssemblyFingerprint &fingerprint_,
+                         InlineInstructionTemplate *instrs_);
+  ~InlineAssemblyTemplate(void);
+
+  GRANARY_DECLARE_NEW_ALLOCATOR(InlineAssemblyTemplate, {
+    kAlignment = 1
+  })
+
+  // The next template in the same bucket.
+  InlineAssemblyTemplate *next;
+
+  // The assembly from which this template was parsed.
+  const char * const assembly;
+
+  // Summary of the contents of `assembly` when it was parsed.
+  const InlineAssemblyFingerprint fingerprint;
+
+  // The parsed instructions.
+  InlineInstructionTemplate * const instrs;
+
+ private:
+  InlineAssemblyTemplate(void) = delete;
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(InlineAssemblyTemplate);
+};
+
+GRANARY_IMPLEMENT_NEW_ALLOCATOR(InlineInstructionTemplate)
+GRANARY_IMPLEMENT_NEW_ALLOCATOR(InlineAssemblyTemplate)
+
+InlineInstructionTemplate::InlineInstructionTemplate(void)
+    : next(nullptr),
+      kind(kInlineInstructionNative),
+      label_var(kInvalidInlineVar),
+      instr() {
+  for (auto &op : ops) {
+    op.kind = kInlineOperandLiteral;
+    op.var_num = kInvalidInlineVar;
+    op.segment_var = kInvalidInlineVar;
+    op.base_var = kInvalidInlineVar;
+    op.index_var = kInvalidInlineVar;
+    op.disp_var = kInvalidInlineVar;
+    op.index_or_disp_var = kInvalidInlineVar;
+  }
+}
+
+InlineAssemblyTemplate::InlineAssemblyTemplate(
+    const char *assembly_, const InlineAssemblyFingerprint &fingerprint_,
+    InlineInstructionTemplate *instrs_)
+    : next(nullptr),
+      assembly(assembly_),
+      fingerprint(fingerprint_),
+      instrs(instrs_) {}
+
+InlineAssemblyTemplate::~InlineAssemblyTemplate(void) {
+  for (auto instr = instrs; instr; ) {
+    auto next_instr = instr->next;
+    delete instr;
+    instr = next_instr;
+  }
+}
+
+// Returns true if instructions with the iclass `iclass` use an effective
+// address operand.
+//
+// Note: These need to be kept consistent with `ConvertMemoryOperand` in
+//       `decode.cc` and with `MemoryBuilder::Build`.
+//
+// TODO(pag): This should be turned into a utility function.
+static bool IsEffectiveAddress(xed_iclass_enum_t iclass) {
+  return XED_ICLASS_BNDCL == iclass ||
+         XED_ICLASS_BNDCN == iclass ||
+         XED_ICLASS_BNDCU == iclass ||
+         XED_ICLASS_BNDMK == iclass ||
+         XED_ICLASS_CLFLUSH == iclass ||
+         XED_ICLASS_CLFLUSHOPT == iclass ||
+         XED_ICLASS_LEA == iclass ||
+         (XED_ICLASS_PREFETCHNTA <= iclass &&
+          XED_ICLASS_PREFETCH_RESERVED >= iclass);
+}
+
+// Finalize a compound memory operand once its base, index, scale, and
+// displacement are all known.
+static void FinalizeCompoundMemoryOperand(arch::Operand *op) {
+  GRANARY_ASSERT(op->mem.base.IsValid() || op->mem.index.IsValid());
+  op->is_compound = op->mem.disp || 1 < op->mem.scale ||
+                    (op->mem.base.IsValid() && op->mem.index.IsValid());
+
+  // Canonicalize to use base reg over index reg when it makes sense.
+  if (!op->is_compound && op->mem.index.IsValid()) {
+    op->mem.base = op->mem.index;
+    op->mem.index = VirtualRegister();
+    op->mem.scale = 0;
+  }
+
+  // TODO(pag): Uggh, get rid of this nastiness.
+  if (!op->is_compound) {
+    op->reg = op->mem.base;
+  }
+}
+
 // Not very pretty, but implements a simple top-down parser for parsing
-// Granary's inline assembly instructions.
+// Granary's inline assembly instructions into templates.
 class InlineAssemblyParser {
  public:
-  InlineAssemblyParser(Trace *cfg_,
-                       InlineAssemblyScope *scope_,
-                       DecodedBlock *block_,
-                       Instruction *instr_,
-                       const char *ch_)
-      : op(nullptr),
-        cfg(cfg_),
-        scope(scope_),
-        block(block_),
-        instr(instr_),
+  explicit InlineAssemblyParser(const char *ch_)
+      : tmpl(nullptr),
+        data(nullptr),
+        op(nullptr),
+        op_tmpl(nullptr),
         ch(ch_),
         num_immediates(0) {}
 
-  void ParseInstructions(void) {
+  // Parse the assembly into a list of instruction templates.
+  InlineInstructionTemplate *ParseInstructions(void) {
+    InlineInstructionTemplate *first_tmpl(nullptr);
+    auto next_tmpl = &first_tmpl;
     while (*ch) {
       ConsumeWhiteSpace();
       if (!*ch) break;
-      memset(&data, 0, sizeof data);
+      tmpl = new InlineInstructionTemplate;
+      data = &(tmpl->instr);
       num_immediates = 0;
-      op = &(data.ops[0]);
+      op = &(data->ops[0]);
+      op_tmpl = &(tmpl->ops[0]);
       ParseInstruction();
+      *next_tmpl = tmpl;
+      next_tmpl = &(tmpl->next);
     }
+    return first_tmpl;
   }
 
  private:
-  // Returns true if this instruction uses an effective address operand.
-  //
-  // Note: These need to be kept consistent with `ConvertMemoryOperand` in
-  //       `decode.cc` and with `MemoryBuilder::Build`.
-  //
-  // TODO(pag): This should be turned into a utility function.
-  bool IsEffectiveAddress(void) {
-    return XED_ICLASS_BNDCL == data.iclass ||
-           XED_ICLASS_BNDCN == data.iclass ||
-           XED_ICLASS_BNDCU == data.iclass ||
-           XED_ICLASS_BNDMK == data.iclass ||
-           XED_ICLASS_CLFLUSH == data.iclass ||
-           XED_ICLASS_CLFLUSHOPT == data.iclass ||
-           XED_ICLASS_LEA == data.iclass ||
-           (XED_ICLASS_PREFETCHNTA <= data.iclass &&
-            XED_ICLASS_PREFETCH_RESERVED >= data.iclass);
-  }
-
-  unsigned ParseVar(void) {
+  uint8_t ParseVar(void) {
     Accept('%');
     ParseWord();
     unsigned var_num = kMaxNumInlineVars;
     DeFormat(buff, "%u", &var_num);
     GRANARY_ASSERT(kMaxNumInlineVars > var_num);
-    return var_num;
-  }
-
-  // Get a label.
-  void InitLabelVar(unsigned var_num)  {
-    auto &aop(scope->vars[var_num]);
-    if (!scope->var_is_initialized[var_num]) {
-      scope->var_is_initialized[var_num] = true;
-      aop->annotation_instr = new LabelInstruction;
-      aop->is_annotation_instr = true;
-      aop->type = XED_ENCODER_OPERAND_TYPE_BRDISP;
-      aop->width = arch::ADDRESS_WIDTH_BITS;
-    }
-  }
-
-  // Get a virtual register.
-  void InitRegVar(unsigned var_num) {
-    auto &aop(scope->vars[var_num]);
-    if (!scope->var_is_initialized[var_num]) {
-      scope->var_is_initialized[var_num] = true;
-      aop->reg = block->AllocateVirtualRegister();
-      aop->type = XED_ENCODER_OPERAND_TYPE_REG;
-      aop->width = arch::GPR_WIDTH_BITS;
-    }
+    return static_cast<uint8_t>(var_num);
   }
 
   // Parse a label instruction.
   void ParseLabelInstruction(void) {
-    auto var_num = ParseVar();
-    InitLabelVar(var_num);
-    instr->InsertBefore(scope->vars[var_num]->annotation_instr);
+    tmpl->kind = kInlineInstructionLabel;
+    tmpl->label_var = ParseVar();
   }
 
   // Parse the next thing as an explicitly state architectural register.
@@ -125,22 +286,12 @@ class InlineAssemblyParser {
         str2xed_reg_enum_t(buff)));
   }
 
-  // Parse the next thisng as an already initialized variable operand, and
-  // return the virtual register associated with that operand.
-  VirtualRegister ParseRegisterVar(void) {
-    auto var_num = ParseVar();
-    ConsumeWhiteSpace();
-    GRANARY_ASSERT(scope->var_is_initialized[var_num]);
-    GRANARY_ASSERT(scope->vars[var_num]->IsRegister());
-    return scope->vars[var_num]->reg.WidenedTo(arch::GPR_WIDTH_BYTES);
-  }
-
-  // Parse the next thing as a generic, already initialized variable.
-  const arch::Operand &ParseOperandVar(void) {
+  // Parse the next thing as a variable operand, and return the number of
+  // that variable.
+  uint8_t ParseOperandVar(void) {
     auto var_num = ParseVar();
     ConsumeWhiteSpace();
-    GRANARY_ASSERT(scope->var_is_initialized[var_num]);
-    return *(scope->vars[var_num]);
+    return var_num;
   }
 
   // Treat this memory operand as a pointer.
@@ -154,10 +305,36 @@ class InlineAssemblyParser {
     }
   }
 
+  // Use either the literal register `reg` or the register variable `reg_var`
+  // as the base register of a compound memory operand.
+  void SetBaseRegister(VirtualRegister reg, uint8_t reg_var) {
+    if (kInvalidInlineVar != reg_var) {
+      op_tmpl->base_var = reg_var;
+    } else {
+      GRANARY_ASSERT(reg.IsValid());
+      op->mem.base = reg;
+    }
+  }
+
+  // Use either the literal register `reg` or the register variable `reg_var`
+  // as the index register of a compound memory operand.
+  void SetIndexRegister(VirtualRegister reg, uint8_t reg_var) {
+    if (kInvalidInlineVar != reg_var) {
+      op_tmpl->index_var = reg_var;
+    } else {
+      GRANARY_ASSERT(reg.IsValid());
+      op->mem.index = reg;
+    }
+    op->mem.scale = 1;
+  }
+
   // Parse a compound memory operand. This is quite tricky and almost nearly
   // handles the full generality of base/disp memory operands, with the ability
   // to mix in input virtual registers and immediates, as well as literal
   // registers and immediates for the various components.
+  //
+  // Components that come from variables are recorded in the operand's
+  // template, and are only filled in when the template is instantiated.
   void ParseCompoundMemoryOperand(void) {
     enum {
       ParseReg,
@@ -169,6 +346,7 @@ class InlineAssemblyParser {
     } state = ParseReg;
 
     VirtualRegister reg;
+    uint8_t reg_var = kInvalidInlineVar;
     Accept('[');
     ConsumeWhiteSpace();
 
@@ -183,7 +361,7 @@ class InlineAssemblyParser {
       switch (state) {
         case ParseReg:
           if (Peek('%')) {
-            reg = ParseRegisterVar();
+            reg_var = ParseOperandVar();
           } else {
             GRANARY_ASSERT(PeekAlpha());
             reg = ParseArchRegister();
@@ -199,8 +377,7 @@ class InlineAssemblyParser {
 
         case InterpretRegAsBase:
         lInterpretRegAsBase:
-          GRANARY_ASSERT(reg.IsValid());
-          op->mem.base = reg;
+          SetBaseRegister(reg, reg_var);
           if (Peek('+')) {
             Accept('+');
             ConsumeWhiteSpace();
@@ -212,9 +389,7 @@ class InlineAssemblyParser {
 
         case InterpretRegAsIndex:
         lInterpretRegAsIndex:
-          GRANARY_ASSERT(reg.IsValid());
-          op->mem.index = reg;
-          op->mem.scale = 1;
+          SetIndexRegister(reg, reg_var);
           if (Peek('*')) {
             Accept('*');
             ConsumeWhiteSpace();
@@ -229,6 +404,7 @@ class InlineAssemblyParser {
           break;
 
         case TryParseIndexOrDisp:
+          reg_var = kInvalidInlineVar;
           if (PeekNumber()) {  // Literal displacement.
             state = ParseDisp;
 
@@ -237,22 +413,17 @@ class InlineAssemblyParser {
             state = InterpretRegAsIndex;
             goto lInterpretRegAsIndex;
 
-          } else if (Peek('%')) {  // Index var reg, or displacement imm reg.
-            auto &aop(ParseOperandVar());
-            if (aop.IsRegister()) {
-              reg = aop.reg.WidenedTo(arch::GPR_WIDTH_BYTES);
+          // Index var reg, or displacement imm reg. If the variable is scaled
+          // or followed by a displacement then it must be an index register;
+          // otherwise, what it is depends on what the variable is bound to.
+          } else if (Peek('%')) {
+            reg_var = ParseOperandVar();
+            if (Peek('*') || Peek('+')) {
               state = InterpretRegAsIndex;
               goto lInterpretRegAsIndex;
-
-            } else if (aop.IsImmediate()) {
-              op->mem.disp = static_cast<int32_t>(aop.imm.as_int);
-
-              // Make sure that we don't lost precision.
-              GRANARY_ASSERT(op->mem.disp == aop.imm.as_int);
-              goto lDone;
-
             } else {
-              GRANARY_ASSERT(false);
+              op_tmpl->index_or_disp_var = reg_var;
+              goto lDone;
             }
           } else {
             GRANARY_ASSERT(false);
@@ -287,10 +458,7 @@ class InlineAssemblyParser {
               DeFormat(buff, "%d", &(op->mem.disp));
             }
           } else if (Peek('%')) {
-            auto &aop(ParseOperandVar());
-            GRANARY_ASSERT(aop.IsImmediate());
-            op->mem.disp = static_cast<int32_t>(aop.imm.as_int);
-            GRANARY_ASSERT(op->mem.disp == aop.imm.as_int);
+            op_tmpl->disp_var = ParseOperandVar();
 
           } else {
             GRANARY_ASSERT(false);
@@ -299,26 +467,17 @@ class InlineAssemblyParser {
       }
     }
   lDone:
-    GRANARY_ASSERT(op->mem.base.IsValid() || op->mem.index.IsValid());
     ConsumeWhiteSpace();
     Accept(']');
 
     op->type = XED_ENCODER_OPERAND_TYPE_MEM;
-    op->is_compound = op->mem.disp || 1 < op->mem.scale ||
-                      (op->mem.base.IsValid() && op->mem.index.IsValid());
-    if (6 == op->mem.disp) {
-
-    }
-    // Canonicalize to use base reg over index reg when it makes sense.
-    if (!op->is_compound && op->mem.index.IsValid()) {
-      op->mem.base = op->mem.index;
-      op->mem.index = VirtualRegister();
-      op->mem.scale = 0;
-    }
-
-    // TODO(pag): Uggh, get rid of this nastiness.
-    if (!op->is_compound) {
-      op->reg = op->mem.base;
+    if (kInvalidInlineVar != op_tmpl->base_var ||
+        kInvalidInlineVar != op_tmpl->index_var ||
+        kInvalidInlineVar != op_tmpl->index_or_disp_var ||
+        kInvalidInlineVar != op_tmpl->disp_var) {
+      op_tmpl->kind = kInlineOperandCompoundMemory;
+    } else {
+      FinalizeCompoundMemoryOperand(op);
     }
   }
 
@@ -344,31 +503,26 @@ class InlineAssemblyParser {
       Accept(':');
       ParseCompoundMemoryOperand();
 
+    // Either a segment register variable (followed by a compound memory
+    // operand), or a memory operand variable.
     } else if (Peek('%')) {
       auto var_num = ParseVar();
-      auto &aop(scope->vars[var_num]);
-      if (aop->IsRegister()) {
-        seg_reg = static_cast<xed_reg_enum_t>(aop->reg.EncodeToNative());
-        GRANARY_ASSERT(seg_reg && XED_REG_DS != seg_reg);
+      if (Peek(':')) {
         Accept(':');
         ParseCompoundMemoryOperand();
+        op_tmpl->kind = kInlineOperandCompoundMemory;
+        op_tmpl->segment_var = var_num;
       } else {
-        GRANARY_ASSERT(aop->IsMemory());
-        *op = *aop;
+        op_tmpl->kind = kInlineOperandMemoryVar;
+        op_tmpl->var_num = var_num;
+        op->type = XED_ENCODER_OPERAND_TYPE_MEM;  // Placeholder.
       }
     }
     op->segment = seg_reg;
-    op->is_effective_address = IsEffectiveAddress();
+    op->is_effective_address = IsEffectiveAddress(data->iclass);
     GRANARY_ASSERT(!(op->is_effective_address && op->segment));
   }
 
-  // Parse a virtual register.
-  void ParseVirtRegisterOperand(void) {
-    auto var_num = ParseVar();
-    InitRegVar(var_num);
-    *op = *(scope->vars[var_num]);
-  }
-
   // Parse an explicitly specified architectural register.
   void ParseArchRegisterOperand(void) {
     ParseWord();
@@ -382,11 +536,13 @@ class InlineAssemblyParser {
   // architectural register.
   void ParseRegisterOperand(unsigned width) {
     if (Peek('%')) {
-      ParseVirtRegisterOperand();
+      op_tmpl->kind = kInlineOperandRegisterVar;
+      op_tmpl->var_num = ParseVar();
+      op->type = XED_ENCODER_OPERAND_TYPE_REG;  // Placeholder.
     } else {
       ParseArchRegisterOperand();
+      op->reg.Widen(width / arch::BYTE_WIDTH_BITS);
     }
-    op->reg.Widen(width / arch::BYTE_WIDTH_BITS);
   }
 
   // Parse an immediate literal operand.
@@ -428,12 +584,9 @@ class InlineAssemblyParser {
   // Parse an immediate operand.
   void ParseImmediateOperand(void) {
     if (Peek('%')) {
-      auto var_num = ParseVar();
-      GRANARY_ASSERT(scope->var_is_initialized[var_num]);
-      auto &aop(scope->vars[var_num]);
-      GRANARY_ASSERT(aop->IsImmediate());
-      *op = *aop;
-
+      op_tmpl->kind = kInlineOperandImmediateVar;
+      op_tmpl->var_num = ParseVar();
+      op->type = XED_ENCODER_OPERAND_TYPE_IMM0;  // Placeholder.
     } else {
       ParseImmediateLiteralOperand();
     }
@@ -442,22 +595,12 @@ class InlineAssemblyParser {
   // Used in branch targets and calculation of effective addresses, for later
   // indirect jumps, return address stuff, etc.
   void ParseLabelOperand(void) {
-    auto var_num = ParseVar();
-    InitLabelVar(var_num);
-    auto &aop(scope->vars[var_num]);
-    auto annot_instr = aop->annotation_instr;
-
-    // Increment the refcount; for branch instructions, the `BranchInstruction`
-    // class does this.
-    if (!data.IsJump()) {
-      if (auto label_instr = DynamicCast<LabelInstruction *>(annot_instr)) {
-        label_instr->DataRef<uintptr_t>() += 1;
-      }
-    }
-
-    *op = *aop;
-    if ((op->is_effective_address = IsEffectiveAddress())) {
+    op_tmpl->kind = kInlineOperandLabelVar;
+    op_tmpl->var_num = ParseVar();
+    if ((op->is_effective_address = IsEffectiveAddress(data->iclass))) {
       op->type = XED_ENCODER_OPERAND_TYPE_PTR;
+    } else {
+      op->type = XED_ENCODER_OPERAND_TYPE_BRDISP;  // Placeholder.
     }
   }
 
@@ -489,11 +632,11 @@ class InlineAssemblyParser {
       if (!buff[0]) return;
 
       if (StringsMatch(buff, "LOCK")) {
-        data.has_prefix_lock = true;
+        data->has_prefix_lock = true;
       } else if (StringsMatch(buff, "REP") || StringsMatch(buff, "REPE")) {
-        data.has_prefix_rep = true;
+        data->has_prefix_rep = true;
       } else if (StringsMatch(buff, "REPNE")) {
-        data.has_prefix_repne = true;
+        data->has_prefix_repne = true;
       } else {
         break;
       }
@@ -510,15 +653,11 @@ class InlineAssemblyParser {
       Accept(':');
       return true;
     } else if (StringsMatch(buff, "@COLD")) {
-      instr->InsertBefore(new AnnotationInstruction(
-          kAnnotationCodeCacheKind,
-          block->IsColdCode() ? kCodeCacheKindFrozen : kCodeCacheKindCold));
+      tmpl->kind = kInlineInstructionCold;
       Accept(';');
       return true;
     } else if (StringsMatch(buff, "@FROZEN")) {
-      instr->InsertBefore(new AnnotationInstruction(
-          kAnnotationCodeCacheKind,
-          block->IsColdCode() ? kCodeCacheKindSubZero : kCodeCacheKindFrozen));
+      tmpl->kind = kInlineInstructionFrozen;
       Accept(';');
       return true;
     } else {
@@ -530,31 +669,25 @@ class InlineAssemblyParser {
   //
   // Note: This re-uses `buff` from `ParseInstructionPrefixes`.
   void ParseInstructionOpcode(void) {
-    data.iclass = str2xed_iclass_enum_t(buff);
-    GRANARY_ASSERT(XED_ICLASS_INVALID != data.iclass);
-    data.category = arch::ICLASS_CATEGORIES[data.iclass];
+    data->iclass = str2xed_iclass_enum_t(buff);
+    GRANARY_ASSERT(XED_ICLASS_INVALID != data->iclass);
+    data->category = arch::ICLASS_CATEGORIES[data->iclass];
   }
 
-
-  // Fix-up the operands by matching the instruction to a specific instruction
-  // selection, and then super-imposing the r/w actions of those operands onto
-  // the assembled operands.
-  void FixupOperands(void) {
-    auto xedi = SelectInstruction(&data);
+  // Match the instruction to a specific instruction selection, and then
+  // super-impose the r/w actions of those operands onto the template's
+  // operands. The selection is made using placeholders for any variable
+  // operands, and so only needs to be redone when instantiating the template
+  // if a variable is bound to something that the placeholder doesn't match.
+  void SelectInstruction(void) {
+    auto xedi = arch::SelectInstruction(data);
     GRANARY_ASSERT(nullptr != xedi);
 
-    FinalizeInstruction(&data);
     uint16_t op_size = 0;
-
-    for (auto i = 0U; i < data.num_explicit_ops; ++i) {
-      auto &instr_op(data.ops[i]);
+    for (auto i = 0U; i < data->num_explicit_ops; ++i) {
+      auto &instr_op(data->ops[i]);
       GRANARY_ASSERT(XED_ENCODER_OPERAND_TYPE_INVALID != instr_op.type);
-
-      auto xedi_op = xed_inst_operand(xedi, i);
-      instr_op.rw = xed_operand_rw(xedi_op);
-      instr_op.is_explicit = true;
-      instr_op.is_sticky = instr_op.IsRegister() && instr_op.reg.IsNative() &&
-                           !instr_op.reg.IsGeneralPurpose();
+      instr_op.rw = xed_operand_rw(xed_inst_operand(xedi, i));
 
       // Note: Things like label operands won't have a width.
       op_size = std::max(op_size, instr_op.width);
@@ -562,50 +695,11 @@ class InlineAssemblyParser {
 
     // TODO(pag): This is not right in all cases, e.g. PUSHFW, but then we'll
     //            likely detect it and solve it when it's an issue.
-    if (XED_CATEGORY_PUSH == data.category ||
-        XED_CATEGORY_POP == data.category) {
+    if (XED_CATEGORY_PUSH == data->category ||
+        XED_CATEGORY_POP == data->category) {
       op_size = arch::STACK_WIDTH_BITS;
     }
-    data.effective_operand_width = op_size;
-  }
-
-  // Finalize the instruction by adding it to the basic block's instruction
-  // list.
-  void MakeInstruction(void) {
-    Instruction *new_instr(nullptr);
-    FixupOperands();
-
-    // Ensure that instrumentation instructions do not alter the direction
-    // flag! This is because we have no reliable way of saving and restoring
-    // the direction flag (lest we use `PUSHF` and `POPF`) when the stack
-    // pointer is not known to be valid.
-    GRANARY_IF_DEBUG( auto flags = arch::IFORM_FLAGS[data.iform]; )
-    GRANARY_ASSERT(!flags.written.s.df);
-
-    if (data.IsJump()) {
-      GRANARY_ASSERT(data.ops[0].is_annotation_instr);
-      new_instr = new BranchInstruction(
-          &data, DynamicCast<LabelInstruction *>(data.ops[0].annotation_instr));
-    } else if (data.IsFunctionCall()) {
-      auto bb = new NativeBlock(
-          data.HasIndirectTarget() ? nullptr : data.BranchTargetPC());
-      cfg->AddBlock(bb);
-      new_instr = new ControlFlowInstruction(&data, bb);
-    } else if (data.IsFunctionReturn()) {
-      auto bb = new ReturnBlock(cfg, nullptr /* no meta-data */);
-      cfg->AddBlock(bb);
-      new_instr = new ControlFlowInstruction(&data, bb);
-
-    // Allows for injecting of `INT3`s at convenient locations.
-    } else if (data.IsInterruptCall()) {
-      data.analyzed_stack_usage = false;
-      data.is_stack_blind = true;
-      new_instr = new NativeInstruction(&data);
-
-    } else {
-      new_instr = new NativeInstruction(&data);
-    }
-    instr->InsertBefore(new_instr);
+    data->effective_operand_width = op_size;
   }
 
   // Parse a single inline assembly instructions.
@@ -615,17 +709,20 @@ class InlineAssemblyParser {
     ParseInstructionOpcode();
     ConsumeWhiteSpace();
     while (!Peek(';')) {
-      if (data.num_explicit_ops) {
+      if (data->num_explicit_ops) {
         Accept(',');
         ConsumeWhiteSpace();
       }
+      GRANARY_ASSERT(arch::Instruction::MAX_NUM_EXPLICIT_OPERANDS >
+                     data->num_explicit_ops);
       ParseOperand();
-      ++data.num_explicit_ops;
+      ++data->num_explicit_ops;
       ++op;
+      ++op_tmpl;
       ConsumeWhiteSpace();
     }
     Accept(';');
-    MakeInstruction();
+    SelectInstruction();
   }
 
  private:
@@ -666,11 +763,305 @@ class InlineAssemblyParser {
     *b = '\0';
   }
 
-  // Holds an in-progress instructions.
-  arch::Instruction data;
+  // The template of the instruction being parsed.
+  InlineInstructionTemplate *tmpl;
+
+  // Holds an in-progress instruction.
+  arch::Instruction *data;
 
-  // The next operand to decode.
+  // The next operand to decode, and its template.
   arch::Operand *op;
+  InlineOperandTemplate *op_tmpl;
+
+  // The next character to parse.
+  const char *ch;
+
+  char buff[20];
+
+  // The number of immediates already seen.
+  int num_immediates;
+};
+
+// Returns true if the instruction selection made using the placeholder
+// operand `placeholder_op` is also valid for the operand `op` that is bound to
+// a variable. Bound immediates must have the same kind (e.g. `SIMM0` vs.
+// `IMM0`) and width as the placeholder.
+static bool SelectionMatches(const arch::Operand &placeholder_op,
+                             const arch::Operand &op) {
+  if (op.IsRegister()) {
+    return placeholder_op.IsRegister() && !op.reg.IsNative();
+  } else if (op.IsMemory()) {
+    return placeholder_op.IsMemory();
+  } else if (op.IsBranchTarget()) {
+    return placeholder_op.IsBranchTarget();
+  } else if (op.IsImmediate()) {
+    return placeholder_op.type == op.type && placeholder_op.width == op.width;
+  } else {
+    return false;
+  }
+}
+
+// Instantiates the template of some inline assembly, placing the resulting
+// instructions before an instruction in a basic block.
+class InlineAssemblyInstantiator {
+ public:
+  InlineAssemblyInstantiator(Trace *cfg_,
+                             InlineAssemblyScope *scope_,
+                             DecodedBlock *block_,
+                             Instruction *instr_)
+      : cfg(cfg_),
+        scope(scope_),
+        block(block_),
+        instr(instr_) {}
+
+  void InstantiateInstructions(const InlineAssemblyTemplate *asm_tmpl) {
+    for (auto tmpl = asm_tmpl->instrs; tmpl; tmpl = tmpl->next) {
+      switch (tmpl->kind) {
+        case kInlineInstructionNative:
+          InstantiateInstruction(tmpl);
+          break;
+        case kInlineInstructionLabel:
+          InitLabelVar(tmpl->label_var);
+          instr->InsertBefore(scope->vars[tmpl->label_var]->annotation_instr);
+          break;
+        case kInlineInstructionCold:
+          instr->InsertBefore(new AnnotationInstruction(
+              kAnnotationCodeCacheKind,
+              block->IsColdCode() ? kCodeCacheKindFrozen : kCodeCacheKindCold));
+          break;
+        case kInlineInstructionFrozen:
+          instr->InsertBefore(new AnnotationInstruction(
+              kAnnotationCodeCacheKind,
+              block->IsColdCode() ? kCodeCacheKindSubZero
+                                  : kCodeCacheKindFrozen));
+          break;
+      }
+    }
+  }
+
+ private:
+  // Get a label.
+  void InitLabelVar(unsigned var_num)  {
+    auto &aop(scope->vars[var_num]);
+    if (!scope->var_is_initialized[var_num]) {
+      scope->var_is_initialized[var_num] = true;
+      aop->annotation_instr = new LabelInstruction;
+      aop->is_annotation_instr = true;
+      aop->type = XED_ENCODER_OPERAND_TYPE_BRDISP;
+      aop->width = arch::ADDRESS_WIDTH_BITS;
+    }
+  }
+
+  // Get a virtual register.
+  void InitRegVar(unsigned var_num) {
+    auto &aop(scope->vars[var_num]);
+    if (!scope->var_is_initialized[var_num]) {
+      scope->var_is_initialized[var_num] = true;
+      aop->reg = block->AllocateVirtualRegister();
+      aop->type = XED_ENCODER_OPERAND_TYPE_REG;
+      aop->width = arch::GPR_WIDTH_BITS;
+    }
+  }
+
+  // Returns an already initialized variable.
+  const arch::Operand &OperandVar(unsigned var_num) {
+    GRANARY_ASSERT(scope->var_is_initialized[var_num]);
+    return *(scope->vars[var_num]);
+  }
+
+  // Returns the virtual register associated with an already initialized
+  // register variable.
+  VirtualRegister RegisterVar(unsigned var_num) {
+    auto &aop(OperandVar(var_num));
+    GRANARY_ASSERT(aop.IsRegister());
+    return aop.reg.WidenedTo(arch::GPR_WIDTH_BYTES);
+  }
+
+  // Fill in the components of a compound memory operand that come from
+  // variables.
+  void InstantiateCompoundMemoryOperand(const InlineOperandTemplate &op_tmpl,
+                                        arch::Operand *op) {
+    if (kInvalidInlineVar != op_tmpl.segment_var) {
+      auto &aop(OperandVar(op_tmpl.segment_var));
+      GRANARY_ASSERT(aop.IsRegister());
+      op->segment = static_cast<xed_reg_enum_t>(aop.reg.EncodeToNative());
+      GRANARY_ASSERT(op->segment && XED_REG_DS != op->segment);
+      GRANARY_ASSERT(!op->is_effective_address);
+    }
+
+    auto has_var_components = false;
+    if (kInvalidInlineVar != op_tmpl.base_var) {
+      op->mem.base = RegisterVar(op_tmpl.base_var);
+      has_var_components = true;
+    }
+    if (kInvalidInlineVar != op_tmpl.index_var) {
+      op->mem.index = RegisterVar(op_tmpl.index_var);
+      has_var_components = true;
+    }
+    if (kInvalidInlineVar != op_tmpl.index_or_disp_var) {
+      auto &aop(OperandVar(op_tmpl.index_or_disp_var));
+      if (aop.IsRegister()) {
+        op->mem.index = aop.reg.WidenedTo(arch::GPR_WIDTH_BYTES);
+        op->mem.scale = 1;
+      } else {
+        GRANARY_ASSERT(aop.IsImmediate());
+        op->mem.disp = static_cast<int32_t>(aop.imm.as_int);
+
+        // Make sure that we don't lost precision.
+        GRANARY_ASSERT(op->mem.disp == aop.imm.as_int);
+      }
+      has_var_components = true;
+    }
+    if (kInvalidInlineVar != op_tmpl.disp_var) {
+      auto &aop(OperandVar(op_tmpl.disp_var));
+      GRANARY_ASSERT(aop.IsImmediate());
+      op->mem.disp = static_cast<int32_t>(aop.imm.as_int);
+      GRANARY_ASSERT(op->mem.disp == aop.imm.as_int);
+      has_var_components = true;
+    }
+    if (has_var_components) {
+      FinalizeCompoundMemoryOperand(op);
+    }
+  }
+
+  // Substitute a variable into an operand. Returns `true` if the instruction
+  // selection made using `placeholder_op` is also valid for the substituted
+  // operand.
+  bool InstantiateOperand(const InlineOperandTemplate &op_tmpl,
+                          const arch::Operand &placeholder_op,
+                          arch::Operand *op) {
+    switch (op_tmpl.kind) {
+      case kInlineOperandLiteral:
+        return true;
+
+      case kInlineOperandCompoundMemory:
+        InstantiateCompoundMemoryOperand(op_tmpl, op);
+        return true;
+
+      case kInlineOperandRegisterVar:
+        InitRegVar(op_tmpl.var_num);
+        *op = *(scope->vars[op_tmpl.var_num]);
+        op->reg.Widen(placeholder_op.width / arch::BYTE_WIDTH_BITS);
+        break;
+
+      case kInlineOperandImmediateVar:
+        *op = OperandVar(op_tmpl.var_num);
+        GRANARY_ASSERT(op->IsImmediate());
+        break;
+
+      case kInlineOperandMemoryVar:
+        *op = OperandVar(op_tmpl.var_num);
+        GRANARY_ASSERT(op->IsMemory());
+        op->segment = XED_REG_INVALID;
+        op->is_effective_address = placeholder_op.is_effective_address;
+        break;
+
+      case kInlineOperandLabelVar: {
+        InitLabelVar(op_tmpl.var_num);
+        auto &aop(scope->vars[op_tmpl.var_num]);
+
+        // Increment the refcount; for branch instructions, the
+        // `BranchInstruction` class does this.
+        if (!data.IsJump()) {
+          auto annot_instr = aop->annotation_instr;
+          if (auto label_instr = DynamicCast<LabelInstruction *>(annot_instr)) {
+            label_instr->DataRef<uintptr_t>() += 1;
+          }
+        }
+        *op = *aop;
+        if ((op->is_effective_address = placeholder_op.is_effective_address)) {
+          op->type = XED_ENCODER_OPERAND_TYPE_PTR;
+        }
+        break;
+      }
+    }
+
+    // Checked before the width of the bound operand is replaced.
+    const auto selection_matches = SelectionMatches(placeholder_op, *op);
+    op->width = placeholder_op.width;
+    op->rw = placeholder_op.rw;
+    op->is_explicit = true;
+    op->is_sticky = false;
+    return selection_matches;
+  }
+
+  // Re-select the instruction, e.g. because a register variable is bound to
+  // an architectural register, which might match a more specific selection
+  // than the placeholder did.
+  void ReselectInstruction(void) {
+    auto xedi = arch::SelectInstruction(&data);
+    GRANARY_ASSERT(nullptr != xedi);
+    for (auto i = 0U; i < data.num_explicit_ops; ++i) {
+      data.ops[i].rw = xed_operand_rw(xed_inst_operand(xedi, i));
+    }
+  }
+
+  // Instantiate a template instruction by substituting in the variables of
+  // the current scope.
+  void InstantiateInstruction(const InlineInstructionTemplate *tmpl) {
+    memcpy(&data, &(tmpl->instr), sizeof data);
+
+    auto selection_matches = true;
+    for (auto i = 0U; i < data.num_explicit_ops; ++i) {
+      const auto &op_tmpl(tmpl->ops[i]);
+      if (kInlineOperandLiteral == op_tmpl.kind) continue;
+      if (!InstantiateOperand(op_tmpl, tmpl->instr.ops[i], &(data.ops[i]))) {
+        selection_matches = false;
+      }
+    }
+    if (GRANARY_UNLIKELY(!selection_matches)) {
+      ReselectInstruction();
+    }
+
+    FinalizeInstruction(&data);
+    for (auto i = 0U; i < data.num_explicit_ops; ++i) {
+      auto &instr_op(data.ops[i]);
+      instr_op.is_sticky = instr_op.IsRegister() && instr_op.reg.IsNative() &&
+                           !instr_op.reg.IsGeneralPurpose();
+    }
+    MakeInstruction();
+  }
+
+  // Finalize the instruction by adding it to the basic block's instruction
+  // list.
+  void MakeInstruction(void) {
+    Instruction *new_instr(nullptr);
+
+    // Ensure that instrumentation instructions do not alter the direction
+    // flag! This is because we have no reliable way of saving and restoring
+    // the direction flag (lest we use `PUSHF` and `POPF`) when the stack
+    // pointer is not known to be valid.
+    GRANARY_IF_DEBUG( auto flags = arch::IFORM_FLAGS[data.iform]; )
+    GRANARY_ASSERT(!flags.written.s.df);
+
+    if (data.IsJump()) {
+      GRANARY_ASSERT(data.ops[0].is_annotation_instr);
+      new_instr = new BranchInstruction(
+          &data, DynamicCast<LabelInstruction *>(data.ops[0].annotation_instr));
+    } else if (data.IsFunctionCall()) {
+      auto bb = new NativeBlock(
+          data.HasIndirectTarget() ? nullptr : data.BranchTargetPC());
+      cfg->AddBlock(bb);
+      new_instr = new ControlFlowInstruction(&data, bb);
+    } else if (data.IsFunctionReturn()) {
+      auto bb = new ReturnBlock(cfg, nullptr /* no meta-data */);
+      cfg->AddBlock(bb);
+      new_instr = new ControlFlowInstruction(&data, bb);
+
+    // Allows for injecting of `INT3`s at convenient locations.
+    } else if (data.IsInterruptCall()) {
+      data.analyzed_stack_usage = false;
+      data.is_stack_blind = true;
+      new_instr = new NativeInstruction(&data);
+
+    } else {
+      new_instr = new NativeInstruction(&data);
+    }
+    instr->InsertBefore(new_instr);
+  }
+
+  // Holds an in-progress instructions.
+  arch::Instruction data;
 
   // The control-flow graph; used to materialize basic blocks.
   Trace *cfg;
@@ -684,15 +1075,72 @@ class InlineAssemblyParser {
 
   // Instruction before which all assembly instructions will be placed.
   Instruction * const instr;
+};
 
-  // The next character to parse.
-  const char *ch;
+// Parsed inline assembly templates, bucketed by the addresses of their
+// assembly. In practice, almost all inline assembly comes from string
+// literals, and so there is a small, fixed number of templates.
+static InlineAssemblyTemplate *gTemplates[kNumInlineAssemblyTemplateBuckets] = {
+  nullptr
+};
 
-  char buff[20];
+// Lock protecting the inline assembly templates.
+static ReaderWriterLock gTemplatesLock;
+
+// Summarize the contents of `assembly` by its length, and by its first and
+// last (up to) eight bytes.
+static InlineAssemblyFingerprint FingerprintOf(const char *assembly) {
+  InlineAssemblyFingerprint fingerprint = {StringLength(assembly), 0, 0};
+  const auto num_bytes = GRANARY_MIN(fingerprint.length,
+                                     sizeof fingerprint.first_word);
+  memcpy(&(fingerprint.first_word), assembly, num_bytes);
+  memcpy(&(fingerprint.last_word),
+         &(assembly[fingerprint.length - num_bytes]), num_bytes);
+  return fingerprint;
+}
 
-  // The number of immediates already seen.
-  int num_immediates;
-};
+// Find the template for `assembly` in a bucket of templates.
+static InlineAssemblyTemplate *FindTemplate(
+    InlineAssemblyTemplate *tmpl, const char *assembly,
+    const InlineAssemblyFingerprint &fingerprint) {
+  for (; tmpl; tmpl = tmpl->next) {
+    if (tmpl->assembly == assembly &&
+        tmpl->fingerprint.length == fingerprint.length &&
+        tmpl->fingerprint.first_word == fingerprint.first_word &&
+        tmpl->fingerprint.last_word == fingerprint.last_word) {
+      return tmpl;
+    }
+  }
+  return nullptr;
+}
+
+// Returns the template for `assembly`, parsing `assembly` into a template if
+// it hasn't been parsed before. Templates are found by the address of their
+// assembly, and by a fingerprint of its contents. Almost all assembly comes
+// from string literals, whose fingerprints never change; assembly in a buffer
+// whose contents change gets a new template for each new fingerprint.
+static const InlineAssemblyTemplate *GetTemplate(const char *assembly) {
+  auto &bucket(gTemplates[(reinterpret_cast<uintptr_t>(assembly) >> 3) %
+                          kNumInlineAssemblyTemplateBuckets]);
+  const auto fingerprint = FingerprintOf(assembly);
+  do {
+    ReadLockedRegion locker(&gTemplatesLock);
+    if (auto tmpl = FindTemplate(bucket, assembly, fingerprint)) return tmpl;
+  } while (false);
+
+  InlineAssemblyParser parser(assembly);
+  auto tmpl = new InlineAssemblyTemplate(assembly, fingerprint,
+                                         parser.ParseInstructions());
+
+  WriteLockedRegion locker(&gTemplatesLock);
+  if (auto existing_tmpl = FindTemplate(bucket, assembly, fingerprint)) {
+    delete tmpl;  // Lost a race with another thread.
+    return existing_tmpl;
+  }
+  tmpl->next = bucket;
+  bucket = tmpl;
+  return tmpl;
+}
 
 }  // namespace
 namespace arch {
@@ -705,9 +1153,21 @@ void CompileInlineAssemblyBlock(Trace *cfg,
                                 DecodedBlock *block,
                                 granary::Instruction *instr,
                                 InlineAssemblyBlock *asm_block) {
-  InlineAssemblyParser parser(cfg, asm_block->scope, block,
-                              instr, asm_block->assembly);
-  parser.ParseInstructions();
+  InlineAssemblyInstantiator instantiator(cfg, asm_block->scope, block, instr);
+  instantiator.InstantiateInstructions(GetTemplate(asm_block->assembly));
+}
+
+// Free all parsed inline assembly templates.
+void ExitInlineAssemblyTemplates(void) {
+  WriteLockedRegion locker(&gTemplatesLock);
+  for (auto &bucket : gTemplates) {
+    for (auto tmpl = bucket; tmpl; ) {
+      auto next_tmpl = tmpl->next;
+      delete tmpl;
+      tmpl = next_tmpl;
+    }
+    bucket = nullptr;
+  }
 }
 
 }  // namespace arch
@@ -9,14 +9,25 @@
 #include "granary/base/new.h"
 
 #include "granary/cfg/block.h"
+#include "granary/cfg/trace.h"
 #include "granary/cfg/instruction.h"
 
 #include "arch/x86-64/builder.h"
 #include "arch/x86-64/xed.h"
 
+#include "granary/code/edge.h"
+
 #include "granary/cache.h"
 #include "granary/breakpoint.h"
 
+extern "C" {
+
+// Shadow stack routines for `--shadow_return_stack`.
+extern const unsigned char granary_arch_push_return_site;
+extern const unsigned char granary_arch_pop_return_site;
+
+}  // extern C
+
 namespace granary {
 namespace arch {
 namespace {
@@ -234,6 +245,51 @@ void MangleIndirectReturn(DecodedBlock *block,
   JMP_GPRv(&(cfi->instruction), target);
 }
 
+// Insert a call to one of the shadow stack routines before `cfi`.
+static ControlFlowInstruction *CallShadowStackRoutine(
+    Trace *trace, ControlFlowInstruction *cfi, const unsigned char *routine) {
+  auto routine_block = new NativeBlock(routine);
+  trace->AddBlock(routine_block);
+  Instruction ni;
+  CALL_NEAR_RELBRd(&ni, routine);
+  auto call = new ControlFlowInstruction(&ni, routine_block);
+  cfi->InsertBefore(call);
+  return call;
+}
+
+// Mangle a function call so that its return site is pushed onto the shadow
+// stack before the call. Returns the inserted call to the push routine.
+//
+// Note: By this point, `MangleTailCall` has pushed the native return address,
+//       and the function call has been converted into a jump.
+ControlFlowInstruction *MangleReturnSitePush(Trace *trace, DecodedBlock *block,
+                                             ControlFlowInstruction *cfi,
+                                             ReturnSite *site) {
+  auto site_reg = block->AllocateTemporaryRegister();
+  Instruction ni;
+  MOV_GPRv_IMMv(&ni, site_reg, reinterpret_cast<uintptr_t>(site));
+  cfi->InsertBefore(new NativeInstruction(&ni));
+  PUSH_GPRv_50(&ni, site_reg);
+  ni.effective_operand_width = ADDRESS_WIDTH_BITS;
+  cfi->InsertBefore(new NativeInstruction(&ni));
+  return CallShadowStackRoutine(trace, cfi, &granary_arch_push_return_site);
+}
+
+// Mangle a function return so that a return site is popped off of the shadow
+// stack before the return. Returns the inserted call to the pop routine, or
+// `nullptr` if the return can't use the shadow stack.
+//
+// Note: The pop routine only skips over the remainder of the mangled return
+//       if the native return address matches the popped return site;
+//       otherwise, the return goes through its indirect edge.
+ControlFlowInstruction *MangleReturnSitePop(Trace *trace, DecodedBlock *,
+                                            ControlFlowInstruction *cfi) {
+  if (ADDRESS_WIDTH_BYTES != cfi->instruction.StackPointerShiftAmount()) {
+    return nullptr;  // E.g. `RET imm16`.
+  }
+  return CallShadowStackRoutine(trace, cfi, &granary_arch_pop_return_site);
+}
+
 // Performs mangling of an indirect CFI instruction. This ensures that the
 // target of any specialized indirect CFI instruction is stored in a register.
 //
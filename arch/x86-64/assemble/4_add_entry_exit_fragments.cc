@@ -3,6 +3,7 @@
 #define GRANARY_INTERNAL
 #define GRANARY_ARCH_INTERNAL
 
+#include "arch/x86-64/builder.h"
 #include "arch/x86-64/instruction.h"
 
 #include "granary/code/fragment.h"
@@ -64,5 +65,88 @@ uint32_t AllArithmeticFlags(void) {
   */
 }
 
+// Returns `true` if `reg` can be both the destination and the base/index
+// register of a flag-neutral `LEA` instruction.
+static bool IsLEARegister(VirtualRegister reg) {
+  return reg.IsGeneralPurpose() && GPR_WIDTH_BYTES == reg.ByteWidth() &&
+         !reg.IsStackPointer() && !reg.IsStackPointerAlias();
+}
+
+// Returns the value of the immediate operand `op`, sign-extended from the
+// width of the operand, in the same way as `ADD` and `SUB` would.
+static intptr_t SignedImmediate(const Operand &op) {
+  switch (op.width) {
+    case 8: return static_cast<int8_t>(op.imm.as_uint);
+    case 16: return static_cast<int16_t>(op.imm.as_uint);
+    case 32: return static_cast<int32_t>(op.imm.as_uint);
+    default: return op.imm.as_int;
+  }
+}
+
+// Tries to convert an instrumentation instruction that writes to the flags
+// into an equivalent instruction that doesn't write to the flags, e.g. by
+// converting an `ADD` into an `LEA`. Returns `true` if the instruction was
+// converted.
+//
+// The following forms are converted, where `r` and `s` are 64-bit GPRs:
+//      ADD r, imm    ->  LEA r, [r + imm]
+//      ADD r, s      ->  LEA r, [r + s]
+//      SUB r, imm    ->  LEA r, [r - imm]
+//      INC r         ->  LEA r, [r + 1]
+//      DEC r         ->  LEA r, [r - 1]
+bool TryMakeFlagNeutral(Instruction *instr) {
+  if (instr->is_atomic || instr->has_prefix_lock) return false;
+  if (!instr->num_explicit_ops) return false;
+
+  const auto &dest_op(instr->ops[0]);
+  if (!dest_op.IsRegister() || !IsLEARegister(dest_op.reg)) return false;
+
+  const auto dest = dest_op.reg;
+  VirtualRegister index;
+  intptr_t disp = 0;
+
+  switch (instr->iclass) {
+    case XED_ICLASS_INC:
+      disp = 1;
+      break;
+
+    case XED_ICLASS_DEC:
+      disp = -1;
+      break;
+
+    case XED_ICLASS_ADD:
+    case XED_ICLASS_SUB: {
+      if (2 != instr->num_explicit_ops) return false;
+      const auto &src_op(instr->ops[1]);
+      if (src_op.IsImmediate() && !src_op.IsBranchTarget()) {
+        disp = SignedImmediate(src_op);
+        if (XED_ICLASS_SUB == instr->iclass) disp = -disp;
+      } else if (XED_ICLASS_ADD == instr->iclass && src_op.IsRegister() &&
+                 IsLEARegister(src_op.reg)) {
+        index = src_op.reg;
+      } else {
+        return false;
+      }
+      break;
+    }
+
+    default:
+      return false;
+  }
+
+  // `LEA` only has a 32-bit signed displacement.
+  if (disp != static_cast<int32_t>(disp)) return false;
+
+  const auto is_sticky = instr->is_sticky;
+  if (index.IsValid()) {
+    LEA_GPRv_AGEN(instr, dest, dest, index);
+  } else {
+    LEA_GPRv_AGEN(instr, dest, BaseDispMemOp(static_cast<int32_t>(disp), dest,
+                                             ADDRESS_WIDTH_BITS));
+  }
+  instr->is_sticky = is_sticky;
+  return true;
+}
+
 }  // namespace arch
 }  // namespace granary
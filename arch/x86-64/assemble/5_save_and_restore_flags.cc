@@ -42,6 +42,13 @@ GRANARY_DEFINE_bool(always_spill_flags, false,
 namespace granary {
 namespace arch {
 
+// Returns `true` if the native value of `RAX` is dead on exit from `frag`.
+static bool RAXIsDeadOnExit(Fragment *frag) {
+  auto succ = frag->successors[kFragSuccFallThrough];
+  auto succ_cfrag = DynamicCast<CodeFragment *>(succ);
+  return succ_cfrag && !succ_cfrag->entry_live_gprs.IsLive(REG_RAX);
+}
+
 // Inserts instructions that saves the flags within the fragment `frag`.
 void InjectSaveFlags(Fragment *frag) {
   arch::Instruction ni;
@@ -56,6 +63,16 @@ void InjectSaveFlags(Fragment *frag) {
   GRANARY_IF_DEBUG( killed_flags.flat = zone.killed_flags; )
   GRANARY_ASSERT(!killed_flags.s.df);
 
+  // The native value of RAX is dead, so we can clobber it, and then save the
+  // flags directly into RAX's slot.
+  if (RAXIsDeadOnExit(frag)) {
+    frag->instrs.Prepend(new AnnotationInstruction(kAnnotSaveRegister,
+                                                   REG_RAX));
+    if (flags.s.of) PREP(SETO_GPR8(&ni, XED_REG_AL));
+    PREP(LAHF(&ni));
+    return;
+  }
+
   // Step 4: Restore RAX.
   frag->instrs.Prepend(new AnnotationInstruction(
       kAnnotSwapRestoreRegister, REG_RAX));
@@ -79,10 +96,16 @@ void InjectRestoreFlags(Fragment *frag) {
   if (!FLAG_always_spill_flags) flags.flat &= zone.live_flags;
   if (!flags.flat) return;
 
+  // The native value of RAX is dead after the flags are restored, so we don't
+  // need to preserve it while extracting the saved flags.
+  const auto rax_is_dead = RAXIsDeadOnExit(frag);
+
   // Step 1: Extract the saved flags from `flag_save_reg`, while keeping
   // the value of `flag_killed_reg` alive.
-  frag->instrs.Prepend(new AnnotationInstruction(kAnnotSwapRestoreRegister,
-                                                 REG_RAX));
+  frag->instrs.Prepend(new AnnotationInstruction(
+      rax_is_dead ? kAnnotRestoreRegister : kAnnotSwapRestoreRegister,
+      REG_RAX));
+
   // Step 2: Restore the overflow flag.
   if (flags.s.of) {
     APP(ADD_GPR8_IMMb_80r0(&ni, XED_REG_AL, static_cast<uint8_t>(0x7F)));
@@ -92,8 +115,10 @@ void InjectRestoreFlags(Fragment *frag) {
   APP(SAHF(&ni));
 
   // Step 4: Restore the native value of `flag_killed_reg`
-  frag->instrs.Append(new AnnotationInstruction(kAnnotRestoreRegister,
-                                                REG_RAX));
+  if (!rax_is_dead) {
+    frag->instrs.Append(new AnnotationInstruction(kAnnotRestoreRegister,
+                                                  REG_RAX));
+  }
 }
 
 }  // namespace arch
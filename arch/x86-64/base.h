@@ -76,7 +76,10 @@ enum {
   EXEC_MEMORY_POISON_BYTE = 0xCC,
 
   // The maximum width of a relative branch.
-  REL_ADDR_WIDTH_BITS = 32
+  REL_ADDR_WIDTH_BITS = 32,
+
+  // The maximum length of an encoded instruction.
+  MAX_INSTRUCTION_SIZE_BYTES = 15
 };
 
 }  // namespace arch
@@ -157,8 +157,7 @@ static void CopyOperand(CodeFragment *frag, Instruction &ni,
 
 // Generates the wrapper code for an outline callback.
 Callback *GenerateInlineCallback(InlineFunctionCall *call) {
-  auto edge_code = AllocateCode(kCodeCacheKindCold,
-                                INLINE_CALL_CODE_SIZE_BYTES);
+  auto edge_code = AllocateRuntimeCode(INLINE_CALL_CODE_SIZE_BYTES);
   auto callback = new Callback(call->target_app_pc, edge_code);
   CodeCacheTransaction transaction;
   GenerateInlineCallCode(callback, call->NumArguments());
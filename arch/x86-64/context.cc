@@ -117,8 +117,7 @@ void GenerateContextCallCode(Callback *callback) {
 
 // Generates the wrapper code for a context callback.
 Callback *GenerateContextCallback(AppPC func_pc) {
-  auto edge_code = AllocateCode(kCodeCacheKindCold,
-                                CONTEXT_CALL_CODE_SIZE_BYTES);
+  auto edge_code = AllocateRuntimeCode(CONTEXT_CALL_CODE_SIZE_BYTES);
   auto callback = new Callback(func_pc, edge_code);
   CodeCacheTransaction transaction;
   GenerateContextCallCode(callback);
@@ -44,6 +44,9 @@ extern "C" {
 extern const unsigned char granary_arch_enter_direct_edge;
 extern const unsigned char granary_arch_enter_indirect_edge;
 
+// Counts the executions of a profiled direct edge.
+extern const unsigned char granary_arch_profile_direct_edge;
+
 }  // extern C
 
 namespace granary {
@@ -110,11 +113,26 @@ Fragment *GenerateDirectEdgeCode(DirectEdge *edge) {
   auto label = new LabelInstruction;
   label->DataRef<uintptr_t>()++;
 
+  // Count executions of the edge, so that the target block can be re-
+  // translated as the head of a hot trace. This is skipped once the edge is
+  // patched, i.e. once it stops being profiled.
+  if (edge->is_profiled) {
+    frag->instrs.Append(new AnnotationInstruction(kAnnotCondLeaveNativeStack));
+    APP(frag, PUSH_GPRv_50(&ni, XED_REG_RDI); ni.is_stack_blind = true; );
+    APP(frag, MOV_GPRv_IMMv(&ni, XED_REG_RDI,
+                            reinterpret_cast<uintptr_t>(edge)));
+    APP(frag, CALL_NEAR_RELBRd(&ni, &granary_arch_profile_direct_edge));
+    APP(frag, POP_GPRv_51(&ni, XED_REG_RDI); ni.is_stack_blind = true; );
+    frag->instrs.Append(new AnnotationInstruction(kAnnotCondEnterNativeStack));
+  }
+
   frag->instrs.Append(label);
   APP(frag, JMP_MEMv(&ni, &(edge->entry_target_pc)));
 
   frag->instrs.Append(new AnnotationInstruction(kAnnotUpdateAddressWhenEncoded,
                                                 &(edge->entry_target_pc)));
+  frag->instrs.Append(new AnnotationInstruction(kAnnotUpdateAddressWhenEncoded,
+                                                &(edge->enter_granary_pc)));
   frag->instrs.Append(new AnnotationInstruction(kAnnotCondLeaveNativeStack));
 
   // Steal `RDI` (arg1 on Itanium C++ ABI) to hold the address of the
@@ -277,6 +295,8 @@ CodeFragment *GenerateIndirectEdgeCode(FragmentList *frags, IndirectEdge *edge,
   auto miss_addr = new AnnotationInstruction(kAnnotUpdateAddressWhenEncoded,
                                              &(edge->out_edge_pc));
   go_to_granary->instrs.Append(miss_addr);
+  go_to_granary->instrs.Append(new AnnotationInstruction(
+      kAnnotUpdateAddressWhenEncoded, &(edge->enter_granary_pc)));
 
   // Store the branch target into `RSI` and theaddress of the `IndirectEdge`
   // data structure in `RDI`. Jump to `edge->in_edge_pc`, which is initialized
@@ -300,7 +320,12 @@ CodeFragment *GenerateIndirectEdgeCode(FragmentList *frags, IndirectEdge *edge,
 
   go_to_granary->instrs.Append(new AnnotationInstruction(
       kAnnotRestoreRegister, REG_RDI));
-  APP(go_to_granary, JMP_MEMv(&ni, &(edge->out_edge_pc));
+
+  // The indirect edge entry code either finds the target in the edge's
+  // indirect branch target cache, or enters Granary to translate the target.
+  // Either way, it returns the address of an out-edge template that matches
+  // the target in `RSI`.
+  APP(go_to_granary, JMP_GPRv(&ni, XED_REG_RSI);
                      ni.is_sticky = true; );
 
   auto begin_template = new AnnotationInstruction(
@@ -376,39 +401,58 @@ void InstantiateIndirectEdge(IndirectEdge *edge, FragmentList *frags,
   }
 }
 
-// Patch a direct edge.
-//
-// Note: This function has an architecture-specific implementation.
-bool TryAtomicPatchEdge(DirectEdge *edge) {
+namespace {
+
+// Atomically change the target of the branch instruction at `branch_pc` to be
+// `target_pc`.
+static bool TryAtomicRetargetBranch(CachePC branch_pc, CachePC target_pc) {
   Instruction ni;
   InstructionEncoder stage_enc(InstructionEncodeKind::STAGED);
   InstructionEncoder commit_enc(InstructionEncodeKind::COMMIT_ATOMIC);
 
   // If we fail to decode the instruction then don't patch it.
-  if (!InstructionDecoder::Decode(&ni, edge->patch_instruction_pc)) {
-    return false;
-  }
+  if (!InstructionDecoder::Decode(&ni, branch_pc)) return false;
   const auto decoded_length = ni.decoded_length;
 
   // If the decoded length is greater than 8 bytes then don't patch it.
   if (8 < decoded_length) return false;
 
-  // If the instruction crosses two cache lines then don't patch it.
-  auto decode_addr = reinterpret_cast<uintptr_t>(edge->patch_instruction_pc);
+  // The instruction is committed with a single 8-byte store. If that store
+  // crosses two cache lines then it isn't atomic, so don't patch it.
+  auto decode_addr = reinterpret_cast<uintptr_t>(branch_pc);
   auto start_cl = decode_addr / CACHE_LINE_SIZE_BYTES;
-  auto end_cl = (decode_addr + decoded_length - 1) / CACHE_LINE_SIZE_BYTES;
+  auto end_cl = (decode_addr + 8 - 1) / CACHE_LINE_SIZE_BYTES;
   if (start_cl != end_cl) return false;
 
-  ni.SetBranchTarget(edge->entry_target_pc);
-  stage_enc.Encode(&ni, edge->patch_instruction_pc);
+  ni.SetBranchTarget(target_pc);
+  stage_enc.Encode(&ni, branch_pc);
 
   // If the instruction length changes then don't patch it.
   if (ni.encoded_length != decoded_length) return false;
 
-  CodeCacheTransaction transaction;
-  commit_enc.Encode(&ni, edge->patch_instruction_pc);
+  CodeCacheTransaction transaction(kCodeCacheTransactionLiveCode);
+  commit_enc.Encode(&ni, branch_pc);
   return true;
 }
 
+}  // namespace
+
+// Patch a direct edge.
+//
+// Note: This function has an architecture-specific implementation.
+bool TryAtomicPatchEdge(DirectEdge *edge) {
+  return TryAtomicRetargetBranch(edge->patch_instruction_pc,
+                                 edge->entry_target_pc);
+}
+
+// Un-patch a direct edge, so that the patched branch once again targets the
+// edge's stub code.
+//
+// Note: This function has an architecture-specific implementation.
+bool TryAtomicUnpatchEdge(DirectEdge *edge) {
+  return TryAtomicRetargetBranch(edge->patch_instruction_pc,
+                                 edge->edge_code_pc);
+}
+
 }  // namespace arch
 }  // namespace granary
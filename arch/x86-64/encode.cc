@@ -315,6 +315,61 @@ static void AtomicCommit(CachePC pc, uint8_t itext[], uint8_t len) {
   std::atomic_thread_fence(std::memory_order_release);
 }
 
+// Try to commit the bytes (`staged_bytes`) produced when `instr` was stage
+// encoded. This works if none of those bytes depend on where `instr` was
+// staged, or if the only such bytes are a trailing branch displacement, which
+// can be patched. Returns the address of the next instruction, or `nullptr` if
+// `instr` needs to be re-encoded.
+static CachePC CommitStagedBytes(Instruction *instr,
+                                 const uint8_t *staged_bytes, CachePC pc) {
+  const Operand *brdisp_op(nullptr);
+  for (auto i = 0U; i < instr->num_explicit_ops; ++i) {
+    const auto &op(instr->ops[i]);
+    if (XED_ENCODER_OPERAND_TYPE_PTR == op.type) {
+      return nullptr;  // Might be encoded as RIP-relative.
+    } else if (XED_ENCODER_OPERAND_TYPE_BRDISP == op.type) {
+      brdisp_op = &op;
+    }
+  }
+
+  // Relative branches only have the one operand, and their displacements
+  // are encoded as the last bytes of the instruction.
+  if (brdisp_op && 1 != instr->num_explicit_ops) return nullptr;
+
+  const auto len = instr->encoded_length;
+  const auto next_pc = pc + len;
+  GRANARY_ASSERT(0 < len);
+  memcpy(pc, staged_bytes, len);
+  if (!brdisp_op) return next_pc;
+
+  intptr_t target = 0;
+  if (brdisp_op->is_annotation_instr) {
+    target = brdisp_op->annotation_instr->Data<intptr_t>();
+  } else {
+    target = brdisp_op->branch_target.as_int;
+  }
+  const auto brdisp_64 = target - reinterpret_cast<intptr_t>(next_pc);
+  const auto brdisp_32 = static_cast<int32_t>(brdisp_64);
+  GRANARY_ASSERT(brdisp_32 == brdisp_64);
+  GRANARY_ASSERT(0 <= brdisp_32 || -5 > brdisp_32);
+
+  switch (instr->iclass) {
+    case XED_ICLASS_JRCXZ:
+    case XED_ICLASS_LOOP:
+    case XED_ICLASS_LOOPE:
+    case XED_ICLASS_LOOPNE: {
+      const auto brdisp_8 = static_cast<int8_t>(brdisp_32);
+      GRANARY_ASSERT(brdisp_8 == brdisp_32);
+      memcpy(next_pc - sizeof brdisp_8, &brdisp_8, sizeof brdisp_8);
+      break;
+    }
+    default:
+      memcpy(next_pc - sizeof brdisp_32, &brdisp_32, sizeof brdisp_32);
+      break;
+  }
+  return next_pc;
+}
+
 }  // namespace
 
 // Encode a XED instruction intermediate representation into an x86
@@ -330,6 +385,16 @@ CachePC InstructionEncoder::EncodeInternal(Instruction *instr, CachePC pc) {
     return pc;
   }
 
+  // Fast path: re-use the bytes from when this instruction was staged.
+  if (InstructionEncodeKind::COMMIT_STAGED == encode_kind && staged_bytes) {
+    const auto instr_staged_bytes = staged_bytes;
+    staged_bytes += instr->encoded_length;
+    instr->encoded_pc = pc;
+    if (auto next_pc = CommitStagedBytes(instr, instr_staged_bytes, pc)) {
+      return next_pc;
+    }
+  }
+
   xed_encoder_instruction_t xede;
   const auto is_stage_encoding = InstructionEncodeKind::STAGED == encode_kind;
 
@@ -367,7 +432,13 @@ CachePC InstructionEncoder::EncodeInternal(Instruction *instr, CachePC pc) {
 
   instr->encoded_length = static_cast<uint8_t>(encoded_length);
 
-  if (InstructionEncodeKind::COMMIT == encode_kind) {
+  if (is_stage_encoding) {
+    if (staged_bytes) {
+      memcpy(staged_bytes, &(itext[0]), instr->encoded_length);
+      staged_bytes += instr->encoded_length;
+    }
+  } else if (InstructionEncodeKind::COMMIT == encode_kind ||
+             InstructionEncodeKind::COMMIT_STAGED == encode_kind) {
     memcpy(pc, &(itext[0]), instr->encoded_length);
   } else if (InstructionEncodeKind::COMMIT_ATOMIC == encode_kind) {
     AtomicCommit(pc, &(itext[0]), instr->encoded_length);
@@ -43,6 +43,9 @@ extern uint32_t AllArithmeticFlags(void);
 // Initialize the block tracer.
 extern void InitBlockTracer(void);
 
+// Free all parsed inline assembly templates.
+extern void ExitInlineAssemblyTemplates(void);
+
 namespace {
 
 // Number of pages allocates to hold the table of implicit operands.
@@ -598,6 +601,7 @@ void Init(void) {
 
 // Exit the driver.
 void Exit(void) {
+  ExitInlineAssemblyTemplates();
   memset(IMPLICIT_OPERANDS, 0, sizeof IMPLICIT_OPERANDS);
   memset(NUM_IMPLICIT_OPERANDS, 0, sizeof NUM_IMPLICIT_OPERANDS);
   os::FreeDataPages(gImplicitOperandPages, gNumImplicitOperandPages);
@@ -174,6 +174,27 @@ size_t MemoryOperand::CountMatchedRegisters(
   return num_matched;
 }
 
+// Try to match the components of a `base + index * scale + disp` memory
+// operand. This also works when the memory operand is not compound.
+bool MemoryOperand::MatchAddressComponents(VirtualRegister &base,
+                                           VirtualRegister &index,
+                                           size_t &scale,
+                                           int32_t &disp) const {
+  if (XED_ENCODER_OPERAND_TYPE_MEM != op->type) return false;
+  if (op->is_compound) {
+    base = op->mem.base;
+    index = op->mem.index;
+    scale = index.IsValid() ? op->mem.scale : 0;
+    disp = op->mem.disp;
+  } else {
+    base = op->reg;
+    index = VirtualRegister();
+    scale = 0;
+    disp = 0;
+  }
+  return true;
+}
+
 // Tries to replace the memory operand.
 bool MemoryOperand::TryReplaceWith(const MemoryOperand &repl_op) {
   return UnsafeTryReplaceOperand(repl_op);
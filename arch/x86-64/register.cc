@@ -251,6 +251,35 @@ void UsedRegisterSet::Visit(const arch::Operand *op) {
   }
 }
 
+// Update this register tracker by marking all registers that are written by
+// an instruction as used. This includes registers that are implicitly or
+// conditionally written (e.g. `RDX:RAX` by `MUL`, or `RCX` by `REP MOVS`).
+void UsedRegisterSet::VisitWrites(const arch::Instruction *instr) {
+  GRANARY_ASSERT(XED_IFORM_INVALID != instr->iform);
+  GRANARY_ASSERT(0 != instr->isel);
+  const auto is_string_op = XED_CATEGORY_STRINGOP == instr->category;
+  for (auto i = 0U; i < instr->num_ops; ++i) {
+    const auto &op(instr->ops[i]);
+    if (op.IsRegister()) {
+      if (op.IsWrite()) Revive(op.reg);
+
+    // String operations advance the registers that address their memory
+    // operands. These registers aren't separate operands because they are
+    // recorded in the memory operands themselves.
+    } else if (is_string_op && op.IsMemory()) {
+      Visit(&op);
+    }
+  }
+
+  // `REP`-prefixed string operations count down `RCX`, and system calls return
+  // their results in `RAX`.
+  if (is_string_op && (instr->has_prefix_rep || instr->has_prefix_repne)) {
+    Revive(arch::REG_RCX);
+  } else if (instr->IsSystemCall() || instr->IsInterruptCall()) {
+    Revive(arch::REG_RAX);
+  }
+}
+
 namespace {
 
 // Does this instruction use legacy registers (e.g. `AH`)? If so, then this
@@ -12,6 +12,78 @@ namespace {
 static ClosureList<const InstrumentedMemoryOperand &>
     gMemOpHooks GRANARY_GLOBAL;
 
+// Hooks that other tools can use for interposing on ranges of memory that are
+// accessed by groups of coalesced memory operands.
+static ClosureList<const InstrumentedMemoryRange &>
+    gMemRangeHooks GRANARY_GLOBAL;
+
+enum : size_t {
+  // Maximum number of bytes that a group of coalesced memory operands can
+  // span.
+  kMaxCoalescedRangeBytes = 64
+};
+
+// Set of instructions whose Nth memory operand is covered by a coalesced
+// memory range.
+typedef TinySet<NativeInstruction *, 16> CoalescedInstrSet;
+
+// A group of memory operands that compute their addresses from the same base
+// and index registers, and whose accesses cover the contiguous displacements
+// `[begin_disp, end_disp)`.
+struct MemOpGroup {
+  NativeInstruction *first_instr;
+  NativeInstruction *last_instr;
+  VirtualRegister base;
+  VirtualRegister index;
+  size_t scale;
+  intptr_t begin_disp;
+  intptr_t end_disp;
+  size_t num_mem_ops;
+  bool is_read;
+  bool is_write;
+};
+
+// Returns true if the memory operand `mloc` can be coalesced with other memory
+// operands that use the same base and index registers. Only operands that
+// compute their addresses from native general-purpose registers (other than
+// the stack pointer) can be coalesced.
+static bool MatchCoalescableMemOp(const MemoryOperand &mloc,
+                                  VirtualRegister &base, VirtualRegister &index,
+                                  size_t &scale, int32_t &disp) {
+  VirtualRegister seg_reg;
+  if (mloc.IsEffectiveAddress()) return false;
+  if (mloc.MatchSegmentRegister(seg_reg)) return false;
+  if (!mloc.MatchAddressComponents(base, index, scale, disp)) return false;
+  if (!base.IsValid() || !base.IsNative() || !base.IsGeneralPurpose()) {
+    return false;
+  }
+  if (base.IsStackPointer() || base.IsStackPointerAlias()) return false;
+  return !index.IsValid() || (index.IsNative() && index.IsGeneralPurpose());
+}
+
+// Returns true if `instr` (might) redefine the base or index register of
+// `group`. This considers every register written by `instr`, including
+// implicitly written registers (e.g. `RDX:RAX` by `DIV`, `RSI` and `RDI` by
+// `MOVS`, or `RCX` and `R11` by `SYSCALL`).
+static bool RedefinesGroupRegister(NativeInstruction *instr,
+                                   const MemOpGroup &group) {
+  UsedRegisterSet written_regs;
+  written_regs.VisitWrites(instr);
+  if (written_regs.IsLive(group.base)) return true;
+  return group.index.IsValid() && written_regs.IsLive(group.index);
+}
+
+// Returns the inline assembly for computing the lowest address of a group of
+// memory operands that has an index register.
+static const char *IndexedRangeLEA(size_t scale) {
+  switch (scale) {
+    case 2: return "LEA r64 %2, m64 [%0 + %3*2 + %1];"_x86_64;
+    case 4: return "LEA r64 %2, m64 [%0 + %3*4 + %1];"_x86_64;
+    case 8: return "LEA r64 %2, m64 [%0 + %3*8 + %1];"_x86_64;
+    default: return "LEA r64 %2, m64 [%0 + %3*1 + %1];"_x86_64;
+  }
+}
+
 }  // namespace
 
 // Abstract tool for instrumenting memory operands.
@@ -20,7 +92,8 @@ class MemOpTool : public InstrumentationTool {
   MemOpTool(void)
       : bb(nullptr),
         instr(nullptr),
-        op_num(0) {}
+        op_num(0),
+        coalesced_instrs() {}
 
   virtual ~MemOpTool(void) = default;
 
@@ -28,18 +101,27 @@ class MemOpTool : public InstrumentationTool {
     if (kInitProgram == reason || kInitAttach == reason) {
       virt_addr_reg[0] = AllocateVirtualRegister();
       virt_addr_reg[1] = AllocateVirtualRegister();
+      virt_range_reg = AllocateVirtualRegister();
     }
   }
 
   static void Exit(ExitReason reason) {
     if (kExitDetach == reason) {
       gMemOpHooks.Reset();
+      gMemRangeHooks.Reset();
     }
   }
 
   virtual void InstrumentBlock(DecodedBlock *bb_) override {
     MemoryOperand mloc1, mloc2;
     bb = bb_;
+    coalesced_instrs[0] = CoalescedInstrSet();
+    coalesced_instrs[1] = CoalescedInstrSet();
+
+    // Group the memory operands first, so that the memory operand hooks know
+    // which operands are covered by ranges.
+    if (!gMemRangeHooks.IsEmpty()) InstrumentMemRanges();
+
     for (auto instr_ : bb->AppInstructions()) {
       auto num_matched = instr_->CountMatchedOperands(ReadOrWriteTo(mloc1),
                                                       ReadOrWriteTo(mloc2));
@@ -62,6 +144,12 @@ class MemOpTool : public InstrumentationTool {
     gMemOpHooks.ApplyAll(op);
   }
 
+  // Returns true if the current memory operand is covered by a coalesced
+  // memory range.
+  bool IsCoalesced(void) const {
+    return coalesced_instrs[op_num].Contains(instr);
+  }
+
   // Instrument a memory operation.
   void InstrumentMemOp(MemoryOperand &mloc) {
     if (mloc.IsEffectiveAddress()) return;  // Doesn't access memory.
@@ -87,7 +175,8 @@ class MemOpTool : public InstrumentationTool {
   // Instrument a memory operand that accesses some memory through a register.
   void InstrumentRegMemOp(MemoryOperand &mloc, VirtualRegister reg) {
     RegisterOperand addr_reg_op(reg);
-    InstrumentedMemoryOperand op = {bb, instr, mloc, addr_reg_op, op_num};
+    InstrumentedMemoryOperand op = {bb, instr, mloc, addr_reg_op, op_num,
+                                    IsCoalesced()};
     InstrumentMemOp(op);
   }
 
@@ -102,7 +191,8 @@ class MemOpTool : public InstrumentationTool {
     lir::InlineAssembly asm_(offset_op, addr_reg_op, seg_reg_op);
     asm_.InlineBefore(instr, "MOV r64 %1, m64 %2:[0];"
                              "LEA r64 %1, m64 [%1 + %0];"_x86_64);
-    InstrumentedMemoryOperand op = {bb, instr, mloc, addr_reg_op, op_num};
+    InstrumentedMemoryOperand op = {bb, instr, mloc, addr_reg_op, op_num,
+                                    IsCoalesced()};
     InstrumentMemOp(op);
   }
 
@@ -112,7 +202,8 @@ class MemOpTool : public InstrumentationTool {
     RegisterOperand addr_reg_op(virt_addr_reg[op_num]);
     lir::InlineAssembly asm_(native_addr, addr_reg_op);
     asm_.InlineBefore(instr, "MOV r64 %1, i64 %0;"_x86_64);
-    InstrumentedMemoryOperand op = {bb, instr, mloc, addr_reg_op, op_num};
+    InstrumentedMemoryOperand op = {bb, instr, mloc, addr_reg_op, op_num,
+                                    IsCoalesced()};
     InstrumentMemOp(op);
   }
 
@@ -129,10 +220,100 @@ class MemOpTool : public InstrumentationTool {
     RegisterOperand addr_reg_op(addr_reg);
     lir::InlineAssembly asm_(mloc, addr_reg_op);
     asm_.InlineBefore(instr, "LEA r64 %1, m64 %0;"_x86_64);
-    InstrumentedMemoryOperand op = {bb, instr, mloc, addr_reg_op, op_num};
+    InstrumentedMemoryOperand op = {bb, instr, mloc, addr_reg_op, op_num,
+                                    IsCoalesced()};
     InstrumentMemOp(op);
   }
 
+  // Group together memory operands that use the same base and index registers,
+  // where neither register is redefined within the group, and report each
+  // group to the range hooks as a single range of memory.
+  void InstrumentMemRanges(void) {
+    MemOpGroup group;
+    group.num_mem_ops = 0;
+    for (auto instr_ : bb->AppInstructions()) {
+      MemoryOperand mlocs[2];
+      auto num_matched = instr_->CountMatchedOperands(
+          ReadOrWriteTo(mlocs[0]), ReadOrWriteTo(mlocs[1]));
+      for (auto i = 0UL; i < num_matched; ++i) {
+        AddToGroup(&group, instr_, mlocs[i], i);
+      }
+      if (group.num_mem_ops && RedefinesGroupRegister(instr_, group)) {
+        InstrumentMemRange(&group);
+      }
+    }
+    if (group.num_mem_ops) InstrumentMemRange(&group);
+  }
+
+  // Add the memory operand `mloc`, which is memory operand number `mloc_num`
+  // of `instr_`, to `group`. If `mloc` can't be added to `group` then `group`
+  // is instrumented, and a new group containing only `mloc` is started. An
+  // operand can only be added if its access overlaps with or is adjacent to
+  // the group's range, so that the range never covers bytes that the group
+  // doesn't access.
+  void AddToGroup(MemOpGroup *group, NativeInstruction *instr_,
+                  const MemoryOperand &mloc, size_t mloc_num) {
+    VirtualRegister base, index;
+    size_t scale(0);
+    int32_t disp(0);
+    if (!MatchCoalescableMemOp(mloc, base, index, scale, disp)) return;
+
+    intptr_t begin_disp = disp;
+    intptr_t end_disp = disp + static_cast<intptr_t>(mloc.ByteWidth());
+    if (group->num_mem_ops) {
+      auto is_contiguous = begin_disp <= group->end_disp &&
+                           end_disp >= group->begin_disp;
+      begin_disp = GRANARY_MIN(begin_disp, group->begin_disp);
+      end_disp = GRANARY_MAX(end_disp, group->end_disp);
+      auto num_bytes = static_cast<size_t>(end_disp - begin_disp);
+      if (base != group->base || index != group->index ||
+          scale != group->scale || !is_contiguous ||
+          kMaxCoalescedRangeBytes < num_bytes) {
+        InstrumentMemRange(group);
+        begin_disp = disp;
+        end_disp = disp + static_cast<intptr_t>(mloc.ByteWidth());
+      }
+    }
+    if (!group->num_mem_ops) {
+      group->first_instr = instr_;
+      group->base = base;
+      group->index = index;
+      group->scale = scale;
+      group->is_read = false;
+      group->is_write = false;
+    }
+    group->last_instr = instr_;
+    group->begin_disp = begin_disp;
+    group->end_disp = end_disp;
+    group->num_mem_ops += 1;
+    group->is_read = group->is_read || mloc.IsRead();
+    group->is_write = group->is_write || mloc.IsWrite();
+    coalesced_instrs[mloc_num].Add(instr_);
+  }
+
+  // Compute the lowest address accessed by a group of memory operands before
+  // the first instruction of the group, and then dispatch to all range hooks.
+  void InstrumentMemRange(MemOpGroup *group) {
+    RegisterOperand base_op(group->base);
+    ImmediateOperand disp_op(static_cast<int32_t>(group->begin_disp));
+    RegisterOperand addr_reg_op(virt_range_reg);
+    if (group->index.IsValid()) {
+      RegisterOperand index_op(group->index);
+      lir::InlineAssembly asm_(base_op, disp_op, addr_reg_op, index_op);
+      asm_.InlineBefore(group->first_instr, IndexedRangeLEA(group->scale));
+    } else {
+      lir::InlineAssembly asm_(base_op, disp_op, addr_reg_op);
+      asm_.InlineBefore(group->first_instr,
+                        "LEA r64 %2, m64 [%0 + %1];"_x86_64);
+    }
+    InstrumentedMemoryRange range = {
+        bb, group->first_instr, group->last_instr, addr_reg_op,
+        static_cast<size_t>(group->end_disp - group->begin_disp),
+        group->num_mem_ops, group->is_read, group->is_write};
+    gMemRangeHooks.ApplyAll(range);
+    group->num_mem_ops = 0;
+  }
+
   // Current block being instrumented.
   DecodedBlock *bb;
 
@@ -142,17 +323,31 @@ class MemOpTool : public InstrumentationTool {
   // Current memory operand being instrumented.
   size_t op_num;
 
+  // Instructions whose first and second memory operands are covered by
+  // coalesced memory ranges in the current block.
+  CoalescedInstrSet coalesced_instrs[2];
+
   // Virtual registers used throughout.
   static VirtualRegister virt_addr_reg[2];
+
+  // Virtual register that holds the lowest address of a range of memory.
+  static VirtualRegister virt_range_reg;
 };
 
 VirtualRegister MemOpTool::virt_addr_reg[2];
+VirtualRegister MemOpTool::virt_range_reg;
 
 // Registers a function that can hook into the memory operands instrumenter.
 void AddMemOpInstrumenter(void (*func)(const InstrumentedMemoryOperand &)) {
   gMemOpHooks.Add(func);
 }
 
+// Registers a function that can hook into the memory operands instrumenter,
+// and that will be invoked once per group of coalesced memory operands.
+void AddMemOpRangeInstrumenter(void (*func)(const InstrumentedMemoryRange &)) {
+  gMemRangeHooks.Add(func);
+}
+
 GRANARY_ON_CLIENT_INIT() {
   AddInstrumentationTool<MemOpTool>("memop");
 }
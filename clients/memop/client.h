@@ -25,6 +25,12 @@ class InstrumentedMemoryOperand {
   // going to be `0` or `1`.
   const size_t operand_number;
 
+  // Is this memory operand covered by a coalesced memory range that was
+  // reported to the memory range hooks? Tools that instrument memory ranges
+  // can use this to skip the same memory operands in their memory operand
+  // instrumenters.
+  const bool is_coalesced;
+
  private:
   GRANARY_DISALLOW_COPY_AND_ASSIGN(InstrumentedMemoryOperand);
 };
@@ -32,4 +38,45 @@ class InstrumentedMemoryOperand {
 // Registers a function that can hook into the memory operands instrumenter.
 void AddMemOpInstrumenter(void (*func)(const InstrumentedMemoryOperand &));
 
+// Represents a range of memory accessed by a group of memory operands within
+// a block. All memory operands in the group compute their addresses from the
+// same base and index registers, neither register is redefined between the
+// first and last instructions of the group, and the accesses of the group
+// are contiguous or overlapping.
+class InstrumentedMemoryRange {
+ public:
+  // Block that contains `first_instr` and `last_instr`.
+  granary::DecodedBlock * const block;
+
+  // First instruction of the group. Instrumentation that checks the range
+  // should be injected before this instruction.
+  granary::NativeInstruction * const first_instr;
+
+  // Last instruction of the group.
+  granary::NativeInstruction * const last_instr;
+
+  // Register operand containing the lowest native address accessed by any
+  // memory operand of the group.
+  const granary::RegisterOperand &native_addr_op;
+
+  // Number of bytes covered by the range, starting at the address in
+  // `native_addr_op`. Every byte of the range is accessed by at least one
+  // memory operand of the group.
+  const size_t num_bytes;
+
+  // Number of memory operands covered by this range.
+  const size_t num_mem_ops;
+
+  // Do any of the memory operands of the group read or write memory?
+  const bool is_read;
+  const bool is_write;
+
+ private:
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(InstrumentedMemoryRange);
+};
+
+// Registers a function that can hook into the memory operands instrumenter,
+// and that will be invoked once per group of coalesced memory operands.
+void AddMemOpRangeInstrumenter(void (*func)(const InstrumentedMemoryRange &));
+
 #endif  // CLIENTS_MEMOP_CLIENT_H_
@@ -74,9 +74,11 @@ class ShadowMemory : public InstrumentationTool {
       GRANARY_ASSERT(0 != gShiftAmount);
 
       AddMemOpInstrumenter(InstrumentMemOp);
+      AddMemOpRangeInstrumenter(InstrumentMemRange);
 
       shadow_addr_reg[0] = AllocateVirtualRegister();
       shadow_addr_reg[1] = AllocateVirtualRegister();
+      shadow_range_addr_reg = AllocateVirtualRegister();
       shadow_base_reg = AllocateVirtualRegister();
     }
   }
@@ -89,6 +91,7 @@ class ShadowMemory : public InstrumentationTool {
         gDescriptions = desc->next;
         desc->next = nullptr;
         desc->instrumenter = nullptr;
+        desc->range_instrumenter = nullptr;
         desc->is_registered = false;
         desc->offset_asm_instruction[0] = '\0';
       }
@@ -117,14 +120,49 @@ class ShadowMemory : public InstrumentationTool {
   }
 
  private:
+  // Inject instructions before `instr` that compute the shadow address of the
+  // native address in `%3` into `%4`.
+  //
+  // %0 is an i8 shift amount.
+  // %1 is an i8 scale amount.
+  // %2 is an i64 containing the value of `gShadowMem`.
+  // %3 is an r64 native pointer.
+  // %4 will be our shadow pointer (calculated based on %3).
+  // %5 is our shadow base
+  static void InstrumentShadowAddress(lir::InlineAssembly *asm_,
+                                      NativeInstruction *instr) {
+    asm_->InlineBefore(instr,
+        "MOV r64 %4, r64 %3;"
+        "LEA r64 %5, m64 %2;"_x86_64);
+
+    // Scale the native address by the granularity of the shadow memory.
+    asm_->InlineBeforeIf(instr, 0 < gShiftAmount,
+        "SHR r64 %4, i8 %0;"_x86_64);
+
+    // Chop off the high-order 32 bits of the shadow offset, then scale the
+    // offset by the size of the shadow structure. This has the benefit of
+    // making it more likely that both shadow memory and address watchpoints
+    // can be simultaneously used.
+    asm_->InlineBefore(instr,
+        "MOV r32 %4, r32 %4;"_x86_64);
+    asm_->InlineBeforeIf(instr, 1 < gAlignedSize,
+        "SHL r64 %4, i8 %1;"_x86_64);
+
+    // Add the shadow base to the offset, forming the shadow pointer.
+    asm_->InlineBefore(instr,
+        "ADD r64 %4, r64 %5;"_x86_64);
+  }
+
   static void InstrumentMemOp(const InstrumentedMemoryOperand &op) {
 
-    // Should we instrument this memory operand?
+    // Should we instrument this memory operand? Coalesced memory operands are
+    // instrumented by range instrumenters, if there are any.
     auto i = 0;
     auto do_instrument = false;
     bool instrument[kMaxNumShadowStructures] = {false};
     for (auto desc : ShadowStructureIterator(gDescriptions)) {
-      if ((instrument[i++] = desc->predicate(op))) {
+      auto in_range = op.is_coalesced && desc->range_instrumenter;
+      if ((instrument[i++] = !in_range && desc->predicate(op))) {
         do_instrument = true;
       }
     }
@@ -137,33 +175,7 @@ class ShadowMemory : public InstrumentationTool {
     RegisterOperand shadow_base_addr(shadow_base_reg);
     lir::InlineAssembly asm_(shift, scale, shadow_base, op.native_addr_op,
                              shadow_addr, shadow_base_addr);
-    asm_.InlineBefore(op.instr,
-        "MOV r64 %4, r64 %3;"
-        "LEA r64 %5, m64 %2;"_x86_64);
-
-    // %0 is an i8 shift amount.
-    // %1 is an i8 scale amount.
-    // %2 is an i64 containing the value of `gShadowMem`.
-    // %3 is an r64 native pointer.
-    // %4 will be our shadow pointer (calculated based on %3).
-    // %5 is our shadow base
-
-    // Scale the native address by the granularity of the shadow memory.
-    asm_.InlineBeforeIf(op.instr, 0 < gShiftAmount,
-        "SHR r64 %4, i8 %0;"_x86_64);
-
-    // Chop off the high-order 32 bits of the shadow offset, then scale the
-    // offset by the size of the shadow structure. This has the benefit of
-    // making it more likely that both shadow memory and address watchpoints
-    // can be simultaneously used.
-    asm_.InlineBefore(op.instr,
-        "MOV r32 %4, r32 %4;"_x86_64);
-    asm_.InlineBeforeIf(op.instr, 1 < gAlignedSize,
-        "SHL r64 %4, i8 %1;"_x86_64);
-
-    // Add the shadow base to the offset, forming the shadow pointer.
-    asm_.InlineBefore(op.instr,
-        "ADD r64 %4, r64 %5;"_x86_64);
+    InstrumentShadowAddress(&asm_, op.instr);
     auto native_addr_op(asm_.Register(op.block, 3));
     auto shadow_addr_op(asm_.Register(op.block, 4));
     i = 0;
@@ -184,6 +196,37 @@ class ShadowMemory : public InstrumentationTool {
     }
   }
 
+  // Instrument a range of memory accessed by a group of coalesced memory
+  // operands. The shadow address of the range is computed once, before the
+  // first instruction of the group.
+  static void InstrumentMemRange(const InstrumentedMemoryRange &range) {
+    auto do_instrument = false;
+    for (auto desc : ShadowStructureIterator(gDescriptions)) {
+      if (desc->range_instrumenter) do_instrument = true;
+    }
+    if (!do_instrument) return;
+
+    ImmediateOperand shift(gShiftAmount);
+    ImmediateOperand scale(gScaleAmount);
+    MemoryOperand shadow_base(gShadowMem);
+    RegisterOperand shadow_addr(shadow_range_addr_reg);
+    RegisterOperand shadow_base_addr(shadow_base_reg);
+    lir::InlineAssembly asm_(shift, scale, shadow_base, range.native_addr_op,
+                             shadow_addr, shadow_base_addr);
+    InstrumentShadowAddress(&asm_, range.first_instr);
+    auto native_addr_op(asm_.Register(range.block, 3));
+    auto shadow_addr_op(asm_.Register(range.block, 4));
+    for (auto desc : ShadowStructureIterator(gDescriptions)) {
+      asm_.InlineBefore(range.first_instr, desc->offset_asm_instruction);
+      if (desc->range_instrumenter) {
+        ShadowedMemoryRange shadow_range{
+            range.block, range.first_instr, range.last_instr, shadow_addr_op,
+            native_addr_op, range.num_bytes, range.is_read, range.is_write};
+        desc->range_instrumenter(shadow_range);
+      }
+    }
+  }
+
 #ifdef GRANARY_WHERE_user
   // Initialize the shadow memory if it has not yet been initialized.
   static void InitShadowMemory(void) {
@@ -219,10 +262,12 @@ class ShadowMemory : public InstrumentationTool {
 #endif  // GRANARY_WHERE_user
 
   static VirtualRegister shadow_addr_reg[2];
+  static VirtualRegister shadow_range_addr_reg;
   static VirtualRegister shadow_base_reg;
 };
 
 VirtualRegister ShadowMemory::shadow_addr_reg[2];
+VirtualRegister ShadowMemory::shadow_range_addr_reg;
 VirtualRegister ShadowMemory::shadow_base_reg;
 
 // Tells the shadow memory tool about a structure to be stored in shadow
@@ -280,6 +325,16 @@ void AddShadowStructure(ShadowStructureDescription *desc,
   gShadowMemNumPages = gShadowMemSize / arch::PAGE_SIZE_BYTES;
 }
 
+// Tells the shadow memory tool to instrument ranges of memory accessed by
+// coalesced memory operands with `range_instrumenter`.
+void AddShadowRangeInstrumenter(
+    ShadowStructureDescription *desc,
+    void (*range_instrumenter)(const ShadowedMemoryRange &)) {
+  GRANARY_ASSERT(!gShadowMem);
+  GRANARY_ASSERT(desc->is_registered);
+  desc->range_instrumenter = range_instrumenter;
+}
+
 // Returns the address of some shadow object.
 uintptr_t ShadowOf(const ShadowStructureDescription *desc, uintptr_t addr) {
   GRANARY_ASSERT(desc->is_registered);
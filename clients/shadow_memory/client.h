@@ -32,12 +32,49 @@ class ShadowedMemoryOperand {
   GRANARY_DISALLOW_COPY_AND_ASSIGN(ShadowedMemoryOperand);
 };
 
+// Range of memory, accessed by a group of coalesced memory operands, along with
+// the shadow memory of the lowest address of the range.
+class ShadowedMemoryRange {
+ public:
+  // Block that contains `first_instr` and `last_instr`.
+  granary::DecodedBlock * const block;
+
+  // First and last instructions of the group of memory operands. Range checks
+  // should be injected before `first_instr`.
+  granary::NativeInstruction * const first_instr;
+  granary::NativeInstruction * const last_instr;
+
+  // Register operand that can be used to access the shadow memory of the
+  // lowest native address of the range. The shadow memory of the rest of the
+  // range follows it, one shadow unit per `--shadow_granularity` bytes, so a
+  // range of `num_bytes` bytes can span more than one shadow unit.
+  const granary::RegisterOperand &shadow_addr_op;
+
+  // Register operand containing the lowest native address of the range.
+  const granary::RegisterOperand &native_addr_op;
+
+  // Number of bytes accessed by the range.
+  const size_t num_bytes;
+
+  // Do any of the memory operands of the range read or write memory?
+  const bool is_read;
+  const bool is_write;
+
+ private:
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(ShadowedMemoryRange);
+};
+
 // Represents a description of a shadow memory structure.
 class ShadowStructureDescription {
  public:
   ShadowStructureDescription *next;
   void (*instrumenter)(const ShadowedMemoryOperand &op);
   bool (*predicate)(const InstrumentedMemoryOperand &op);
+
+  // Optional instrumenter for ranges of memory accessed by coalesced memory
+  // operands. If this is set, then coalesced memory operands are only
+  // reported to `range_instrumenter`, and not to `instrumenter`.
+  void (*range_instrumenter)(const ShadowedMemoryRange &range);
   size_t offset;
   const size_t size;
   const size_t align;
@@ -73,6 +110,7 @@ ShadowStructureDescription GetShadowStructureDescription<T>::kDescription = {
   nullptr,
   nullptr,
   &detail::AlwaysInstrumentMemOpPredicate,
+  nullptr,
   0,
   sizeof(T),
   alignof(T),
@@ -100,6 +138,20 @@ inline static void AddShadowStructure(
   AddShadowStructure(ShadowDescription<T>(), instrumenter, predicate);
 }
 
+// Tells the shadow memory tool to instrument ranges of memory accessed by
+// coalesced memory operands with `range_instrumenter`, so that the shadow
+// address of each range is computed only once. The structure must have already
+// been added with `AddShadowStructure`.
+void AddShadowRangeInstrumenter(
+    ShadowStructureDescription *desc,
+    void (*range_instrumenter)(const ShadowedMemoryRange &));
+
+template <typename T>
+inline static void AddShadowRangeInstrumenter(
+    void (*range_instrumenter)(const ShadowedMemoryRange &)) {
+  AddShadowRangeInstrumenter(ShadowDescription<T>(), range_instrumenter);
+}
+
 // Returns the address of some shadow object.
 uintptr_t ShadowOf(const ShadowStructureDescription *desc, uintptr_t addr);
 
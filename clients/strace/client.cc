@@ -12,6 +12,23 @@ GRANARY_DECLARE_bool(hook_syscalls);
 
 GRANARY_USING_NAMESPACE granary;
 
+GRANARY_DEFINE_string(strace_syscalls, "*",
+    "Comma-separated list of the names or numbers of the system calls to "
+    "trace. A `-` before a name excludes that system call. The default "
+    "value is `*`, which means that all system calls are traced. For "
+    "example: `--strace_syscalls=*,-futex`.\n"
+    "\n"
+    "Note: If `--event_log_file` is specified, then system calls are written "
+    "to the binary event log instead of the text log.",
+
+    "strace");
+
+GRANARY_DEFINE_bool(strace_latency_histograms, false,
+    "Log a histogram of the latencies (in cycles) of each traced system call "
+    "when the program exits. The default is `no`.",
+
+    "strace");
+
 namespace {
 
 #pragma clang diagnostic push
@@ -348,38 +365,141 @@ enum {
   NUM_SYSCALLS = sizeof kSystemCallNames / sizeof kSystemCallNames[0]
 };
 
-static __thread uint64_t tSyscallNumber = 0;
-static __thread uint64_t tSyscallArg0 = 0;
-static __thread uint64_t tSyscallArg1 = 0;
-static __thread uint64_t tSyscallArg2 = 0;
-static __thread uint64_t tSyscallArg3 = 0;
-static __thread uint64_t tSyscallArg4 = 0;
-static __thread uint64_t tSyscallArg5 = 0;
+enum : size_t {
+  kNumSyscallBitmapWords = (NUM_SYSCALLS + 63) / 64,
+
+  // Number of log-scale buckets in each latency histogram. Bucket `i` counts
+  // the system calls that took `[2^i, 2^(i+1))` cycles.
+  kNumLatencyBuckets = 64
+};
+
+// Bitmap of the system calls that should be traced.
+static uint64_t gTracedSyscalls[kNumSyscallBitmapWords] = {0};
+
+// Event kind of each system call, if system calls are written to the binary
+// event log.
+static uint32_t gSyscallEventKinds[NUM_SYSCALLS] = {0};
+static bool gLogEvents = false;
+
+// Per-system call latency histograms.
+static std::atomic<uint64_t> gLatencyHistograms[NUM_SYSCALLS]
+                                               [kNumLatencyBuckets];
+
+// The system call being made by this thread, and the cycle count when it was
+// made. The arguments of the system call aren't saved, because the kernel
+// preserves the argument registers.
+static __thread uint64_t tSyscallNumber = NUM_SYSCALLS;
+static __thread uint64_t tSyscallStartCycles = 0;
+
+// Returns true if the system call `number` should be traced.
+static bool IsTracedSyscall(uint64_t number) {
+  return number < NUM_SYSCALLS &&
+         (gTracedSyscalls[number / 64] & (1ULL << (number % 64)));
+}
+
+// Mark the system call `number` as being traced or not.
+static void SetTracedSyscall(uint64_t number, bool is_traced) {
+  if (number >= NUM_SYSCALLS) return;
+  if (is_traced) {
+    gTracedSyscalls[number / 64] |= 1ULL << (number % 64);
+  } else {
+    gTracedSyscalls[number / 64] &= ~(1ULL << (number % 64));
+  }
+}
+
+// Returns the number of the system call named by `name`, which is either a
+// system call name or number. Returns `NUM_SYSCALLS` if `name` doesn't name
+// a system call.
+static uint64_t SyscallNumber(const char *name) {
+  uint64_t number(NUM_SYSCALLS);
+  if (1 == DeFormat(name, "%lu", &number)) return number;
+  for (number = 0; number < NUM_SYSCALLS; ++number) {
+    if (kSystemCallNames[number] &&
+        StringsMatch(kSystemCallNames[number], name)) {
+      break;
+    }
+  }
+  return number;
+}
+
+// Initialize the bitmap of traced system calls from `--strace_syscalls`.
+static void InitTracedSyscalls(void) {
+  const auto trace_all = '*' == FLAG_strace_syscalls[0];
+  for (auto number = 0UL; number < NUM_SYSCALLS; ++number) {
+    SetTracedSyscall(number, trace_all);
+  }
+  ForEachCommaSeparatedString<32>(
+      FLAG_strace_syscalls,
+      [] (const char *syscall_str) {
+        if ('-' == syscall_str[0]) {
+          SetTracedSyscall(SyscallNumber(&(syscall_str[1])), false);
+        } else {
+          SetTracedSyscall(SyscallNumber(syscall_str), true);
+        }
+      });
+}
+
+// Register one kind of event per system call, so that traced system calls
+// can be written to the binary event log.
+static void InitSyscallEventKinds(void) {
+  gLogEvents = os::EventLogIsEnabled();
+  if (!gLogEvents) return;
+  for (auto number = 0UL; number < NUM_SYSCALLS; ++number) {
+    if (!kSystemCallNames[number]) continue;
+    gSyscallEventKinds[number] = os::RegisterEventKind(
+        kSystemCallNames[number],
+        "%lx\t%lx\t%lx\t%lx\t%lx\t%lx\t= %lx\t(%lu cycles)");
+  }
+}
+
+// Returns the index of the latency histogram bucket for `num_cycles`.
+static size_t LatencyBucket(uint64_t num_cycles) {
+  return 63UL - static_cast<size_t>(__builtin_clzll(num_cycles | 1));
+}
+
+// Log the latency histograms of every traced system call that was made.
+static void LogLatencyHistograms(void) {
+  for (auto number = 0UL; number < NUM_SYSCALLS; ++number) {
+    auto &histogram(gLatencyHistograms[number]);
+    uint64_t num_calls(0);
+    for (auto &bucket : histogram) num_calls += bucket.load();
+    if (!num_calls) continue;
+    os::Log("#strace %s %lu calls\n", kSystemCallNames[number], num_calls);
+    for (auto i = 0UL; i < kNumLatencyBuckets; ++i) {
+      if (auto count = histogram[i].exchange(0)) {
+        os::Log("#strace   [%lu, %lu) cycles: %lu\n", 1UL << i,
+                (1UL << i) << 1, count);
+      }
+    }
+  }
+}
 
 static void TraceSyscallEntry(SystemCallContext ctx) {
   tSyscallNumber = ctx.Number();
-  tSyscallArg0 = ctx.Arg0();
-  tSyscallArg1 = ctx.Arg1();
-  tSyscallArg2 = ctx.Arg2();
-  tSyscallArg3 = ctx.Arg3();
-  tSyscallArg4 = ctx.Arg4();
-  tSyscallArg5 = ctx.Arg5();
+  if (IsTracedSyscall(tSyscallNumber)) {
+    tSyscallStartCycles = arch::CycleCount();
+  }
 }
 
 static void TraceSyscallExit(SystemCallContext ctx) {
-  if (tSyscallNumber < NUM_SYSCALLS) {
+  const auto number = tSyscallNumber;
+  tSyscallNumber = NUM_SYSCALLS;
+  if (!IsTracedSyscall(number)) return;
+
+  const auto num_cycles = arch::CycleCount() - tSyscallStartCycles;
+  if (FLAG_strace_latency_histograms) {
+    gLatencyHistograms[number][LatencyBucket(num_cycles)].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+  if (gLogEvents) {
+    os::LogEvent(gSyscallEventKinds[number], ctx.Arg0(), ctx.Arg1(),
+                 ctx.Arg2(), ctx.Arg3(), ctx.Arg4(), ctx.Arg5(),
+                 ctx.ReturnValue(), num_cycles);
+  } else {
     os::Log("%s\t%lx\t%lx\t%lx\t%lx\t%lx\t%lx\t= %lx\n",
-            kSystemCallNames[tSyscallNumber], tSyscallArg0, tSyscallArg1,
-            tSyscallArg2, tSyscallArg3, tSyscallArg4, tSyscallArg5,
-            ctx.ReturnValue());
+            kSystemCallNames[number], ctx.Arg0(), ctx.Arg1(), ctx.Arg2(),
+            ctx.Arg3(), ctx.Arg4(), ctx.Arg5(), ctx.ReturnValue());
   }
-  tSyscallNumber = 0;
-  tSyscallArg0 = 0;
-  tSyscallArg1 = 0;
-  tSyscallArg2 = 0;
-  tSyscallArg3 = 0;
-  tSyscallArg4 = 0;
-  tSyscallArg5 = 0;
 }
 
 }  // namespace
@@ -390,9 +510,17 @@ class SystemCallTracer : public InstrumentationTool {
   virtual ~SystemCallTracer(void) = default;
   static void Init(InitReason reason) {
     if (kInitThread == reason) return;
+    InitTracedSyscalls();
+    InitSyscallEventKinds();
     AddSystemCallEntryFunction(TraceSyscallEntry);
     AddSystemCallExitFunction(TraceSyscallExit);
   }
+
+  static void Exit(ExitReason reason) {
+    if (kExitProgram == reason || kExitDetach == reason) {
+      if (FLAG_strace_latency_histograms) LogLatencyHistograms();
+    }
+  }
 };
 
 // Initialize the `strace` tool.
@@ -0,0 +1,372 @@
+/* Copyright 2015 Peter Goodman, all rights reserved. */
+
+#include "clients/util/types.h"  // Needs to go first.
+
+#include <granary.h>
+
+#ifdef GRANARY_WHERE_user
+
+GRANARY_DECLARE_bool(hook_syscalls);
+
+#include "clients/stack_trace/client.h"
+#include "clients/user/client.h"
+
+GRANARY_USING_NAMESPACE granary;
+
+GRANARY_DEFINE_uint(syscall_profile_stack_depth, 0,
+    "The number of return addresses from the call stack that should be used, "
+    "in addition to the system call instruction, to distinguish the call "
+    "sites of system calls. The maximum value is `8`. The default value is "
+    "`0`, which means that call stacks are not used.\n"
+    "\n"
+    "Note: A non-zero value requires the `stack_trace` tool.",
+
+    "syscall_profile");
+
+GRANARY_DEFINE_positive_uint(syscall_profile_num_sites, 32,
+    "The number of call sites to log when the program exits. Call sites are "
+    "logged in decreasing order of the total number of cycles spent in their "
+    "system calls. The default value is `32`.",
+
+    "syscall_profile");
+
+namespace {
+enum : size_t {
+  kMaxStackDepth = 8,
+
+  // Bucket `i` of a latency histogram counts system calls that took
+  // `[2^i, 2^(i+1))` cycles. The last bucket also counts longer calls.
+  kNumLatencyBuckets = 40,
+
+  // Number of call sites that each thread can profile. Must be a power of
+  // two.
+  kNumThreadSites = 256,
+
+  // Number of call sites that can be profiled across all threads. Must be a
+  // power of two.
+  kNumMergedSites = 4096
+};
+
+// Identifies where a system call was made.
+struct CallSite {
+  uint64_t number;
+  AppPC pc;
+  AppPC stack[kMaxStackDepth];
+};
+
+// A program counter, resolved to an offset within a module.
+struct ModuleLocation {
+  const os::Module *module;
+  uintptr_t offset;
+};
+
+// A call site whose program counters are resolved to module offsets. Call
+// sites are resolved when they are first recorded, as their modules might be
+// unloaded by the time that the profiles are logged.
+struct ResolvedCallSite {
+  ModuleLocation pc;
+  ModuleLocation stack[kMaxStackDepth];
+};
+
+// Profile of the system calls made from a single call site.
+struct CallSiteProfile {
+  std::atomic<bool> is_valid;
+  CallSite site;
+  ResolvedCallSite resolved_site;
+  std::atomic<uint64_t> num_calls;
+  std::atomic<uint64_t> num_cycles;
+  std::atomic<uint64_t> latencies[kNumLatencyBuckets];
+};
+
+// Profile of the system calls made by a thread. Only the thread that owns
+// a profile adds call sites to it, but its counters are also reset by the
+// thread that merges the profiles, so the counters are updated with atomic
+// read-modify-write operations.
+struct ThreadProfile {
+  ThreadProfile *next;
+  std::atomic<bool> is_owned;
+  std::atomic<uint64_t> num_dropped_calls;
+  CallSiteProfile sites[kNumThreadSites];
+};
+
+// Profile of the system calls made by all threads.
+struct MergedProfile {
+  CallSiteProfile sites[kNumMergedSites];
+};
+
+static_assert(0 == (kNumThreadSites & (kNumThreadSites - 1)),
+              "`kNumThreadSites` must be a power of two.");
+static_assert(0 == (kNumMergedSites & (kNumMergedSites - 1)),
+              "`kNumMergedSites` must be a power of two.");
+
+// List of all thread profiles. Profiles are never removed from this list;
+// instead, the profile of an exited thread is re-used by a later thread.
+static std::atomic<ThreadProfile *> gProfiles(ATOMIC_VAR_INIT(nullptr));
+
+// Number of return addresses used to distinguish call sites.
+static size_t gStackDepth = 0;
+
+// The current thread's profile.
+static __thread ThreadProfile *tProfile = nullptr;
+
+// The call site and start time of the current thread's pending system call.
+static __thread CallSite tCallSite;
+static __thread uint64_t tStartCycles = 0;
+
+// Allocate some zero-initialized memory for a profile.
+template <typename T>
+static T *AllocateProfile(void) {
+  auto mem = mmap(nullptr, sizeof(T), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return MAP_FAILED == mem ? nullptr : reinterpret_cast<T *>(mem);
+}
+
+// Returns the current thread's profile. This either re-uses the profile of
+// an exited thread, or allocates a new profile.
+static ThreadProfile *CurrentProfile(void) {
+  if (GRANARY_LIKELY(nullptr != tProfile)) return tProfile;
+  for (auto profile = gProfiles.load(); profile; profile = profile->next) {
+    auto is_owned = false;
+    if (profile->is_owned.compare_exchange_strong(is_owned, true)) {
+      return tProfile = profile;
+    }
+  }
+  auto profile = AllocateProfile<ThreadProfile>();
+  if (!profile) return nullptr;
+  profile->is_owned.store(true);
+  profile->next = gProfiles.load();
+  while (!gProfiles.compare_exchange_weak(profile->next, profile)) {}
+  return tProfile = profile;
+}
+
+// Returns a hash of a call site.
+static uint64_t HashCallSite(const CallSite &site) {
+  auto hash = site.number * 0x9E3779B97F4A7C15ULL;
+  hash = (hash ^ reinterpret_cast<uintptr_t>(site.pc)) * 0x100000001B3ULL;
+  for (auto pc : site.stack) {
+    hash = (hash ^ reinterpret_cast<uintptr_t>(pc)) * 0x100000001B3ULL;
+  }
+  return hash ^ (hash >> 29);
+}
+
+// Resolve a program counter to an offset within a module.
+static ModuleLocation ResolvePC(AppPC pc) {
+  auto offset = os::ModuleOffsetOfPC(pc);
+  return {offset.module, offset.offset};
+}
+
+// Resolve the program counters of `site` to module offsets.
+static void ResolveCallSite(const CallSite &site, ResolvedCallSite *resolved) {
+  resolved->pc = ResolvePC(site.pc);
+  for (auto i = 0UL; i < kMaxStackDepth; ++i) {
+    if (site.stack[i]) resolved->stack[i] = ResolvePC(site.stack[i]);
+  }
+}
+
+// Returns the profile of `site` within `sites`, adding `site` if it is not
+// yet profiled. Newly added call sites are resolved to module offsets, unless
+// `resolved_site` is non-null, in which case the resolved offsets are copied
+// from `resolved_site`. Returns `nullptr` if `sites` is full.
+static CallSiteProfile *FindSiteProfile(CallSiteProfile *sites,
+                                        size_t num_sites,
+                                        const CallSite &site,
+                                        const ResolvedCallSite *resolved_site) {
+  const auto mask = num_sites - 1;
+  auto index = HashCallSite(site) & mask;
+  for (auto i = 0UL; i < num_sites; ++i, index = (index + 1) & mask) {
+    auto &profile(sites[index]);
+    if (!profile.is_valid.load(std::memory_order_acquire)) {
+      memcpy(&(profile.site), &site, sizeof site);
+      if (resolved_site) {
+        memcpy(&(profile.resolved_site), resolved_site, sizeof *resolved_site);
+      } else {
+        ResolveCallSite(site, &(profile.resolved_site));
+      }
+      profile.is_valid.store(true, std::memory_order_release);
+      return &profile;
+    } else if (!memcmp(&(profile.site), &site, sizeof site)) {
+      return &profile;
+    }
+  }
+  return nullptr;
+}
+
+// Returns the index of the latency histogram bucket for `num_cycles`.
+static size_t LatencyBucket(uint64_t num_cycles) {
+  auto bucket = 63UL - static_cast<size_t>(__builtin_clzll(num_cycles | 1));
+  return GRANARY_MIN(bucket, kNumLatencyBuckets - 1UL);
+}
+
+// Add `val` to a counter. This must be an atomic read-modify-write, even
+// though only one thread adds to the counters of a thread profile, as the
+// thread that merges the profiles concurrently resets them. Otherwise, an
+// update could overwrite a reset, and its counts would be merged twice.
+static void AddToCounter(std::atomic<uint64_t> &counter, uint64_t val) {
+  counter.fetch_add(val, std::memory_order_relaxed);
+}
+
+// Record the program counter of the system call instruction that is about to
+// be executed.
+static void RecordCallSite(AppPC pc) {
+  tCallSite.pc = pc;
+}
+
+static void ProfileSyscallEntry(SystemCallContext ctx) {
+  tCallSite.number = ctx.Number();
+  if (gStackDepth) {
+    memset(tCallSite.stack, 0, sizeof tCallSite.stack);
+    CopyStackTrace(tCallSite.stack, gStackDepth);
+  }
+  tStartCycles = arch::CycleCount();
+}
+
+static void ProfileSyscallExit(SystemCallContext) {
+  const auto num_cycles = arch::CycleCount() - tStartCycles;
+  auto profile = CurrentProfile();
+  if (GRANARY_UNLIKELY(!profile)) return;
+
+  auto site = FindSiteProfile(profile->sites, kNumThreadSites, tCallSite,
+                              nullptr);
+  if (GRANARY_UNLIKELY(!site)) {
+    AddToCounter(profile->num_dropped_calls, 1);
+    return;
+  }
+  AddToCounter(site->num_calls, 1);
+  AddToCounter(site->num_cycles, num_cycles);
+  AddToCounter(site->latencies[LatencyBucket(num_cycles)], 1);
+}
+
+// Merge the profiles of all threads into `merged`, and reset the thread
+// profiles. Returns the number of system calls that could not be profiled.
+static uint64_t MergeProfiles(MergedProfile *merged) {
+  uint64_t num_dropped_calls(0);
+  for (auto profile = gProfiles.load(); profile; profile = profile->next) {
+    num_dropped_calls += profile->num_dropped_calls.exchange(0);
+    for (auto &site : profile->sites) {
+      if (!site.is_valid.load(std::memory_order_acquire)) continue;
+      auto merged_site = FindSiteProfile(merged->sites, kNumMergedSites,
+                                         site.site, &(site.resolved_site));
+      if (!merged_site) {
+        num_dropped_calls += site.num_calls.exchange(0);
+        continue;
+      }
+      AddToCounter(merged_site->num_calls, site.num_calls.exchange(0));
+      AddToCounter(merged_site->num_cycles, site.num_cycles.exchange(0));
+      for (auto i = 0UL; i < kNumLatencyBuckets; ++i) {
+        AddToCounter(merged_site->latencies[i], site.latencies[i].exchange(0));
+      }
+    }
+  }
+  return num_dropped_calls;
+}
+
+// Log a program counter in terms of its module and offset.
+static void LogProgramCounter(const char *prefix, AppPC pc,
+                              const ModuleLocation &loc) {
+  if (loc.module) {
+    os::Log("#syscall_profile   %s %p %s:%lx\n", prefix, pc,
+            loc.module->Path(), loc.offset);
+  } else {
+    os::Log("#syscall_profile   %s %p\n", prefix, pc);
+  }
+}
+
+// Log the profile of a single call site.
+static void LogSiteProfile(const CallSiteProfile &site) {
+  const auto num_calls = site.num_calls.load();
+  const auto num_cycles = site.num_cycles.load();
+  os::Log("#syscall_profile syscall %lu: %lu calls, %lu cycles, %lu cycles "
+          "per call\n", site.site.number, num_calls, num_cycles,
+          num_cycles / num_calls);
+  LogProgramCounter("at", site.site.pc, site.resolved_site.pc);
+  for (auto i = 0UL; i < kMaxStackDepth; ++i) {
+    if (auto pc = site.site.stack[i]) {
+      LogProgramCounter("from", pc, site.resolved_site.stack[i]);
+    }
+  }
+  for (auto i = 0UL; i < kNumLatencyBuckets; ++i) {
+    if (auto count = site.latencies[i].load()) {
+      os::Log("#syscall_profile   [%lu, %lu) cycles: %lu\n", 1UL << i,
+              (1UL << i) << 1, count);
+    }
+  }
+}
+
+// Log the profiles of the call sites that spent the most cycles in system
+// calls.
+static void LogMergedProfile(MergedProfile *merged) {
+  for (auto i = 0UL; i < FLAG_syscall_profile_num_sites; ++i) {
+    CallSiteProfile *max_site(nullptr);
+    for (auto &site : merged->sites) {
+      if (!site.is_valid.load() || !site.num_calls.load()) continue;
+      if (!max_site || site.num_cycles.load() > max_site->num_cycles.load()) {
+        max_site = &site;
+      }
+    }
+    if (!max_site) return;
+    LogSiteProfile(*max_site);
+    max_site->num_calls.store(0);  // Don't log it again.
+  }
+}
+
+// Merge and log the profiles of all threads.
+static void LogProfiles(void) {
+  auto merged = AllocateProfile<MergedProfile>();
+  if (!merged) return;
+  if (auto num_dropped_calls = MergeProfiles(merged)) {
+    os::Log("#syscall_profile %lu calls were not profiled.\n",
+            num_dropped_calls);
+  }
+  LogMergedProfile(merged);
+  munmap(merged, sizeof *merged);
+}
+
+}  // namespace
+
+// Tool that profiles the latencies of system calls by call site.
+class SystemCallProfiler : public InstrumentationTool {
+ public:
+  virtual ~SystemCallProfiler(void) = default;
+
+  static void Init(InitReason reason) {
+    if (kInitThread == reason) return;
+    gStackDepth = GRANARY_MIN(FLAG_syscall_profile_stack_depth,
+                              static_cast<uint32_t>(kMaxStackDepth));
+    AddSystemCallEntryFunction(ProfileSyscallEntry);
+    AddSystemCallExitFunction(ProfileSyscallExit);
+  }
+
+  static void Exit(ExitReason reason) {
+    if (kExitThread == reason) {
+      if (tProfile) tProfile->is_owned.store(false);
+      tProfile = nullptr;
+    } else if (kExitProgram == reason || kExitDetach == reason) {
+      LogProfiles();
+    }
+  }
+
+  // Record the program counter of every system call so that its latency can
+  // be attributed to its call site.
+  virtual void InstrumentBlock(DecodedBlock *block) {
+    for (auto succ : block->Successors()) {
+      if (succ.cfi->IsSystemCall()) {
+        succ.cfi->InsertBefore(
+            lir::InlineFunctionCall(block, RecordCallSite,
+                                    succ.cfi->DecodedPC()));
+      }
+    }
+  }
+};
+
+// Initialize the `syscall_profile` tool.
+GRANARY_ON_CLIENT_INIT() {
+  if (!FLAG_hook_syscalls) return;
+  if (FLAG_syscall_profile_stack_depth) {
+    AddInstrumentationTool<SystemCallProfiler>("syscall_profile",
+                                               {"stack_trace"});
+  } else {
+    AddInstrumentationTool<SystemCallProfiler>("syscall_profile");
+  }
+}
+
+#endif  // GRANARY_WHERE_user
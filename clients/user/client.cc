@@ -27,13 +27,30 @@ GRANARY_DEFINE_bool(hook_syscalls, true,
 
     "user");
 
+GRANARY_DEFINE_bool(track_memory_maps, false,
+    "Should Granary track the program's `mmap`s, `mprotect`s, and `mremap`s "
+    "as they happen? If not, then Granary re-reads `/proc/self/maps` when it "
+    "finds an address that isn't part of any known module. Tracking requires "
+    "instrumenting the exit of every system call. The default is `no`.",
+
+    "user");
+
 namespace {
 
+// The number of the last system call made by this thread. The system call
+// number register is clobbered by the return value, so it's saved on entry.
+static __thread uint64_t tSystemCallNumber = 0;
+
 // Invalidates any code cache blocks related to an `mmap` request.
 static void UnmapMemory(SystemCallContext ctx) {
   auto addr = ctx.Arg0();
   auto len = ctx.Arg1();
 
+  // Invalidate any blocks translated from the code being unmapped, so that a
+  // later mapping of different code at the same addresses isn't mistaken for
+  // the old code.
+  os::InvalidateModuleCode(reinterpret_cast<AppPC>(addr), len);
+
   // Turn an `munmap` into an `mmap` and `mprotect` pair that first makes
   // the memory unusable, then hints to the OS that it no longer needs to be
   // backed.
@@ -45,6 +62,41 @@ static void UnmapMemory(SystemCallContext ctx) {
   ctx.Arg2() = PROT_NONE;  // Should succeed.
 }
 
+// Convert `mmap`/`mprotect` protection and mapping flags into module
+// permissions.
+static unsigned ModulePermissions(uint64_t prot, uint64_t flags) {
+  unsigned perms(0);
+  if (prot & PROT_READ) perms |= os::MODULE_READABLE;
+  if (prot & PROT_WRITE) perms |= os::MODULE_WRITABLE;
+  if (prot & PROT_EXEC) perms |= os::MODULE_EXECUTABLE;
+  if (flags & MAP_PRIVATE) perms |= os::MODULE_COPY_ON_WRITE;
+  return perms;
+}
+
+// Tells Granary about changes to the program's memory maps, so that Granary
+// doesn't need to re-read `/proc/self/maps` to find new modules.
+static void TrackMemoryMaps(SystemCallContext ctx) {
+  const auto ret = ctx.ReturnValue();
+  if (ret >= static_cast<uint64_t>(-4095L)) return;  // Failed; `-errno`.
+
+  if (__NR_mmap == tSystemCallNumber) {
+    const auto flags = ctx.Arg3();
+    const auto fd = (flags & MAP_ANONYMOUS) ? -1 : static_cast<int>(ctx.Arg4());
+    os::NotifyMemoryMapped(reinterpret_cast<AppPC>(ret), ctx.Arg1(),
+                           ModulePermissions(ctx.Arg2(), flags), fd,
+                           ctx.Arg5());
+
+  // Note: The `MODULE_COPY_ON_WRITE` permission is kept from the mapping.
+  } else if (__NR_mprotect == tSystemCallNumber) {
+    os::NotifyMemoryProtected(reinterpret_cast<AppPC>(ctx.Arg0()), ctx.Arg1(),
+                              ModulePermissions(ctx.Arg2(), 0));
+
+  } else if (__NR_mremap == tSystemCallNumber) {
+    os::NotifyMemoryRemapped(reinterpret_cast<AppPC>(ctx.Arg0()), ctx.Arg1(),
+                             reinterpret_cast<AppPC>(ret), ctx.Arg2());
+  }
+}
+
 // Hooks that other clients can use for interposing on system calls.
 static ClosureList<SystemCallContext> gEntryHooks GRANARY_GLOBAL;
 static ClosureList<SystemCallContext> gExitHooks GRANARY_GLOBAL;
@@ -84,6 +136,7 @@ void HookSystemCallEntry(arch::MachineContext *mcontext) {
   // Note: We apply these hooks *after* the `entry_hooks` so that client-added
   //       hooks can have visibility on all system calls before Granary mangles
   //       them.
+  tSystemCallNumber = ctx.Number();
 
   // Handle proper Granary exit procedures. Granary's `exit_group` function
   // deals with proper `Exit`ing of all tools.
@@ -95,6 +148,11 @@ void HookSystemCallEntry(arch::MachineContext *mcontext) {
   } else if (__NR_exit == ctx.Number()) {
     os::ExitThread();
 
+  // Creating a new thread. Granary needs to know about new threads so that
+  // it doesn't reclaim flushed code that a new thread might be executing.
+  } else if (__NR_clone == ctx.Number()) {
+    if (ctx.Arg0() & CLONE_THREAD) os::BeforeCreateThread();
+
   // Manipulate certain kinds of memory operations.
   } else if (__NR_munmap == ctx.Number()) {
     UnmapMemory(ctx);
@@ -103,7 +161,9 @@ void HookSystemCallEntry(arch::MachineContext *mcontext) {
 
 // Handle a system call exit.
 void HookSystemCallExit(arch::MachineContext *context) {
-  gExitHooks.ApplyAll(SystemCallContext(context));
+  SystemCallContext ctx(context);
+  if (FLAG_track_memory_maps) TrackMemoryMaps(ctx);
+  gExitHooks.ApplyAll(ctx);
 }
 
 // Register a function to be called before a system call is made.
@@ -163,7 +223,10 @@ class UserSpaceInstrumenter : public InstrumentationTool {
     // `exit_group`s.
     syscall->InsertBefore(lir::ContextFunctionCall(HookSystemCallEntry));
 
-    if (!gExitHooks.IsEmpty()) {
+    // Only post-instrument syscalls if some tool has registered an exit hook,
+    // or if we need to see the results of `mmap`s, `mprotect`s, and
+    // `mremap`s.
+    if (FLAG_track_memory_maps || !gExitHooks.IsEmpty()) {
       syscall->InsertAfter(lir::ContextFunctionCall(HookSystemCallExit));
     }
   }
@@ -4,31 +4,75 @@
 
 #include "granary/base/cast.h"
 #include "granary/base/new.h"
+#include "granary/base/option.h"
 #include "granary/base/string.h"
 
 #include "granary/breakpoint.h"
 
+#include "os/logging.h"
 #include "os/memory.h"
 
+GRANARY_DEFINE_bool(log_allocator_stats, false,
+    "Log statistics about each slab allocator when Granary exits. This "
+    "includes the number of slabs allocated, the number of objects allocated "
+    "from slabs, and the number of objects moved between the per-thread "
+    "magazines and the global free lists. The default is `no`.");
+
+GRANARY_DEFINE_bool(translation_arena, true,
+    "Allocate the instructions, blocks, and fragments of each translation from "
+    "a thread-private bump arena, which is reset all at once when the "
+    "translation finishes. If disabled, then these objects are individually "
+    "allocated from and freed to shared slab allocators. The default is "
+    "`yes`."
+    GRANARY_IF_KERNEL("\n\nNote: Translation arenas are not yet supported in "
+                      "kernel space."));
+
 namespace granary {
 namespace internal {
+namespace {
+
+// Number of slab allocator IDs handed out. IDs are never re-used, so that
+// stale magazines of destroyed allocators are never mistaken for the
+// magazines of new allocators.
+static std::atomic<size_t> gNumSlabAllocatorIds(ATOMIC_VAR_INIT(0));
+
+// All live slab allocators, indexed by their IDs.
+static SlabAllocator *gSlabAllocators[kMaxNumSlabAllocators] = {nullptr};
+
+// Returns a new ID for a slab allocator, or `kMaxNumSlabAllocators` if there
+// are no more IDs, in which case the allocator has no magazines.
+static size_t AllocateId(void) {
+  auto id = gNumSlabAllocatorIds.fetch_add(1);
+  return GRANARY_MIN(id, static_cast<size_t>(kMaxNumSlabAllocators));
+}
+
+}  // namespace
 
 // Initialize a new slab list. Once initialized, slab lists are never changed.
 SlabList::SlabList(const SlabList *next_slab_)
     : next(next_slab_) {}
 
 // Initialize the slab allocator.
-SlabAllocator::SlabAllocator(size_t start_offset_, size_t max_offset_,
-                             size_t allocation_size_, size_t object_size_)
-    : offset(max_offset_),
+SlabAllocator::SlabAllocator(const char *name_, size_t start_offset_,
+                             size_t max_offset_, size_t allocation_size_,
+                             size_t object_size_)
+    : name(name_),
+      id(AllocateId()),
+      offset(max_offset_),
       start_offset(start_offset_),
       max_offset(max_offset_),
       allocation_size(allocation_size_),
       object_size(object_size_),
       slab_list_lock(),
       slab_list(nullptr),
+      num_slabs(0),
+      num_slab_allocations(0),
       free_list_lock(),
-      free_list(nullptr) {
+      free_list(nullptr),
+      num_free_list_allocations(0),
+      num_free_list_frees(0),
+      num_magazine_refills(0),
+      num_magazine_flushes(0) {
   asm("":::"memory");
   GRANARY_UNUSED(object_size);
   GRANARY_UNUSED(offset);
@@ -37,21 +81,32 @@ SlabAllocator::SlabAllocator(size_t start_offset_, size_t max_offset_,
   GRANARY_UNUSED(allocation_size);
   GRANARY_UNUSED(slab_list);
   GRANARY_UNUSED(free_list);
+  if (kMaxNumSlabAllocators > id) gSlabAllocators[id] = this;
 }
 
 // For those cases where a slab allocator is non-global.
 SlabAllocator::~SlabAllocator(void) {
+  if (kMaxNumSlabAllocators > id) gSlabAllocators[id] = nullptr;
   auto slab = slab_list;
   for (const SlabList *next_slab(nullptr); slab; slab = next_slab) {
     next_slab = slab->next;
-    auto slab_addr = const_cast<void *>(
-        reinterpret_cast<const void *>(slab_list));
+    auto slab_addr = const_cast<void *>(reinterpret_cast<const void *>(slab));
     os::FreeDataPages(slab_addr, kNewAllocatorNumPagesPerSlab);
   }
   slab_list = nullptr;
   free_list = nullptr;
 }
 
+// Get a snapshot of the statistics of this allocator.
+void SlabAllocator::GetStatistics(SlabAllocatorStatistics *stats_) const {
+  stats_->num_slabs = num_slabs;
+  stats_->num_slab_allocations = num_slab_allocations;
+  stats_->num_free_list_allocations = num_free_list_allocations;
+  stats_->num_free_list_frees = num_free_list_frees;
+  stats_->num_magazine_refills = num_magazine_refills;
+  stats_->num_magazine_flushes = num_magazine_flushes;
+}
+
 #ifndef GRANARY_WITH_VALGRIND
 namespace {
 
@@ -71,6 +126,38 @@ static const SlabList *AllocateSlab(const SlabList *next_slab) {
   return new (slab_memory) SlabList(next_slab);
 }
 
+#ifdef GRANARY_WHERE_user
+enum : size_t {
+  kMagazineTableNumBytes = sizeof(Magazine) * kMaxNumSlabAllocators,
+  kMagazineTableNumPages = (kMagazineTableNumBytes +
+                            arch::PAGE_SIZE_BYTES - 1) / arch::PAGE_SIZE_BYTES
+};
+
+// Table of magazines for the current thread, indexed by allocator ID.
+static __thread Magazine *tMagazines = nullptr;
+
+// Returns the current thread's magazine for the allocator with ID `id`, or
+// `nullptr` if the allocator has no magazines.
+static Magazine *MagazineForAllocator(size_t id) {
+  if (kMaxNumSlabAllocators <= id) return nullptr;
+  if (GRANARY_UNLIKELY(!tMagazines)) {
+    auto magazines = reinterpret_cast<Magazine *>(
+        os::AllocateDataPages(kMagazineTableNumPages));
+    for (auto i = 0UL; i < kMaxNumSlabAllocators; ++i) {
+      magazines[i].num_objects = 0;
+    }
+    tMagazines = magazines;
+  }
+  return &(tMagazines[id]);
+}
+#else
+// Magazines are thread-private, and kernel space has no thread-local storage
+// in which to keep them, so every allocation goes to the global depot.
+static Magazine *MagazineForAllocator(size_t) {
+  return nullptr;
+}
+#endif  // GRANARY_WHERE_user
+
 }  // namespace
 
 // Get a pointer into the slab list. This potentially allocates a new slab.
@@ -78,6 +165,7 @@ const SlabList *SlabAllocator::SlabForAllocation(void) {
   if (GRANARY_UNLIKELY(offset >= max_offset)) {
     slab_list = AllocateSlab(slab_list);
     offset = start_offset;
+    num_slabs++;
   }
   return slab_list;
 }
@@ -99,13 +187,16 @@ static bool MemoryNotInUse(void *mem, size_t num_bytes) {
 
 // Allocate some memory from the slab allocator.
 void *SlabAllocator::Allocate(void) {
-  auto address = AllocateFromFreeList();
-  if (!address) {
-    SpinLockedRegion locker(&slab_list_lock);
-    auto slab = SlabForAllocation();
-    auto addr = reinterpret_cast<uintptr_t>(slab) + offset;
-    offset += allocation_size;
-    address = reinterpret_cast<void *>(addr);
+  void *address(nullptr);
+  if (auto magazine = MagazineForAllocator(id)) {
+    if (GRANARY_UNLIKELY(!magazine->num_objects)) RefillMagazine(magazine);
+    address = magazine->objects[--magazine->num_objects];
+  } else {
+    address = AllocateFromFreeList();
+    if (!address) {
+      SpinLockedRegion locker(&slab_list_lock);
+      address = AllocateFromSlab();
+    }
   }
   GRANARY_ASSERT(MemoryNotInUse(address, allocation_size));
   GRANARY_IF_DEBUG( checked_memset(address, kUninitializedMemoryPoison,
@@ -120,10 +211,90 @@ void SlabAllocator::Free(void *address) {
   GRANARY_IF_DEBUG( checked_memset(address, kDeallocatedMemoryPoison,
                                    allocation_size); )
 
+  if (auto magazine = MagazineForAllocator(id)) {
+    if (GRANARY_UNLIKELY(kMagazineCapacity == magazine->num_objects)) {
+      FlushMagazine(magazine, kMagazineTransferSize);
+    }
+    magazine->objects[magazine->num_objects++] = address;
+    return;
+  }
+
   SpinLockedRegion locker(&free_list_lock);
   auto list = reinterpret_cast<FreeList *>(address);
   list->next = free_list;
   free_list = list;
+  num_free_list_frees++;
+}
+
+// Move all objects in `magazine` back into the global depot.
+void SlabAllocator::FlushMagazine(Magazine *magazine) {
+  FlushMagazine(magazine, magazine->num_objects);
+}
+
+// Move `num_objects` objects from the top of `magazine` to the global free
+// list.
+void SlabAllocator::FlushMagazine(Magazine *magazine, size_t num_objects) {
+  if (!num_objects) return;
+
+  // Chain the objects together outside of the lock, then splice the chain
+  // into the free list.
+  FreeList *first(nullptr);
+  FreeList *last(nullptr);
+  for (auto i = 0UL; i < num_objects; ++i) {
+    auto list = reinterpret_cast<FreeList *>(
+        magazine->objects[--magazine->num_objects]);
+    list->next = first;
+    first = list;
+    if (!last) last = list;
+  }
+  SpinLockedRegion locker(&free_list_lock);
+  last->next = free_list;
+  free_list = first;
+  num_free_list_frees += num_objects;
+  num_magazine_flushes++;
+}
+
+// Refill `magazine` with objects from the global depot. Objects are taken from
+// the free list first, and then from the slab list.
+void SlabAllocator::RefillMagazine(Magazine *magazine) {
+  FreeList *list(nullptr);
+  auto num_objects = 0UL;
+  do {
+    SpinLockedRegion locker(&free_list_lock);
+    list = free_list;
+    for (; free_list && num_objects < kMagazineTransferSize; ++num_objects) {
+      free_list = free_list->next;
+    }
+    num_free_list_allocations += num_objects;
+    num_magazine_refills++;
+  } while (false);
+
+  for (auto i = 0UL; i < num_objects; ++i) {
+    auto next_list = list->next;
+    // Maintain the invariant that is checked by `MemoryNotInUse`.
+    GRANARY_IF_DEBUG( memset(list, kDeallocatedMemoryPoison,
+                             sizeof (FreeList *)); )
+    magazine->objects[magazine->num_objects++] = list;
+    list = next_list;
+  }
+
+  if (kMagazineTransferSize > num_objects) {
+    SpinLockedRegion locker(&slab_list_lock);
+    for (; num_objects < kMagazineTransferSize; ++num_objects) {
+      magazine->objects[magazine->num_objects++] = AllocateFromSlab();
+    }
+  }
+}
+
+// Allocate an object from the slab list.
+//
+// Note: This assumes that `slab_list_lock` is held.
+void *SlabAllocator::AllocateFromSlab(void) {
+  auto slab = SlabForAllocation();
+  auto addr = reinterpret_cast<uintptr_t>(slab) + offset;
+  offset += allocation_size;
+  num_slab_allocations++;
+  return reinterpret_cast<void *>(addr);
 }
 
 // Allocate an object from the free list, if possible. Returns `nullptr` if
@@ -136,6 +307,7 @@ void *SlabAllocator::AllocateFromFreeList(void) {
     auto list = free_list;
     free_list = list->next;
     head = list;
+    num_free_list_allocations++;
   }
   // Maintain the invariant that is checked by `MemoryNotInUse`.
   GRANARY_IF_DEBUG( memset(head, kDeallocatedMemoryPoison,
@@ -168,7 +340,208 @@ void *SlabAllocator::AllocateFromFreeList(void) {
   return nullptr;
 }
 
+void *SlabAllocator::AllocateFromSlab(void) {
+  return nullptr;
+}
+
+void SlabAllocator::FlushMagazine(Magazine *) {}
+void SlabAllocator::FlushMagazine(Magazine *, size_t) {}
+void SlabAllocator::RefillMagazine(Magazine *) {}
+
 #endif  // GRANARY_WITH_VALGRIND
 
+namespace {
+
+// Copy the name of the type allocated by a slab allocator into `buff`. The
+// names of the allocators of `OperatorNewAllocator<T>` are the pretty-printed
+// names of their `Init` functions, and so the name of `T` is extracted.
+static void CopyAllocatorName(char *buff, size_t buff_len, const char *name) {
+  for (auto ch = name; ch[0]; ++ch) {
+    if ('T' == ch[0] && ' ' == ch[1] && '=' == ch[2] && ' ' == ch[3]) {
+      name = ch + 4;
+      break;
+    }
+  }
+  auto i = 0UL;
+  for (; i < (buff_len - 1) && name[i] && ']' != name[i] && ';' != name[i];
+       ++i) {
+    buff[i] = name[i];
+  }
+  buff[i] = '\0';
+}
+
+}  // namespace
+}  // namespace internal
+
+// Return all objects cached in the current thread's magazines to the global
+// depots of their allocators, and free the magazines. This is invoked when a
+// thread exits.
+void FreeThreadMagazines(void) {
+#if defined(GRANARY_WHERE_user) && !defined(GRANARY_WITH_VALGRIND)
+  auto magazines = internal::tMagazines;
+  if (!magazines) return;
+  internal::tMagazines = nullptr;
+  const auto num_ids = GRANARY_MIN(internal::gNumSlabAllocatorIds.load(),
+                                   internal::kMaxNumSlabAllocators);
+  for (auto id = 0UL; id < num_ids; ++id) {
+    if (auto allocator = internal::gSlabAllocators[id]) {
+      allocator->FlushMagazine(&(magazines[id]));
+    }
+  }
+  os::FreeDataPages(magazines, internal::kMagazineTableNumPages);
+#endif  // GRANARY_WHERE_user && !GRANARY_WITH_VALGRIND
+}
+
+// Log the statistics of every slab allocator, if `--log_allocator_stats` is
+// used.
+void LogAllocatorStatistics(void) {
+  if (!FLAG_log_allocator_stats) return;
+  os::Log(os::LogOutput, "Slab allocator statistics:\n");
+  const auto num_ids = GRANARY_MIN(internal::gNumSlabAllocatorIds.load(),
+                                   internal::kMaxNumSlabAllocators);
+  for (auto id = 0UL; id < num_ids; ++id) {
+    auto allocator = internal::gSlabAllocators[id];
+    if (!allocator) continue;
+    internal::SlabAllocatorStatistics stats;
+    allocator->GetStatistics(&stats);
+    if (!stats.num_slabs) continue;
+    char name[128];
+    internal::CopyAllocatorName(name, sizeof name, allocator->name);
+    os::Log(os::LogOutput,
+            "  %s: slabs=%lu slab_allocs=%lu free_list_allocs=%lu "
+            "free_list_frees=%lu magazine_refills=%lu magazine_flushes=%lu\n",
+            name, stats.num_slabs, stats.num_slab_allocations,
+            stats.num_free_list_allocations, stats.num_free_list_frees,
+            stats.num_magazine_refills, stats.num_magazine_flushes);
+  }
+}
+
+namespace internal {
+
+#if defined(GRANARY_WHERE_user) && !defined(GRANARY_WITH_VALGRIND)
+namespace {
+
+enum : size_t {
+  kTranslationArenaNumPages = 32,
+  kTranslationArenaNumBytes = arch::PAGE_SIZE_BYTES * kTranslationArenaNumPages
+};
+
+// A thread-private bump allocator for the objects of a translation. All of a
+// thread's arena objects come from one region of pages, so that arena objects
+// can be told apart from slab objects with a single range check.
+struct TranslationArena {
+  uintptr_t begin_address;
+  uintptr_t next_address;
+  uintptr_t limit_address;
+
+  // Number of nested arena regions that the thread is in. Objects are only
+  // allocated from the arena if this is non-zero.
+  int depth;
+};
+
+static __thread TranslationArena tTranslationArena = {0, 0, 0, 0};
+
+// Allocate the region of `arena`.
+static void AllocateRegion(TranslationArena *arena) {
+  auto region = os::AllocateDataPages(kTranslationArenaNumPages);
+  arena->begin_address = reinterpret_cast<uintptr_t>(region);
+  arena->next_address = arena->begin_address;
+  arena->limit_address = arena->begin_address + kTranslationArenaNumBytes;
+}
+
+// Reclaim every object allocated from `arena`.
+static void ResetRegion(TranslationArena *arena) {
+  GRANARY_IF_DEBUG( checked_memset(
+      reinterpret_cast<void *>(arena->begin_address), kDeallocatedMemoryPoison,
+      arena->next_address - arena->begin_address); )
+  arena->next_address = arena->begin_address;
+}
+
+}  // namespace
+
+// Allocate `size` bytes, aligned to `align` bytes, from the current thread's
+// translation arena. Returns `nullptr` if the current thread isn't translating
+// code, or if the translation arena is disabled.
+//
+// Note: Translations that outgrow the arena's region fall back to the slab
+//       allocators for the rest of their objects.
+void *AllocateFromTranslationArena(size_t size, size_t align) {
+  auto &arena(tTranslationArena);
+  if (!arena.depth) return nullptr;
+  if (GRANARY_UNLIKELY(!arena.begin_address)) AllocateRegion(&arena);
+  auto address = GRANARY_ALIGN_TO(arena.next_address, align);
+  if (GRANARY_UNLIKELY((address + size) > arena.limit_address)) return nullptr;
+  arena.next_address = address + size;
+  GRANARY_IF_DEBUG( checked_memset(reinterpret_cast<void *>(address),
+                                   kUninitializedMemoryPoison, size); )
+  return reinterpret_cast<void *>(address);
+}
+
+// Returns true if `address` was allocated from the current thread's
+// translation arena. Such memory is not individually freed; instead, all of it
+// is reclaimed at once when the translation finishes.
+bool IsTranslationArenaAddress(const void *address) {
+  const auto addr = reinterpret_cast<uintptr_t>(address);
+  return (addr - tTranslationArena.begin_address) < kTranslationArenaNumBytes;
+}
+
+}  // namespace internal
+
+// Enter the current thread's translation arena. While a thread is within its
+// arena, objects whose allocators have the `kUseTranslationArena` property are
+// bump-allocated from the arena instead of from their slab allocators. Arena
+// regions can be nested.
+void EnterTranslationArena(void) {
+  if (!FLAG_translation_arena) return;
+  internal::tTranslationArena.depth++;
+}
+
+// Leave the current thread's translation arena. When the outermost arena
+// region is left, all objects allocated from the arena are reclaimed.
+//
+// Note: The destructors of arena-allocated objects must have already run.
+void LeaveTranslationArena(void) {
+  if (!FLAG_translation_arena) return;
+  auto &arena(internal::tTranslationArena);
+  GRANARY_ASSERT(0 < arena.depth);
+  if (!--arena.depth) internal::ResetRegion(&arena);
+}
+
+// Free the memory backing the current thread's translation arena. This is
+// invoked when a thread exits.
+void FreeTranslationArena(void) {
+  auto &arena(internal::tTranslationArena);
+  GRANARY_ASSERT(!arena.depth);
+  if (!arena.begin_address) return;
+  os::FreeDataPages(reinterpret_cast<void *>(arena.begin_address),
+                    internal::kTranslationArenaNumPages);
+  arena = {0, 0, 0, 0};
+}
+
+#else
+
+// Allocate `size` bytes, aligned to `align` bytes, from the current thread's
+// translation arena. Returns `nullptr` if the current thread isn't translating
+// code, or if the translation arena is disabled.
+void *AllocateFromTranslationArena(size_t, size_t) {
+  return nullptr;
+}
+
+// Returns true if `address` was allocated from the current thread's
+// translation arena.
+bool IsTranslationArenaAddress(const void *) {
+  return false;
+}
+
 }  // namespace internal
+
+// Translation arenas are thread-private, and kernel space has no thread-local
+// storage in which to keep them, so translations always use the slab
+// allocators.
+void EnterTranslationArena(void) {}
+void LeaveTranslationArena(void) {}
+void FreeTranslationArena(void) {}
+
+#endif  // GRANARY_WHERE_user && !GRANARY_WITH_VALGRIND
+
 }  // namespace granary
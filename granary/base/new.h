@@ -93,12 +93,53 @@ enum {
                                  kNewAllocatorNumPagesPerSlab
 };
 
+enum : size_t {
+  // Maximum number of slab allocators that can have per-thread magazines.
+  kMaxNumSlabAllocators = 256,
+
+  // Number of free objects that can be cached in a per-thread magazine.
+  kMagazineCapacity = 15,
+
+  // Number of objects moved between a magazine and the global depot (i.e. the
+  // free list and slab list) at once.
+  kMagazineTransferSize = (kMagazineCapacity + 1) / 2
+};
+
+// A per-thread cache of free objects for a specific slab allocator.
+struct Magazine {
+  size_t num_objects;
+  void *objects[kMagazineCapacity];
+};
+
+// Statistics about a slab allocator. These are only updated on the slow paths
+// of the allocator, i.e. when the global depot is accessed.
+struct SlabAllocatorStatistics {
+  // Number of slabs allocated.
+  size_t num_slabs;
+
+  // Number of objects allocated from slabs.
+  size_t num_slab_allocations;
+
+  // Number of objects taken from and returned to the global free list.
+  size_t num_free_list_allocations;
+  size_t num_free_list_frees;
+
+  // Number of times that a per-thread magazine was refilled from, or flushed
+  // to, the global depot.
+  size_t num_magazine_refills;
+  size_t num_magazine_flushes;
+};
+
 // Simple, lock-free allocator. This allocator operates at a page granularity,
 // where each page begins with some meta-data (`SlabList`) and then contains
 // the (potentially) allocated data on the page.
+//
+// In user space, each application thread caches free objects in a per-thread
+// `Magazine`, which is refilled from and flushed to the global depot in bulk.
+// This keeps most allocations and frees off of the depot's locks.
 class SlabAllocator {
  public:
-  SlabAllocator(size_t start_offset_, size_t max_offset_,
+  SlabAllocator(const char *name_, size_t start_offset_, size_t max_offset_,
                 size_t allocation_size_, size_t object_size_);
 
   ~SlabAllocator(void);
@@ -106,8 +147,28 @@ class SlabAllocator {
   void *Allocate(void);
   void Free(void *address);
 
+  // Move all objects in `magazine` back into the global depot.
+  void FlushMagazine(Magazine *magazine);
+
+  // Get a snapshot of the statistics of this allocator.
+  void GetStatistics(SlabAllocatorStatistics *stats_) const;
+
+  // Name of the type of objects allocated by this allocator.
+  const char * const name;
+
+  // Index of this allocator's magazine in each thread's table of magazines.
+  const size_t id;
+
  private:
   void *AllocateFromFreeList(void);
+  void *AllocateFromSlab(void);
+
+  // Refill `magazine` with objects from the global depot.
+  void RefillMagazine(Magazine *magazine);
+
+  // Move `num_objects` objects from the top of `magazine` to the global free
+  // list.
+  void FlushMagazine(Magazine *magazine, size_t num_objects);
 
   const SlabList *SlabForAllocation(void);
 
@@ -119,25 +180,97 @@ class SlabAllocator {
 
   alignas(arch::CACHE_LINE_SIZE_BYTES) SpinLock slab_list_lock;
   const SlabList *slab_list;
+  size_t num_slabs;
+  size_t num_slab_allocations;
 
   alignas(arch::CACHE_LINE_SIZE_BYTES) SpinLock free_list_lock;
   FreeList *free_list;
+  size_t num_free_list_allocations;
+  size_t num_free_list_frees;
+  size_t num_magazine_refills;
+  size_t num_magazine_flushes;
 
   GRANARY_DISALLOW_COPY_AND_ASSIGN(SlabAllocator);
 };
 
+// Allocate `size` bytes, aligned to `align` bytes, from the current thread's
+// translation arena. Returns `nullptr` if the current thread isn't translating
+// code, or if the translation arena is disabled.
+//
+// Note: Translations that outgrow the arena's region fall back to the slab
+//       allocators for the rest of their objects.
+void *AllocateFromTranslationArena(size_t size, size_t align);
+
+// Returns true if `address` was allocated from the current thread's
+// translation arena. Such memory is not individually freed; instead, all of it
+// is reclaimed at once when the translation finishes.
+bool IsTranslationArenaAddress(const void *address);
+
 }  // namespace internal
 
+#ifdef GRANARY_INTERNAL
+// Return all objects cached in the current thread's magazines to the global
+// depots of their allocators, and free the magazines. This is invoked when a
+// thread exits.
+void FreeThreadMagazines(void);
+
+// Log the statistics of every slab allocator, if `--log_allocator_stats` is
+// used.
+void LogAllocatorStatistics(void);
+
+// Enter the current thread's translation arena. While a thread is within its
+// arena, objects whose allocators have the `kUseTranslationArena` property are
+// bump-allocated from the arena instead of from their slab allocators. Arena
+// regions can be nested.
+void EnterTranslationArena(void);
+
+// Leave the current thread's translation arena. When the outermost arena
+// region is left, all objects allocated from the arena are reclaimed.
+//
+// Note: The destructors of arena-allocated objects must have already run.
+void LeaveTranslationArena(void);
+
+// Free the memory backing the current thread's translation arena. This is
+// invoked when a thread exits.
+void FreeTranslationArena(void);
+#endif  // GRANARY_INTERNAL
+
+namespace detail {
+
+// Returns true if the allocator properties `P` specify that objects should be
+// allocated from the translation arena.
+template <typename P>
+constexpr bool UseTranslationArena(decltype(P::kUseTranslationArena) *) {
+  return 0 != static_cast<size_t>(P::kUseTranslationArena);
+}
+
+template <typename P>
+constexpr bool UseTranslationArena(...) {
+  return false;
+}
+
+}  // namespace detail
+
 // Simple, slab-based allocator used to service operators `new` and `delete` for
 // simple types. This allocator does not support allocating arrays of objects
 template <typename T>
 class OperatorNewAllocator {
  public:
   inline static void *Allocate(void) {
+    if (kUseTranslationArena) {
+      if (auto address = internal::AllocateFromTranslationArena(
+              kAlignedSize, kMinimumAlignment)) {
+        return address;
+      }
+    }
     return gAllocator->Allocate();
   }
 
   inline static void Free(void *address) {
+    if (kUseTranslationArena &&
+        internal::IsTranslationArenaAddress(address)) {
+      return;
+    }
     gAllocator->Free(address);
   }
 
@@ -148,8 +281,17 @@ class OperatorNewAllocator {
   //    ALIGNMENT:  What should be the minimum alignment of the allocated
   //                objects? The allocator ensures that all objects are
   //                aligned to `MINIMUM_ALIGNMENT` bytes.
+  //
+  //    USE_TRANSLATION_ARENA:  Should objects allocated during a translation
+  //                            come from the translating thread's translation
+  //                            arena? This is only safe for objects that never
+  //                            outlive the translation, e.g. the IR of a
+  //                            `Trace`.
   typedef typename T::OperatorNewProperties Properties;
 
+  static constexpr bool kUseTranslationArena =
+      detail::UseTranslationArena<Properties>(nullptr);
+
   enum : size_t {
     kObjectSize = GRANARY_MAX(sizeof(T), sizeof(internal::FreeList *)),
     kRequestedAlignment = static_cast<size_t>(Properties::kAlignment),
@@ -181,7 +323,8 @@ class OperatorNewAllocator {
   __attribute__((noinline, used))
   static void Init(void) {
     kAllocatorConstructor.PreserveSymbols();
-    gAllocator.Construct(OperatorNewAllocator<T>::kStartOffset,
+    gAllocator.Construct(__PRETTY_FUNCTION__,
+                         OperatorNewAllocator<T>::kStartOffset,
                          OperatorNewAllocator<T>::kEndOffset,
                          OperatorNewAllocator<T>::kAlignedSize,
                          sizeof(T));
@@ -237,6 +237,22 @@ void PrintAllOptions(void) {
   }
 }
 
+// Returns a hash of the names and values of all specified options. Two runs of
+// Granary that are given the same options will have the same option hash.
+uint64_t HashOptions(void) {
+  uint64_t hash = 14695981039346656037ULL;  // FNV-1a.
+  for (int i(0); i < MAX_NUM_OPTIONS && OPTION_NAMES[i]; ++i) {
+    const char *strs[] = {OPTION_NAMES[i], OPTION_VALUES[i]};
+    for (auto str : strs) {
+      for (auto ch = str; ch && *ch; ++ch) {
+        hash = (hash ^ static_cast<uint8_t>(*ch)) * 1099511628211ULL;
+      }
+      hash = (hash ^ 0xFFU) * 1099511628211ULL;  // Separator.
+    }
+  }
+  return hash;
+}
+
 namespace detail {
 
 // Initialize an option.
@@ -134,6 +134,10 @@ GRANARY_INTERNAL_DEFINITION void InitOptions(int argc, const char **argv);
 // Works for `--help` option: print out each options along with their document.
 GRANARY_INTERNAL_DEFINITION void PrintAllOptions(void);
 
+// Returns a hash of the names and values of all specified options. Two runs of
+// Granary that are given the same options will have the same option hash.
+GRANARY_INTERNAL_DEFINITION uint64_t HashOptions(void);
+
 namespace detail {
 
 // Initialize an option.
@@ -12,12 +12,30 @@
 #include "granary/cache.h"
 
 #include "os/lock.h"
+#include "os/logging.h"
 #include "os/memory.h"
 
 GRANARY_DEFINE_positive_uint(code_cache_slab_size, 8,
     "The number of pages allocated at once to store code. The default value is "
     "`8` pages per slab.");
 
+GRANARY_DEFINE_uint(code_cache_arena_size, 1024,
+    "The number of bytes of code that a thread reserves from a code cache "
+    "slab at once. Code allocations that fit within a thread's reserved arena "
+    "do not acquire any locks. A value of `0` disables per-thread arenas. The "
+    "default value is `1024` bytes.");
+
+GRANARY_DEFINE_uint(code_cache_budget, 0,
+    "The maximum number of pages of code that can be in use by the code "
+    "caches before Granary flushes them. Flushed code is retired, and only "
+    "reclaimed once no thread can be executing it. A value of `0` means that "
+    "the code caches are unbounded. Budgets smaller than two slabs per code "
+    "cache are rounded up. The default value is `0`.");
+
+GRANARY_DEFINE_bool(debug_log_code_cache_stats, false,
+    "Log statistics about code cache slab and arena usage when Granary exits. "
+    "The default is `no`.");
+
 extern "C" {
 extern const granary::CachePC granary_code_cache_begin;
 extern const granary::CachePC granary_code_cache_end;
@@ -65,15 +83,17 @@ extern void GenerateInterruptDisableCode(CachePC pc);
 extern void GenerateInterruptEnableCode(CachePC pc);
 
 }  // namespace arch
-namespace {
 
+// A contiguous range of pages from which code is allocated.
 class CodeSlab {
  public:
-  CodeSlab(CachePC begin_, const CodeSlab *next_)
+  CodeSlab(CachePC begin_, size_t num_pages_, const CodeSlab *next_)
       : begin(begin_),
+        num_pages(num_pages_),
         next(next_) {}
 
   const CachePC begin;
+  const size_t num_pages;
   const CodeSlab *next;
 
   GRANARY_DEFINE_NEW_ALLOCATOR(CodeSlab, {
@@ -85,24 +105,83 @@ class CodeSlab {
   GRANARY_DISALLOW_COPY_AND_ASSIGN(CodeSlab);
 };
 
+namespace {
+
+// The number of pages in use by the slabs of the flushable code caches. This
+// does not count retired slabs.
+static std::atomic<size_t> gNumCodeCachePages(ATOMIC_VAR_INIT(0));
+
 static const CodeSlab *AllocateSlab(size_t num_pages, const CodeSlab *next) {
-  return new CodeSlab(os::AllocateCodePages(num_pages), next);
+  gNumCodeCachePages.fetch_add(num_pages);
+  return new CodeSlab(os::AllocateCodePages(num_pages), num_pages, next);
 }
 
+// A thread-private sub-slab region of a code cache. Threads allocate code
+// from their arenas without acquiring any locks, and only synchronize with
+// other threads when their arenas must be refilled.
+struct CodeArena {
+  // The next allocatable address, and the address one past the end of the
+  // arena.
+  uintptr_t next_addr;
+  uintptr_t limit_addr;
+
+  // The ID of the code cache that owns this arena. This lets us detect stale
+  // arenas after the code caches are retired, or destroyed and re-initialized.
+  uint64_t cache_id;
+};
+
+#ifdef GRANARY_WHERE_user
+// Per-thread code cache arenas, one per kind of code cache.
+static __thread CodeArena tCodeArenas[kNumCodeCacheKinds];
+#endif  // GRANARY_WHERE_user
+
+// Used to assign unique IDs to code caches.
+static std::atomic<uint64_t> gNextCodeCacheId(ATOMIC_VAR_INIT(1));
+
 // Implementation of Granary's code caches.
 class CodeCache {
  public:
-  explicit CodeCache(size_t slab_size_);
+  CodeCache(size_t slab_size_, size_t arena_size_);
   ~CodeCache(void);
 
   // Allocate a block of code from this code cache.
   CachePC AllocateCode(size_t size);
 
+  // Allocate a block of code from a thread's arena within this code cache.
+  CachePC AllocateCode(CodeArena *arena, size_t size);
+
+  // Detach all slabs from this code cache, and return them as a linked list.
+  // Arenas that were carved out of the retired slabs are invalidated.
+  const CodeSlab *Retire(void);
+
+  // Estimate the instruction cache footprint of the code in this code cache.
+  void EstimateFootprint(CodeCacheFootprint *footprint);
+
+  // Log statistics about this code cache.
+  void LogStatistics(const char *name);
+
  private:
+  // Allocate a block of code from the current slab of this code cache. If
+  // `cache_id` is non-null then it is set to the ID of the code cache that
+  // owns the slab.
+  CachePC AllocateSlabCode(size_t size, uint64_t *cache_id=nullptr);
+
+  // Record the allocation of `size` bytes of code at `addr`.
+  void RecordAllocation(uintptr_t addr, size_t size);
+
+  // Unique ID of this code cache. This changes when the cache is retired. It
+  // is read without holding `slab_list_lock` by threads checking whether their
+  // arenas are stale, so it's published with release semantics after the old
+  // slabs have been detached.
+  std::atomic<uint64_t> id;
+
   // The size of a slab.
   const size_t slab_num_pages;
   const size_t slab_num_bytes;
 
+  // The size of a per-thread arena.
+  const size_t arena_num_bytes;
+
   // The offset into the current slab that's serving allocations.
   size_t slab_byte_offset;
 
@@ -113,33 +192,89 @@ class CodeCache {
   // Allocator used to allocate blocks from this code cache.
   const CodeSlab *slab_list;
 
+  // Statistics about how slabs and arenas are used. The number of wasted
+  // bytes counts the unused tails of slabs and arenas that were replaced.
+  size_t num_slabs;
+  size_t num_slab_wasted_bytes;
+  std::atomic<size_t> num_arena_refills;
+  std::atomic<size_t> num_arena_wasted_bytes;
+
+  // Statistics used to estimate the instruction cache footprint of the code
+  // in this cache. These are reset when the cache is retired.
+  std::atomic<size_t> num_code_bytes;
+  std::atomic<size_t> num_code_cache_lines;
+
   GRANARY_DISALLOW_COPY_AND_ASSIGN(CodeCache);
 };
 
-CodeCache::CodeCache(size_t slab_size_)
-    : slab_num_pages(slab_size_),
+CodeCache::CodeCache(size_t slab_size_, size_t arena_size_)
+    : id(ATOMIC_VAR_INIT(gNextCodeCacheId.fetch_add(1))),
+      slab_num_pages(slab_size_),
       slab_num_bytes(slab_size_ * arch::PAGE_SIZE_BYTES),
+      arena_num_bytes(std::min(arena_size_, slab_num_bytes / 4)),
       slab_byte_offset(0),
       slab_list_lock(),
-      slab_list(AllocateSlab(slab_num_pages, nullptr)) {}
+      slab_list(AllocateSlab(slab_num_pages, nullptr)),
+      num_slabs(1),
+      num_slab_wasted_bytes(0),
+      num_arena_refills(ATOMIC_VAR_INIT(0)),
+      num_arena_wasted_bytes(ATOMIC_VAR_INIT(0)),
+      num_code_bytes(ATOMIC_VAR_INIT(0)),
+      num_code_cache_lines(ATOMIC_VAR_INIT(0)) {}
 
 CodeCache::~CodeCache(void) {
-  auto slab = slab_list;
-  for (const CodeSlab *next_slab(nullptr); slab; slab = next_slab) {
-    next_slab = slab->next;
-    delete slab;
+  FreeCodeCacheSlabs(slab_list);
+  slab_byte_offset = 0;
+}
+
+// Detach all slabs from this code cache, and return them as a linked list.
+// Arenas that were carved out of the retired slabs are invalidated.
+const CodeSlab *CodeCache::Retire(void) {
+  SpinLockedRegion locker(&slab_list_lock);
+  auto retired_slabs = slab_list;
+  for (auto slab = retired_slabs; slab; slab = slab->next) {
+    gNumCodeCachePages.fetch_sub(slab->num_pages);
   }
+  slab_list = AllocateSlab(slab_num_pages, nullptr);
   slab_byte_offset = 0;
+  num_slabs += 1;
+  num_code_bytes.store(0);
+  num_code_cache_lines.store(0);
+  id.store(gNextCodeCacheId.fetch_add(1), std::memory_order_release);
+  return retired_slabs;
+}
+
+// Record the allocation of `size` bytes of code at `addr`. The number of cache
+// lines is an over-approximation, as consecutive allocations can share a cache
+// line.
+void CodeCache::RecordAllocation(uintptr_t addr, size_t size) {
+  const auto first_line = addr / arch::CACHE_LINE_SIZE_BYTES;
+  const auto last_line = (addr + size - 1) / arch::CACHE_LINE_SIZE_BYTES;
+  num_code_bytes.fetch_add(size, std::memory_order_relaxed);
+  num_code_cache_lines.fetch_add(last_line - first_line + 1,
+                                 std::memory_order_relaxed);
 }
 
 // Allocate a block of code from this code cache.
 CachePC CodeCache::AllocateCode(size_t size) {
+  auto addr = AllocateSlabCode(size);
+  RecordAllocation(reinterpret_cast<uintptr_t>(addr), size);
+  return addr;
+}
+
+// Allocate a block of code from the current slab of this code cache. If
+// `cache_id` is non-null then it is set to the ID of the code cache that owns
+// the slab.
+CachePC CodeCache::AllocateSlabCode(size_t size, uint64_t *cache_id) {
   SpinLockedRegion locker(&slab_list_lock);
+  if (cache_id) *cache_id = id.load(std::memory_order_relaxed);
   auto old_offset = slab_byte_offset;
   auto aligned_offset = GRANARY_ALIGN_TO(old_offset, arch::CODE_ALIGN_BYTES);
   auto new_offset = aligned_offset + size;
   if (GRANARY_UNLIKELY(new_offset >= slab_num_bytes)) {
     slab_list = AllocateSlab(slab_num_pages, slab_list);
+    num_slabs += 1;
+    num_slab_wasted_bytes += slab_num_bytes - old_offset;
     slab_byte_offset = 0;
     aligned_offset = 0;
     new_offset = size;
@@ -151,39 +286,166 @@ CachePC CodeCache::AllocateCode(size_t size) {
   return addr;
 }
 
-// Lock around all code cache transactions.
-static os::Lock gCodeCacheLock;
+// Allocate a block of code from a thread's arena within this code cache. If
+// the arena is exhausted then it is refilled from the current slab.
+CachePC CodeCache::AllocateCode(CodeArena *arena, size_t size) {
+  const auto cache_id = id.load(std::memory_order_acquire);
+  const auto arena_is_valid = arena->cache_id == cache_id;
+  const auto addr = GRANARY_ALIGN_TO(arena->next_addr, arch::CODE_ALIGN_BYTES);
+  if (GRANARY_LIKELY(arena_is_valid && (addr + size) <= arena->limit_addr)) {
+    arena->next_addr = addr + size;
+    RecordAllocation(addr, size);
+    return reinterpret_cast<CachePC>(addr);
+  }
+
+  // Large allocations go directly to the slab so that they don't cause
+  // excessive waste at the end of the arena.
+  if (GRANARY_UNLIKELY(!arena_num_bytes || size > (arena_num_bytes / 2))) {
+    return AllocateCode(size);
+  }
+
+  if (arena_is_valid) {
+    num_arena_wasted_bytes.fetch_add(arena->limit_addr - arena->next_addr);
+  }
+  num_arena_refills.fetch_add(1);
+
+  uint64_t new_cache_id(0);
+  const auto begin_addr = reinterpret_cast<uintptr_t>(
+      AllocateSlabCode(arena_num_bytes, &new_cache_id));
+  RecordAllocation(begin_addr, size);
+  arena->next_addr = begin_addr + size;
+  arena->limit_addr = begin_addr + arena_num_bytes;
+  arena->cache_id = new_cache_id;
+  return reinterpret_cast<CachePC>(begin_addr);
+}
+
+// Log statistics about this code cache.
+void CodeCache::LogStatistics(const char *name) {
+  CodeCacheFootprint footprint;
+  EstimateFootprint(&footprint);
+  os::Log(os::LogOutput,
+          "Code cache %s: %lu slabs (%lu bytes wasted), %lu arena refills "
+          "(%lu bytes wasted), footprint of %lu bytes (%lu cache lines, "
+          "%lu pages)\n",
+          name, num_slabs, num_slab_wasted_bytes, num_arena_refills.load(),
+          num_arena_wasted_bytes.load(), footprint.num_bytes,
+          footprint.num_cache_lines, footprint.num_pages);
+}
+
+// Estimate the instruction cache footprint of the code in this code cache.
+// Every slab except the current one is full, so the number of pages counts
+// the whole of the older slabs, and the used part of the current slab.
+void CodeCache::EstimateFootprint(CodeCacheFootprint *footprint) {
+  footprint->num_bytes = num_code_bytes.load(std::memory_order_relaxed);
+  footprint->num_cache_lines = num_code_cache_lines.load(
+      std::memory_order_relaxed);
+  SpinLockedRegion locker(&slab_list_lock);
+  footprint->num_pages = GRANARY_ALIGN_TO(slab_byte_offset,
+                                          arch::PAGE_SIZE_BYTES) /
+                         arch::PAGE_SIZE_BYTES;
+  for (auto slab = slab_list->next; slab; slab = slab->next) {
+    footprint->num_pages += slab->num_pages;
+  }
+}
+
+// Lock around all code cache transactions. Transactions that write new code
+// acquire it for reading, and so don't contend with each other; transactions
+// that modify live code acquire it for writing.
+static ReaderWriterLock gCodeCacheLock;
 
 // Code caches.
 static Container<CodeCache> gCodeCaches[kNumCodeCacheKinds];
 
+// Code cache for Granary's own runtime code. This code cache is never flushed.
+static Container<CodeCache> gRuntimeCodeCache;
+
 }  // namespace
 
 // Used to allocate code from a code cache.
 CachePC AllocateCode(CodeCacheKind kind, size_t num_bytes) {
   if (!num_bytes) return nullptr;
+#ifdef GRANARY_WHERE_user
+  return gCodeCaches[kind]->AllocateCode(&(tCodeArenas[kind]), num_bytes);
+#else
   return gCodeCaches[kind]->AllocateCode(num_bytes);
+#endif  // GRANARY_WHERE_user
+}
+
+// Used to allocate code that must never be flushed from the code cache, e.g.
+// Granary's edge entry routines and callback wrappers.
+CachePC AllocateRuntimeCode(size_t num_bytes) {
+  if (!num_bytes) return nullptr;
+  return gRuntimeCodeCache->AllocateCode(num_bytes);
+}
+
+// Returns true if the flushable code caches have grown beyond their budget,
+// and should be flushed at the next safe point.
+bool CodeCacheIsOverBudget(void) {
+  if (!FLAG_code_cache_budget) return false;
+
+  // Every flush leaves behind one fresh slab per code cache, so make sure that
+  // the budget leaves some room for code beyond that.
+  const auto min_budget = 2 * (kNumCodeCacheKinds + 1) *
+                          FLAG_code_cache_slab_size;
+  const auto budget = std::max<size_t>(FLAG_code_cache_budget, min_budget);
+  return gNumCodeCachePages.load(std::memory_order_relaxed) > budget;
+}
+
+// Retire all slabs of all flushable code caches, and return the retired slabs
+// as a linked list. Future allocations will be served by new slabs.
+//
+// Note: This must only be invoked at a safe point, i.e. when no other thread
+//       is executing within Granary.
+const CodeSlab *RetireCodeCache(void) {
+  const CodeSlab *retired_slabs(nullptr);
+  for (auto &cache : gCodeCaches) {
+    auto slab = cache->Retire();
+    auto last_slab = slab;
+    while (last_slab->next) last_slab = last_slab->next;
+    const_cast<CodeSlab *>(last_slab)->next = retired_slabs;
+    retired_slabs = slab;
+  }
+  return retired_slabs;
+}
+
+// Free a linked list of retired code cache slabs.
+void FreeCodeCacheSlabs(const CodeSlab *slab) {
+  for (const CodeSlab *next_slab(nullptr); slab; slab = next_slab) {
+    next_slab = slab->next;
+    os::FreeCodePages(slab->begin, slab->num_pages);
+    delete slab;
+  }
 }
 
 // Begin a transaction that will read or write to the code cache.
 //
 // Note: Transactions are distinct from allocations. Therefore, many threads/
-//       cores can simultaneously allocate from a code cache, but only one
-//       should be able to read/write data to the cache at a given time.
-CodeCacheTransaction::CodeCacheTransaction(void) {
-  gCodeCacheLock.Acquire();
+//       cores can simultaneously allocate from a code cache, and write to
+//       their newly allocated code, but only one should be able to modify
+//       live code at a given time.
+CodeCacheTransaction::CodeCacheTransaction(CodeCacheTransactionKind kind_)
+    : kind(kind_) {
+  if (kCodeCacheTransactionLiveCode == kind) {
+    gCodeCacheLock.WriteAcquire();
+  } else {
+    gCodeCacheLock.ReadAcquire();
+  }
 }
 
 // End a transaction that will read or write to the code cache.
 CodeCacheTransaction::~CodeCacheTransaction(void) {
-  gCodeCacheLock.Release();
+  if (kCodeCacheTransactionLiveCode == kind) {
+    gCodeCacheLock.WriteRelease();
+  } else {
+    gCodeCacheLock.ReadRelease();
+  }
 }
 
 namespace {
 
 template <typename T>
 static CachePC GenerateCode(T generator, size_t size) {
-  auto code = AllocateCode(kCodeCacheKindEdge, size);
+  auto code = AllocateRuntimeCode(size);
   CodeCacheTransaction transaction;
   generator(code);
   return code;
@@ -197,6 +459,13 @@ static CachePC gEnableInterruptsFunction = nullptr;
 
 }  // namespace
 
+// Estimate the instruction cache footprint of the code in the code cache
+// `kind`.
+void EstimateCodeCacheFootprint(CodeCacheKind kind,
+                                CodeCacheFootprint *footprint) {
+  gCodeCaches[kind]->EstimateFootprint(footprint);
+}
+
 // Returns the address of the code that exits the code cache via a direct edge.
 CachePC DirectExitFunction(void) {
   return gDirectExitFunction;
@@ -221,8 +490,9 @@ CachePC EnableInterruptsFunction(void) {
 // Initialize the code caches.
 void InitCodeCache(void) {
   for (auto &cache : gCodeCaches) {
-    cache.Construct(FLAG_code_cache_slab_size);
+    cache.Construct(FLAG_code_cache_slab_size, FLAG_code_cache_arena_size);
   }
+  gRuntimeCodeCache.Construct(FLAG_code_cache_slab_size, 0);
   gDirectExitFunction = GenerateCode(
       arch::GenerateDirectEdgeEntryCode,
       arch::DIRECT_EDGE_ENTRY_CODE_SIZE_BYTES);
@@ -239,9 +509,19 @@ void InitCodeCache(void) {
 
 // Exit the code caches.
 void ExitCodeCache(void) {
+  if (FLAG_debug_log_code_cache_stats) {
+    static const char *kCodeCacheNames[kNumCodeCacheKinds] = {
+      "hot", "cold", "frozen", "sub zero", "edge"
+    };
+    for (auto i = 0; i < kNumCodeCacheKinds; ++i) {
+      gCodeCaches[i]->LogStatistics(kCodeCacheNames[i]);
+    }
+  }
   for (auto &cache : gCodeCaches) {
     cache.Destroy();
   }
+  gRuntimeCodeCache.Destroy();
+  gNumCodeCachePages.store(0);
 }
 
 // Provides a good estimation of the location of the code cache. This is used
@@ -255,7 +535,8 @@ CachePC EstimatedCachePC(void) {
 // Initialize Granary's internal translation cache meta-data.
 CacheMetaData::CacheMetaData(void)
     : start_pc(nullptr),
-      native_addresses(nullptr) {}
+      native_addresses(nullptr),
+      is_unused_speculation(ATOMIC_VAR_INIT(false)) {}
 
 // Clean up the cache meta-data, and any data structures tied in to the cached
 // code.
@@ -44,6 +44,45 @@ enum {
 // Used to allocate code from a code cache.
 CachePC AllocateCode(CodeCacheKind kind, size_t num_bytes);
 
+// Used to allocate code that must never be flushed from the code cache, e.g.
+// Granary's edge entry routines and callback wrappers.
+CachePC AllocateRuntimeCode(size_t num_bytes);
+
+// Forward declaration.
+class CodeSlab;
+
+// Returns true if the flushable code caches have grown beyond their budget,
+// and should be flushed at the next safe point.
+bool CodeCacheIsOverBudget(void);
+
+// Retire all slabs of all flushable code caches, and return the retired slabs
+// as a linked list. Future allocations will be served by new slabs.
+//
+// Note: This must only be invoked at a safe point, i.e. when no other thread
+//       is executing within Granary.
+const CodeSlab *RetireCodeCache(void);
+
+// Free a linked list of retired code cache slabs.
+void FreeCodeCacheSlabs(const CodeSlab *slab);
+
+// Estimated instruction cache footprint of a code cache.
+struct CodeCacheFootprint {
+  // Number of bytes of code allocated from the code cache.
+  size_t num_bytes;
+
+  // Number of instruction cache lines spanned by the allocated code. This is
+  // an over-approximation, as consecutive allocations can share cache lines.
+  size_t num_cache_lines;
+
+  // Number of pages spanned by the allocated code.
+  size_t num_pages;
+};
+
+// Estimate the instruction cache footprint of the code in the code cache
+// `kind`. Retired code is not counted.
+void EstimateCodeCacheFootprint(CodeCacheKind kind,
+                                CodeCacheFootprint *footprint);
+
 // Returns the address of the code that exits the code cache via a direct edge.
 CachePC DirectExitFunction(void);
 
@@ -65,20 +104,37 @@ void InitCodeCache(void);
 // Exit the code caches.
 void ExitCodeCache(void);
 
+// Kinds of code cache transactions.
+enum CodeCacheTransactionKind {
+  // Writes code into memory that was just allocated by the current thread, and
+  // that no other thread can execute yet. Any number of these transactions can
+  // happen at once.
+  kCodeCacheTransactionNewCode,
+
+  // Modifies code that other threads might be executing, e.g. when patching
+  // or un-patching a direct edge. Only one of these transactions can happen at
+  // a time, and never alongside other transactions.
+  kCodeCacheTransactionLiveCode
+};
+
 // Transaction on the code cache.
 class CodeCacheTransaction {
  public:
   // Begin a transaction that will read or write to the code cache.
   //
   // Note: Transactions are distinct from allocations. Therefore, many threads/
-  //       cores can simultaneously allocate from a code cache, but only one
-  //       should be able to read/write data to the cache at a given time.
-  CodeCacheTransaction(void);
+  //       cores can simultaneously allocate from a code cache, and write to
+  //       their newly allocated code, but only one should be able to modify
+  //       live code at a given time.
+  explicit CodeCacheTransaction(
+      CodeCacheTransactionKind kind_=kCodeCacheTransactionNewCode);
 
   // End a transaction that will read or write to the code cache.
   ~CodeCacheTransaction(void);
 
  private:
+  const CodeCacheTransactionKind kind;
+
   GRANARY_DISALLOW_COPY_AND_ASSIGN(CodeCacheTransaction);
 };
 
@@ -129,7 +185,8 @@ class CacheMetaData : public MutableMetaData<CacheMetaData> {
   // Don't copy anything over.
   CacheMetaData(const CacheMetaData &)
       : start_pc(nullptr),
-        native_addresses(nullptr) {}
+        native_addresses(nullptr),
+        is_unused_speculation(ATOMIC_VAR_INIT(false)) {}
 
   ~CacheMetaData(void);
 
@@ -147,6 +204,11 @@ class CacheMetaData : public MutableMetaData<CacheMetaData> {
 
   // Far-away code addresses referenced by code in this block.
   NativeAddress *native_addresses;
+
+  // Whether or not this block was speculatively translated by a worker thread,
+  // and has not yet been found in the code cache index by any other
+  // translation.
+  mutable std::atomic<bool> is_unused_speculation;
 };
 
 }  // namespace granary
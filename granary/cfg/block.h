@@ -230,7 +230,8 @@ class CachedBlock final : public InstrumentedBlock {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Block, CachedBlock)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(CachedBlock, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -263,7 +264,8 @@ class DecodedBlock : public InstrumentedBlock {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Block, DecodedBlock)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(DecodedBlock, {
-    kAlignment = arch::CACHE_LINE_SIZE_BYTES
+    kAlignment = arch::CACHE_LINE_SIZE_BYTES,
+    kUseTranslationArena = 1
   })
 
   // Return the first instruction in the basic block.
@@ -349,7 +351,8 @@ class CompensationBlock : public DecodedBlock {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Block, CompensationBlock)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(CompensationBlock, {
-    kAlignment = arch::CACHE_LINE_SIZE_BYTES
+    kAlignment = arch::CACHE_LINE_SIZE_BYTES,
+    kUseTranslationArena = 1
   })
 
  protected:
@@ -371,7 +374,8 @@ class DirectBlock final : public InstrumentedBlock {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Block, DirectBlock)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(DirectBlock, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -405,7 +409,8 @@ class IndirectBlock final : public InstrumentedBlock {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Block, IndirectBlock)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(IndirectBlock, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -439,7 +444,8 @@ class ReturnBlock final : public InstrumentedBlock {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Block, ReturnBlock)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(ReturnBlock, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -472,7 +478,8 @@ class NativeBlock final : public Block {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Block, NativeBlock)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(NativeBlock, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -16,7 +16,10 @@
 
 #include "granary/app.h"
 #include "granary/cache.h"
+#include "granary/decode_cache.h"
 #include "granary/index.h"
+#include "granary/profile.h"
+#include "granary/speculate.h"
 #include "granary/util.h"
 
 #include "os/exception.h"
@@ -262,8 +265,10 @@ static void AnnotateInstruction(BlockFactory *factory, DecodedBlock *block,
 // Decode an instruction list starting at `pc` and link the decoded
 // instructions into the instruction list beginning with `instr`.
 void BlockFactory::DecodeInstructionList(DecodedBlock *block) {
+  TranslationTimer timer;
   auto decode_pc = block->StartAppPC();
   arch::InstructionDecoder decoder(block);
+  CachingInstructionDecoder cached_decoder;
   arch::Instruction dinstr;
   arch::Instruction ainstr;
   Instruction *instr(nullptr);
@@ -280,9 +285,11 @@ void BlockFactory::DecodeInstructionList(DecodedBlock *block) {
     // if the instruction raises an interrupt, e.g. the debug trap, then assume
     // that is because of GDB debugging (or something similar) and go native
     // there as well.
-    if (!decoder.DecodeNext(&dinstr, &decode_pc) || dinstr.IsInterruptCall()) {
+    if (!cached_decoder.DecodeNext(&dinstr, &decode_pc) ||
+        dinstr.IsInterruptCall()) {
       auto native_block = new NativeBlock(decoded_pc);
       block->AppendInstruction(AsApp(lir::Jump(native_block), decoded_pc));
+      timer.RecordPass(kTranslationPassDecode);
       return;
     }
 
@@ -297,6 +304,7 @@ void BlockFactory::DecodeInstructionList(DecodedBlock *block) {
     instr = block->LastInstruction()->Previous();
   } while (!IsA<ControlFlowInstruction *>(instr) && --num_instrs > 0);
   AddFallThroughInstruction(block , instr, decode_pc);
+  timer.RecordPass(kTranslationPassDecode);
 }
 
 // Iterates through the blocks and tries to materialize `DirectBlock`s.
@@ -453,6 +461,9 @@ InstrumentedBlock *BlockFactory::RequestIndexedBlock(
     BlockMetaData **meta_ptr) {
   auto meta = *meta_ptr;
   const auto response = FindMetaDataInIndex(meta);
+  if (kUnificationStatusReject != response.status) {
+    ObserveIndexedBlock(response.meta);
+  }
   switch (response.status) {
     case kUnificationStatusAccept: {
       auto new_block = new CachedBlock(trace, response.meta);
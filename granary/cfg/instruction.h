@@ -256,7 +256,8 @@ class AnnotationInstruction : public Instruction {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Instruction, AnnotationInstruction)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(AnnotationInstruction, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
   GRANARY_INTERNAL_DEFINITION
@@ -305,7 +306,8 @@ class LabelInstruction final : public AnnotationInstruction {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Instruction, LabelInstruction)
   GRANARY_DECLARE_NEW_ALLOCATOR(LabelInstruction, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
   GRANARY_INTERNAL_DEFINITION Fragment *fragment;
@@ -412,7 +414,8 @@ class NativeInstruction : public Instruction {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Instruction, NativeInstruction)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(NativeInstruction, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  GRANARY_ARCH_PUBLIC:
@@ -463,7 +466,8 @@ class BranchInstruction final : public NativeInstruction {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Instruction, BranchInstruction)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(BranchInstruction, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -496,7 +500,8 @@ class ControlFlowInstruction : public NativeInstruction {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Instruction, ControlFlowInstruction)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(ControlFlowInstruction, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -527,7 +532,8 @@ class ExceptionalControlFlowInstruction : public ControlFlowInstruction {
   GRANARY_DECLARE_DERIVED_CLASS_OF(Instruction,
                                    ExceptionalControlFlowInstruction)
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(ExceptionalControlFlowInstruction, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  GRANARY_PROTECTED:
@@ -154,6 +154,13 @@ inline static std::unique_ptr<Instruction> InlineFunctionCall(
 //            code.
 
 // Represents a block of inline assembly.
+//
+// Note: Each line of inline assembly is parsed once, and is later found again
+//       by its address and a fingerprint of its contents (its length, and its
+//       first and last few bytes). Lines should be string literals (e.g.
+//       `_x86_64` literals). Lines in buffers are re-parsed whenever their
+//       fingerprints change, but a change that preserves the fingerprint
+//       (e.g. changing only a middle byte) goes unnoticed.
 class InlineAssembly {
  public:
   inline InlineAssembly(void)
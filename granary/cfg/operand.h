@@ -225,6 +225,17 @@ class MemoryOperand : public Operand {
   size_t CountMatchedRegisters(
       std::initializer_list<VirtualRegister *> regs) const;
 
+  // Try to match the components of a `base + index * scale + disp` memory
+  // operand. This also works when the memory operand is not compound, in
+  // which case the address register is matched as the base, the index is
+  // invalid, and the scale and displacement are both `0`.
+  //
+  // Note: This does not match pointer memory operands.
+  //
+  // Note: This has a architecture-specific implementation.
+  bool MatchAddressComponents(VirtualRegister &base, VirtualRegister &index,
+                              size_t &scale, int32_t &disp) const;
+
   // Tries to replace the memory operand.
   //
   // Note: This has a architecture-specific implementation.
@@ -5,6 +5,7 @@
 #include "arch/base.h"
 
 #include "granary/base/cstring.h"
+#include "granary/base/new.h"
 #include "granary/base/pc.h"
 
 #include "granary/cfg/block.h"
@@ -23,7 +24,9 @@ Trace::Trace(Context *context_)
       num_temporary_regs(kMinTemporaryVirtualRegister),
       num_virtual_regs(kMinTraceVirtualRegister),
       num_basic_blocks(0),
-      generation(0) {}
+      generation(0) {
+  EnterTranslationArena();
+}
 
 // Destroy the CFG and all basic blocks in the CFG.
 Trace::~Trace(void) {
@@ -31,6 +34,7 @@ Trace::~Trace(void) {
     next = block->list.Next();
     delete block;
   }
+  LeaveTranslationArena();
 }
 
 // Return the entry basic block of this control-flow graph.
@@ -111,4 +115,9 @@ void Trace::FreeTemporaryRegisters(void) {
   num_temporary_regs = kMinTemporaryVirtualRegister;
 }
 
+// Returns the number of virtual registers allocated within this trace.
+size_t Trace::NumVirtualRegisters(void) const {
+  return static_cast<size_t>(num_virtual_regs - kMinTraceVirtualRegister);
+}
+
 }  // namespace granary
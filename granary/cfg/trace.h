@@ -26,6 +26,10 @@ GRANARY_INTERNAL_DEFINITION class IndirectEdge;
 GRANARY_INTERNAL_DEFINITION class Context;
 
 // A control flow graph of basic blocks to instrument.
+//
+// Note: The blocks, instructions, and fragments of a trace are allocated from
+//       the translating thread's translation arena, and so must not outlive
+//       the trace.
 class Trace final {
  public:
   GRANARY_INTERNAL_DEFINITION
@@ -80,6 +84,9 @@ class Trace final {
   // Free all temporary virtual registers.
   GRANARY_INTERNAL_DEFINITION void FreeTemporaryRegisters(void);
 
+  // Returns the number of virtual registers allocated within this trace.
+  GRANARY_INTERNAL_DEFINITION size_t NumVirtualRegisters(void) const;
+
  private:
   friend class BlockFactory;  // For `first_new_block`.
 
@@ -4,6 +4,8 @@
 
 #include "granary/base/option.h"
 
+#include "granary/cfg/trace.h"
+
 #include "granary/code/assemble.h"
 #include "granary/code/fragment.h"
 
@@ -21,6 +23,7 @@
 #include "granary/code/assemble/10_add_connecting_jumps.h"
 #include "granary/code/assemble/11_find_block_entrypoints.h"
 
+#include "granary/profile.h"
 #include "granary/util.h"
 
 GRANARY_DEFINE_bool(debug_log_fragments, false,
@@ -31,18 +34,46 @@ GRANARY_DEFINE_uint(num_copy_propagations, 2,
     "The number of iterations of copy propagation to run. The default is `2`.");
 
 namespace granary {
+namespace {
+
+// Record the sizes of an assembled trace in the translation profile.
+static void ProfileFragments(const Trace *cfg, FragmentList *frags) {
+  uint64_t num_frags = 0;
+  uint64_t num_instrs = 0;
+  uint64_t num_slots = 0;
+  for (auto frag : FragmentListIterator(frags)) {
+    ++num_frags;
+    for (auto instr : InstructionListIterator(frag->instrs)) {
+      if (IsA<NativeInstruction *>(instr)) ++num_instrs;
+    }
+    auto partition = frag->partition.Value();
+    if (partition && partition->entry_frag == frag) {
+      num_slots += partition->num_slots;
+    }
+  }
+  RecordTranslationCounter(kTranslationCounterFragments, num_frags);
+  RecordTranslationCounter(kTranslationCounterInstructions, num_instrs);
+  RecordTranslationCounter(kTranslationCounterVirtualRegs,
+                           cfg->NumVirtualRegisters());
+  RecordTranslationCounter(kTranslationCounterSpillSlots, num_slots);
+}
+
+}  // namespace
 
 // Assemble the local control-flow graph.
 FragmentList Assemble(Context *context, Trace *cfg) {
 
   // Compile all inline assembly instructions by parsing the inline assembly
   // instructions and doing code generation for them.
+  TranslationTimer timer;
   CompileInlineAssembly(cfg);
+  timer.RecordPass(kTranslationPassCompileInlineAssembly);
 
   // "Fix" instructions that might use PC-relative operands that are now too
   // far away from their original data/targets (e.g. if the code cache is really
   // far away from the original native code in memory).
   MangleInstructions(cfg);
+  timer.RecordPass(kTranslationPassLateMangle);
 
   FragmentList frags;
 
@@ -53,21 +84,26 @@ FragmentList Assemble(Context *context, Trace *cfg) {
   // complicated, so to simplify things we re-split up the blocks into fragments
   // that represent the "true" basic blocks.
   BuildFragmentList(context, cfg, &frags);
+  timer.RecordPass(kTranslationPassBuildFragmentList);
 
   // Try to figure out the stack frame size on entry to / exit from every
   // fragment.
   PartitionFragments(&frags);
+  timer.RecordPass(kTranslationPassPartitionFragments);
 
   // Add a bunch of entry/exit fragments at places where flags needs to be
   // saved/restored, and at places where GPRs need to be spilled / filled.
   AddEntryAndExitFragments(&frags);
+  timer.RecordPass(kTranslationPassAddEntryExitFragments);
 
   // Add flags saving and restoring code around injected instrumentation
   // instructions.
   SaveAndRestoreFlags(&frags);
+  timer.RecordPass(kTranslationPassSaveAndRestoreFlags);
 
   // Figure out the live VRs on entry/exit from each frag.
   TrackVirtualRegs(&frags);
+  timer.RecordPass(kTranslationPassTrackVirtualRegs);
 
   // Perform a single step of copy propagation. The purpose of this is to
   // allow us to get rid of redundant defs/uses of registers that are created
@@ -75,22 +111,29 @@ FragmentList Assemble(Context *context, Trace *cfg) {
   for (auto i = 0U; i < FLAG_num_copy_propagations; ++i) {
     if (!PropagateRegisterCopies(&frags)) break;
   }
+  timer.RecordPass(kTranslationPassPropagateCopies);
 
   // Schedule the virtual registers into either physical registers or memory
   // locations.
   ScheduleRegisters(&frags);
+  timer.RecordPass(kTranslationPassScheduleRegisters);
 
   // Allocate space for the virtual registers, and perform final mangling of
   // instructions so that all abstract spill slots are converted into concrete
   // spill slots.
   AllocateSlots(&frags);
+  timer.RecordPass(kTranslationPassAllocateSlots);
 
   // Add final connecting jumps (where needed) between predecessor and
   // successor fragments.
   AddConnectingJumps(&frags);
+  timer.RecordPass(kTranslationPassAddConnectingJumps);
 
   // Identify fragments associated with block entrypoints.
   FindBlockEntrypointFragments(&frags);
+  timer.RecordPass(kTranslationPassFindBlockEntrypoints);
+
+  if (TranslationProfilingIsEnabled()) ProfileFragments(cfg, &frags);
 
   if (FLAG_debug_log_fragments) {
     os::Log(os::LogDebug, &frags);
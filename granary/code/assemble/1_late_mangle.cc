@@ -18,12 +18,21 @@
 #include "granary/cfg/operand.h"
 
 #include "granary/code/assemble/1_late_mangle.h"
+#include "granary/code/edge.h"
 
 #include "granary/cache.h"  // For `CacheMetaData`.
+#include "granary/context.h"
 #include "granary/util.h"  // For `GetMetaData`.
 
 GRANARY_DECLARE_bool(transparent_returns);
 
+GRANARY_DEFINE_bool(shadow_return_stack, false,
+    "Track the return addresses of translated function calls on a thread-"
+    "private shadow stack, so that function returns can go directly to their "
+    "translated return addresses instead of through indirect edges. This only "
+    "applies to user space code and when `--transparent_returns` is enabled. "
+    "The default is `no`.");
+
 namespace granary {
 namespace arch {
 
@@ -69,6 +78,22 @@ extern void MangleTailCall(DecodedBlock *block,
 extern void MangleIndirectReturn(DecodedBlock *block,
                                  ControlFlowInstruction *cfi);
 
+// Mangle a function call so that its return site is pushed onto the shadow
+// stack before the call. Returns the inserted call to the push routine.
+//
+// Note: This has an architecture-specific implementation.
+extern ControlFlowInstruction *MangleReturnSitePush(
+    Trace *trace, DecodedBlock *block, ControlFlowInstruction *cfi,
+    ReturnSite *site);
+
+// Mangle a function return so that a return site is popped off of the shadow
+// stack before the return. Returns the inserted call to the pop routine, or
+// `nullptr` if the return can't use the shadow stack.
+//
+// Note: This has an architecture-specific implementation.
+extern ControlFlowInstruction *MangleReturnSitePop(
+    Trace *trace, DecodedBlock *block, ControlFlowInstruction *cfi);
+
 }  // namespace arch
 namespace {
 
@@ -138,9 +163,29 @@ class BlockMangler {
     if (FLAG_transparent_returns && cfi->IsAppInstruction()) {
       lir::ConvertFunctionCallToJump(cfi);
       arch::MangleTailCall(block, cfi);
+      if (UseShadowReturnStack()) {
+        auto ret_pc = cfi->DecodedPC() + cfi->DecodedLength();
+        auto site = GlobalContext()->AllocateReturnSite(ret_pc);
+        MangleCFI(arch::MangleReturnSitePush(trace, block, cfi, site));
+      }
     }
   }
 
+  // Mangle a function return that is converted into an indirect jump.
+  void MangleFunctionReturn(ControlFlowInstruction *cfi) {
+    if (UseShadowReturnStack()) {
+      if (auto pop_call = arch::MangleReturnSitePop(trace, block, cfi)) {
+        MangleCFI(pop_call);
+      }
+    }
+    arch::MangleIndirectReturn(block, cfi);
+  }
+
+  // Returns true if function calls and returns should use the shadow stack.
+  static bool UseShadowReturnStack(void) {
+    return GRANARY_IF_USER_ELSE(FLAG_shadow_return_stack, false);
+  }
+
   // Relativize a control-flow instruction.
   void MangleCFI(ControlFlowInstruction *cfi) {
     auto target_block = cfi->TargetBlock();
@@ -171,7 +216,7 @@ class BlockMangler {
     // a different program counter.
     } else if (auto return_bb = DynamicCast<ReturnBlock *>(target_block)) {
       if (return_bb->UnsafeMetaData()) {
-        arch::MangleIndirectReturn(block, cfi);
+        MangleFunctionReturn(cfi);
       }
 
     // Some CFIs (e.g. very short conditional jumps) might need to be mangled
@@ -119,7 +119,8 @@ struct FragmentInProgress {
   Instruction *instr;
 
   GRANARY_DEFINE_NEW_ALLOCATOR(FragmentInProgress, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 };
 
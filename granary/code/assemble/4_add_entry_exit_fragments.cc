@@ -8,6 +8,7 @@
 #include "granary/code/fragment.h"
 #include "granary/code/assemble/4_add_entry_exit_fragments.h"
 
+#include "granary/profile.h"
 #include "granary/util.h"
 
 namespace granary {
@@ -25,6 +26,14 @@ extern void VisitInstructionFlags(const arch::Instruction &instr,
 // Note: This has an architecture-specific implementation.
 extern uint32_t AllArithmeticFlags(void);
 
+// Tries to convert an instrumentation instruction that writes to the flags
+// into an equivalent instruction that doesn't write to the flags, e.g. by
+// converting an `ADD` into an `LEA`. Returns `true` if the instruction was
+// converted.
+//
+// Note: This has an architecture-specific implementation.
+extern bool TryMakeFlagNeutral(arch::Instruction *instr);
+
 }  // namespace arch
 namespace {
 
@@ -180,8 +189,80 @@ static void AnalyzeFlagsUse(FragmentList *frags) {
   }
 }
 
-// Group fragments together into flag zones.
-static void CombineFlagZones(FragmentList *frags) {
+// Converts the instrumentation instructions of `frag` whose flag writes are
+// never read into flag-neutral instructions. Returns `true` if any
+// instructions were converted.
+static bool MakeFlagNeutral(CodeFragment *frag) {
+  FlagUsageInfo flags;
+  flags.entry_live_flags = frag->inst_flags.exit_live_flags;
+
+  auto changed = false;
+  auto modifies_flags = false;
+  for (auto instr : ReverseInstructionListIterator(frag->instrs)) {
+    auto ninstr = DynamicCast<NativeInstruction *>(instr);
+    if (!ninstr) continue;
+    if (!ninstr->IsAppInstruction() && ninstr->WritesConditionCodes()) {
+      FlagUsageInfo instr_flags;
+      arch::VisitInstructionFlags(ninstr->instruction, &instr_flags);
+      if (!(instr_flags.all_written_flags & flags.entry_live_flags) &&
+          arch::TryMakeFlagNeutral(&(ninstr->instruction))) {
+        changed = true;
+      }
+    }
+    modifies_flags = modifies_flags || ninstr->WritesConditionCodes();
+    arch::VisitInstructionFlags(ninstr->instruction, &flags);
+  }
+  frag->attr.modifies_flags = modifies_flags;
+  return changed;
+}
+
+// Reset the flags usage info of every fragment, so that it can be recomputed.
+static void ResetFlagsUse(FragmentList *frags) {
+  for (auto frag : FragmentListIterator(frags)) {
+    frag->app_flags = FlagUsageInfo();
+    frag->inst_flags = FlagUsageInfo();
+  }
+}
+
+// Converts instrumentation instructions whose flag writes are never read by
+// other instrumentation instructions into flag-neutral instructions. This can
+// avoid the need to save and restore the flags around instrumentation code
+// altogether. Returns the number of fragments that no longer modify the flags.
+static size_t MakeFlagNeutral(FragmentList *frags) {
+  auto num_neutral_frags = 0UL;
+  auto changed = false;
+  for (auto frag : FragmentListIterator(frags)) {
+    if (kFragmentKindInst != frag->kind) continue;
+    auto code_frag = DynamicCast<CodeFragment *>(frag);
+    if (!code_frag || !code_frag->attr.modifies_flags) continue;
+    if (MakeFlagNeutral(code_frag)) {
+      changed = true;
+      if (!code_frag->attr.modifies_flags) ++num_neutral_frags;
+    }
+  }
+  if (changed) {
+    ResetFlagsUse(frags);
+    AnalyzeFlagsUse(frags);
+  }
+  return num_neutral_frags;
+}
+
+// Returns `true` if `frag` has a successor instrumentation fragment in the
+// same partition.
+static bool HasInstSuccessor(Fragment *frag) {
+  for (auto succ : frag->successors) {
+    if (!succ || frag->partition != succ->partition) continue;
+    if (IsA<CodeFragment *>(succ) && kFragmentKindInst == succ->kind) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Group fragments together into flag zones. Returns the number of application
+// fragments that were merged into flag zones despite writing to the flags.
+static size_t CombineFlagZones(FragmentList *frags) {
+  auto num_merged_frags = 0UL;
   for (auto frag : FragmentListIterator(frags)) {
     auto code_frag = DynamicCast<CodeFragment *>(frag);
     if (!code_frag) continue;
@@ -196,12 +277,23 @@ static void CombineFlagZones(FragmentList *frags) {
         if (kFragmentKindApp != code_succ->kind) continue;
         if (code_succ->branch_instr) continue;
         if (code_succ->app_flags.all_read_flags) continue;
-        if (code_succ->app_flags.all_written_flags) continue;
+
+        // If the application code writes to the flags, but the flags written
+        // are dead, then the flag zones on either side of the application
+        // code can be merged. This avoids restoring and then immediately
+        // re-saving the flags around the application code.
+        if (auto written_flags = code_succ->app_flags.all_written_flags) {
+          if (written_flags & code_succ->app_flags.exit_live_flags) continue;
+          if (!HasInstSuccessor(code_succ)) continue;
+          code_succ->inst_flags.all_written_flags |= written_flags;
+          ++num_merged_frags;
+        }
         code_succ->kind = kFragmentKindInst;
       }
       code_frag->flag_zone.Union(code_succ->flag_zone);
     }
   }
+  return num_merged_frags;
 }
 
 // Update the flag zones with the flags and registers used in the various
@@ -445,8 +537,11 @@ static void PropagateCodeCacheKinds(FragmentList *frags) {
 void AddEntryAndExitFragments(FragmentList *frags) {
   PropagateFragKinds(frags);
   AnalyzeFlagsUse(frags);
-  CombineFlagZones(frags);
+  auto num_elided_flag_saves = MakeFlagNeutral(frags);
+  num_elided_flag_saves += CombineFlagZones(frags);
   UpdateFlagZones(frags);
+  RecordTranslationCounter(kTranslationCounterElidedFlagSaves,
+                           num_elided_flag_saves);
 
   // Guarantee that there is a partition entry fragment. The one special case
   // against this entry fragment is that the first instruction of the first
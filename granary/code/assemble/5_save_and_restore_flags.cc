@@ -45,6 +45,7 @@ static void InjectSaveAndRestoreFlags(FragmentList *frags) {
 // restoring code into `FRAG_TYPE_FLAG_EXIT` code. We only insert code to save
 // and restore flags if it is necessary.
 void SaveAndRestoreFlags(FragmentList *frags) {
+  FindLiveGPRs(frags);
   InjectSaveAndRestoreFlags(frags);
 }
 
@@ -9,8 +9,13 @@
 
 #include "granary/code/assemble/8_schedule_registers.h"
 
+#include "granary/base/new.h"
+
+#include "granary/profile.h"
 #include "granary/util.h"
 
+#include "os/memory.h"
+
 namespace granary {
 namespace arch {
 
@@ -81,17 +86,12 @@ static void GetSchedulableVRs(FragmentList *frags, VRIdSet *vrs) {
 struct RegisterScheduler {
   RegisterScheduler(void)
       : num_slots(0),
+        num_elided_spill_fills(0),
         is_in_slot{false},
         slot_for_gpr{0},
         gpr_has_slot(),
         gpr_counts() {}
 
-  // Recounts the uses of GPRs across all frags.
-  void ResetGlobal(FragmentList *frags) {
-    gpr_counts.ClearGPRUseCounters();
-    gpr_counts.CountGPRUses(frags);
-  }
-
   // Recounts the uses of GPRs within a specific frag.
   void ResetLocal(Fragment *frag) {
     gpr_counts.ClearGPRUseCounters();
@@ -122,17 +122,21 @@ struct RegisterScheduler {
     return NthSpillSlot(slot_for_gpr[gpr_num]);
   }
 
-  // Return an unused GPR for use as a preferred GPR.
-  VirtualRegister GetPreferredGPR(const UsedRegisterSet &used_regs) {
-    for (auto i = 0UL; i < arch::NUM_GENERAL_PURPOSE_REGISTERS; ++i) {
-      if (used_regs.IsLive(i)) continue;
-      if (!gpr_counts.NumUses(i)) return NthArchGPR(i);
-    }
-    return VirtualRegister();
+  // Return a GPR that's not used in `used_regs` to locally home a VR in `frag`.
+  // We try to avoid stealing the preferred GPR of a VR that is live in `frag`,
+  // as the stolen GPR would be saved to the same slot that holds the native
+  // value of the preferred GPR.
+  VirtualRegister GetGPR(const CodeFragment *frag,
+                         const UsedRegisterSet &used_regs) {
+    UsedRegisterSet avoided_regs(used_regs);
+    avoided_regs.Union(frag->homed_gprs);
+    auto gpr = GetLeastUsedGPR(avoided_regs);
+    if (!gpr.IsValid()) gpr = GetLeastUsedGPR(used_regs);
+    return gpr;
   }
 
   // Return the least used GPR for use that's not also used in `used_regs`.
-  VirtualRegister GetGPR(const UsedRegisterSet &used_regs) {
+  VirtualRegister GetLeastUsedGPR(const UsedRegisterSet &used_regs) {
     auto found_reg = false;
     auto min_gpr_num = static_cast<size_t>(arch::NUM_GENERAL_PURPOSE_REGISTERS);
     auto min_num_uses = std::numeric_limits<size_t>::max();
@@ -152,6 +156,10 @@ struct RegisterScheduler {
   // Number of slots allocated.
   size_t num_slots;
 
+  // Number of spills and fills of preferred GPRs that were not added because
+  // the native values of those GPRs were dead.
+  size_t num_elided_spill_fills;
+
   // Tells us whether or not the GPR is currently located in its slot.
   bool is_in_slot[arch::NUM_GENERAL_PURPOSE_REGISTERS];
 
@@ -188,6 +196,218 @@ static bool UpdateUseRegs(AnnotationInstruction *instr,
   }
 }
 
+// Returns `true` if `frag` is within the live range of the VR with id `vr_id`.
+static bool IsInLiveRange(const CodeFragment *frag, uint16_t vr_id) {
+  return frag->entry_regs.Contains(vr_id) || frag->exit_regs.Contains(vr_id);
+}
+
+// Find the GPRs that are used anywhere within each fragment. These sets are
+// then kept up-to-date as VRs are homed to GPRs.
+static void FindUsedGPRs(FragmentList *frags) {
+  for (auto frag : FragmentListIterator(frags)) {
+    auto cfrag = DynamicCast<CodeFragment *>(frag);
+    if (!cfrag) continue;
+    cfrag->used_gprs.KillAll();
+    cfrag->homed_gprs.KillAll();
+    for (auto instr : InstructionListIterator(cfrag->instrs)) {
+      if (auto ninstr = DynamicCast<NativeInstruction *>(instr)) {
+        cfrag->used_gprs.Visit(ninstr);
+      } else if (auto ainstr = DynamicCast<AnnotationInstruction *>(instr)) {
+        UpdateUseRegs(ainstr, &(cfrag->used_gprs));
+      }
+    }
+  }
+}
+
+// Scheduling information about a VR.
+struct VRInfo {
+  // Weighted number of uses and definitions of this VR.
+  size_t weight;
+
+  // GPRs that can't be used in place of this VR due to encoding restrictions
+  // of the instructions that use or define this VR.
+  UsedRegisterSet restricted_gprs;
+
+  // Id of this VR, or `0` if this isn't a schedulable VR.
+  uint16_t vr_id;
+};
+
+// Returns the weight of a use or definition of a VR in `frag`. Uses in hot
+// code are weighted more heavily than uses in cold code.
+static size_t UseWeight(const Fragment *frag) {
+  return kCodeCacheKindHot == frag->cache ? 8UL : 1UL;
+}
+
+// Returns `true` if `a` should be scheduled before `b`. Heavier VRs are
+// scheduled first, and ties are broken by the VR ids so that the order is
+// deterministic.
+static bool IsScheduledBefore(const VRInfo *a, const VRInfo *b) {
+  if (a->weight != b->weight) return a->weight > b->weight;
+  return a->vr_id < b->vr_id;
+}
+
+// Table of the scheduling information of all schedulable VRs, indexed by
+// VR id, along with the order in which the VRs should be scheduled.
+class VRInfoTable {
+ public:
+  VRInfoTable(FragmentList *frags, const VRIdSet &vrs)
+      : min_vr_id(0),
+        num_infos(0),
+        num_vrs(0),
+        num_pages(0),
+        infos(nullptr),
+        order(nullptr) {
+    auto max_vr_id = 0U;
+    for (auto vr_id : vrs) {
+      if (!min_vr_id || vr_id < min_vr_id) min_vr_id = vr_id;
+      if (vr_id > max_vr_id) max_vr_id = vr_id;
+      ++num_vrs;
+    }
+    if (!num_vrs) return;
+
+    num_infos = max_vr_id - min_vr_id + 1UL;
+    Allocate();
+    for (auto i = 0UL; i < num_infos; ++i) {
+      infos[i].weight = 0;
+      infos[i].restricted_gprs.KillAll();
+      infos[i].vr_id = 0;
+    }
+    auto i = 0UL;
+    for (auto vr_id : vrs) {
+      auto info = &(infos[vr_id - min_vr_id]);
+      info->vr_id = vr_id;
+      order[i++] = info;
+    }
+    Visit(frags);
+    std::sort(order, order + num_vrs, IsScheduledBefore);
+  }
+
+  ~VRInfoTable(void) {
+    if (num_pages) os::FreeDataPages(infos, num_pages);
+  }
+
+  // Iterate over the VRs in the order in which they should be scheduled.
+  inline VRInfo * const *begin(void) const {
+    return order;
+  }
+
+  inline VRInfo * const *end(void) const {
+    return order + num_vrs;
+  }
+
+ private:
+  VRInfoTable(void) = delete;
+
+  // Returns the info for the VR with id `vr_id`, or `nullptr` if the VR isn't
+  // schedulable.
+  VRInfo *Find(uint16_t vr_id) const {
+    if (vr_id < min_vr_id || vr_id >= min_vr_id + num_infos) return nullptr;
+    auto info = &(infos[vr_id - min_vr_id]);
+    return info->vr_id ? info : nullptr;
+  }
+
+  // Allocate the info table and the schedule order. This is short-lived, so
+  // we first try to allocate it from the translation arena, and fall back to
+  // data pages if the arena is disabled or exhausted.
+  void Allocate(void) {
+    auto infos_size = GRANARY_ALIGN_TO(num_infos * sizeof(VRInfo),
+                                       alignof(VRInfo *));
+    auto size = infos_size + num_vrs * sizeof(VRInfo *);
+    auto mem = reinterpret_cast<uint8_t *>(
+        internal::AllocateFromTranslationArena(size, alignof(VRInfo)));
+    if (!mem) {
+      num_pages = GRANARY_ALIGN_TO(size, arch::PAGE_SIZE_BYTES) /
+                  arch::PAGE_SIZE_BYTES;
+      mem = reinterpret_cast<uint8_t *>(os::AllocateDataPages(num_pages));
+    }
+    infos = reinterpret_cast<VRInfo *>(mem);
+    order = reinterpret_cast<VRInfo **>(mem + infos_size);
+  }
+
+  // Compute the weighted number of uses and definitions, and the restricted
+  // GPRs, of every schedulable VR in one pass over the fragments.
+  void Visit(FragmentList *frags) {
+    for (auto frag : FragmentListIterator(frags)) {
+      auto cfrag = DynamicCast<CodeFragment *>(frag);
+      if (!cfrag) continue;
+      const auto weight = UseWeight(cfrag);
+      for (auto instr : InstructionListIterator(cfrag->instrs)) {
+        auto ninstr = DynamicCast<NativeInstruction *>(instr);
+        if (!ninstr) continue;
+        for (auto used_vr_id : ninstr->used_vrs) {
+          if (used_vr_id) Visit(cfrag, ninstr, used_vr_id, weight);
+        }
+        if (ninstr->defined_vr) {
+          Visit(cfrag, ninstr, ninstr->defined_vr, weight);
+        }
+      }
+    }
+  }
+
+  // Account for a use or definition of the VR with id `vr_id` in `ninstr`.
+  void Visit(const CodeFragment *frag, const NativeInstruction *ninstr,
+             uint16_t vr_id, size_t weight) {
+    if (auto info = Find(vr_id)) {
+      info->weight += weight;
+      if (IsInLiveRange(frag, vr_id)) {
+        info->restricted_gprs.ReviveRestrictedRegisters(ninstr);
+      }
+    }
+  }
+
+  // Smallest schedulable VR id. This is the VR id of `infos[0]`.
+  uint16_t min_vr_id;
+
+  // Number of entries in `infos`, and number of entries in `order`.
+  size_t num_infos;
+  size_t num_vrs;
+
+  // Number of data pages allocated to back `infos` and `order`, or `0` if
+  // they were allocated from the translation arena.
+  size_t num_pages;
+
+  VRInfo *infos;
+  VRInfo **order;
+
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(VRInfoTable);
+};
+
+// Return a GPR that isn't used within the live range of the VR `info`, and
+// that isn't the preferred GPR of any other VR whose live range overlaps with
+// this VR's live range. We favor GPRs whose native values are dead where the
+// VR is defined, as then the GPR doesn't need to be spilled or filled.
+static VirtualRegister GetPreferredGPR(FragmentList *frags,
+                                       const VRInfo *info,
+                                       bool *gpr_is_dead) {
+  const auto vr_id = info->vr_id;
+  UsedRegisterSet unavailable_regs(info->restricted_gprs);
+  LiveRegisterSet live_regs_at_defs;
+  for (auto frag : FragmentListIterator(frags)) {
+    auto cfrag = DynamicCast<CodeFragment *>(frag);
+    if (!cfrag || !IsInLiveRange(cfrag, vr_id)) continue;
+    unavailable_regs.Union(cfrag->used_gprs);
+    unavailable_regs.Union(cfrag->homed_gprs);
+
+    // This fragment is where the live range of the VR begins.
+    if (!cfrag->attr.is_compensation_frag &&
+        !cfrag->entry_regs.Contains(vr_id)) {
+      live_regs_at_defs.Union(cfrag->entry_live_gprs);
+    }
+  }
+
+  VirtualRegister preferred_gpr;
+  for (auto i = 0UL; i < arch::NUM_GENERAL_PURPOSE_REGISTERS; ++i) {
+    if (unavailable_regs.IsLive(i)) continue;
+    if (!live_regs_at_defs.IsLive(i)) {
+      *gpr_is_dead = true;
+      return NthArchGPR(i);
+    }
+    if (!preferred_gpr.IsValid()) preferred_gpr = NthArchGPR(i);
+  }
+  *gpr_is_dead = false;
+  return preferred_gpr;
+}
+
 // Arrange for a label to be *just* before any useful VR-related instructions.
 static Instruction *AddSchedLabel(CodeFragment *frag,
                                   Instruction *first_vr_instr) {
@@ -219,6 +439,9 @@ static Instruction *AddSchedLabel(CodeFragment *frag,
 static void ChangeVRHome(RegisterScheduler *sched, CodeFragment *frag,
                          Instruction *instr, VirtualRegister old_home,
                          VirtualRegister new_home) {
+  frag->used_gprs.Revive(old_home);
+  frag->used_gprs.Revive(new_home);
+
   frag->instrs.InsertAfter(instr, arch::RestoreGPRFromSlot(
       new_home, sched->SlotForGPR(new_home)));
 
@@ -230,10 +453,13 @@ static void ChangeVRHome(RegisterScheduler *sched, CodeFragment *frag,
 }
 
 // Schedule the virtual register with id `vr_id`, where the VR will be stored
-// in `preferred_gpr` across control-flow edges where it's live.
+// in `preferred_gpr` across control-flow edges where it's live. If
+// `preferred_gpr_is_dead` is `true` then the native value of `preferred_gpr`
+// doesn't need to be saved at the beginning of the VR's live range.
 static void ScheduleRegisters(RegisterScheduler *sched, CodeFragment *frag,
                               const uint16_t vr_id,
-                              const VirtualRegister preferred_gpr) {
+                              const VirtualRegister preferred_gpr,
+                              const bool preferred_gpr_is_dead) {
   // Nothing to do. This fragment isn't in the live range of this VR.
   if (!frag->exit_regs.Contains(vr_id)) return;
 
@@ -278,7 +504,7 @@ static void ScheduleRegisters(RegisterScheduler *sched, CodeFragment *frag,
     if (used_regs.IsLive(vr_home)) {
       auto new_vr_home = preferred_gpr;
       if (used_regs.IsLive(preferred_gpr)) {
-        new_vr_home = sched->GetGPR(used_regs);
+        new_vr_home = sched->GetGPR(frag, used_regs);
       }
       GRANARY_ASSERT(vr_home != new_vr_home);
       GRANARY_ASSERT(new_vr_home.IsNative());
@@ -292,6 +518,7 @@ static void ScheduleRegisters(RegisterScheduler *sched, CodeFragment *frag,
 
       // Replace all uses of this VR in the instruction with `vr_home`.
       GRANARY_ASSERT(vr_home.IsNative() && vr_home.IsGeneralPurpose());
+      frag->used_gprs.Revive(vr_home);
       GRANARY_IF_DEBUG( auto replaced = ) arch::TryReplaceRegInInstruction(
           ninstr, vr_reg, vr_home);
       GRANARY_ASSERT(replaced);
@@ -304,10 +531,17 @@ static void ScheduleRegisters(RegisterScheduler *sched, CodeFragment *frag,
   // GPR across control-transfers.
   if (vr_is_live_on_entry) {
     if (preferred_gpr != vr_home) {
+      GRANARY_ASSERT(!preferred_gpr_is_dead);
       auto sched_label = AddSchedLabel(frag, first_vr_instr);
       ChangeVRHome(sched, frag, sched_label, vr_home, preferred_gpr);
     }
 
+  // Not live on entry, but the native value of the preferred GPR is dead, so
+  // there's no need to spill it.
+  } else if (preferred_gpr_is_dead) {
+    GRANARY_ASSERT(preferred_gpr == vr_home);
+    sched->num_elided_spill_fills++;
+
   // Not live on entry, need to set up an initial spill.
   } else {
     auto sched_label = AddSchedLabel(frag, first_vr_instr);
@@ -384,7 +618,8 @@ static void ScheduleRegisters(RegisterScheduler *sched, CodeFragment *frag,
 
     if (vr_is_used_or_defined_in_instr) {
       if (slot_reg == vr_home) {
-        vr_home = sched->GetGPR(used_regs);
+        vr_home = sched->GetGPR(frag, used_regs);
+        frag->used_gprs.Revive(vr_home);
         frag->instrs.InsertAfter(instr, arch::RestoreGPRFromSlot(
             vr_home, sched->SlotForGPR(vr_home)));
         if (vr_is_used_in_later_instr && vr_is_defined_in_frag) {
@@ -478,14 +713,17 @@ static void MarkPartitionUseCounts(RegisterScheduler *sched,
 void ScheduleRegisters(FragmentList *frags) {
   VRIdSet vrs;
   RegisterScheduler sched;
-  UsedRegisterSet preferred_gprs;
 
-  // TODO(pag): Weighted sorting of VRs by number of uses, where the number of
-  //            uses is weighted to favor hot code.
+  FindLiveGPRs(frags);
+  FindUsedGPRs(frags);
   GetSchedulableVRs(frags, &vrs);
 
-  for (auto vr_id : vrs) {
-    sched.ResetGlobal(frags);
+  // Schedule the VRs in order of their (hotness-weighted) number of uses, so
+  // that the most important VRs get the first pick of the preferred GPRs.
+  VRInfoTable vr_infos(frags, vrs);
+
+  for (auto vr_info : vr_infos) {
+    const auto vr_id = vr_info->vr_id;
 
     // Allocate a slot for the VR, and try to find a preferred GPR for the VR.
     // The idea with the preferred GPRs is that we ideally want the VR to be
@@ -493,13 +731,16 @@ void ScheduleRegisters(FragmentList *frags) {
     // Specifically, we also want the GPR to be homed to its preferred GPR
     // across control-flow edges. Otherwise, we say the VR is always in its
     // slot across control-flow edges.
-    auto preferred_gpr = sched.GetPreferredGPR(preferred_gprs);
+    //
+    // Preferred GPRs are allocated over the whole trace, and so VRs whose live
+    // ranges don't overlap can share the same preferred GPR. If the native
+    // value of the preferred GPR is dead over the VR's live range, then we
+    // don't need to spill/fill the native value at all.
+    auto preferred_gpr_is_dead = false;
+    auto preferred_gpr = GetPreferredGPR(frags, vr_info,
+                                         &preferred_gpr_is_dead);
     auto slot = 0UL;
-    if (preferred_gpr.IsValid()) {
-      preferred_gprs.Revive(preferred_gpr);
-    } else {
-      slot = sched.num_slots++;
-    }
+    if (!preferred_gpr.IsValid()) slot = sched.num_slots++;
 
     for (auto frag : FragmentListIterator(frags)) {
       if (auto cfrag = DynamicCast<CodeFragment *>(frag)) {
@@ -508,17 +749,29 @@ void ScheduleRegisters(FragmentList *frags) {
         // across control-flow transfers.
         if (preferred_gpr.IsValid()) {
 
+          // VRs can only share a preferred GPR if their live ranges don't
+          // overlap.
+          if (IsInLiveRange(cfrag, vr_id)) {
+            cfrag->homed_gprs.Revive(preferred_gpr);
+          }
+
           // Only thing in compensation fragments are implicit register
           // kills for VRs that are homed to preferred GPRs.
           if (cfrag->attr.is_compensation_frag) {
             if (cfrag->entry_regs.Contains(vr_id) &&
                 !cfrag->exit_regs.Contains(vr_id)) {
-              cfrag->instrs.Prepend(arch::RestoreGPRFromSlot(
-                  preferred_gpr, sched.SlotForGPR(preferred_gpr)));
+              if (preferred_gpr_is_dead) {
+                sched.num_elided_spill_fills++;
+              } else {
+                cfrag->used_gprs.Revive(preferred_gpr);
+                cfrag->instrs.Prepend(arch::RestoreGPRFromSlot(
+                    preferred_gpr, sched.SlotForGPR(preferred_gpr)));
+              }
             }
 
           } else {
-            ScheduleRegisters(&sched, cfrag, vr_id, preferred_gpr);
+            ScheduleRegisters(&sched, cfrag, vr_id, preferred_gpr,
+                              preferred_gpr_is_dead);
           }
 
         // Without preferred GRPs, all transfers will end up going through
@@ -531,6 +784,9 @@ void ScheduleRegisters(FragmentList *frags) {
     }
   }
 
+  RecordTranslationCounter(kTranslationCounterElidedSpillFills,
+                           sched.num_elided_spill_fills);
+
   sched.ResetGPRSlots();
   ScheduleSaveRestores(&sched, frags);
   MarkPartitionUseCounts(&sched, frags);
@@ -18,6 +18,7 @@
 #include "granary/app.h"
 #include "granary/cache.h"
 #include "granary/context.h"
+#include "granary/profile.h"
 #include "granary/util.h"
 
 GRANARY_DEFINE_bool(debug_trace_exec, false,
@@ -87,12 +88,27 @@ static void StageEncodeLabels(Fragment *frag) {
   }
 }
 
+// Allocate a buffer for the staged bytes of the native instructions of a
+// fragment. The buffer is reclaimed along with the rest of the translation
+// arena. Returns `nullptr` if the buffer can't be allocated.
+static uint8_t *AllocateStagedBytes(Fragment *frag) {
+  auto num_instrs = 0UL;
+  for (auto instr : InstructionListIterator(frag->instrs)) {
+    if (IsA<NativeInstruction *>(instr)) ++num_instrs;
+  }
+  if (!num_instrs) return nullptr;
+  return reinterpret_cast<uint8_t *>(internal::AllocateFromTranslationArena(
+      num_instrs * arch::MAX_INSTRUCTION_SIZE_BYTES, 1));
+}
+
 // Stage encode an individual fragment. Returns the number of bytes needed to
 // encode all native instructions in this fragment.
 static size_t StageEncodeNativeInstructions(Fragment *frag) {
   auto estimated_encode_pc = EstimatedCachePC();
   auto encode_pc = estimated_encode_pc;
-  arch::InstructionEncoder encoder(arch::InstructionEncodeKind::STAGED);
+  frag->staged_bytes = AllocateStagedBytes(frag);
+  arch::InstructionEncoder encoder(arch::InstructionEncodeKind::STAGED,
+                                   frag->staged_bytes);
   for (auto instr : InstructionListIterator(frag->instrs)) {
     if (auto ninstr = DynamicCast<NativeInstruction *>(instr)) {
       if (ninstr->IsNoOp()) ninstr->instruction.DontEncode();
@@ -212,9 +228,10 @@ static void RelativizeControlFlow(FragmentList *frags) {
 // edge or out-edge code.
 static void Encode(FragmentList *frags) {
   CodeCacheTransaction transaction;
-  arch::InstructionEncoder encoder(arch::InstructionEncodeKind::COMMIT);
   for (auto frag : EncodeOrderedFragmentIterator(frags->First())) {
     GRANARY_ASSERT(nullptr != frag->encoded_pc);
+    arch::InstructionEncoder encoder(
+        arch::InstructionEncodeKind::COMMIT_STAGED, frag->staged_bytes);
     for (auto instr : InstructionListIterator(frag->instrs)) {
       if (auto ninstr = DynamicCast<NativeInstruction *>(instr)) {
         if (!ninstr->instruction.WillBeEncoded()) continue;
@@ -283,6 +300,7 @@ static void ConnectEdgesToInstructions(FragmentList *frags) {
 
 // Encodes the fragments into the specified code caches.
 static CachePC EncodeAndFree(FragmentList *frags) {
+  TranslationTimer timer;
   if (GRANARY_UNLIKELY(FLAG_debug_trace_exec)) AddBlockTracers(frags);
   CodeCacheUse cache_use = {{0}, {nullptr}};
   StageEncode(frags, &cache_use);
@@ -303,6 +321,7 @@ static CachePC EncodeAndFree(FragmentList *frags) {
   AssignBlockCacheLocations(frags);
   ConnectEdgesToInstructions(frags);
   FreeFragments(frags);
+  timer.RecordPass(kTranslationPassEncode);
   return entry_pc;
 }
 
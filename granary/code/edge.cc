@@ -2,16 +2,43 @@
 
 #define GRANARY_INTERNAL
 
+#include "granary/base/option.h"
+
 #include "granary/code/edge.h"
 
 #include "granary/breakpoint.h"
 #include "granary/index.h"
 #include "granary/metadata.h"
 
+GRANARY_DECLARE_uint(hot_trace_threshold);
+
 namespace granary {
 
 GRANARY_IMPLEMENT_NEW_ALLOCATOR(DirectEdge)
 GRANARY_IMPLEMENT_NEW_ALLOCATOR(IndirectEdge)
+GRANARY_IMPLEMENT_NEW_ALLOCATOR(IndirectBranchCache)
+GRANARY_IMPLEMENT_NEW_ALLOCATOR(ReturnSite)
+
+namespace {
+
+// Shared table for indirect edges that haven't cached any targets. It is
+// never modified.
+static IndirectBranchCache gEmptyIndirectBranchCache;
+
+// Returns the initial value of `DirectEdge::num_executions_until_hot`.
+static uint16_t HotTraceThreshold(void) {
+  return static_cast<uint16_t>(GRANARY_MIN(FLAG_hot_trace_threshold, 0xFFFFU));
+}
+
+// Delete a list of indirect branch target caches.
+static void DeleteCacheList(IndirectBranchCache *cache) {
+  for (IndirectBranchCache *next_cache(nullptr); cache; cache = next_cache) {
+    next_cache = cache->next;
+    delete cache;
+  }
+}
+
+}  // namespace
 
 DirectEdge::DirectEdge(BlockMetaData *dest_meta_, DirectEdge *next_)
     : entry_target_pc(nullptr),
@@ -19,24 +46,109 @@ DirectEdge::DirectEdge(BlockMetaData *dest_meta_, DirectEdge *next_)
       dest_block_meta(dest_meta_),
       edge_code_pc(nullptr),
       patch_instruction_pc(nullptr),
+      enter_granary_pc(nullptr),
+      num_executions_until_hot(HotTraceThreshold()),
+      is_retired(false),
+      is_profiled(0 != num_executions_until_hot),
       lock() {}
 
 DirectEdge::~DirectEdge(void) {
   if (dest_block_meta) delete dest_block_meta;
 }
 
+// Returns the number of times that the profiled direct edge `edge` has been
+// taken.
+unsigned NumProfiledExecutions(const DirectEdge *edge) {
+  return HotTraceThreshold() - edge->num_executions_until_hot;
+}
+
 IndirectEdge::IndirectEdge(const BlockMetaData *source_meta_,
                            const BlockMetaData *dest_meta_)
     : out_edge_pc(nullptr),
+      cache(&gEmptyIndirectBranchCache),
       source_block_meta(source_meta_),
       dest_block_meta_template(dest_meta_),
       next(nullptr),
       out_edge_template(nullptr),
+      enter_granary_pc(nullptr),
+      is_retired(false),
+      retired_caches(nullptr),
+      num_misses(0),
       out_edges(),
       lock() {}
 
 IndirectEdge::~IndirectEdge(void) {
+  ResetIndirectEdgeCache(this);
+  DeleteCacheList(retired_caches);
   delete dest_block_meta_template;
 }
 
+ReturnSite::ReturnSite(AppPC native_pc_, ReturnSite *next_)
+    : native_pc(native_pc_),
+      cache_pc(nullptr),
+      next(next_) {}
+
+IndirectBranchCache::IndirectBranchCache(void)
+    : num_hits(0),
+      next(nullptr) {
+  for (auto &entry : entries) {
+    entry.app_pc.store(nullptr, std::memory_order_relaxed);
+    entry.cache_pc.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+// Try to add a mapping from `app_pc` to `cache_pc` into the table. Returns
+// `false` if all the entries where `app_pc` could be placed are taken.
+//
+// Note: This must be invoked in the context of the owning edge's `lock`.
+bool IndirectBranchCache::TryInsert(AppPC app_pc, CachePC cache_pc) {
+  const auto index = IndexOf(app_pc);
+  for (auto i = index; i < index + kMaxNumProbes; ++i) {
+    auto &entry(entries[i]);
+    auto entry_app_pc = entry.app_pc.load(std::memory_order_relaxed);
+    if (entry_app_pc == app_pc) return true;
+    if (entry_app_pc) continue;
+
+    // Publish the target last, so that a concurrent probe never matches on
+    // `app_pc` and then reads a stale `cache_pc`.
+    entry.cache_pc.store(cache_pc, std::memory_order_relaxed);
+    entry.app_pc.store(app_pc, std::memory_order_release);
+    return true;
+  }
+  return false;
+}
+
+// Add a mapping from `app_pc` to the out-edge template `cache_pc` into the
+// indirect branch target cache of `edge`.
+//
+// Note: This must be invoked in the context of the edge's `lock`.
+void CacheIndirectEdgeTarget(IndirectEdge *edge, AppPC app_pc,
+                             CachePC cache_pc) {
+  if (!app_pc) return;  // `nullptr` marks unused entries.
+  auto cache = edge->cache.load(std::memory_order_relaxed);
+  if (&gEmptyIndirectBranchCache == cache) {
+    cache = new IndirectBranchCache;
+    cache->TryInsert(app_pc, cache_pc);
+    edge->cache.store(cache, std::memory_order_release);
+
+  // Entries are never replaced, as a concurrent probe could then match the
+  // old target and read the new template. If there's no room for `app_pc`
+  // then it will continue to be resolved by Granary.
+  } else {
+    cache->TryInsert(app_pc, cache_pc);
+  }
+}
+
+// Empty the indirect branch target cache of `edge`. The old table is kept
+// around until the edge is deleted, as other threads might be probing it.
+//
+// Note: This must be invoked in the context of the edge's `lock`.
+void ResetIndirectEdgeCache(IndirectEdge *edge) {
+  auto cache = edge->cache.exchange(&gEmptyIndirectBranchCache);
+  if (&gEmptyIndirectBranchCache != cache) {
+    cache->next = edge->retired_caches;
+    edge->retired_caches = cache;
+  }
+}
+
 }  // namespace granary
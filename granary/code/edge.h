@@ -61,6 +61,24 @@ class DirectEdge {
   // Instruction that is patched by this direct edge.
   CachePC patch_instruction_pc;
 
+  // The code within the edge stub that enters Granary. Before the edge is
+  // translated, `entry_target_pc` points here.
+  CachePC enter_granary_pc;
+
+  // Number of times that this edge can be taken before its target block is
+  // considered hot. This is decremented by `granary_arch_profile_direct_edge`
+  // without synchronization, and so is approximate.
+  uint16_t num_executions_until_hot;
+
+  // Whether or not this edge belongs to code that was flushed from the code
+  // cache. Retired edges are never patched.
+  bool is_retired;
+
+  // Whether or not this edge is counting its executions. Profiled edges own
+  // `dest_block_meta` until they become hot, and so are never patched or
+  // queued for patching before then.
+  bool is_profiled;
+
   // Lock that guards the modification of `dest_meta` and this structure.
   os::Lock lock;
 
@@ -78,9 +96,94 @@ static_assert(0 == offsetof(DirectEdge, entry_target_pc),
     "Field `DirectEdge::cached_target` must be at offset `0`, as assembly "
     "routines depend on this.");
 
+static_assert(40 == offsetof(DirectEdge, enter_granary_pc),
+    "Field `DirectEdge::enter_granary_pc` must be at offset `40`, as assembly "
+    "routines depend on this.");
+
+static_assert(48 == offsetof(DirectEdge, num_executions_until_hot),
+    "Field `DirectEdge::num_executions_until_hot` must be at offset `48`, as "
+    "assembly routines depend on this.");
+
 static_assert(arch::CACHE_LINE_SIZE_BYTES >= sizeof(DirectEdge),
     "The `DirectEdge` structure should fit into an individual cache line.");
 
+// Returns the number of times that the profiled direct edge `edge` has been
+// taken.
+unsigned NumProfiledExecutions(const DirectEdge *edge);
+
+// An entry in an indirect branch target cache.
+struct IndirectBranchCacheEntry {
+  // The application target of an indirect CFI. This is `nullptr` if the entry
+  // is unused.
+  std::atomic<AppPC> app_pc;
+
+  // The instantiated out-edge template that jumps to the block translated
+  // from `app_pc`.
+  std::atomic<CachePC> cache_pc;
+};
+
+// A small, open-addressed hash table that maps the application targets of an
+// indirect CFI to their instantiated out-edge templates. The table is probed
+// by `granary_arch_enter_indirect_edge` before entering Granary, so that
+// indirect CFIs with many targets don't need to walk a long chain of out-edge
+// templates, or context switch into Granary, in the common case.
+//
+// Entries are never changed after they are published, so the table can be
+// read without locks. A target `pc` is only ever located in one of the
+// `kMaxNumProbes` entries starting at `entries[IndexOf(pc)]`.
+class IndirectBranchCache {
+ public:
+  enum : size_t {
+    kNumEntries = 128,
+    kMaxNumProbes = 2
+  };
+
+  IndirectBranchCache(void);
+
+  // Returns the index of the first entry that might contain `pc`.
+  inline static size_t IndexOf(AppPC pc) {
+    auto addr = reinterpret_cast<uintptr_t>(pc);
+    return ((addr >> 4) ^ addr) & (kNumEntries - 1);
+  }
+
+  // Try to add a mapping from `app_pc` to `cache_pc` into the table. Returns
+  // `false` if all the entries where `app_pc` could be placed are taken.
+  //
+  // Note: This must be invoked in the context of the owning edge's `lock`.
+  bool TryInsert(AppPC app_pc, CachePC cache_pc);
+
+  // Number of times that a lookup in this table found its target. This is
+  // incremented by `granary_arch_enter_indirect_edge` without synchronization,
+  // and so is approximate.
+  uint64_t num_hits;
+
+  // Next table in a list of tables that are no longer used by an edge, but
+  // might still be being probed by some thread.
+  IndirectBranchCache *next;
+
+  // The entries of the table. There is one extra entry so that probing never
+  // needs to wrap around to the beginning of the table.
+  IndirectBranchCacheEntry entries[kNumEntries + kMaxNumProbes - 1];
+
+  GRANARY_DECLARE_NEW_ALLOCATOR(IndirectBranchCache, {
+    kAlignment = arch::CACHE_LINE_SIZE_BYTES
+  })
+
+ private:
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(IndirectBranchCache);
+};
+
+static_assert(128 == IndirectBranchCache::kNumEntries &&
+              2 == IndirectBranchCache::kMaxNumProbes,
+    "The size of `IndirectBranchCache` must be `128` entries, with at most "
+    "`2` probes, as assembly routines depend on this.");
+
+static_assert(0 == offsetof(IndirectBranchCache, num_hits) &&
+              16 == offsetof(IndirectBranchCache, entries) &&
+              16 == sizeof(IndirectBranchCacheEntry),
+    "The layout of `IndirectBranchCache` is unexpected, and assembly routines "
+    "depend on this.");
+
 // Used to resolve indirect control-flow tranfers between the code cache and
 // Granary.
 class IndirectEdge {
@@ -107,6 +210,11 @@ class IndirectEdge {
   //        to (1).
   CachePC out_edge_pc;
 
+  // Hashed lookup table of the out-edge templates of this edge that aren't
+  // part of the chain starting at `out_edge_pc`. Initially, this points to a
+  // shared, empty table.
+  std::atomic<IndirectBranchCache *> cache;
+
   // Meta-data associated with the block containing the indirect CFI.
   const BlockMetaData * const source_block_meta;
 
@@ -123,6 +231,21 @@ class IndirectEdge {
   //       instruction using `kAnnotUpdateAddressWhenEncoded`.
   AppPC out_edge_template;
 
+  // The "miss" code that enters Granary. This is the initial value of
+  // `out_edge_pc`.
+  CachePC enter_granary_pc;
+
+  // Whether or not this edge belongs to code that was flushed from the code
+  // cache.
+  bool is_retired;
+
+  // Tables that used to be pointed to by `cache`.
+  IndirectBranchCache *retired_caches;
+
+  // Number of times that this edge entered Granary, i.e. the number of times
+  // that neither the out-edge chain nor `cache` contained the target.
+  uint64_t num_misses;
+
   // Map of all application targets and the associated in-edge PC.
   //
   // TODO(pag): Map this to a `(CachePC, BlockMetaData *)` pair, so that we can
@@ -146,6 +269,66 @@ static_assert(0 == offsetof(IndirectEdge, out_edge_pc),
     "Field `IndirectEdge::in_edge_pc` must be at offset `0`, as assembly "
     "routines depend on this.");
 
+static_assert(8 == offsetof(IndirectEdge, cache),
+    "Field `IndirectEdge::cache` must be at offset `8`, as assembly "
+    "routines depend on this.");
+
+// Add a mapping from `app_pc` to the out-edge template `cache_pc` into the
+// indirect branch target cache of `edge`.
+//
+// Note: This must be invoked in the context of the edge's `lock`.
+void CacheIndirectEdgeTarget(IndirectEdge *edge, AppPC app_pc,
+                             CachePC cache_pc);
+
+// Empty the indirect branch target cache of `edge`. The old table is kept
+// around until the edge is deleted, as other threads might be probing it.
+//
+// Note: This must be invoked in the context of the edge's `lock`.
+void ResetIndirectEdgeCache(IndirectEdge *edge);
+
+// The return site of a translated function call. With `--shadow_return_stack`,
+// translated function calls push their return site onto the thread-private
+// `os::ShadowStack`, and translated function returns pop them. If the native
+// return address matches `native_pc`, then the return goes directly to
+// `cache_pc`, without going through the return's indirect edge.
+//
+// Note: Return sites are retired by code cache flushes, along with the code
+//       that pushes them. Stale pointers to them can live on in the shadow
+//       stacks of any thread, so every thread clears its shadow stack when it
+//       observes a new epoch, before retired return sites are reclaimed.
+class ReturnSite {
+ public:
+  ReturnSite(AppPC native_pc_, ReturnSite *next_);
+
+  // The native return address of the function call.
+  const AppPC native_pc;
+
+  // The code cache address of the block at `native_pc`, or `nullptr` if it
+  // isn't yet known. Resolved lazily, the first time a return to `native_pc`
+  // goes through an indirect edge.
+  std::atomic<CachePC> cache_pc;
+
+  // Next return site in a chain of all return sites.
+  ReturnSite *next;
+
+  GRANARY_DECLARE_NEW_ALLOCATOR(ReturnSite, {
+    kAlignment = 1
+  })
+
+ private:
+  ReturnSite(void) = delete;
+
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(ReturnSite);
+};
+
+static_assert(0 == offsetof(ReturnSite, native_pc),
+    "Field `ReturnSite::native_pc` must be at offset `0`, as assembly "
+    "routines depend on this.");
+
+static_assert(8 == offsetof(ReturnSite, cache_pc),
+    "Field `ReturnSite::cache_pc` must be at offset `8`, as assembly "
+    "routines depend on this.");
+
 }  // namespace granary
 
 #endif  // GRANARY_CODE_EDGE_H_
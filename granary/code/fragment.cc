@@ -150,6 +150,7 @@ Fragment::Fragment(void)
       num_predecessors(0),
       encoded_size(0),
       encoded_pc(nullptr),
+      staged_bytes(nullptr),
       block_meta(nullptr),
       kind(kFragmentKindInvalid),
       cache(kCodeCacheKindHot),
@@ -171,6 +172,9 @@ CodeFragment::CodeFragment(void)
       attr(),
       entry_regs(),
       exit_regs(),
+      entry_live_gprs(),
+      used_gprs(),
+      homed_gprs(),
       def_regs() {}
 
 CodeFragment::~CodeFragment(void) {}
@@ -473,6 +477,54 @@ static void FreePartitionInfo(Fragment *frag) {
   }
 }
 
+// Returns `true` if `instr` might transfer control to code that reads any
+// native GPR, e.g. a function call or an indirect jump.
+static bool MightReadAllGPRs(const NativeInstruction *instr) {
+  return instr->IsFunctionCall() || instr->IsFunctionReturn() ||
+         instr->IsSystemCall() || instr->IsSystemReturn() ||
+         instr->IsInterruptCall() || instr->IsInterruptReturn() ||
+         (instr->IsJump() && instr->HasIndirectTarget());
+}
+
+// Updates `live_regs` based on registers specifically marked by `instr`.
+static void VisitAnnotation(AnnotationInstruction *instr,
+                            LiveRegisterSet *live_regs) {
+  if (kAnnotSaveRegister == instr->annotation ||
+      kAnnotRestoreRegister == instr->annotation ||
+      kAnnotSwapRestoreRegister == instr->annotation) {
+    live_regs->Revive(instr->Data<VirtualRegister>());
+  } else if (kAnnotReviveRegisters == instr->annotation) {
+    live_regs->Union(instr->DataRef<UsedRegisterSet>());
+  }
+}
+
+// Find the native GPRs that are live on entry to `frag`. Returns `true` if
+// the set of live GPRs changed.
+static bool FindLiveGPRs(CodeFragment *frag) {
+  LiveRegisterSet live_regs;
+  auto has_succ = false;
+  for (auto succ : frag->successors) {
+    if (!succ) continue;
+    has_succ = true;
+    if (auto succ_cfrag = DynamicCast<CodeFragment *>(succ)) {
+      live_regs.Union(succ_cfrag->entry_live_gprs);
+    } else {
+      live_regs.ReviveAll();  // Leaves the trace, or the partition.
+    }
+  }
+  if (!has_succ) live_regs.ReviveAll();
+
+  for (auto instr : ReverseInstructionListIterator(frag->instrs)) {
+    if (auto ninstr = DynamicCast<NativeInstruction *>(instr)) {
+      if (MightReadAllGPRs(ninstr)) live_regs.ReviveAll();
+      live_regs.Visit(ninstr);
+    } else if (auto ainstr = DynamicCast<AnnotationInstruction *>(instr)) {
+      VisitAnnotation(ainstr, &live_regs);
+    }
+  }
+  return frag->entry_live_gprs.Union(live_regs);
+}
+
 }  // namespace
 
 // Free all fragments, their instructions, etc.
@@ -489,4 +541,22 @@ void FreeFragments(FragmentList *frags) {
   }
 }
 
+// Conservatively find the native GPRs that are live on entry to every code
+// fragment. All native GPRs are treated as live on exit from the trace.
+void FindLiveGPRs(FragmentList *frags) {
+  for (auto frag : FragmentListIterator(frags)) {
+    if (auto cfrag = DynamicCast<CodeFragment *>(frag)) {
+      cfrag->entry_live_gprs.KillAll();
+    }
+  }
+  for (auto changed = true; changed; ) {
+    changed = false;
+    for (auto frag : ReverseFragmentListIterator(frags)) {
+      if (auto cfrag = DynamicCast<CodeFragment *>(frag)) {
+        changed = FindLiveGPRs(cfrag) || changed;
+      }
+    }
+  }
+}
+
 }  // namespace granary
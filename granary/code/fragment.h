@@ -81,7 +81,8 @@ class PartitionInfo {
   explicit PartitionInfo(int id_);
 
   GRANARY_DECLARE_NEW_ALLOCATOR(PartitionInfo, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
   // The first fragment in this partition. This will either be a
@@ -175,7 +176,8 @@ class Fragment {
 
   GRANARY_DECLARE_BASE_CLASS(Fragment)
   GRANARY_DECLARE_NEW_ALLOCATOR(Fragment, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
   // Connects together fragments into a `FragmentList`.
@@ -195,6 +197,11 @@ class Fragment {
   size_t encoded_size;
   CachePC encoded_pc;
 
+  // The bytes of this fragment's native instructions, as they were stage
+  // encoded. These are re-used when the fragment is committed to the code
+  // cache. This is `nullptr` if no staged bytes were kept.
+  uint8_t *staged_bytes;
+
   // The meta-data associated with the basic block that this fragment
   // originates from.
   BlockMetaData *block_meta;
@@ -288,6 +295,10 @@ void Log(LogLevel level, FragmentList *frags);
 // Free all fragments, their instructions, etc.
 void FreeFragments(FragmentList *frags);
 
+// Conservatively find the native GPRs that are live on entry to every code
+// fragment. All native GPRs are treated as live on exit from the trace.
+void FindLiveGPRs(FragmentList *frags);
+
 // Attributes about a block of code.
 class alignas(alignof(void *)) CodeAttributes {
  public:
@@ -372,13 +383,26 @@ class CodeFragment : public Fragment {
   VRIdSet entry_regs;
   VRIdSet exit_regs;
 
+  // Set of native GPRs that are conservatively live on entry to this
+  // fragment. This is computed by `FindLiveGPRs`, and lets the flags saving
+  // and register scheduling passes avoid saving/restoring dead native GPRs.
+  LiveRegisterSet entry_live_gprs;
+
+  // Set of native GPRs that are used anywhere in this fragment, and set of
+  // native GPRs that are the preferred homes of VRs that are live in this
+  // fragment. These are maintained by register scheduling, so that choosing a
+  // preferred GPR for a VR doesn't need to re-scan the VR's live range.
+  UsedRegisterSet used_gprs;
+  UsedRegisterSet homed_gprs;
+
   // Number of times virtual registers are defined in this fragment. This
   // includes read/write operations that modify the value in-place.
   VRIdCountSet def_regs;
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Fragment, CodeFragment)
   GRANARY_DECLARE_NEW_ALLOCATOR(CodeFragment, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -393,7 +417,8 @@ class PartitionEntryFragment : public Fragment {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Fragment, PartitionEntryFragment)
   GRANARY_DECLARE_NEW_ALLOCATOR(PartitionEntryFragment, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -408,7 +433,8 @@ class PartitionExitFragment : public Fragment {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Fragment, PartitionExitFragment)
   GRANARY_DECLARE_NEW_ALLOCATOR(PartitionExitFragment, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -423,7 +449,8 @@ class FlagEntryFragment : public CodeFragment {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Fragment, FlagEntryFragment)
   GRANARY_DECLARE_NEW_ALLOCATOR(FlagEntryFragment, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -438,7 +465,8 @@ class FlagExitFragment : public CodeFragment {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Fragment, FlagExitFragment)
   GRANARY_DECLARE_NEW_ALLOCATOR(FlagExitFragment, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -453,7 +481,8 @@ class NonLocalEntryFragment : public Fragment {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Fragment, NonLocalEntryFragment)
   GRANARY_DECLARE_NEW_ALLOCATOR(NonLocalEntryFragment, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
  private:
@@ -476,7 +505,8 @@ class ExitFragment : public Fragment {
 
   GRANARY_DECLARE_DERIVED_CLASS_OF(Fragment, ExitFragment)
   GRANARY_DECLARE_NEW_ALLOCATOR(ExitFragment, {
-    kAlignment = 1
+    kAlignment = 1,
+    kUseTranslationArena = 1
   })
 
   // Pointer to one of the edge structures associated with this fragment.
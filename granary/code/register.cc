@@ -108,6 +108,13 @@ void UsedRegisterSet::Visit(const NativeInstruction *instr) {
   Visit(&(instr->instruction));
 }
 
+// Update this register tracker by marking all registers that are written by
+// an instruction as used. This includes registers that are implicitly or
+// conditionally written (e.g. `RDX:RAX` by `MUL`, or `RCX` by `REP MOVS`).
+void UsedRegisterSet::VisitWrites(const NativeInstruction *instr) {
+  VisitWrites(&(instr->instruction));
+}
+
 // Update this register tracker by marking some registers as used (i.e.
 // restricted). This allows us to communicate some architecture-specific
 // encoding constraints to the register scheduler.
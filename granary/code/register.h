@@ -493,6 +493,15 @@ class UsedRegisterSet : public RegisterSet {
   GRANARY_INTERNAL_DEFINITION
   void Visit(const arch::Operand *op);
 
+  // Update this register tracker by marking all registers that are written by
+  // an instruction as used. This includes registers that are implicitly or
+  // conditionally written (e.g. `RDX:RAX` by `MUL`, or `RCX` by `REP MOVS`).
+  void VisitWrites(const NativeInstruction *instr);
+
+  // Note: This function has an architecture-specific implementation.
+  GRANARY_INTERNAL_DEFINITION
+  void VisitWrites(const arch::Instruction *instr);
+
   // Update this register tracker by marking some registers as used (i.e.
   // restricted). This allows us to communicate some architecture-specific
   // encoding constraints to the register scheduler.
@@ -4,6 +4,7 @@
 
 #include "arch/base.h"
 #include "arch/context.h"
+#include "arch/cpu.h"
 
 #include "granary/base/container.h"
 #include "granary/base/option.h"
@@ -18,14 +19,60 @@
 #include "granary/breakpoint.h"
 #include "granary/cache.h"
 #include "granary/context.h"
+#include "granary/epoch.h"
 #include "granary/index.h"
 #include "granary/metadata.h"
 
+#include "os/logging.h"
+#include "os/memory.h"
 #include "os/module.h"
+#include "os/slot.h"
+#include "os/thread.h"
+
+GRANARY_DEFINE_bool(patch_direct_edges, true,
+    "Should Granary patch the branches that lead to translated direct edges "
+    "so that they jump directly to the edges' target blocks? Edges are "
+    "patched in batches (see `--patch_edges_batch_size`) when no other "
+    "threads are executing within Granary, and every thread is serialized "
+    "after each batch. Patching is skipped if the OS can't serialize all "
+    "threads. The default is `yes`.");
+
+GRANARY_DEFINE_positive_uint(patch_edges_batch_size, 64,
+    "The number of translated direct edges that are queued up before Granary "
+    "tries to patch them as a batch. Edges are only patched when Granary "
+    "reaches a safe point, i.e. when no other threads are executing within "
+    "Granary. The default value is `64`.");
+
+GRANARY_DEFINE_bool(debug_log_indirect_edge_stats, false,
+    "Log how often the targets of each indirect control-flow instruction were "
+    "found in its indirect branch target cache when Granary exits. The "
+    "default is `no`.");
+
+GRANARY_DECLARE_bool(transparent_returns);
+
+extern "C" {
+
+// Offset of the `os::ShadowStack` from the base of the thread's segment.
+//
+// Note: This is defined in `arch/*/asm/edge.asm`.
+extern uintptr_t granary_shadow_stack_offset;
+
+}  // extern C
 
 namespace granary {
 namespace arch {
 
+// Patch a direct edge.
+//
+// Note: This function has an architecture-specific implementation.
+extern bool TryAtomicPatchEdge(DirectEdge *edge);
+
+// Un-patch a direct edge, so that the patched branch once again targets the
+// edge's stub code.
+//
+// Note: This function has an architecture-specific implementation.
+extern bool TryAtomicUnpatchEdge(DirectEdge *edge);
+
 // Generates the wrapper code for a context callback.
 //
 // Note: This has an architecture-specific implementation.
@@ -66,24 +113,288 @@ static void FreeCallbacks(const T &callback_map) {
   }
 }
 
+// Maps the code cache addresses of a list of blocks to their meta-data.
+class CachedBlockMap {
+ public:
+  explicit CachedBlockMap(const BlockMetaData *metas)
+      : num_blocks(0),
+        num_pages(0),
+        blocks(nullptr) {
+    for (auto meta : IndexMetaDataIterator(metas)) {
+      if (MetaDataCast<CacheMetaData *>(meta)->start_pc) ++num_blocks;
+    }
+    if (!num_blocks) return;
+
+    num_pages = GRANARY_ALIGN_TO(num_blocks * sizeof(Block),
+                                 arch::PAGE_SIZE_BYTES) /
+                arch::PAGE_SIZE_BYTES;
+    blocks = reinterpret_cast<Block *>(os::AllocateDataPages(num_pages));
+
+    auto i = 0UL;
+    for (auto meta : IndexMetaDataIterator(metas)) {
+      if (auto start_pc = MetaDataCast<CacheMetaData *>(meta)->start_pc) {
+        blocks[i++] = {start_pc, meta};
+      }
+    }
+    std::sort(blocks, blocks + num_blocks);
+  }
+
+  ~CachedBlockMap(void) {
+    if (blocks) os::FreeDataPages(blocks, num_pages);
+  }
+
+  // Find the meta-data of the block that begins at `start_pc`.
+  const BlockMetaData *Find(CachePC start_pc) const {
+    const Block key = {start_pc, nullptr};
+    auto block = std::lower_bound(blocks, blocks + num_blocks, key);
+    if (block == blocks + num_blocks || block->start_pc != start_pc) {
+      return nullptr;
+    }
+    return block->meta;
+  }
+
+ private:
+  struct Block {
+    CachePC start_pc;
+    const BlockMetaData *meta;
+
+    inline bool operator<(const Block &that) const {
+      return start_pc < that.start_pc;
+    }
+  };
+
+  size_t num_blocks;
+  size_t num_pages;
+  Block *blocks;
+
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(CachedBlockMap);
+};
+
+// Re-route a translated direct edge whose target block is in `blocks` back
+// through Granary, so that the next time the edge is taken, a new translation
+// of the target block is used. Returns `false` if the edge doesn't target any
+// block in `blocks`.
+//
+// Note: The edge must not be a member of an un/patched edge list, as this
+//       overwrites `DirectEdge::dest_block_meta`. Profiled edges keep their
+//       own copy of the target block's meta-data.
+static bool RerouteDirectEdge(const CachedBlockMap &blocks, DirectEdge *edge) {
+  if (edge->entry_target_pc == edge->enter_granary_pc) return false;
+  auto dest_meta = blocks.Find(edge->entry_target_pc);
+  if (!dest_meta) return false;
+  if (!edge->is_profiled) edge->dest_block_meta = dest_meta->Copy();
+  edge->entry_target_pc = edge->enter_granary_pc;
+  if (edge->patch_instruction_pc) arch::TryAtomicUnpatchEdge(edge);
+  return true;
+}
+
+// Unlink a retired direct edge so that the next time it's taken, control
+// enters Granary and a new translation of the target block is used. If the
+// edge's target can't be recovered then the edge is left as-is, and will
+// continue to go to the retired block.
+static void UnlinkDirectEdge(const CachedBlockMap &blocks, DirectEdge *edge) {
+  edge->is_retired = true;
+  if (edge->entry_target_pc != edge->enter_granary_pc &&
+      !RerouteDirectEdge(blocks, edge) && !edge->is_profiled) {
+    edge->dest_block_meta = nullptr;  // Might have been a list link.
+  }
+}
+
+// Re-route an indirect edge back through Granary, so that the next time the
+// edge is taken, a new translation of the target block is used.
+static void RerouteIndirectEdge(IndirectEdge *edge) {
+  for (auto target_pc : edge->out_edges.Keys()) {
+    edge->out_edges.Remove(target_pc);
+  }
+  edge->out_edge_pc = edge->enter_granary_pc;
+  ResetIndirectEdgeCache(edge);
+}
+
+// Unlink a retired indirect edge so that the next time it's taken, control
+// enters Granary and a new translation of the target block is used.
+static void UnlinkIndirectEdge(IndirectEdge *edge) {
+  os::LockedRegion locker(&(edge->lock));
+  edge->is_retired = true;
+  RerouteIndirectEdge(edge);
+}
+
+// Returns true if an indirect edge has been resolved to any targets in the
+// range `[begin_pc, end_pc)`.
+static bool IndirectEdgeTargetsRange(const IndirectEdge *edge, AppPC begin_pc,
+                                     AppPC end_pc) {
+  for (auto target_pc : edge->out_edges.Keys()) {
+    if (begin_pc <= target_pc && target_pc < end_pc) return true;
+  }
+  return false;
+}
+
 }  // namespace
 
+// Code, edges, and meta-data that were flushed from the code cache.
+class RetiredCode {
+ public:
+  RetiredCode(void)
+      : next(nullptr),
+        epoch(0),
+        is_pinned(false),
+        slabs(nullptr),
+        metas(nullptr),
+        direct_edges(nullptr),
+        indirect_edges(nullptr),
+        return_sites(nullptr) {}
+
+  ~RetiredCode(void) {
+    FreeEdgeList(direct_edges);
+    FreeEdgeList(indirect_edges);
+    FreeEdgeList(return_sites);
+    for (const BlockMetaData *next_meta(nullptr); metas; metas = next_meta) {
+      next_meta = MetaDataCast<const IndexMetaData *>(metas)->next;
+      delete metas;
+    }
+    FreeCodeCacheSlabs(slabs);
+  }
+
+  RetiredCode *next;
+
+  // The epoch in which this code was retired.
+  uint64_t epoch;
+
+  // Whether or not code cache addresses of the retired code escaped to the
+  // application. Pinned code is never reclaimed.
+  bool is_pinned;
+
+  const CodeSlab *slabs;
+  const BlockMetaData *metas;
+  DirectEdge *direct_edges;
+  IndirectEdge *indirect_edges;
+
+  // Return sites pushed by the retired code. Threads clear their shadow
+  // stacks when they observe a new epoch, so once every thread has observed
+  // `epoch`, no shadow stack can refer to these.
+  ReturnSite *return_sites;
+
+  GRANARY_DEFINE_NEW_ALLOCATOR(RetiredCode, {
+    kAlignment = 1
+  })
+
+ private:
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(RetiredCode);
+};
+
+// A translated hot trace.
+class HotTrace {
+ public:
+  HotTrace(const BlockMetaData *meta_, CachePC cache_pc_, HotTrace *next_)
+      : next(next_),
+        meta(meta_->Copy()),
+        cache_pc(cache_pc_) {}
+
+  ~HotTrace(void) {
+    delete meta;
+  }
+
+  HotTrace *next;
+
+  // Meta-data of the head block of the trace.
+  const BlockMetaData * const meta;
+
+  // Where the head block of the trace was encoded.
+  const CachePC cache_pc;
+
+  GRANARY_DEFINE_NEW_ALLOCATOR(HotTrace, {
+    kAlignment = 1
+  })
+
+ private:
+  HotTrace(void) = delete;
+
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(HotTrace);
+};
+
+// A profiled direct edge, chained together with the other profiled edges
+// whose targets hash to the same bucket. Profiled edges stay in their buckets
+// after they become hot (their execution counts saturate at the hot trace
+// threshold), and are only removed by code cache flushes, so the buckets can be
+// read without holding `edge_list_lock`.
+class ProfiledEdge {
+ public:
+  ProfiledEdge(AppPC target_pc_, const DirectEdge *edge_, ProfiledEdge *next_)
+      : next(next_),
+        target_pc(target_pc_),
+        edge(edge_) {}
+
+  // Next profiled edge in the same bucket. This is set before the profiled
+  // edge is published to its bucket, and never changes afterward.
+  ProfiledEdge * const next;
+
+  // Application PC of the block targeted by `edge`.
+  const AppPC target_pc;
+
+  const DirectEdge * const edge;
+
+  GRANARY_DEFINE_NEW_ALLOCATOR(ProfiledEdge, {
+    kAlignment = 1
+  })
+
+ private:
+  ProfiledEdge(void) = delete;
+
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(ProfiledEdge);
+};
+
+// Log the hit rates of the indirect branch target caches of a list of
+// indirect edges.
+static void LogIndirectEdgeStatistics(const IndirectEdge *edge) {
+  for (; edge; edge = edge->next) {
+    auto num_hits = edge->cache.load()->num_hits;
+    for (auto cache = edge->retired_caches; cache; cache = cache->next) {
+      num_hits += cache->num_hits;
+    }
+    if (!num_hits && !edge->num_misses) continue;
+    auto source = MetaDataCast<const AppMetaData *>(edge->source_block_meta);
+    os::Log(os::LogOutput,
+            "Indirect edge in block %p: %lu targets, %lu hits, %lu misses "
+            "(%lu%% hit rate)\n",
+            source->start_pc, edge->out_edges.Size(), num_hits,
+            edge->num_misses, (num_hits * 100) / (num_hits + edge->num_misses));
+  }
+}
+
 Context::Context(void)
     : edge_list_lock(),
       edge_list(nullptr),
       unpatched_edge_list(nullptr),
       patched_edge_list(nullptr),
+      num_unpatched_edges(ATOMIC_VAR_INIT(0)),
+      num_patched_edges(ATOMIC_VAR_INIT(0)),
       indirect_edge_list_lock(),
       indirect_edge_list(nullptr),
+      return_site_list_lock(),
+      return_site_list(nullptr),
+      hot_trace_list_lock(),
+      hot_trace_list(nullptr),
+      profiled_edges(),
+      retired_code(ATOMIC_VAR_INIT(nullptr)),
+      code_cache_is_pinned(ATOMIC_VAR_INIT(false)),
       context_callbacks_lock(),
       context_callbacks(),
       inline_callbacks_lock(),
-      inline_callbacks() {}
+      inline_callbacks() {
+  GRANARY_IF_USER( granary_shadow_stack_offset =
+                       os::Slot(os::SLOT_SHADOW_STACK); )
+}
 
 Context::~Context(void) {
+  if (FLAG_debug_log_indirect_edge_stats) {
+    LogIndirectEdgeStatistics(indirect_edge_list);
+  }
   UnlinkEdgeList(unpatched_edge_list);
   UnlinkEdgeList(patched_edge_list);
   FreeEdgeList(edge_list);
+  FreeEdgeList(return_site_list);
+  FreeEdgeList(hot_trace_list);
+  FreeProfiledEdges();
+  ReclaimRetiredCode(std::numeric_limits<uint64_t>::max());
   FreeCallbacks(context_callbacks);
   FreeCallbacks(inline_callbacks);
 }
@@ -94,14 +405,370 @@ DirectEdge *Context::AllocateDirectEdge(BlockMetaData *dest_block_meta) {
   SpinLockedRegion locker(&edge_list_lock);
   auto edge = new DirectEdge(dest_block_meta, edge_list);
   edge_list = edge;
+  if (edge->is_profiled) {
+    auto app_meta = MetaDataCast<const AppMetaData *>(dest_block_meta);
+    auto bucket = ProfiledEdgeBucket(app_meta->start_pc);
+    auto profiled_edge = new ProfiledEdge(
+        app_meta->start_pc, edge, bucket->load(std::memory_order_relaxed));
+    bucket->store(profiled_edge, std::memory_order_release);
+  }
   return edge;
 }
 
-// Prepare a direct edge for patching.
+// Prepare a direct edge for patching. Edges are only queued if they can be
+// patched at all.
 void Context::PreparePatchDirectEdge(DirectEdge *edge) {
+  if (!FLAG_patch_direct_edges || !edge->patch_instruction_pc) return;
+  if (!os::CanSynchronizeAllThreads()) return;
   SpinLockedRegion locker(&edge_list_lock);
   edge->next_patchable = unpatched_edge_list;
   unpatched_edge_list = edge;
+  num_unpatched_edges.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Remove `edge` from the queue of edges waiting to be patched, if it's
+// queued.
+//
+// Note: This must be invoked in the context of the edge's `lock`.
+void Context::RemoveUnpatchedDirectEdge(DirectEdge *edge) {
+  SpinLockedRegion locker(&edge_list_lock);
+  for (auto next_ptr = &unpatched_edge_list; *next_ptr;
+       next_ptr = &((*next_ptr)->next_patchable)) {
+    if (edge == *next_ptr) {
+      *next_ptr = edge->next_patchable;
+      edge->next_patchable = nullptr;
+      num_unpatched_edges.fetch_sub(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+// Returns true if enough direct edges are queued for patching that it's
+// worth trying to patch them as a batch.
+bool Context::ShouldPatchDirectEdges(void) const {
+  return num_unpatched_edges.load(std::memory_order_relaxed) >=
+         FLAG_patch_edges_batch_size;
+}
+
+// Patch all queued direct edges, and move the patched edges onto the list
+// of patched edges. Returns the number of edges that were patched.
+//
+// Other threads might be executing the patched branches. Each patch is a
+// single atomic store to a branch that doesn't cross a cache line, and only
+// changes the branch's displacement, so other threads execute either the old
+// branch (which goes through `DirectEdge::entry_target_pc`) or the new one.
+// All threads are then serialized, so that none of them keeps executing
+// stale instructions.
+//
+// Note: This must only be invoked at a safe point, i.e. when no other thread
+//       is executing within Granary.
+size_t Context::PatchDirectEdges(void) {
+  DirectEdge *edge(nullptr);
+  do {
+    SpinLockedRegion locker(&edge_list_lock);
+    edge = unpatched_edge_list;
+    unpatched_edge_list = nullptr;
+    num_unpatched_edges.store(0, std::memory_order_relaxed);
+  } while (false);
+
+  DirectEdge *first_patched(nullptr);
+  DirectEdge *last_patched(nullptr);
+  auto num_patched = 0UL;
+
+  // Edges that can't be patched are dropped from the queue and never retried,
+  // as the reasons for not patching an edge (e.g. its branch crosses a cache
+  // line) don't change. They remain owned by `edge_list`, and continue to
+  // work by way of the indirect jump through `DirectEdge::entry_target_pc`.
+  for (DirectEdge *next_edge(nullptr); edge; edge = next_edge) {
+    next_edge = edge->next_patchable;
+    edge->next_patchable = nullptr;
+    if (!arch::TryAtomicPatchEdge(edge)) continue;
+    edge->next_patched = first_patched;
+    first_patched = edge;
+    if (!last_patched) last_patched = edge;
+    ++num_patched;
+  }
+
+  if (!num_patched) return 0;
+
+  // Make sure that the patches are visible to every thread's instruction
+  // stream before we leave the safe point.
+  arch::SynchronizePipeline();
+  os::SynchronizeAllThreads();
+
+  SpinLockedRegion locker(&edge_list_lock);
+  last_patched->next_patched = patched_edge_list;
+  patched_edge_list = first_patched;
+  num_patched_edges.fetch_add(num_patched, std::memory_order_relaxed);
+  return num_patched;
+}
+
+// Stop profiling the direct edge `edge`, and return the meta-data of the
+// block targeted by `edge`. The caller takes ownership of the meta-data.
+//
+// Note: The edge remains in `profiled_edges`, where its execution count stays
+//       saturated at the hot trace threshold, so that hot edges continue to
+//       steer the formation of later hot traces.
+//
+// Note: This must be invoked in the context of the edge's `lock`.
+BlockMetaData *Context::StopProfilingDirectEdge(DirectEdge *edge) {
+  auto meta = edge->dest_block_meta;
+  edge->dest_block_meta = nullptr;
+  edge->is_profiled = false;
+  return meta;
+}
+
+// Returns the number of times that profiled direct edges targeting the
+// block at `target_pc` have been taken. The counts of hot edges saturate at
+// the hot trace threshold.
+//
+// Note: This doesn't acquire `edge_list_lock`. Profiled edges are only added
+//       to the front of their buckets, and are only removed by code cache
+//       flushes, which can't happen concurrently with translation. The counts
+//       themselves are updated without synchronization, and so are
+//       approximate.
+size_t Context::NumDirectEdgeExecutions(AppPC target_pc) {
+  size_t num_executions(0);
+  auto bucket = ProfiledEdgeBucket(target_pc);
+  for (auto profiled_edge = bucket->load(std::memory_order_acquire);
+       profiled_edge; profiled_edge = profiled_edge->next) {
+    if (profiled_edge->target_pc == target_pc) {
+      num_executions += NumProfiledExecutions(profiled_edge->edge);
+    }
+  }
+  return num_executions;
+}
+
+// Returns the bucket of `profiled_edges` for edges that target the block at
+// `target_pc`.
+std::atomic<ProfiledEdge *> *Context::ProfiledEdgeBucket(AppPC target_pc) {
+  const auto hash = reinterpret_cast<uintptr_t>(target_pc) *
+                    0x9E3779B97F4A7C15ULL;
+  return &(profiled_edges[hash >> (64 - kNumBitsProfiledEdgeBucket)]);
+}
+
+// Remove and free all profiled edges in `profiled_edges`.
+//
+// Note: This must be invoked in the context of `edge_list_lock`, and when no
+//       other thread can be reading `profiled_edges`, e.g. at a safe point.
+void Context::FreeProfiledEdges(void) {
+  for (auto &bucket : profiled_edges) {
+    FreeEdgeList(bucket.exchange(nullptr, std::memory_order_relaxed));
+  }
+}
+
+// Returns the code cache address of a hot trace whose head block can be
+// used in place of the block described by `meta`, or `nullptr` if no such
+// trace has been translated.
+CachePC Context::FindHotTrace(const BlockMetaData *meta) {
+  SpinLockedRegion locker(&hot_trace_list_lock);
+  for (auto trace = hot_trace_list; trace; trace = trace->next) {
+    if (meta->Equals(trace->meta) &&
+        kUnificationStatusAccept == meta->CanUnifyWith(trace->meta)) {
+      return trace->cache_pc;
+    }
+  }
+  return nullptr;
+}
+
+// Record that a hot trace, whose head block is described by `meta`, has
+// been translated to `cache_pc`.
+void Context::AddHotTrace(const BlockMetaData *meta, CachePC cache_pc) {
+  SpinLockedRegion locker(&hot_trace_list_lock);
+  hot_trace_list = new HotTrace(meta, cache_pc, hot_trace_list);
+}
+
+// Returns the number of direct edges that are waiting to be patched.
+size_t Context::NumUnpatchedDirectEdges(void) const {
+  return num_unpatched_edges.load(std::memory_order_relaxed);
+}
+
+// Returns the number of direct edges that have been patched.
+size_t Context::NumPatchedDirectEdges(void) const {
+  return num_patched_edges.load(std::memory_order_relaxed);
+}
+
+// Flush the code cache. All code, edges, and meta-data that make up the
+// current contents of the code cache are retired in epoch `epoch`, and the
+// edges of the retired code are unlinked so that threads executing retired
+// code will migrate to new code the next time they take an edge.
+//
+// Note: This must only be invoked at a safe point, i.e. when no other thread
+//       is executing within Granary.
+void Context::FlushCodeCache(uint64_t epoch) {
+  auto code = new RetiredCode;
+  code->epoch = epoch;
+  code->is_pinned = code_cache_is_pinned.exchange(false);
+  code->metas = RemoveAllMetaDataFromIndex();
+  code->slabs = RetireCodeCache();
+
+  do {
+    SpinLockedRegion locker(&edge_list_lock);
+    code->direct_edges = edge_list;
+    FreeProfiledEdges();
+    edge_list = nullptr;
+    unpatched_edge_list = nullptr;
+    patched_edge_list = nullptr;
+    num_unpatched_edges.store(0, std::memory_order_relaxed);
+    num_patched_edges.store(0, std::memory_order_relaxed);
+  } while (false);
+
+  do {
+    SpinLockedRegion locker(&indirect_edge_list_lock);
+    code->indirect_edges = indirect_edge_list;
+    indirect_edge_list = nullptr;
+  } while (false);
+
+  CachedBlockMap blocks(code->metas);
+  for (auto edge = code->direct_edges; edge; edge = edge->next) {
+    UnlinkDirectEdge(blocks, edge);
+  }
+  for (auto edge = code->indirect_edges; edge; edge = edge->next) {
+    UnlinkIndirectEdge(edge);
+  }
+  code->return_sites = RemoveAllReturnSites();
+  ResetHotTraces();
+
+  // Un-patched edges might be executing in other threads.
+  arch::SynchronizePipeline();
+  os::SynchronizeAllThreads();
+
+  RetireCode(code);
+}
+
+// Invalidate all translated blocks whose application code is in the range
+// `[begin_pc, end_pc)`. The blocks are removed from the code cache index,
+// edges targeting the blocks are re-routed through Granary, and the blocks'
+// meta-data is retired. Returns `true` if any blocks were invalidated.
+//
+// Note: The code of the invalidated blocks remains in the code cache until
+//       the next code cache flush.
+//
+// Note: This doesn't wait for a safe point. Other threads can be executing
+//       within Granary or in the invalidated blocks; the invalidated blocks'
+//       meta-data is reclaimed once every thread has observed the epoch in
+//       which it was retired. A translation of the range that is already in
+//       progress can still index a stale block, but then the application
+//       itself is racing with its unmapping of the range.
+bool Context::InvalidateCode(AppPC begin_pc, AppPC end_pc) {
+  auto metas = RemoveMetaDataFromIndex(begin_pc, end_pc);
+  if (!metas) return false;
+
+  // Edges queued for patching aren't patched here, as patching is only safe
+  // at a safe point. Queued edges that target invalidated blocks are instead
+  // taken off the queue while re-routing them below.
+  CachedBlockMap blocks(metas);
+  DirectEdge *edges(nullptr);
+  do {
+    SpinLockedRegion locker(&edge_list_lock);
+    DirectEdge *patched_edges(nullptr);
+    DirectEdge *next_edge(nullptr);
+    auto num_patched = 0UL;
+    for (auto edge = patched_edge_list; edge; edge = next_edge) {
+      next_edge = edge->next_patched;
+      if (blocks.Find(edge->entry_target_pc)) {
+        edge->next_patched = nullptr;
+      } else {
+        edge->next_patched = patched_edges;
+        patched_edges = edge;
+        ++num_patched;
+      }
+    }
+    patched_edge_list = patched_edges;
+    num_patched_edges.store(num_patched, std::memory_order_relaxed);
+    edges = edge_list;
+  } while (false);
+
+  // Edges are only removed from `edge_list` by code cache flushes, which
+  // can't happen concurrently with this, so the list can be walked without
+  // holding `edge_list_lock`. Each edge is locked so that this doesn't race
+  // with a thread that is translating the edge's target, which might queue
+  // the edge for patching.
+  for (auto edge = edges; edge; edge = edge->next) {
+    os::LockedRegion edge_locker(&(edge->lock));
+    if (!blocks.Find(edge->entry_target_pc)) continue;
+    RemoveUnpatchedDirectEdge(edge);
+    RerouteDirectEdge(blocks, edge);
+  }
+
+  // Same as above: indirect edges are only removed by code cache flushes, and
+  // the list lock isn't held while locking an edge, as threads translating
+  // an indirect edge's target hold the edge's lock while allocating new
+  // indirect edges.
+  IndirectEdge *indirect_edges(nullptr);
+  do {
+    SpinLockedRegion locker(&indirect_edge_list_lock);
+    indirect_edges = indirect_edge_list;
+  } while (false);
+  for (auto edge = indirect_edges; edge; edge = edge->next) {
+    os::LockedRegion edge_locker(&(edge->lock));
+    if (IndirectEdgeTargetsRange(edge, begin_pc, end_pc)) {
+      RerouteIndirectEdge(edge);
+    }
+  }
+
+  ResetReturnSites();
+  ResetHotTraces();
+
+  // Un-patched edges might be executing in other threads.
+  arch::SynchronizePipeline();
+  os::SynchronizeAllThreads();
+
+  // The invalidated blocks' instrumentation might refer to their meta-data,
+  // so the meta-data is only reclaimed once no thread can be executing the
+  // invalidated blocks.
+  auto code = new RetiredCode;
+  code->epoch = AdvanceEpoch();
+  code->metas = metas;
+  RetireCode(code);
+  return true;
+}
+
+// Add `code` to the list of retired code. This can be invoked concurrently
+// by several threads invalidating code.
+void Context::RetireCode(RetiredCode *code) {
+  code->next = retired_code.load();
+  while (!retired_code.compare_exchange_weak(code->next, code)) {}
+}
+
+// Returns true if there is retired code that has not been reclaimed.
+bool Context::HasRetiredCode(void) const {
+  return nullptr != retired_code.load(std::memory_order_relaxed);
+}
+
+// Reclaim retired code that can no longer be executed by any thread, i.e.
+// code that was retired in an epoch `<= epoch`.
+//
+// Note: Without transparent returns, the application's stack can contain
+//       return addresses into retired code, and so we can only reclaim retired
+//       code on exit.
+//
+// Note: This must only be invoked at a safe point, i.e. when no other thread
+//       is executing within Granary.
+void Context::ReclaimRetiredCode(uint64_t epoch) {
+  const auto is_exiting = std::numeric_limits<uint64_t>::max() == epoch;
+  if (!FLAG_transparent_returns && !is_exiting) return;
+
+  // Code is only retired by threads holding `gExitGranaryLock` (at least)
+  // for reading, so nothing new can be retired while this runs.
+  auto codes = retired_code.load();
+  for (auto next_ptr = &codes; *next_ptr; ) {
+    auto code = *next_ptr;
+    if (code->epoch <= epoch && (!code->is_pinned || is_exiting)) {
+      *next_ptr = code->next;
+      delete code;
+    } else {
+      next_ptr = &(code->next);
+    }
+  }
+  retired_code.store(codes);
+}
+
+// Pin the current contents of the code cache, so that if they are ever
+// flushed, they are never reclaimed. This is used when code cache addresses
+// escape to the application, e.g. with entrypoints.
+void Context::PinCodeCache(void) {
+  code_cache_is_pinned.store(true, std::memory_order_relaxed);
 }
 
 // Allocates an indirect edge data structure.
@@ -115,6 +782,74 @@ IndirectEdge *Context::AllocateIndirectEdge(
   return edge;
 }
 
+// Allocates a return site for a function call whose native return address
+// is `native_pc`.
+ReturnSite *Context::AllocateReturnSite(AppPC native_pc) {
+  SpinLockedRegion locker(&return_site_list_lock);
+  auto site = new ReturnSite(native_pc, return_site_list);
+  return_site_list = site;
+  return site;
+}
+
+// Returns the number of return sites of the current contents of the code
+// cache.
+size_t Context::NumReturnSites(void) {
+  SpinLockedRegion locker(&return_site_list_lock);
+  auto num_sites = 0UL;
+  for (auto site = return_site_list; site; site = site->next) ++num_sites;
+  return num_sites;
+}
+
+// Returns the number of return sites of the current contents of the code
+// cache whose code cache addresses are known.
+size_t Context::NumResolvedReturnSites(void) {
+  SpinLockedRegion locker(&return_site_list_lock);
+  auto num_sites = 0UL;
+  for (auto site = return_site_list; site; site = site->next) {
+    if (site->cache_pc.load(std::memory_order_relaxed)) ++num_sites;
+  }
+  return num_sites;
+}
+
+// Forget the code cache addresses of all return sites, so that returns to
+// them go back through indirect edges.
+//
+// Note: Return sites are kept around, as the code that pushes them might
+//       still be live.
+void Context::ResetReturnSites(void) {
+  SpinLockedRegion locker(&return_site_list_lock);
+  for (auto site = return_site_list; site; site = site->next) {
+    site->cache_pc.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+// Remove all return sites, and return them as a linked list. The removed
+// return sites are retired along with the code that pushes them.
+//
+// Note: Retired return sites might still be on the shadow stacks of some
+//       threads, so their code cache addresses are forgotten.
+ReturnSite *Context::RemoveAllReturnSites(void) {
+  SpinLockedRegion locker(&return_site_list_lock);
+  auto sites = return_site_list;
+  return_site_list = nullptr;
+  for (auto site = sites; site; site = site->next) {
+    site->cache_pc.store(nullptr, std::memory_order_relaxed);
+  }
+  return sites;
+}
+
+// Forget all translated hot traces, e.g. because their code has been
+// retired.
+void Context::ResetHotTraces(void) {
+  HotTrace *traces(nullptr);
+  do {
+    SpinLockedRegion locker(&hot_trace_list_lock);
+    traces = hot_trace_list;
+    hot_trace_list = nullptr;
+  } while (false);
+  FreeEdgeList(traces);
+}
+
 // Returns a pointer to the `CachePC` associated with the context-callable
 // function at `func_addr`.
 const arch::Callback *Context::ContextCallback(AppPC func_pc) {
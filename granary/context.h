@@ -27,10 +27,14 @@ class CodeCache;
 class CompensationBlock;
 class DecodedBlock;
 class DirectEdge;
+class HotTrace;
 class IndirectEdge;
 class Instruction;
 class MetaDataDescription;
 class InlineFunctionCall;
+class ProfiledEdge;
+class RetiredCode;
+class ReturnSite;
 
 namespace arch {
 class Callback;
@@ -48,13 +52,99 @@ class Context {
   // back the direct edge.
   DirectEdge *AllocateDirectEdge(BlockMetaData *dest_block_meta);
 
-  // Prepare a direct edge for patching.
+  // Prepare a direct edge for patching. Edges are only queued if they can be
+  // patched at all.
   void PreparePatchDirectEdge(DirectEdge *edge);
 
+  // Returns true if enough direct edges are queued for patching that it's
+  // worth trying to patch them as a batch.
+  bool ShouldPatchDirectEdges(void) const;
+
+  // Patch all queued direct edges, and move the patched edges onto the list
+  // of patched edges. Returns the number of edges that were patched.
+  //
+  // Note: This must only be invoked at a safe point, i.e. when no other thread
+  //       is executing within Granary. Other threads might be executing in the
+  //       code cache; they are serialized after the edges are patched.
+  size_t PatchDirectEdges(void);
+
+  // Stop profiling the direct edge `edge`, and return the meta-data of the
+  // block targeted by `edge`. The caller takes ownership of the meta-data.
+  //
+  // Note: This must be invoked in the context of the edge's `lock`.
+  BlockMetaData *StopProfilingDirectEdge(DirectEdge *edge);
+
+  // Returns the number of times that profiled direct edges targeting the
+  // block at `target_pc` have been taken. The counts of hot edges saturate at
+  // the hot trace threshold.
+  //
+  // Note: This doesn't acquire any locks, and so is cheap to invoke once per
+  //       successor while forming hot traces.
+  size_t NumDirectEdgeExecutions(AppPC target_pc);
+
+  // Returns the code cache address of a hot trace whose head block can be
+  // used in place of the block described by `meta`, or `nullptr` if no such
+  // trace has been translated.
+  CachePC FindHotTrace(const BlockMetaData *meta);
+
+  // Record that a hot trace, whose head block is described by `meta`, has
+  // been translated to `cache_pc`.
+  void AddHotTrace(const BlockMetaData *meta, CachePC cache_pc);
+
+  // Returns the number of direct edges that are waiting to be patched.
+  size_t NumUnpatchedDirectEdges(void) const;
+
+  // Returns the number of direct edges that have been patched.
+  size_t NumPatchedDirectEdges(void) const;
+
+  // Flush the code cache. All code, edges, and meta-data that make up the
+  // current contents of the code cache are retired in epoch `epoch`, and the
+  // edges of the retired code are unlinked so that threads executing retired
+  // code will migrate to new code the next time they take an edge.
+  //
+  // Note: This must only be invoked at a safe point, i.e. when no other thread
+  //       is executing within Granary.
+  void FlushCodeCache(uint64_t epoch);
+
+  // Invalidate all translated blocks whose application code is in the range
+  // `[begin_pc, end_pc)`. The blocks are removed from the code cache index,
+  // edges targeting the blocks are re-routed through Granary, and the blocks'
+  // meta-data is retired. Returns `true` if any blocks were invalidated.
+  //
+  // Note: This doesn't wait for a safe point. Other threads can be executing
+  //       within Granary or in the invalidated blocks; the invalidated blocks'
+  //       meta-data is reclaimed once every thread has observed the epoch in
+  //       which it was retired.
+  bool InvalidateCode(AppPC begin_pc, AppPC end_pc);
+
+  // Returns true if there is retired code that has not been reclaimed.
+  bool HasRetiredCode(void) const;
+
+  // Reclaim retired code that can no longer be executed by any thread, i.e.
+  // code that was retired in an epoch `<= epoch`.
+  //
+  // Note: This must only be invoked at a safe point, i.e. when no other thread
+  //       is executing within Granary.
+  void ReclaimRetiredCode(uint64_t epoch);
+
+  // Pin the current contents of the code cache, so that if they are ever
+  // flushed, they are never reclaimed. This is used when code cache addresses
+  // escape to the application, e.g. with entrypoints.
+  void PinCodeCache(void);
+
   // Allocates an indirect edge data structure.
   IndirectEdge *AllocateIndirectEdge(const BlockMetaData *source_block_meta,
                                      const BlockMetaData *dest_block_meta);
 
+  // Allocates a return site for a function call whose native return address
+  // is `native_pc`.
+  ReturnSite *AllocateReturnSite(AppPC native_pc);
+
+  // Returns the number of return sites of the current contents of the code
+  // cache, and the number of those whose code cache addresses are known.
+  size_t NumReturnSites(void);
+  size_t NumResolvedReturnSites(void);
+
   // Returns a pointer to the `arch::MachineContextCallback` associated with
   // the context-callable function at `func_addr`.
   const arch::Callback *ContextCallback(AppPC func_pc);
@@ -72,10 +162,71 @@ class Context {
   DirectEdge *unpatched_edge_list;
   DirectEdge *patched_edge_list;
 
+  // Counters for the number of edges in each of the above lists.
+  std::atomic<size_t> num_unpatched_edges;
+  std::atomic<size_t> num_patched_edges;
+
   // List of indirect edges.
   SpinLock indirect_edge_list_lock;
   IndirectEdge *indirect_edge_list;
 
+  // List of return sites.
+  SpinLock return_site_list_lock;
+  ReturnSite *return_site_list;
+
+  // List of translated hot traces.
+  SpinLock hot_trace_list_lock;
+  HotTrace *hot_trace_list;
+
+  enum : size_t {
+    kNumBitsProfiledEdgeBucket = 10,
+    kNumProfiledEdgeBuckets = 1UL << kNumBitsProfiledEdgeBucket
+  };
+
+  // Profiled direct edges, hashed by the application PCs of their targets.
+  // Edges are added in the context of `edge_list_lock`, but the buckets can
+  // be read without it.
+  std::atomic<ProfiledEdge *> profiled_edges[kNumProfiledEdgeBuckets];
+
+  // Code, edges, and meta-data that have been retired by code cache flushes
+  // and invalidations, ordered from newest to oldest.
+  std::atomic<RetiredCode *> retired_code;
+
+  // Whether or not the code cache addresses of some of the current contents
+  // of the code cache have escaped to the application.
+  std::atomic<bool> code_cache_is_pinned;
+
+  // Remove `edge` from the queue of edges waiting to be patched, if it's
+  // queued.
+  //
+  // Note: This must be invoked in the context of the edge's `lock`.
+  void RemoveUnpatchedDirectEdge(DirectEdge *edge);
+
+  // Add `code` to the list of retired code. This can be invoked concurrently
+  // by several threads invalidating code.
+  void RetireCode(RetiredCode *code);
+
+  // Forget the code cache addresses of all return sites, so that returns to
+  // them go back through indirect edges.
+  void ResetReturnSites(void);
+
+  // Remove all return sites, and return them as a linked list.
+  ReturnSite *RemoveAllReturnSites(void);
+
+  // Forget all translated hot traces, e.g. because their code has been
+  // retired.
+  void ResetHotTraces(void);
+
+  // Returns the bucket of `profiled_edges` for edges that target the block at
+  // `target_pc`.
+  std::atomic<ProfiledEdge *> *ProfiledEdgeBucket(AppPC target_pc);
+
+  // Remove and free all profiled edges in `profiled_edges`.
+  //
+  // Note: This must be invoked in the context of `edge_list_lock`, and when no
+  //       other thread can be reading `profiled_edges`, e.g. at a safe point.
+  void FreeProfiledEdges(void);
+
   // Mapping of context callback functions to their code cache equivalents. In
   // the code cache, these functions are wrapped with code that saves/restores
   // registers, etc.
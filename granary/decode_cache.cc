@@ -0,0 +1,164 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#define GRANARY_INTERNAL
+
+#include "arch/driver.h"
+
+#include "granary/base/lock.h"
+#include "granary/base/option.h"
+#include "granary/base/string.h"
+
+#include "granary/decode_cache.h"
+
+#include "os/logging.h"
+#include "os/memory.h"
+
+GRANARY_DEFINE_bool(decode_cache, true,
+    "Cache decoded application instructions, so that instructions that are "
+    "decoded many times (e.g. because they are part of many traces) are only "
+    "decoded once. Only instructions in executable, non-writable module code "
+    "are cached. The default is `yes`.");
+
+GRANARY_DEFINE_bool(log_decode_cache_stats, false,
+    "Log the number of hits and misses in the decode cache when Granary "
+    "exits. The default is `no`.");
+
+namespace granary {
+namespace {
+
+enum : size_t {
+  kNumDecodeCacheEntries = 4096,
+  kNumDecodeCacheLocks = 64
+};
+
+// A cached decoded instruction.
+struct DecodeCacheEntry {
+  // Version of the code range containing the instruction, or `0` if this
+  // entry is empty.
+  uint64_t version;
+
+  // Module offset of the program counter at which decoding began.
+  uintptr_t offset;
+
+  // The program counter of the next logical instruction.
+  AppPC next_pc;
+
+  // The decoded instruction. This is never modified after it's been cached.
+  arch::Instruction instr;
+};
+
+enum : size_t {
+  kDecodeCacheNumBytes = sizeof(DecodeCacheEntry) * kNumDecodeCacheEntries,
+  kDecodeCacheNumPages = (kDecodeCacheNumBytes + arch::PAGE_SIZE_BYTES - 1) /
+                         arch::PAGE_SIZE_BYTES
+};
+
+// The cached instructions.
+static DecodeCacheEntry *gEntries = nullptr;
+
+// Locks protecting the cached instructions. The entry `i` is protected by
+// the lock `i % kNumDecodeCacheLocks`.
+static SpinLock gEntryLocks[kNumDecodeCacheLocks];
+
+// Decode cache statistics.
+static std::atomic<uint64_t> gNumHits(ATOMIC_VAR_INIT(0));
+static std::atomic<uint64_t> gNumMisses(ATOMIC_VAR_INIT(0));
+static std::atomic<uint64_t> gNumUncacheable(ATOMIC_VAR_INIT(0));
+
+// Returns the index of the entry that caches the instruction at `offset`
+// within the range with version `version`.
+static size_t EntryIndex(uint64_t version, uintptr_t offset) {
+  auto hash = (version * 0x9E3779B97F4A7C15ULL) ^ offset;
+  hash ^= hash >> 29;
+  return static_cast<size_t>(hash % kNumDecodeCacheEntries);
+}
+
+// Returns true if the range `range` contains `addr`.
+static bool RangeContains(const os::ImmutableCodeRange &range,
+                          uintptr_t addr) {
+  return range.version && range.begin_addr <= addr && addr < range.end_addr;
+}
+
+}  // namespace
+
+CachingInstructionDecoder::CachingInstructionDecoder(void) {
+  range.version = 0;
+}
+
+// Decode an instruction, and update the program counter by reference to
+// point to the next logical instruction. Returns `true` if the instruction
+// was successfully decoded.
+bool CachingInstructionDecoder::DecodeNext(arch::Instruction *instr,
+                                           AppPC *pc) {
+  if (!gEntries) return arch::InstructionDecoder::DecodeNext(instr, pc);
+
+  auto addr = reinterpret_cast<uintptr_t>(*pc);
+  if (!RangeContains(range, addr) &&
+      !os::FindImmutableCodeRange(*pc, &range)) {
+    range.version = 0;
+    gNumUncacheable.fetch_add(1, std::memory_order_relaxed);
+    return arch::InstructionDecoder::DecodeNext(instr, pc);
+  }
+
+  const auto offset = range.begin_offset + (addr - range.begin_addr);
+  const auto index = EntryIndex(range.version, offset);
+  auto &entry(gEntries[index]);
+  auto &lock(gEntryLocks[index % kNumDecodeCacheLocks]);
+  do {
+    SpinLockedRegion locker(&lock);
+    if (entry.version == range.version && entry.offset == offset) {
+      memcpy(instr, &(entry.instr), sizeof *instr);
+      *pc = entry.next_pc;
+      gNumHits.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  } while (false);
+
+  gNumMisses.fetch_add(1, std::memory_order_relaxed);
+  if (!arch::InstructionDecoder::DecodeNext(instr, pc)) return false;
+
+  // Only cache the instruction if all of the decoded bytes (including any
+  // skipped bytes, e.g. NOPs) are inside of the same code range.
+  if (reinterpret_cast<uintptr_t>(*pc) <= range.end_addr) {
+    SpinLockedRegion locker(&lock);
+    entry.version = range.version;
+    entry.offset = offset;
+    entry.next_pc = *pc;
+    memcpy(&(entry.instr), instr, sizeof *instr);
+  }
+  return true;
+}
+
+// Initialize the decode cache.
+void InitDecodeCache(void) {
+  if (!FLAG_decode_cache) return;
+  gEntries = reinterpret_cast<DecodeCacheEntry *>(
+      os::AllocateDataPages(kDecodeCacheNumPages));
+  for (auto i = 0UL; i < kNumDecodeCacheEntries; ++i) {
+    gEntries[i].version = 0;
+  }
+}
+
+// Exit the decode cache.
+void ExitDecodeCache(void) {
+  if (!gEntries) return;
+  os::FreeDataPages(gEntries, kDecodeCacheNumPages);
+  gEntries = nullptr;
+  gNumHits.store(0);
+  gNumMisses.store(0);
+  gNumUncacheable.store(0);
+}
+
+// Log the hit rate of the decode cache, if `--log_decode_cache_stats` is used.
+void LogDecodeCacheStatistics(void) {
+  if (!FLAG_log_decode_cache_stats) return;
+  const auto num_hits = gNumHits.load();
+  const auto num_misses = gNumMisses.load();
+  const auto num_lookups = num_hits + num_misses;
+  os::Log(os::LogOutput, "Decode cache: hits=%lu misses=%lu uncacheable=%lu "
+                         "hit rate=%lu%%\n",
+          num_hits, num_misses, gNumUncacheable.load(),
+          num_lookups ? (num_hits * 100) / num_lookups : 0UL);
+}
+
+}  // namespace granary
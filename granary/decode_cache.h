@@ -0,0 +1,57 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#ifndef GRANARY_DECODE_CACHE_H_
+#define GRANARY_DECODE_CACHE_H_
+
+#ifndef GRANARY_INTERNAL
+# error "This code is internal to Granary."
+#endif
+
+#include "granary/base/base.h"
+#include "granary/base/pc.h"
+
+#include "os/module.h"
+
+namespace granary {
+namespace arch {
+class Instruction;
+}  // namespace arch
+
+// The decode cache remembers the results of decoding application
+// instructions, so that code that is decoded many times (e.g. once per trace
+// that reaches it, or once per meta-data variant of a block) is only decoded
+// once. Decoded instructions are keyed by their offsets within the immutable
+// module code ranges that contain them, along with the versions of those
+// ranges. If a range changes (e.g. because it's unmapped), then it gets a new
+// version, and so stale instructions are never found again.
+
+// Decodes a sequence of instructions, using the decode cache where possible.
+class CachingInstructionDecoder {
+ public:
+  CachingInstructionDecoder(void);
+
+  // Decode an instruction, and update the program counter by reference to
+  // point to the next logical instruction. Returns `true` if the instruction
+  // was successfully decoded.
+  bool DecodeNext(arch::Instruction *instr, AppPC *pc);
+
+ private:
+  // The code range containing the last decoded instruction. This is valid if
+  // `range.version` is non-zero.
+  os::ImmutableCodeRange range;
+
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(CachingInstructionDecoder);
+};
+
+// Initialize the decode cache.
+void InitDecodeCache(void);
+
+// Exit the decode cache.
+void ExitDecodeCache(void);
+
+// Log the hit rate of the decode cache, if `--log_decode_cache_stats` is used.
+void LogDecodeCacheStatistics(void);
+
+}  // namespace granary
+
+#endif  // GRANARY_DECODE_CACHE_H_
@@ -7,14 +7,29 @@
 #include "granary/code/edge.h"
 
 #include "granary/app.h"
+#include "granary/cache.h"
 #include "granary/context.h"
+#include "granary/epoch.h"
+#include "granary/index.h"
 #include "granary/translate.h"
 
-GRANARY_DEFINE_bool(unsafe_patch_edges, false,
-    "Should Granary try to patch direct edges as soon as possible? This is "
-    "unsafe because Granary will not enforce proper barriers or other "
-    "architectural requirements to cross-modifying code, and as such, enabling "
-    "this option can result in spurious faults.");
+#include "os/slot.h"
+#include "os/thread.h"
+
+GRANARY_DEFINE_positive_uint(indirect_edge_chain_length, 4,
+    "The number of targets of an indirect control-flow instruction that are "
+    "resolved by a chain of compare-and-jump templates. Later targets are "
+    "resolved by a per-edge hash table. The default is `4`.");
+
+GRANARY_DEFINE_uint(hot_trace_threshold, 0,
+    "The number of times that a direct edge must be taken before its target "
+    "block is re-translated as the head of a hot trace. Hot traces inline the "
+    "hottest successors of their head block, so that register scheduling and "
+    "flags saving can optimize across block boundaries. Edges are not patched "
+    "until they are hot. Values larger than `65535` are treated as `65535`. "
+    "The default is `0`, which disables hot trace formation.");
+
+GRANARY_DECLARE_bool(shadow_return_stack);
 
 // TODO(pag): Add an option that says put edge code in for all blocks, even if
 //            not needed.
@@ -25,14 +40,6 @@ namespace granary {
 
 extern ReaderWriterLock gExitGranaryLock;
 
-namespace arch {
-
-// Patch a direct edge.
-//
-// Note: This function has an architecture-specific implementation.
-extern bool TryAtomicPatchEdge(DirectEdge *edge);
-
-}  // namespace arch
 namespace {
 
 #if defined(GRANARY_WHERE_kernel) && defined(GRANARY_TARGET_debug)
@@ -50,11 +57,100 @@ static inline bool OnGranaryStack(void) {
 }
 #endif  // GRANARY_WHERE_kernel && GRANARY_WHERE_debug
 
+// Try to perform deferred maintenance on the code cache, i.e. patch a batch of
+// queued direct edges, flush the code cache if it's over budget, and reclaim
+// retired code. This is only done if we're at a safe point, i.e. if no other
+// thread is executing inside of Granary. If another thread is in Granary, then
+// we'll try again later.
+static void TryEnterSafePoint(Context *context) {
+  const auto should_patch = context->ShouldPatchDirectEdges();
+  const auto should_flush = CodeCacheIsOverBudget();
+  const auto should_reclaim = context->HasRetiredCode();
+  if (!should_patch && !should_flush && !should_reclaim) return;
+  if (!gExitGranaryLock.TryWriteAcquire()) return;
+  if (should_flush) {
+    context->FlushCodeCache(AdvanceEpoch());
+  } else if (should_patch) {
+    context->PatchDirectEdges();
+  }
+  context->ReclaimRetiredCode(OldestObservedEpoch());
+  gExitGranaryLock.WriteRelease();
+}
+
+// Returns the shadow stack of the current thread.
+static os::ShadowStack *CurrentShadowStack(void) {
+  return reinterpret_cast<os::ShadowStack *>(
+      os::ThreadBase() + os::Slot(os::SLOT_SHADOW_STACK));
+}
+
+#ifdef GRANARY_WHERE_user
+// The epoch in which the current thread last cleared its shadow stack.
+static __thread uint64_t tShadowStackEpoch = 0;
+#endif  // GRANARY_WHERE_user
+
+// Record that the current thread has observed the current epoch. Code cache
+// flushes retire return sites in a new epoch, so the current thread first
+// clears its shadow stack if it hasn't done so in the current epoch. That way,
+// once every thread has observed the epoch, no shadow stack refers to the
+// retired return sites.
+static void ObserveEpochAndClearShadowStack(void) {
+#ifdef GRANARY_WHERE_user
+  const auto epoch = CurrentEpoch();
+  if (GRANARY_UNLIKELY(epoch != tShadowStackEpoch)) {
+    auto shadow_stack = CurrentShadowStack();
+    shadow_stack->unresolved_site = nullptr;
+    memset(shadow_stack->entries, 0, sizeof shadow_stack->entries);
+    tShadowStackEpoch = epoch;
+  }
+#endif  // GRANARY_WHERE_user
+  ObserveEpoch();
+}
+
+// Resolve the code cache address of the return site that this thread's shadow
+// stack most recently failed to resolve, assuming that it's a return site for
+// `target_app_pc`. This lets later returns to the same site bypass the
+// indirect edge.
+static void ResolveReturnSite(const IndirectEdge *edge, AppPC target_app_pc) {
+  auto shadow_stack = CurrentShadowStack();
+  auto site = reinterpret_cast<ReturnSite *>(shadow_stack->unresolved_site);
+  shadow_stack->unresolved_site = nullptr;
+  if (!site || site->native_pc != target_app_pc) return;
+
+  auto meta = edge->dest_block_meta_template->Copy();
+  MetaDataCast<AppMetaData *>(meta)->start_pc = target_app_pc;
+  auto response = FindMetaDataInIndex(meta);
+  if (kUnificationStatusAccept == response.status) {
+    auto cache_meta = MetaDataCast<const CacheMetaData *>(response.meta);
+    site->cache_pc.store(cache_meta->start_pc, std::memory_order_release);
+  }
+  delete meta;
+}
+
 // Returns true if this edge has already been translated.
+//
+// Note: Profiled edges are redirected back into Granary once they're hot.
 static bool EdgeHasTranslation(const DirectEdge *edge) {
-  const auto begin = edge->edge_code_pc;
-  const auto end = begin + arch::DIRECT_EDGE_CODE_SIZE_BYTES;
-  return edge->entry_target_pc < begin || edge->entry_target_pc >= end;
+  return edge->entry_target_pc != edge->enter_granary_pc;
+}
+
+// Translate the target of a profiled direct edge. Until the edge is hot, it
+// keeps its target block's meta-data, and thus keeps counting executions.
+// Once the edge is hot, its target block is re-translated as the head of a
+// hot trace. Returns `false` if the edge is still being profiled.
+static bool TranslateProfiledEdge(Context *context, DirectEdge *edge) {
+  if (edge->num_executions_until_hot) {
+    edge->entry_target_pc = Translate(context, edge->dest_block_meta->Copy(),
+                                      true);
+
+    // The edge became hot while we were translating it.
+    if (!edge->num_executions_until_hot) {
+      edge->entry_target_pc = edge->enter_granary_pc;
+    }
+    return false;
+  }
+  auto meta = context->StopProfilingDirectEdge(edge);
+  edge->entry_target_pc = TranslateHotTrace(context, meta);
+  return true;
 }
 
 }  // namespace
@@ -63,33 +159,73 @@ extern "C" {
 // Enter into Granary to begin the translation process for a direct edge.
 GRANARY_ENTRYPOINT void granary_enter_direct_edge(DirectEdge *edge) {
   GRANARY_IF_KERNEL(GRANARY_ASSERT(OnGranaryStack()));
-  ReadLockedRegion exit_locker(&gExitGranaryLock);
-  os::LockedRegion edge_locker(&edge->lock);
-  if (!EdgeHasTranslation(edge)) {
-    auto context = GlobalContext();
-    edge->entry_target_pc = Translate(context, edge->dest_block_meta);
-    edge->dest_block_meta = nullptr;
-    if (!FLAG_unsafe_patch_edges || !arch::TryAtomicPatchEdge(edge)) {
+  auto context = GlobalContext();
+  do {
+    ReadLockedRegion exit_locker(&gExitGranaryLock);
+    os::LockedRegion edge_locker(&edge->lock);
+
+    // Taking an edge of code that hasn't been flushed means that this thread
+    // isn't executing any flushed code.
+    if (!edge->is_retired) ObserveEpochAndClearShadowStack();
+
+    if (!EdgeHasTranslation(edge)) {
+      if (edge->is_profiled) {
+        if (!TranslateProfiledEdge(context, edge)) break;
+      } else {
+        edge->entry_target_pc = Translate(context, edge->dest_block_meta);
+        edge->dest_block_meta = nullptr;
+      }
+
+      // Retired edges are never patched, as they aren't owned by the context
+      // anymore, and the code containing them will eventually be reclaimed.
+      if (edge->is_retired) break;
       context->PreparePatchDirectEdge(edge);
     }
-  }
+  } while (false);
+
+  // Patch, flush, and reclaim outside of the above locked region, as these
+  // require that no threads (including this one) are executing within Granary.
+  TryEnterSafePoint(context);
 }
 
 // Enter into Granary to begin the translation process for an indirect edge.
-GRANARY_ENTRYPOINT void granary_enter_indirect_edge(IndirectEdge *edge,
-                                                    AppPC target_app_pc) {
+// Returns the out-edge template for `target_app_pc`, which is where execution
+// continues when `granary_arch_enter_indirect_edge` returns.
+GRANARY_ENTRYPOINT CachePC granary_enter_indirect_edge(IndirectEdge *edge,
+                                                       AppPC target_app_pc) {
   GRANARY_IF_KERNEL(GRANARY_ASSERT(OnGranaryStack()));
-  ReadLockedRegion exit_locker(&gExitGranaryLock);
-  os::LockedRegion edge_locker(&(edge->lock));
-  auto &encoded_pc(edge->out_edges[target_app_pc]);
-  if (!encoded_pc) {
-    auto context = GlobalContext();
-    auto meta = edge->dest_block_meta_template->Copy();
-    auto app_meta = MetaDataCast<AppMetaData *>(meta);
-    app_meta->start_pc = target_app_pc;
-    encoded_pc = Translate(context, edge, meta);
-    edge->out_edge_pc = encoded_pc;
-  }
+  auto context = GlobalContext();
+  CachePC target_pc(nullptr);
+  do {
+    ReadLockedRegion exit_locker(&gExitGranaryLock);
+    os::LockedRegion edge_locker(&(edge->lock));
+    if (!edge->is_retired) ObserveEpochAndClearShadowStack();
+    edge->num_misses++;
+    auto &encoded_pc(edge->out_edges[target_app_pc]);
+    if (!encoded_pc) {
+      auto meta = edge->dest_block_meta_template->Copy();
+      auto app_meta = MetaDataCast<AppMetaData *>(meta);
+      app_meta->start_pc = target_app_pc;
+      encoded_pc = Translate(context, edge, meta);
+
+      // Short chains of templates are fast for indirect CFIs with few
+      // targets, but megamorphic CFIs (e.g. virtual dispatch) would pay for
+      // a compare per target, so their remaining targets go in the edge's
+      // hash table instead.
+      if (edge->out_edges.Size() <= FLAG_indirect_edge_chain_length) {
+        edge->out_edge_pc = encoded_pc;
+      } else {
+        CacheIndirectEdgeTarget(edge, target_app_pc, encoded_pc);
+      }
+    }
+    target_pc = encoded_pc;
+    if (GRANARY_IF_USER_ELSE(FLAG_shadow_return_stack, false)) {
+      ResolveReturnSite(edge, target_app_pc);
+    }
+  } while (false);
+
+  TryEnterSafePoint(context);
+  return target_pc;
 }
 }  // extern C
 }  // namespace granary
@@ -0,0 +1,143 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#define GRANARY_INTERNAL
+
+#include "granary/base/lock.h"
+
+#include "granary/epoch.h"
+
+namespace granary {
+namespace {
+
+enum {
+  // Upper bound on the number of threads whose epochs can be tracked. If
+  // more threads than this are created then retired code is never reclaimed.
+  kMaxNumThreadEpochs = 1024
+};
+
+// The last epoch observed by some thread.
+struct ThreadEpoch {
+  std::atomic<uint64_t> observed_epoch;
+  std::atomic<bool> is_live;
+
+  // Is the thread waiting for work? Idle threads don't hold back reclamation.
+  std::atomic<bool> is_idle;
+};
+
+// The global epoch.
+static std::atomic<uint64_t> gEpoch(ATOMIC_VAR_INIT(1));
+
+#ifdef GRANARY_WHERE_user
+
+// Epochs of every thread that has entered Granary. Thread epochs are never
+// freed, as a thread's `tThreadEpoch` pointer outlives `Init`/`Exit` pairs.
+static ThreadEpoch gThreadEpochs[kMaxNumThreadEpochs];
+static std::atomic<size_t> gNumThreadEpochs(ATOMIC_VAR_INIT(0));
+
+// The number of threads that have been created (including the first thread),
+// and the number of threads that have registered a `ThreadEpoch`. If these
+// differ then some thread might be executing retired code without having ever
+// entered Granary.
+static std::atomic<size_t> gNumThreadsCreated(ATOMIC_VAR_INIT(1));
+
+// Epoch of the current thread.
+static __thread ThreadEpoch *tThreadEpoch = nullptr;
+
+// Returns the current thread's epoch, registering it if necessary. Returns
+// `nullptr` if we've run out of thread epochs.
+static ThreadEpoch *CurrentThreadEpoch(void) {
+  if (GRANARY_UNLIKELY(!tThreadEpoch)) {
+    auto index = gNumThreadEpochs.fetch_add(1);
+    if (index >= kMaxNumThreadEpochs) return nullptr;
+    tThreadEpoch = &(gThreadEpochs[index]);
+    tThreadEpoch->is_live.store(true);
+  }
+  return tThreadEpoch;
+}
+
+#endif  // GRANARY_WHERE_user
+}  // namespace
+
+// Returns the current global epoch.
+uint64_t CurrentEpoch(void) {
+  return gEpoch.load(std::memory_order_acquire);
+}
+
+// Advance the global epoch, and return the new epoch. Code retired in the
+// new epoch must already be unreachable from any code that isn't retired.
+uint64_t AdvanceEpoch(void) {
+  return gEpoch.fetch_add(1) + 1;
+}
+
+// Record that the current thread has observed the current epoch. This must
+// only be invoked when the current thread is known to not be executing any
+// retired code.
+void ObserveEpoch(void) {
+#ifdef GRANARY_WHERE_user
+  if (auto thread_epoch = CurrentThreadEpoch()) {
+    thread_epoch->observed_epoch.store(CurrentEpoch(),
+                                       std::memory_order_release);
+    if (GRANARY_UNLIKELY(thread_epoch->is_idle.load(
+            std::memory_order_relaxed))) {
+      thread_epoch->is_idle.store(false);
+    }
+  }
+#endif  // GRANARY_WHERE_user
+}
+
+// Record that the current thread is idle, e.g. waiting for work, and holds no
+// pointers to anything that might be retired. Idle threads don't hold back
+// reclamation until they next invoke `ObserveEpoch`.
+void IdleThreadEpoch(void) {
+#ifdef GRANARY_WHERE_user
+  if (auto thread_epoch = CurrentThreadEpoch()) {
+    thread_epoch->is_idle.store(true, std::memory_order_release);
+  }
+#endif  // GRANARY_WHERE_user
+}
+
+// Record that the current thread is about to create a new thread. Until the
+// new thread enters Granary, nothing that has been retired can be reclaimed.
+void BeforeCreateThreadEpoch(void) {
+  GRANARY_IF_USER( gNumThreadsCreated.fetch_add(1); )
+}
+
+// Record that the current thread is exiting, and will no longer observe any
+// epochs.
+void ExitThreadEpoch(void) {
+#ifdef GRANARY_WHERE_user
+  if (auto thread_epoch = CurrentThreadEpoch()) {
+    thread_epoch->is_live.store(false, std::memory_order_release);
+  }
+#endif  // GRANARY_WHERE_user
+}
+
+// Returns the oldest epoch that might still be observed by some thread. Code
+// retired in an epoch newer than the returned epoch might still be executing.
+//
+// Note: In kernel space we don't track CPU-private epochs, and so retired code
+//       is never reclaimed.
+uint64_t OldestObservedEpoch(void) {
+#ifdef GRANARY_WHERE_user
+  const auto num_thread_epochs = gNumThreadEpochs.load();
+  if (num_thread_epochs > kMaxNumThreadEpochs) return 0;
+  if (num_thread_epochs < gNumThreadsCreated.load()) return 0;
+
+  auto oldest_epoch = CurrentEpoch();
+  for (auto i = 0UL; i < num_thread_epochs; ++i) {
+    auto &thread_epoch(gThreadEpochs[i]);
+    if (!thread_epoch.is_live.load(std::memory_order_acquire) ||
+        thread_epoch.is_idle.load(std::memory_order_acquire)) {
+      continue;
+    }
+    oldest_epoch = std::min(
+        oldest_epoch,
+        thread_epoch.observed_epoch.load(std::memory_order_acquire));
+  }
+  return oldest_epoch;
+#else
+  return 0;
+#endif  // GRANARY_WHERE_user
+}
+
+}  // namespace granary
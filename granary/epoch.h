@@ -0,0 +1,51 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#ifndef GRANARY_EPOCH_H_
+#define GRANARY_EPOCH_H_
+
+#ifndef GRANARY_INTERNAL
+# error "This code is internal to Granary."
+#endif
+
+#include "granary/base/base.h"
+
+namespace granary {
+
+// Epochs are used to decide when code that was flushed from the code cache,
+// and other data that is read without locks (e.g. module indexes), can be
+// reclaimed. Every code cache flush advances the global epoch. Code that is
+// retired in epoch `E` can be reclaimed once every thread has observed an
+// epoch `>= E` while executing code that was not retired.
+
+// Returns the current global epoch.
+uint64_t CurrentEpoch(void);
+
+// Advance the global epoch, and return the new epoch. Code retired in the
+// new epoch must already be unreachable from any code that isn't retired.
+uint64_t AdvanceEpoch(void);
+
+// Record that the current thread has observed the current epoch. This must
+// only be invoked when the current thread is known to not be executing any
+// retired code.
+void ObserveEpoch(void);
+
+// Record that the current thread is idle, e.g. waiting for work, and holds no
+// pointers to anything that might be retired. Idle threads don't hold back
+// reclamation until they next invoke `ObserveEpoch`.
+void IdleThreadEpoch(void);
+
+// Record that the current thread is about to create a new thread. Until the
+// new thread enters Granary, nothing that has been retired can be reclaimed.
+void BeforeCreateThreadEpoch(void);
+
+// Record that the current thread is exiting, and will no longer observe any
+// epochs.
+void ExitThreadEpoch(void);
+
+// Returns the oldest epoch that might still be observed by some thread. Code
+// retired in an epoch newer than the returned epoch might still be executing.
+uint64_t OldestObservedEpoch(void);
+
+}  // namespace granary
+
+#endif  // GRANARY_EPOCH_H_
@@ -4,26 +4,48 @@
 
 #include "arch/exit.h"
 
+#include "granary/base/new.h"
+
 #include "granary/cache.h"
 #include "granary/client.h"
 #include "granary/context.h"
+#include "granary/decode_cache.h"
 #include "granary/index.h"
 #include "granary/metadata.h"
+#include "granary/persist.h"
+#include "granary/profile.h"
+#include "granary/speculate.h"
 
 #include "code/register.h"
 
+#include "os/event_log.h"
 #include "os/logging.h"
 #include "os/memory.h"
 #include "os/module.h"
+#include "os/thread.h"
 
 namespace granary {
 
 ReaderWriterLock gExitGranaryLock;
 
+namespace {
+
+// Stop all of Granary's worker threads. Worker threads hold
+// `gExitGranaryLock` for reading while they translate, so this must be done
+// before acquiring the lock for writing.
+static void ExitWorkerThreads(void) {
+  os::ExitEventLog();  // Stops the event log's worker thread.
+  ExitSpeculation();
+  os::JoinWorkerThreads();
+}
+
+}  // namespace
+
 extern "C" {
 // Exported to assembly code. This is the "fast" version of Granary's exit,
 // where almost all resources are *not* cleaned up.
 void granary_exit(ExitReason reason) {
+  ExitWorkerThreads();
   gExitGranaryLock.WriteAcquire();  // Don't unlock.
 
 #ifdef GRANARY_WITH_VALGRIND
@@ -31,6 +53,10 @@ void granary_exit(ExitReason reason) {
   // helps track down memory leaks.
   Exit(reason);
 #else
+  ExitPersistentCache();
+  LogTranslationProfile();
+  LogAllocatorStatistics();
+  LogDecodeCacheStatistics();
   ExitTools(reason);
   os::ExitLog();
 #endif  // GRANARY_WITH_VALGRIND
@@ -56,11 +82,17 @@ void PostExit(void) {
 }  // namespace
 
 void Exit(ExitReason reason) {
+  ExitWorkerThreads();
+  ExitPersistentCache();
+  LogTranslationProfile();
+  LogAllocatorStatistics();
+  LogDecodeCacheStatistics();
   ExitTools(reason);
   ExitToolManager();
   ExitContext();
   ExitClients();
   ExitIndex();
+  ExitDecodeCache();
   ExitMetaData();
   ExitCodeCache();
 
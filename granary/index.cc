@@ -3,6 +3,7 @@
 #define GRANARY_INTERNAL
 
 #include "granary/base/new.h"
+#include "granary/base/option.h"
 #include "granary/base/string.h"
 
 #include "granary/app.h"
@@ -13,6 +14,12 @@
 
 #include "os/memory.h"
 
+GRANARY_DEFINE_bool(index_with_radix_tree, false,
+    "Use a two-level radix tree for the code cache index instead of a hash "
+    "table. The radix tree serializes writers on locks that are shared across "
+    "many unrelated blocks, and its readers must inspect every block's "
+    "meta-data along a chain. The default is `no`.");
+
 namespace granary {
 namespace {
 
@@ -27,22 +34,140 @@ enum : uintptr_t {
   kNumBitsFirstIndex = __builtin_popcount(kMaxFirstIndex - 1),
 
   kMaxSecondIndex = arch::PAGE_SIZE_BYTES / sizeof(void *),
-  kNumBitsSecondIndex = __builtin_popcount(kMaxSecondIndex - 1)
+  kNumBitsSecondIndex = __builtin_popcount(kMaxSecondIndex - 1),
+
+  kNumBitsHashTableIndex = 14,
+  kNumHashTableChains = 1UL << kNumBitsHashTableIndex,
+
+  // Number of meta-data entries per hash bucket. This is chosen so that all
+  // fingerprints and the `next` pointer of a bucket fit in one cache line.
+  kNumEntriesPerBucket = (arch::CACHE_LINE_SIZE_BYTES - sizeof(void *)) /
+                         sizeof(uint16_t),
+
+  // Fingerprint of a hash table entry whose meta-data has been removed.
+  kRemovedEntryFingerprint = 0xFFFF
 };
 
+// Operations implemented by a specific code cache index data structure.
+struct IndexEngine {
+  void (* const exit)(void);
+  const BlockMetaData *(* const remove_all)(void);
+  const BlockMetaData *(* const remove_range)(AppPC begin_pc, AppPC end_pc);
+  IndexFindResponse (* const find)(const BlockMetaData *meta);
+  void (* const add)(BlockMetaData *meta);
+  const BlockMetaData *(* const replace)(BlockMetaData *meta);
+  void (* const for_each)(
+      const std::function<void(const BlockMetaData *, IndexedStatus)> &func);
+};
+
+// Linked list of un-indexed meta-data.
+static const BlockMetaData * volatile gUnindexedMeta[kMaxFirstIndex] \
+    = {nullptr};
+static SpinLock gUnindexedMetaLock[kMaxFirstIndex];
+
+// Returns the application program counter associated with some block
+// meta-data.
+static AppPC AppPCOf(const BlockMetaData *meta) {
+  return MetaDataCast<const AppMetaData *>(meta)->start_pc;
+}
+
+// Match some meta-data that we are searching for (`search`) against some
+// indexed meta-data (`meta`), and update `response` if this is the best match
+// so far. Returns `true` if `meta` is an exact match.
+static bool MatchMetaData(const BlockMetaData *search,
+                          const BlockMetaData *meta,
+                          IndexFindResponse *response) {
+  if (!search->Equals(meta)) return false;
+  switch (search->CanUnifyWith(meta)) {
+    case kUnificationStatusAccept:
+      response->status = kUnificationStatusAccept;
+      response->meta = meta;
+      return true;
+
+    case kUnificationStatusAdapt:
+      if (kUnificationStatusAdapt != response->status) {
+        response->status = kUnificationStatusAdapt;
+        response->meta = meta;
+      }
+      return false;
+
+    case kUnificationStatusReject:
+      return false;
+  }
+  return false;
+}
+
+// Prepends a linked list of meta-data onto another linked list of meta-data.
+static const BlockMetaData *PrependMetaDataList(const BlockMetaData *metas,
+                                                const BlockMetaData *list) {
+  if (!metas) return list;
+  auto last_meta = metas;
+  for (auto meta : IndexMetaDataIterator(metas)) last_meta = meta;
+  MetaDataCast<const IndexMetaData *>(last_meta)->next = list;
+  return metas;
+}
+
+// Returns true if the application PC of some meta-data is contained in the
+// range `[begin_pc, end_pc)`.
+static bool MetaDataInRange(const BlockMetaData *meta, AppPC begin_pc,
+                            AppPC end_pc) {
+  auto pc = AppPCOf(meta);
+  return begin_pc <= pc && pc < end_pc;
+}
+
+// Removes all meta-data whose application PCs are in the range
+// `[begin_pc, end_pc)` from the linked list of meta-data at `*list`, and
+// prepends the removed meta-data onto `removed`.
+//
+// Note: The caller must hold the lock that serializes writers to `*list`.
+//       Removed meta-data is unlinked in place, and the links of kept
+//       meta-data are left untouched, so that concurrent readers of the list
+//       never skip over kept meta-data.
+template <typename T>
+static const BlockMetaData *RemoveMetaDataInRange(T *list, AppPC begin_pc,
+                                                  AppPC end_pc,
+                                                  const BlockMetaData *removed) {
+  while (*list && MetaDataInRange(*list, begin_pc, end_pc)) {
+    const BlockMetaData *meta = *list;
+    auto index_meta = MetaDataCast<const IndexMetaData *>(meta);
+    *list = index_meta->next;
+    index_meta->next = removed;
+    removed = meta;
+  }
+  for (const BlockMetaData *prev_meta = *list; prev_meta; ) {
+    auto prev_index_meta = MetaDataCast<const IndexMetaData *>(prev_meta);
+    auto meta = prev_index_meta->next;
+    if (!meta) break;
+    if (MetaDataInRange(meta, begin_pc, end_pc)) {
+      auto index_meta = MetaDataCast<const IndexMetaData *>(meta);
+      prev_index_meta->next = index_meta->next;
+      index_meta->next = removed;
+      removed = meta;
+    } else {
+      prev_meta = meta;
+    }
+  }
+  return removed;
+}
+
+// Deletes all meta-data in a linked list of meta-data.
+static void DeleteMetaDataList(const BlockMetaData *meta) {
+  while (meta) {
+    auto index_meta = MetaDataCast<const IndexMetaData *>(meta);
+    auto next_meta = index_meta->next;
+    delete meta;
+    meta = next_meta;
+  }
+}
+
 // Top-level code cache index. The code cache index is a high-arity, two-level
 // radix tree, where indexes into each level are formed by the `AddrToIndex`
 // function.
-static MetaDataArray * volatile gIndex[kMaxFirstIndex] = {nullptr};
+static MetaDataArray * volatile gRadixIndex[kMaxFirstIndex] = {nullptr};
 
 // Top-level locks of code cache sub-levels.
 static os::Lock gSecondLevelLocks[kMaxSecondIndex];
 
-// Linked list of un-indexed meta-data.
-static const BlockMetaData * volatile gUnindexedMeta[kMaxFirstIndex] \
-    = {nullptr};
-static SpinLock gUnindexedMetaLock[kMaxFirstIndex];
-
 // Represents the index levels for some meta-data.
 struct MetaDataIndex {
   uintptr_t first;
@@ -62,24 +187,13 @@ static MetaDataIndex IndexOf(AppPC pc) {
   };
 }
 
-// Returns the application program counter associated with some block
-// meta-data.
-static AppPC AppPCOf(const BlockMetaData *meta) {
-  return MetaDataCast<const AppMetaData *>(meta)->start_pc;
-}
-
 // Second-level index of meta-data. This is an array of buckets.
 class MetaDataArray {
  public:
   // Deletes all meta-data linked into this array.
   ~MetaDataArray(void) {
     for (auto meta : metas) {
-      while (meta) {
-        auto index_meta = MetaDataCast<IndexMetaData *>(meta);
-        auto next_meta = index_meta->next;
-        delete meta;
-        meta = next_meta;
-      }
+      DeleteMetaDataList(meta);
     }
   }
 
@@ -101,59 +215,457 @@ class MetaDataArray {
 static_assert(sizeof(MetaDataArray) == arch::PAGE_SIZE_BYTES,
               "The size of `MetaDataArray` must be exactly one page.");
 
-// Match some meta-data that we are search for (`search`) against a linked
-// list of potential meta-data.
-static IndexFindResponse MatchMetaData(const BlockMetaData *ls,
-                                       const BlockMetaData *search) {
+// Exit the radix tree index.
+static void ExitRadixTree(void) {
+  for (auto &array : gRadixIndex) {
+    if (array) {
+      delete array;
+      array = nullptr;
+    }
+  }
+}
+
+// Remove all meta-data from the radix tree index.
+static const BlockMetaData *RemoveAllFromRadixTree(void) {
+  const BlockMetaData *metas(nullptr);
+  for (auto &array : gRadixIndex) {
+    if (!array) continue;
+    for (auto &meta : array->metas) {
+      metas = PrependMetaDataList(meta, metas);
+      meta = nullptr;
+    }
+    delete array;
+    array = nullptr;
+  }
+  return metas;
+}
+
+// Remove all meta-data in the range `[begin_pc, end_pc)` from the radix tree
+// index. This can run concurrently with readers and writers of the index.
+// Concurrent readers that are already looking at removed meta-data might
+// still find it; the removed meta-data is retired, not freed, by the caller.
+static const BlockMetaData *RemoveRangeFromRadixTree(AppPC begin_pc,
+                                                     AppPC end_pc) {
+  const BlockMetaData *metas(nullptr);
+  for (auto second = 0UL; second < kMaxSecondIndex; ++second) {
+    os::LockedRegion locker(&(gSecondLevelLocks[second]));
+    for (auto array : gRadixIndex) {
+      if (!array) continue;
+      metas = RemoveMetaDataInRange(&(array->metas[second]), begin_pc,
+                                    end_pc, metas);
+    }
+  }
+  return metas;
+}
+
+// Perform a lookup operation in the radix tree index.
+static IndexFindResponse FindInRadixTree(const BlockMetaData *meta) {
   IndexFindResponse response = {kUnificationStatusReject, nullptr};
-  for (auto meta : IndexMetaDataIterator(ls)) {
-    if (!search->Equals(meta)) continue;
-    switch (search->CanUnifyWith(ls)) {
-      case kUnificationStatusAccept:
-        response.status = kUnificationStatusAccept;
-        response.meta = meta;
-        return response;
-
-      case kUnificationStatusAdapt:
-        if (kUnificationStatusAdapt != response.status) {
-          response.status = kUnificationStatusAdapt;
-          response.meta = meta;
+  auto indices = IndexOf(AppPCOf(meta));
+  if (auto array = gRadixIndex[indices.first]) {
+    for (auto indexed_meta : IndexMetaDataIterator(
+             array->metas[indices.second])) {
+      if (MatchMetaData(meta, indexed_meta, &response)) break;
+    }
+  }
+  return response;
+}
+
+// Insert a block's meta-data into the radix tree index.
+static void AddToRadixTree(BlockMetaData *meta) {
+  auto index_meta = MetaDataCast<IndexMetaData *>(meta);
+  auto indices = IndexOf(AppPCOf(meta));
+  os::LockedRegion locker(&(gSecondLevelLocks[indices.second]));
+
+  auto &array(gRadixIndex[indices.first]);
+  if (GRANARY_UNLIKELY(!array)) array = new MetaDataArray;
+
+  auto &metas(array->metas[indices.second]);
+
+  index_meta->next = metas;
+  metas = meta;
+}
+
+// Replace the meta-data in the radix tree index that exactly unifies with
+// `meta`. Returns the replaced meta-data, or `nullptr` if nothing was replaced,
+// in which case `meta` is added to the index.
+static const BlockMetaData *ReplaceInRadixTree(BlockMetaData *meta) {
+  auto index_meta = MetaDataCast<IndexMetaData *>(meta);
+  auto indices = IndexOf(AppPCOf(meta));
+  os::LockedRegion locker(&(gSecondLevelLocks[indices.second]));
+
+  auto &array(gRadixIndex[indices.first]);
+  if (GRANARY_UNLIKELY(!array)) array = new MetaDataArray;
+
+  auto next_ptr = &(array->metas[indices.second]);
+  for (; *next_ptr; next_ptr = &(MetaDataCast<const IndexMetaData *>(
+                                     *next_ptr)->next)) {
+    auto indexed_meta = *next_ptr;
+    IndexFindResponse response = {kUnificationStatusReject, nullptr};
+    if (MatchMetaData(meta, indexed_meta, &response)) {
+      auto indexed_index_meta = MetaDataCast<const IndexMetaData *>(
+          indexed_meta);
+      index_meta->next = indexed_index_meta->next;
+      *next_ptr = meta;
+      indexed_index_meta->next = nullptr;
+      return indexed_meta;
+    }
+  }
+  index_meta->next = array->metas[indices.second];
+  array->metas[indices.second] = meta;
+  return nullptr;
+}
+
+// Iterates over all meta-data in the radix tree index.
+static void ForEachInRadixTree(
+    const std::function<void(const BlockMetaData *, IndexedStatus)> &func) {
+  for (auto meta_array : gRadixIndex) {
+    if (!meta_array) continue;
+    for (auto metas : meta_array->metas) {
+      for (auto meta : IndexMetaDataIterator(metas)) {
+        func(meta, kMetaDataIndexed);
+      }
+    }
+  }
+}
+
+static const IndexEngine kRadixTreeIndex = {
+  &ExitRadixTree,
+  &RemoveAllFromRadixTree,
+  &RemoveRangeFromRadixTree,
+  &FindInRadixTree,
+  &AddToRadixTree,
+  &ReplaceInRadixTree,
+  &ForEachInRadixTree
+};
+
+// A bucket in the hash table index. The first cache line of a bucket contains
+// the fingerprints of all meta-data in the bucket, so that most lookup misses
+// can be rejected without touching any `BlockMetaData`.
+//
+// Entries are published in order, RCU-style: a writer first stores the meta-
+// data pointer of an entry and then (with release semantics) the entry's
+// fingerprint. Readers don't synchronize with writers; a reader that observes
+// a non-zero fingerprint is guaranteed to observe the associated meta-data.
+//
+// Removing an entry doesn't move any other entries; instead, the entry's
+// fingerprint is replaced by `kRemovedEntryFingerprint`, which never matches
+// a lookup. The removed meta-data stays readable until it is reclaimed, and
+// the entry can later be reused by a writer.
+class IndexBucket {
+ public:
+  IndexBucket(void)
+      : next(ATOMIC_VAR_INIT(nullptr)) {
+    for (auto i = 0UL; i < kNumEntriesPerBucket; ++i) {
+      fingerprints[i].store(0, std::memory_order_relaxed);
+      metas[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  ~IndexBucket(void) {
+    for (auto i = 0UL; i < kNumEntriesPerBucket; ++i) {
+      auto fingerprint = fingerprints[i].load(std::memory_order_relaxed);
+      if (kRemovedEntryFingerprint == fingerprint) continue;
+      if (auto indexed_meta = metas[i].load(std::memory_order_relaxed)) {
+        delete indexed_meta;
+      }
+    }
+  }
+
+  // Fingerprints of the application PCs of the entries in this bucket. A
+  // fingerprint of `0` means that the entry (and all later entries) is empty.
+  // A fingerprint of `kRemovedEntryFingerprint` means that the entry's
+  // meta-data has been removed from the index.
+  std::atomic<uint16_t> fingerprints[kNumEntriesPerBucket];
+
+  // Next bucket in this bucket's chain.
+  std::atomic<IndexBucket *> next;
+
+  // The meta-data of each entry.
+  std::atomic<const BlockMetaData *> metas[kNumEntriesPerBucket];
+
+  GRANARY_DEFINE_NEW_ALLOCATOR(IndexBucket, {
+    kAlignment = arch::CACHE_LINE_SIZE_BYTES
+  })
+
+ private:
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(IndexBucket);
+};
+
+static_assert(arch::CACHE_LINE_SIZE_BYTES == offsetof(IndexBucket, metas),
+    "The fingerprints and `next` pointer of an `IndexBucket` must fill "
+    "exactly one cache line.");
+
+// A chain of hash buckets. Each chain has its own lock, which serializes
+// writers to the chain. Readers never acquire the lock.
+struct IndexChain {
+  std::atomic<IndexBucket *> first;
+  SpinLock lock;
+};
+
+// Top-level hash table of bucket chains.
+static IndexChain gHashIndex[kNumHashTableChains];
+
+// Hashes a program counter using Fibonacci hashing. The high-order bits of
+// the hash select a chain, and some of the lower-order bits of the hash form
+// a fingerprint.
+static uint64_t HashOf(AppPC pc) {
+  return reinterpret_cast<uintptr_t>(pc) * 0x9E3779B97F4A7C15ULL;
+}
+
+static IndexChain *ChainOf(uint64_t hash) {
+  return &(gHashIndex[hash >> (64 - kNumBitsHashTableIndex)]);
+}
+
+static uint16_t FingerprintOf(uint64_t hash) {
+  auto fingerprint = static_cast<uint16_t>(hash >> 24);
+  if (!fingerprint) return 1;
+  if (kRemovedEntryFingerprint == fingerprint) return fingerprint - 1;
+  return fingerprint;
+}
+
+// Exit the hash table index.
+static void ExitHashTable(void) {
+  for (auto &chain : gHashIndex) {
+    auto bucket = chain.first.load(std::memory_order_relaxed);
+    for (IndexBucket *next_bucket(nullptr); bucket; bucket = next_bucket) {
+      next_bucket = bucket->next.load(std::memory_order_relaxed);
+      delete bucket;
+    }
+    chain.first.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+// Publish some meta-data into an empty entry of a bucket.
+static void PublishEntry(IndexBucket *bucket, size_t i,
+                         const BlockMetaData *meta, uint16_t fingerprint) {
+  bucket->metas[i].store(meta, std::memory_order_relaxed);
+  bucket->fingerprints[i].store(fingerprint, std::memory_order_release);
+}
+
+// Remove all meta-data from the hash table index.
+static const BlockMetaData *RemoveAllFromHashTable(void) {
+  const BlockMetaData *metas(nullptr);
+  for (auto &chain : gHashIndex) {
+    auto bucket = chain.first.load(std::memory_order_relaxed);
+    for (IndexBucket *next_bucket(nullptr); bucket; bucket = next_bucket) {
+      next_bucket = bucket->next.load(std::memory_order_relaxed);
+      for (auto i = 0UL; i < kNumEntriesPerBucket; ++i) {
+        auto fingerprint = bucket->fingerprints[i].load(
+            std::memory_order_relaxed);
+        if (!fingerprint) break;
+        if (kRemovedEntryFingerprint != fingerprint) {
+          auto meta = bucket->metas[i].load(std::memory_order_relaxed);
+          MetaDataCast<const IndexMetaData *>(meta)->next = metas;
+          metas = meta;
         }
-        break;
+        bucket->metas[i].store(nullptr, std::memory_order_relaxed);
+      }
+      delete bucket;
+    }
+    chain.first.store(nullptr, std::memory_order_relaxed);
+  }
+  return metas;
+}
 
-      case kUnificationStatusReject:
-        break;
+// Remove all meta-data in the range `[begin_pc, end_pc)` from the hash table
+// index. This can run concurrently with readers and writers of the index.
+// Each chain is modified while holding the chain's lock, and removed entries
+// are marked as removed rather than being compacted away, so that concurrent
+// readers never miss an entry that wasn't removed.
+static const BlockMetaData *RemoveRangeFromHashTable(AppPC begin_pc,
+                                                     AppPC end_pc) {
+  const BlockMetaData *metas(nullptr);
+  for (auto &chain : gHashIndex) {
+    if (!chain.first.load(std::memory_order_acquire)) continue;
+
+    SpinLockedRegion locker(&(chain.lock));
+    auto bucket = chain.first.load(std::memory_order_relaxed);
+    for (; bucket; bucket = bucket->next.load(std::memory_order_relaxed)) {
+      for (auto i = 0UL; i < kNumEntriesPerBucket; ++i) {
+        auto fingerprint = bucket->fingerprints[i].load(
+            std::memory_order_relaxed);
+        if (!fingerprint) break;
+        if (kRemovedEntryFingerprint == fingerprint) continue;
+
+        auto meta = bucket->metas[i].load(std::memory_order_relaxed);
+        if (!MetaDataInRange(meta, begin_pc, end_pc)) continue;
+
+        bucket->fingerprints[i].store(kRemovedEntryFingerprint,
+                                      std::memory_order_release);
+        MetaDataCast<const IndexMetaData *>(meta)->next = metas;
+        metas = meta;
+      }
+    }
+  }
+  return metas;
+}
+
+// Perform a lookup operation in the hash table index. This does not acquire
+// any locks.
+static IndexFindResponse FindInHashTable(const BlockMetaData *meta) {
+  IndexFindResponse response = {kUnificationStatusReject, nullptr};
+  const auto hash = HashOf(AppPCOf(meta));
+  const auto fingerprint = FingerprintOf(hash);
+  auto bucket = ChainOf(hash)->first.load(std::memory_order_acquire);
+  for (; bucket; bucket = bucket->next.load(std::memory_order_acquire)) {
+    for (auto i = 0UL; i < kNumEntriesPerBucket; ++i) {
+      auto entry_fingerprint = bucket->fingerprints[i].load(
+          std::memory_order_acquire);
+      if (!entry_fingerprint) return response;  // End of the chain.
+      if (fingerprint != entry_fingerprint) continue;
+      auto indexed_meta = bucket->metas[i].load(std::memory_order_relaxed);
+      if (MatchMetaData(meta, indexed_meta, &response)) return response;
     }
   }
   return response;
 }
 
+// Insert a block's meta-data into the hash table index.
+static void AddToHashTable(BlockMetaData *meta) {
+  const auto hash = HashOf(AppPCOf(meta));
+  const auto fingerprint = FingerprintOf(hash);
+  auto chain = ChainOf(hash);
+  SpinLockedRegion locker(&(chain->lock));
+
+  IndexBucket *last_bucket(nullptr);
+  auto bucket = chain->first.load(std::memory_order_relaxed);
+  for (; bucket; bucket = bucket->next.load(std::memory_order_relaxed)) {
+    for (auto i = 0UL; i < kNumEntriesPerBucket; ++i) {
+      auto entry_fingerprint = bucket->fingerprints[i].load(
+          std::memory_order_relaxed);
+      if (!entry_fingerprint ||
+          kRemovedEntryFingerprint == entry_fingerprint) {
+        PublishEntry(bucket, i, meta, fingerprint);
+        return;
+      }
+    }
+    last_bucket = bucket;
+  }
+
+  // All buckets are full; fill in a new bucket before making it reachable.
+  bucket = new IndexBucket;
+  PublishEntry(bucket, 0, meta, fingerprint);
+  if (last_bucket) {
+    last_bucket->next.store(bucket, std::memory_order_release);
+  } else {
+    chain->first.store(bucket, std::memory_order_release);
+  }
+}
+
+// Replace the meta-data in the hash table index that exactly unifies with
+// `meta`. Returns the replaced meta-data, or `nullptr` if nothing was replaced,
+// in which case `meta` is added to the index.
+//
+// Note: Concurrent readers either see the replaced meta-data or `meta`. The
+//       replaced meta-data is never freed by this, so both are safe to use.
+static const BlockMetaData *ReplaceInHashTable(BlockMetaData *meta) {
+  const auto hash = HashOf(AppPCOf(meta));
+  const auto fingerprint = FingerprintOf(hash);
+  auto chain = ChainOf(hash);
+  do {
+    SpinLockedRegion locker(&(chain->lock));
+    auto bucket = chain->first.load(std::memory_order_relaxed);
+    for (; bucket; bucket = bucket->next.load(std::memory_order_relaxed)) {
+      for (auto i = 0UL; i < kNumEntriesPerBucket; ++i) {
+        auto entry_fingerprint = bucket->fingerprints[i].load(
+            std::memory_order_relaxed);
+        if (!entry_fingerprint) break;
+        if (fingerprint != entry_fingerprint) continue;
+        auto indexed_meta = bucket->metas[i].load(std::memory_order_relaxed);
+        IndexFindResponse response = {kUnificationStatusReject, nullptr};
+        if (MatchMetaData(meta, indexed_meta, &response)) {
+          bucket->metas[i].store(meta, std::memory_order_release);
+          return indexed_meta;
+        }
+      }
+    }
+  } while (false);
+  AddToHashTable(meta);
+  return nullptr;
+}
+
+// Iterates over all meta-data in the hash table index.
+static void ForEachInHashTable(
+    const std::function<void(const BlockMetaData *, IndexedStatus)> &func) {
+  for (auto &chain : gHashIndex) {
+    auto bucket = chain.first.load(std::memory_order_acquire);
+    for (; bucket; bucket = bucket->next.load(std::memory_order_acquire)) {
+      for (auto i = 0UL; i < kNumEntriesPerBucket; ++i) {
+        auto fingerprint = bucket->fingerprints[i].load(
+            std::memory_order_acquire);
+        if (!fingerprint) break;
+        if (kRemovedEntryFingerprint == fingerprint) continue;
+        func(bucket->metas[i].load(std::memory_order_relaxed),
+             kMetaDataIndexed);
+      }
+    }
+  }
+}
+
+static const IndexEngine kHashTableIndex = {
+  &ExitHashTable,
+  &RemoveAllFromHashTable,
+  &RemoveRangeFromHashTable,
+  &FindInHashTable,
+  &AddToHashTable,
+  &ReplaceInHashTable,
+  &ForEachInHashTable
+};
+
+// The index engine in use.
+static const IndexEngine *gIndex = &kHashTableIndex;
+
 }  // namespace
 
 // Initialize the code cache index.
 void InitIndex(void) {
-
+  gIndex = FLAG_index_with_radix_tree ? &kRadixTreeIndex : &kHashTableIndex;
 }
 
 // Exit the code cache index.
 void ExitIndex(void) {
-  for (auto &array : gIndex) {
-    if (array) {
-      delete array;
-      array = nullptr;
-    }
-  }
+  gIndex->exit();
   for (auto &metas : gUnindexedMeta) {
-    for (auto meta = metas; meta; ) {
-      auto index_meta = MetaDataCast<IndexMetaData *>(meta);
-      auto next_meta = index_meta->next;
-      delete meta;
-      meta = next_meta;
-    }
+    DeleteMetaDataList(metas);
     metas = nullptr;
   }
 }
 
+// Remove all meta-data from the code cache index and from the global list of
+// all meta-data. The removed meta-data is returned as a linked list, chained
+// together through `IndexMetaData::next`.
+//
+// Note: This must only be invoked at a safe point, i.e. when no other thread
+//       is executing within Granary.
+const BlockMetaData *RemoveAllMetaDataFromIndex(void) {
+  auto metas = gIndex->remove_all();
+  for (auto &unindexed_metas : gUnindexedMeta) {
+    metas = PrependMetaDataList(unindexed_metas, metas);
+    unindexed_metas = nullptr;
+  }
+  return metas;
+}
+
+// Remove all meta-data whose application PCs are in the range
+// `[begin_pc, end_pc)` from the code cache index and from the global list of
+// all meta-data. The removed meta-data is returned as a linked list, chained
+// together through `IndexMetaData::next`.
+//
+// Note: This can be invoked while other threads are executing within Granary.
+//       Threads that are concurrently looking up meta-data might still find
+//       removed meta-data, so the caller must retire (rather than free) the
+//       removed meta-data.
+const BlockMetaData *RemoveMetaDataFromIndex(AppPC begin_pc, AppPC end_pc) {
+  auto metas = gIndex->remove_range(begin_pc, end_pc);
+  for (auto i = 0UL; i < kMaxFirstIndex; ++i) {
+    SpinLockedRegion locker(&(gUnindexedMetaLock[i]));
+    metas = RemoveMetaDataInRange(&(gUnindexedMeta[i]), begin_pc, end_pc,
+                                  metas);
+  }
+  return metas;
+}
+
 // Perform a lookup operation in the code cache index. Lookup operations might
 // not return exact matches, as hinted at by the `status` field of the
 // `IndexFindResponse` structure. This has to do with block unification.
@@ -163,39 +675,36 @@ IndexFindResponse FindMetaDataInIndex(const BlockMetaData *meta) {
   GRANARY_IF_DEBUG( auto index_meta =
       MetaDataCast<const IndexMetaData *>(meta); )
   GRANARY_ASSERT(!index_meta->next);
+  GRANARY_ASSERT(nullptr != AppPCOf(meta));
 
-  auto pc = AppPCOf(meta);
-  GRANARY_ASSERT(nullptr != pc);
-
-  auto indices = IndexOf(pc);
-  if (auto array = gIndex[indices.first]) {
-    if (auto metas = array->metas[indices.second]) {
-      return MatchMetaData(metas, meta);
-    }
-  }
-  return {kUnificationStatusReject, nullptr};  // Not in the index
+  return gIndex->find(meta);
 }
 
 // Insert a block's meta-data into the code cache index.
 void AddMetaDataToIndex(BlockMetaData *meta) {
   GRANARY_ASSERT(nullptr != meta);
 
-  auto index_meta = MetaDataCast<IndexMetaData *>(meta);
+  GRANARY_IF_DEBUG( auto index_meta = MetaDataCast<IndexMetaData *>(meta); )
   GRANARY_ASSERT(nullptr == index_meta->next);
+  GRANARY_ASSERT(nullptr != AppPCOf(meta));
 
-  auto pc = AppPCOf(meta);
-  GRANARY_ASSERT(nullptr != pc);
-
-  auto indices = IndexOf(pc);
-  os::LockedRegion locker(&(gSecondLevelLocks[indices.second]));
+  gIndex->add(meta);
+}
 
-  auto &array(gIndex[indices.first]);
-  if (GRANARY_UNLIKELY(!array)) array = new MetaDataArray;
+// Insert a block's meta-data into the code cache index, replacing any indexed
+// meta-data that exactly unifies with `meta`. The replaced meta-data is moved
+// into the global list of all meta-data, as existing code might still jump to
+// its block.
+void ReplaceMetaDataInIndex(BlockMetaData *meta) {
+  GRANARY_ASSERT(nullptr != meta);
 
-  auto &metas(array->metas[indices.second]);
+  GRANARY_IF_DEBUG( auto index_meta = MetaDataCast<IndexMetaData *>(meta); )
+  GRANARY_ASSERT(nullptr == index_meta->next);
+  GRANARY_ASSERT(nullptr != AppPCOf(meta));
 
-  index_meta->next = metas;
-  metas = meta;
+  if (auto replaced_meta = gIndex->replace(meta)) {
+    AddMetaDataToLog(const_cast<BlockMetaData *>(replaced_meta));
+  }
 }
 
 // Insert a block's meta-data into the global list of all meta-data.
@@ -220,14 +729,7 @@ namespace detail {
 // Iterates over all meta-data.
 void ForEachMetaData(
     const std::function<void(const BlockMetaData *, IndexedStatus)> &func) {
-  for (auto meta_array : gIndex) {
-    if (!meta_array) continue;
-    for (auto metas : meta_array->metas) {
-      for (auto meta : IndexMetaDataIterator(metas)) {
-        func(meta, kMetaDataIndexed);
-      }
-    }
-  }
+  gIndex->for_each(func);
   for (auto meta_array : gUnindexedMeta) {
     for (auto meta : IndexMetaDataIterator(meta_array)) {
       func(meta, kMetaDataUnindexed);
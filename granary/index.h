@@ -71,9 +71,34 @@ IndexFindResponse FindMetaDataInIndex(const BlockMetaData *meta);
 // Insert a block into the code cache index.
 void AddMetaDataToIndex(BlockMetaData *meta);
 
+// Insert a block's meta-data into the code cache index, replacing any indexed
+// meta-data that exactly unifies with `meta`. The replaced meta-data is moved
+// into the global list of all meta-data, as existing code might still jump to
+// its block.
+void ReplaceMetaDataInIndex(BlockMetaData *meta);
+
 // Insert a block's meta-data into the global list of all meta-data.
 void AddMetaDataToLog(BlockMetaData *meta);
 
+// Remove all meta-data from the code cache index and from the global list of
+// all meta-data. The removed meta-data is returned as a linked list, chained
+// together through `IndexMetaData::next`.
+//
+// Note: This must only be invoked at a safe point, i.e. when no other thread
+//       is executing within Granary.
+const BlockMetaData *RemoveAllMetaDataFromIndex(void);
+
+// Remove all meta-data whose application PCs are in the range
+// `[begin_pc, end_pc)` from the code cache index and from the global list of
+// all meta-data. The removed meta-data is returned as a linked list, chained
+// together through `IndexMetaData::next`.
+//
+// Note: This can be invoked while other threads are executing within Granary.
+//       Threads that are concurrently looking up meta-data might still find
+//       removed meta-data, so the caller must retire (rather than free) the
+//       removed meta-data.
+const BlockMetaData *RemoveMetaDataFromIndex(AppPC begin_pc, AppPC end_pc);
+
 #endif  // GRANARY_INTERNAL
 
 enum IndexedStatus {
@@ -9,10 +9,14 @@
 #include "granary/cache.h"
 #include "granary/client.h"
 #include "granary/context.h"
+#include "granary/decode_cache.h"
 #include "granary/index.h"
 #include "granary/init.h"
 #include "granary/metadata.h"
+#include "granary/persist.h"
+#include "granary/speculate.h"
 
+#include "os/event_log.h"
 #include "os/logging.h"
 #include "os/memory.h"
 #include "os/module.h"
@@ -51,6 +55,7 @@ void Init(InitReason reason) {
   os::InitHeap();  // Initialize the Granary heap.
   os::InitModuleManager();  // Initialize the global module manager.
   os::InitLog();  // Initialize the logging infrastructure.
+  os::InitEventLog();  // Start writing binary events, if enabled.
 
   // Initialize the driver (e.g. XED, DynamoRIO). This usually performs some
   // architecture-specific checks to determine which architectural features
@@ -60,10 +65,13 @@ void Init(InitReason reason) {
   InitMetaData();
   InitCodeCache();
   InitIndex();
+  InitDecodeCache();
   InitClients();
   InitContext();
   InitToolManager();
   InitTools(reason);
+  InitSpeculation();
+  InitPersistentCache();
 }
 
 }  // namespace granary
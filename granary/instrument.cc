@@ -8,12 +8,14 @@
 #include "granary/cfg/trace.h"
 #include "granary/cfg/block.h"
 #include "granary/cfg/factory.h"
+#include "granary/cfg/instruction.h"
 
 #include "granary/instrument.h"
 
 #include "granary/breakpoint.h"
 #include "granary/context.h"
 #include "granary/metadata.h"
+#include "granary/profile.h"
 #include "granary/tool.h"
 
 GRANARY_DEFINE_positive_int(max_num_control_flow_iterations, 8,
@@ -21,6 +23,10 @@ GRANARY_DEFINE_positive_int(max_num_control_flow_iterations, 8,
     "pass per trace request. The default value is `8`, which--despite being "
     "small--could result in a massive blowup of code.");
 
+GRANARY_DEFINE_positive_uint(hot_trace_max_blocks, 16,
+    "The maximum number of basic blocks that are decoded into a hot trace. "
+    "The default value is `16`.");
+
 namespace granary {
 
 // Initialize a binary instrumenter.
@@ -53,6 +59,88 @@ void BinaryInstrumenter::InstrumentDirect(void) {
   *meta = entry_block->UnsafeMetaData();
 }
 
+namespace {
+
+// Returns true if the trace contains a decoded block starting at `pc`.
+static bool TraceContainsBlock(Trace *trace, AppPC pc) {
+  for (auto block : trace->Blocks()) {
+    if (IsA<DecodedBlock *>(block) && block->StartAppPC() == pc) return true;
+  }
+  return false;
+}
+
+// Returns the hottest direct successor of `block` that can be decoded into a
+// hot trace, or `nullptr` if the trace should end at `block`. Hot traces
+// follow jumps, but not function calls, and end when they loop back on
+// themselves, in which case the loop is closed within the trace.
+static DirectBlock *HottestSuccessor(BlockFactory *factory, Trace *trace,
+                                     DecodedBlock *block) {
+  DirectBlock *hottest_block(nullptr);
+  size_t hottest_count(0);
+  auto closes_loop = false;
+  for (auto succ : block->Successors()) {
+    auto direct_block = DynamicCast<DirectBlock *>(succ.block);
+    if (!direct_block) continue;
+    if (!succ.cfi->IsConditionalJump() && !succ.cfi->IsUnconditionalJump()) {
+      continue;
+    }
+    if (IsA<ExceptionalControlFlowInstruction *>(succ.cfi)) continue;
+    auto target_pc = direct_block->StartAppPC();
+    if (TraceContainsBlock(trace, target_pc)) {
+      factory->RequestBlock(direct_block, kRequestBlockFromTrace);
+      closes_loop = true;
+      continue;
+    }
+    auto count = GlobalContext()->NumDirectEdgeExecutions(target_pc);
+    if (count > hottest_count) {
+      hottest_block = direct_block;
+      hottest_count = count;
+    }
+  }
+  return closes_loop ? nullptr : hottest_block;
+}
+
+// Returns the decoded successor of `block` that starts at `pc`.
+static DecodedBlock *DecodedSuccessor(DecodedBlock *block, AppPC pc) {
+  for (auto succ : block->Successors()) {
+    if (IsA<CompensationBlock *>(succ.block)) continue;
+    auto decoded_block = DynamicCast<DecodedBlock *>(succ.block);
+    if (decoded_block && decoded_block->StartAppPC() == pc) {
+      return decoded_block;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+// Instrument some code as-if it is targeted by a direct CFI, where the
+// targeted block is the head of a hot trace. The hottest direct successor of
+// each block, as counted by profiled direct edges, is decoded into the trace,
+// so that the blocks of the trace are compiled together.
+void BinaryInstrumenter::InstrumentHotTrace(void) {
+  auto entry_block = factory.MaterializeDirectEntryBlock(*meta);
+  *meta = nullptr;  // Potentially undefined after this point.
+
+  auto block = entry_block;
+  for (auto num_blocks = 1U; num_blocks < FLAG_hot_trace_max_blocks;
+       ++num_blocks) {
+    auto succ_block = HottestSuccessor(&factory, trace, block);
+    if (!succ_block) break;
+    const auto succ_pc = succ_block->StartAppPC();
+    factory.RequestBlock(succ_block, kRequestBlockFromTrace);
+    factory.MaterializeRequestedBlocks();
+    if (!(block = DecodedSuccessor(block, succ_pc))) break;
+  }
+
+  InstrumentControlFlow();
+  InstrumentBlocks();
+  InstrumentBlock();
+  factory.RemoveUnreachableBlocks();
+
+  *meta = entry_block->UnsafeMetaData();
+}
+
 // Instrument some code as-if it is targeted by an indirect CFI.
 void BinaryInstrumenter::InstrumentIndirect(void) {
   factory.MaterializeIndirectEntryBlock(*meta);
@@ -68,8 +156,11 @@ void BinaryInstrumenter::InstrumentEntryPoint(EntryPointKind kind,
                                               int category) {
   factory.MaterializeIndirectEntryBlock(*meta);
   auto entry_block = DynamicCast<CompensationBlock *>(trace->EntryBlock());
+  TranslationTimer timer;
+  auto tool_index = 0UL;
   for (auto tool : ToolIterator(tools)) {
     tool->InstrumentEntryPoint(&factory, entry_block, kind, category);
+    timer.RecordTool(tool_index++);
   }
   factory.MaterializeRequestedBlocks();
   InstrumentControlFlow();
@@ -101,8 +192,11 @@ static bool FinalizeControlFlow(BlockFactory *factory,
 void BinaryInstrumenter::InstrumentControlFlow(void) {
   auto stop = false;
   for (auto num_iterations = 1; ; factory.MaterializeRequestedBlocks()) {
+    TranslationTimer timer;
+    auto tool_index = 0UL;
     for (auto tool : ToolIterator(tools)) {
       tool->InstrumentControlFlow(&factory, trace);
+      timer.RecordTool(tool_index++);
     }
     if (stop) break;
     if (!factory.HasPendingMaterializationRequest()) {
@@ -121,8 +215,11 @@ void BinaryInstrumenter::InstrumentControlFlow(void) {
 
 // Apply trace-wide instrumentation for every tool.
 void BinaryInstrumenter::InstrumentBlocks(void) {
+  TranslationTimer timer;
+  auto tool_index = 0UL;
   for (auto tool : ToolIterator(tools)) {
     tool->InstrumentBlocks(trace);
+    timer.RecordTool(tool_index++);
   }
 }
 
@@ -132,10 +229,14 @@ void BinaryInstrumenter::InstrumentBlocks(void) {
 //       block before moving on to the next block in the trace.
 void BinaryInstrumenter::InstrumentBlock(void) {
   for (auto block : trace->Blocks()) {
+    TranslationTimer timer;
+    auto tool_index = 0UL;
     for (auto tool : ToolIterator(tools)) {
       if (auto decoded_block = DynamicCast<DecodedBlock *>(block)) {
         tool->InstrumentBlock(decoded_block);
+        timer.RecordTool(tool_index);
       }
+      ++tool_index;
     }
   }
 }
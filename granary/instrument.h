@@ -34,6 +34,10 @@ class BinaryInstrumenter {
   // Instrument some code as-if it is targeted by a direct CFI.
   void InstrumentDirect(void);
 
+  // Instrument some code as-if it is targeted by a direct CFI, where the
+  // targeted block is the head of a hot trace.
+  void InstrumentHotTrace(void);
+
   // Instrument some code as-if it is targeted by an indirect CFI.
   void InstrumentIndirect(void);
 
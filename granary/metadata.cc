@@ -81,7 +81,7 @@ static void InitAllocator(void) {
   auto max_num_allocs = (remaining_size - gSize + 1) / gSize;
   auto max_offset = offset + max_num_allocs * gSize;
   GRANARY_ASSERT(internal::kNewAllocatorNumBytesPerSlab >= max_offset);
-  gAllocator.Construct(offset, max_offset, gSize, gSize);
+  gAllocator.Construct("BlockMetaData", offset, max_offset, gSize, gSize);
 }
 
 }  // namespace
@@ -0,0 +1,390 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#define GRANARY_INTERNAL
+
+#include "granary/base/cast.h"
+#include "granary/base/cstring.h"
+#include "granary/base/option.h"
+#include "granary/base/string.h"
+
+#include "granary/app.h"
+#include "granary/index.h"
+#include "granary/metadata.h"
+#include "granary/persist.h"
+#include "granary/speculate.h"
+
+#include "os/file.h"
+#include "os/module.h"
+
+GRANARY_DEFINE_string(persistent_cache_file, "",
+    "Path to a file in which Granary records the blocks that it translated. "
+    "On the next run of Granary with the same options, idle worker threads "
+    "re-translate the recorded blocks of each module once the module is "
+    "first seen, so that the blocks are already in the code cache index when "
+    "the application reaches them. Encoded code is not persisted, so this "
+    "moves translation off of the application's threads rather than avoiding "
+    "it. If `--num_speculative_translation_threads` is `0`, then one worker "
+    "thread is started for the persisted blocks. The default value is `` "
+    "(empty), which disables the persistent cache."
+    GRANARY_IF_KERNEL("\n"
+    "\n"
+    "Note: The persistent cache is not supported in kernel space."));
+
+namespace granary {
+namespace {
+enum : uint64_t {
+  kMagic = 0x45484341434E5247ULL  // `GRNCACHE`.
+};
+
+enum : uint32_t {
+  kVersion = 1,
+
+  // Maximum number of modules in a persistent cache.
+  kMaxNumModules = 256,
+
+  // Number of bytes buffered before being written to the persistent cache.
+  kWriteBufferSize = 16384
+};
+
+// A persisted block. This is the offset of the block's first instruction
+// within the file of the block's module.
+struct PersistentBlock {
+  uint64_t offset;
+  uint32_t module_index;
+  uint32_t padding;
+};
+
+// A module whose blocks were persisted.
+struct PersistentModule {
+  // Version of the module's file when the cache was written. A version of `0`
+  // means that the module's blocks can never be used.
+  uint64_t version;
+  char path[os::Module::kMaxModulePathLength];
+};
+
+// Located at the end of the persistent cache file, after the blocks and the
+// modules.
+struct PersistentCacheFooter {
+  uint64_t magic;
+  uint64_t config_hash;
+  uint64_t checksum;
+  uint32_t version;
+  uint32_t num_modules;
+  uint32_t num_blocks;
+  uint32_t padding;
+};
+
+// The previously written persistent cache, mapped into memory.
+static const void *gCache = nullptr;
+static size_t gCacheNumBytes = 0;
+static const PersistentBlock *gBlocks = nullptr;
+static const PersistentModule *gModules = nullptr;
+static uint32_t gNumBlocks = 0;
+static uint32_t gNumModules = 0;
+
+// Whether or not the persisted blocks of each module have been hinted, or
+// discarded because the module changed.
+static std::atomic<bool> gModuleIsDone[kMaxNumModules];
+static std::atomic<uint32_t> gNumPendingModules(ATOMIC_VAR_INIT(0));
+
+// Loaded modules whose persisted blocks are hinted to the worker threads, and
+// the index of the next persisted block to check for each such module.
+static std::atomic<const os::Module *> gHintedModules[kMaxNumModules];
+static std::atomic<uint32_t> gNextHintedBlock[kMaxNumModules];
+static std::atomic<uint32_t> gNumHintedModules(ATOMIC_VAR_INIT(0));
+
+// Modules whose blocks are being written to the new persistent cache.
+static const os::Module *gNewModuleKeys[kMaxNumModules] = {nullptr};
+static PersistentModule gNewModules[kMaxNumModules];
+static uint32_t gNumNewModules = 0;
+
+// Buffer for writing the new persistent cache.
+static uint8_t gWriteBuffer[kWriteBufferSize];
+static size_t gWriteBufferSize = 0;
+static uint64_t gWriteChecksum = 0;
+static uint32_t gNumWrittenBlocks = 0;
+
+// Update a checksum with `num_bytes` bytes from `data`.
+static uint64_t Checksum(uint64_t checksum, const void *data,
+                         size_t num_bytes) {
+  auto bytes = reinterpret_cast<const uint8_t *>(data);
+  for (auto i = 0UL; i < num_bytes; ++i) {
+    checksum = (checksum ^ bytes[i]) * 1099511628211ULL;  // FNV-1a.
+  }
+  return checksum;
+}
+
+// Returns a hash of everything that affects how blocks are translated, other
+// than the modules themselves.
+static uint64_t ConfigHash(void) {
+  uint64_t hash = HashOptions() ^ kVersion;
+  auto granary = os::ModuleContainingPC(
+      UnsafeCast<AppPC>(&InitPersistentCache));
+  if (granary) hash ^= os::FileVersion(granary->Path()) * 31;
+  return hash;
+}
+
+// Returns true if the mapped persistent cache is well-formed, and was written
+// by a run of Granary with the same configuration as this run.
+static bool IsValidCache(const void *cache, size_t num_bytes) {
+  if (num_bytes < sizeof(PersistentCacheFooter)) return false;
+  auto cache_addr = reinterpret_cast<uintptr_t>(cache);
+  auto footer = reinterpret_cast<const PersistentCacheFooter *>(
+      cache_addr + num_bytes - sizeof(PersistentCacheFooter));
+  if (kMagic != footer->magic || kVersion != footer->version ||
+      ConfigHash() != footer->config_hash ||
+      kMaxNumModules < footer->num_modules) {
+    return false;
+  }
+  const auto body_num_bytes =
+      footer->num_blocks * sizeof(PersistentBlock) +
+      footer->num_modules * sizeof(PersistentModule);
+  if (body_num_bytes + sizeof(PersistentCacheFooter) != num_bytes) {
+    return false;
+  }
+  return footer->checksum == Checksum(14695981039346656037ULL, cache,
+                                      body_num_bytes);
+}
+
+// Find the persisted module whose file is at `path`. Returns `-1` if no such
+// module was persisted.
+static int FindPersistentModule(const char *path) {
+  for (auto i = 0U; i < gNumModules; ++i) {
+    if (StringsMatch(gModules[i].path, path)) return static_cast<int>(i);
+  }
+  return -1;
+}
+
+// Hint the persisted blocks of `module` to the worker threads, if they haven't
+// already been hinted.
+//
+// Note: Modules are only freed when Granary exits, after the worker threads
+//       have exited, so the worker threads can safely use `module`.
+static void HintModuleBlocks(const os::Module *module) {
+  const auto index = FindPersistentModule(module->Path());
+  if (0 > index || gModuleIsDone[index].exchange(true)) return;
+  gNumPendingModules.fetch_sub(1);
+
+  const auto &persistent_module = gModules[index];
+  if (!persistent_module.version ||
+      persistent_module.version != os::FileVersion(module->Path())) {
+    return;  // The module's file changed since the cache was written.
+  }
+  gNextHintedBlock[index].store(0);
+  gHintedModules[index].store(module, std::memory_order_release);
+  gNumHintedModules.fetch_add(1);
+  WakeSpeculationWorkers();
+}
+
+// Write out the buffered part of the new persistent cache.
+static void Flush(os::FileWriter *file) {
+  file->Write(gWriteBuffer, gWriteBufferSize);
+  gWriteBufferSize = 0;
+}
+
+// Add `num_bytes` bytes from `data` to the new persistent cache.
+static void Write(os::FileWriter *file, const void *data, size_t num_bytes) {
+  gWriteChecksum = Checksum(gWriteChecksum, data, num_bytes);
+  if (gWriteBufferSize + num_bytes > kWriteBufferSize) Flush(file);
+  memcpy(&(gWriteBuffer[gWriteBufferSize]), data, num_bytes);
+  gWriteBufferSize += num_bytes;
+}
+
+// Add a block to the new persistent cache.
+static void WriteBlock(os::FileWriter *file, uint32_t module_index,
+                       uint64_t offset) {
+  PersistentBlock block = {offset, module_index, 0};
+  Write(file, &block, sizeof block);
+  ++gNumWrittenBlocks;
+}
+
+// Returns the index of `module` in the new persistent cache, adding the
+// module if necessary. Returns `-1` if the module's blocks can't be persisted.
+static int NewModuleIndex(const os::Module *module) {
+  static uint32_t last_index = 0;
+  if (last_index < gNumNewModules && module == gNewModuleKeys[last_index]) {
+    return static_cast<int>(last_index);
+  }
+  for (auto i = 0U; i < gNumNewModules; ++i) {
+    if (module == gNewModuleKeys[i]) return static_cast<int>(last_index = i);
+  }
+  if ('/' != module->Path()[0]) return -1;  // E.g. `[vdso]`.
+  if (kMaxNumModules <= gNumNewModules) return -1;
+
+  auto &new_module = gNewModules[gNumNewModules];
+  memset(&new_module, 0, sizeof new_module);
+  CopyString(new_module.path, module->Path());
+  new_module.version = os::FileVersion(module->Path());
+  gNewModuleKeys[gNumNewModules] = module;
+  return static_cast<int>(last_index = gNumNewModules++);
+}
+
+// Returns true if translating the block at the start of `meta` with default
+// meta-data will reproduce `meta`.
+static bool CanReproduce(const BlockMetaData *meta) {
+  auto app_meta = MetaDataCast<const AppMetaData *>(meta);
+  auto default_meta = new BlockMetaData(app_meta->start_pc);
+  auto can_reproduce = default_meta->Equals(meta);
+  delete default_meta;
+  return can_reproduce;
+}
+
+// Add the blocks in the code cache index to the new persistent cache.
+static void WriteIndexedBlocks(os::FileWriter *file) {
+  ForEachMetaData([=] (const BlockMetaData *meta, IndexedStatus status) {
+    if (kMetaDataIndexed != status) return;
+    auto app_meta = MetaDataCast<const AppMetaData *>(meta);
+    auto offset = os::ModuleOffsetOfPC(app_meta->start_pc);
+    if (!offset.IsValid()) return;
+    auto module_index = NewModuleIndex(offset.module);
+    if (0 > module_index || !gNewModules[module_index].version) return;
+    if (!CanReproduce(meta)) return;
+    WriteBlock(file, static_cast<uint32_t>(module_index), offset.offset);
+  });
+}
+
+// Returns true if the module whose file is at `path` is already in the new
+// persistent cache.
+static bool HasNewModule(const char *path) {
+  for (auto i = 0U; i < gNumNewModules; ++i) {
+    if (StringsMatch(gNewModules[i].path, path)) return true;
+  }
+  return false;
+}
+
+// Add the blocks of the previously loaded persistent cache whose modules were
+// never seen by this run to the new persistent cache.
+static void WriteUnusedBlocks(os::FileWriter *file) {
+  for (auto i = 0U; i < gNumModules; ++i) {
+    if (gModuleIsDone[i].load() || kMaxNumModules <= gNumNewModules) continue;
+    if (HasNewModule(gModules[i].path)) continue;
+    auto new_index = gNumNewModules++;
+    gNewModules[new_index] = gModules[i];
+    gNewModuleKeys[new_index] = nullptr;
+    for (auto j = 0U; j < gNumBlocks; ++j) {
+      if (i == gBlocks[j].module_index) {
+        WriteBlock(file, new_index, gBlocks[j].offset);
+      }
+    }
+  }
+}
+
+// Write out a new persistent cache.
+static void WritePersistentCache(void) {
+  os::FileWriter file(FLAG_persistent_cache_file);
+  if (!file.IsValid()) return;
+
+  gNumNewModules = 0;
+  gNumWrittenBlocks = 0;
+  gWriteBufferSize = 0;
+  gWriteChecksum = 14695981039346656037ULL;
+
+  WriteIndexedBlocks(&file);
+  WriteUnusedBlocks(&file);
+  for (auto i = 0U; i < gNumNewModules; ++i) {
+    Write(&file, &(gNewModules[i]), sizeof gNewModules[i]);
+  }
+  Flush(&file);
+
+  PersistentCacheFooter footer = {
+    kMagic, ConfigHash(), gWriteChecksum, kVersion, gNumNewModules,
+    gNumWrittenBlocks, 0
+  };
+  file.Write(&footer, sizeof footer);
+  file.Commit();
+}
+
+}  // namespace
+
+// Load the persistent cache, and hint the persisted blocks of all loaded
+// modules to the worker threads.
+void InitPersistentCache(void) {
+  if (!FLAG_persistent_cache_file[0]) return;
+
+  size_t num_bytes = 0;
+  auto cache = os::MapFile(FLAG_persistent_cache_file, &num_bytes);
+  if (!cache) return;
+  if (!IsValidCache(cache, num_bytes)) {
+    os::UnmapFile(cache, num_bytes);
+    return;
+  }
+
+  auto cache_addr = reinterpret_cast<uintptr_t>(cache);
+  auto footer = reinterpret_cast<const PersistentCacheFooter *>(
+      cache_addr + num_bytes - sizeof(PersistentCacheFooter));
+  gCache = cache;
+  gCacheNumBytes = num_bytes;
+  gNumBlocks = footer->num_blocks;
+  gNumModules = footer->num_modules;
+  gBlocks = reinterpret_cast<const PersistentBlock *>(cache);
+  gModules = reinterpret_cast<const PersistentModule *>(
+      cache_addr + gNumBlocks * sizeof(PersistentBlock));
+  for (auto i = 0U; i < gNumModules; ++i) {
+    gModuleIsDone[i].store(false);
+    gHintedModules[i].store(nullptr);
+  }
+  gNumHintedModules.store(0);
+
+  // If no worker thread could be started, then the loaded cache is only
+  // carried over into the new persistent cache.
+  if (!HasSpeculationWorkers()) return;
+  gNumPendingModules.store(gNumModules);
+
+  for (auto module : os::LoadedModules()) {
+    HintModuleBlocks(module);
+  }
+}
+
+// Write out the persistent cache, and unload the previously loaded cache.
+//
+// Note: This must only be invoked when no other thread is executing within
+//       Granary.
+void ExitPersistentCache(void) {
+  if (!FLAG_persistent_cache_file[0]) return;
+  WritePersistentCache();
+  if (gCache) os::UnmapFile(gCache, gCacheNumBytes);
+  gCache = nullptr;
+  gCacheNumBytes = 0;
+  gBlocks = nullptr;
+  gModules = nullptr;
+  gNumBlocks = 0;
+  gNumModules = 0;
+  gNumPendingModules.store(0);
+  gNumHintedModules.store(0);
+}
+
+// Hint the persisted blocks of the module containing `pc` to the worker
+// threads, if they haven't already been hinted.
+void HintPersistentBlocks(AppPC pc) {
+  if (GRANARY_LIKELY(!gNumPendingModules.load(std::memory_order_relaxed))) {
+    return;
+  }
+  if (auto module = os::ModuleContainingPC(pc)) {
+    HintModuleBlocks(module);
+  }
+}
+
+// Returns the meta-data of the next hinted block that a worker thread should
+// translate, or `nullptr` if there are no hinted blocks left.
+BlockMetaData *NextPersistentBlock(void) {
+  if (GRANARY_LIKELY(!gNumHintedModules.load(std::memory_order_relaxed))) {
+    return nullptr;
+  }
+  for (auto i = 0U; i < gNumModules; ++i) {
+    auto module = gHintedModules[i].load(std::memory_order_acquire);
+    if (!module) continue;
+    for (auto j = gNextHintedBlock[i].fetch_add(1); j < gNumBlocks;
+         j = gNextHintedBlock[i].fetch_add(1)) {
+      const auto &block = gBlocks[j];
+      if (i != block.module_index) continue;
+      if (auto pc = module->PCOfOffset(block.offset)) {
+        return new BlockMetaData(pc);
+      }
+    }
+    // Every persisted block of this module has been handed out.
+    if (gHintedModules[i].exchange(nullptr)) gNumHintedModules.fetch_sub(1);
+  }
+  return nullptr;
+}
+
+}  // namespace granary
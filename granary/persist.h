@@ -0,0 +1,56 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#ifndef GRANARY_PERSIST_H_
+#define GRANARY_PERSIST_H_
+
+#ifndef GRANARY_INTERNAL
+# error "This code is internal to Granary."
+#endif
+
+#include "granary/base/base.h"
+#include "granary/base/pc.h"
+
+namespace granary {
+
+// The persistent cache remembers which blocks were translated by previous runs
+// of Granary. Blocks are recorded as offsets into the files of the modules that
+// contain them, so that they can be found again even if the modules are loaded
+// at different addresses. When a module is first seen, its persisted blocks
+// become hints for the worker threads, which translate them while they are
+// otherwise idle. Persisted blocks are never translated by application
+// threads. A worker thread is started for them even if speculative
+// translation is disabled.
+//
+// Encoded code isn't persisted, as it embeds the addresses of edge data
+// structures, meta-data, and tool state that differ from run to run. The
+// persistent cache therefore takes translation off of the application's
+// critical path, but doesn't reduce the total amount of translation.
+//
+// A persistent cache is only used if it was written by a run of the same
+// Granary library with the same options, and a module's blocks are only used
+// if the module's file hasn't changed since it was written.
+
+// Forward declarations.
+class BlockMetaData;
+
+// Load the persistent cache, and hint the persisted blocks of all loaded
+// modules to the worker threads.
+void InitPersistentCache(void);
+
+// Write out the persistent cache, and unload the previously loaded cache.
+//
+// Note: This must only be invoked when no other thread is executing within
+//       Granary.
+void ExitPersistentCache(void);
+
+// Hint the persisted blocks of the module containing `pc` to the worker
+// threads, if they haven't already been hinted.
+void HintPersistentBlocks(AppPC pc);
+
+// Returns the meta-data of the next hinted block that a worker thread should
+// translate, or `nullptr` if there are no hinted blocks left.
+BlockMetaData *NextPersistentBlock(void);
+
+}  // namespace granary
+
+#endif  // GRANARY_PERSIST_H_
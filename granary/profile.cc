@@ -0,0 +1,199 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#define GRANARY_INTERNAL
+
+#include "arch/cpu.h"
+
+#include "granary/base/option.h"
+#include "granary/base/string.h"
+
+#include "granary/profile.h"
+#include "granary/tool.h"
+
+#include "os/logging.h"
+
+GRANARY_DEFINE_bool(profile_translation, false,
+    "Profile the translation pipeline. This measures the number of cycles "
+    "spent decoding instructions, in each tool's instrumentation functions, "
+    "in each assembly pass, and encoding instructions, as well as the number "
+    "of fragments, instructions, virtual registers, and spill slots in each "
+    "assembled trace. The profile is logged as a set of histograms when "
+    "Granary exits. The default is `no`.");
+
+namespace granary {
+namespace {
+
+// A histogram that can be concurrently updated.
+struct AtomicHistogram {
+  std::atomic<uint64_t> num_samples;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+  std::atomic<uint64_t> buckets[kNumTranslationHistogramBuckets];
+};
+
+static AtomicHistogram gPassHistograms[kNumTranslationPasses];
+static AtomicHistogram gCounterHistograms[kNumTranslationCounters];
+static AtomicHistogram gToolHistograms[kMaxNumTools];
+
+static const char *kPassNames[] = {
+  "decode",
+  "0_compile_inline_assembly",
+  "1_late_mangle",
+  "2_build_fragment_list",
+  "3_partition_fragments",
+  "4_add_entry_exit_fragments",
+  "5_save_and_restore_flags",
+  "6_track_virtual_regs",
+  "7_propagate_copies",
+  "8_schedule_registers",
+  "9_allocate_slots",
+  "10_add_connecting_jumps",
+  "11_find_block_entrypoints",
+  "encode"
+};
+
+static_assert(kNumTranslationPasses == sizeof kPassNames / sizeof kPassNames[0],
+              "Every translation pass must have a name.");
+
+static const char *kCounterNames[] = {
+  "fragments per trace",
+  "instructions per trace",
+  "virtual registers per trace",
+  "spill slots per trace",
+  "elided spills/fills per trace",
+  "elided flag saves per trace"
+};
+
+static_assert(
+    kNumTranslationCounters == sizeof kCounterNames / sizeof kCounterNames[0],
+    "Every translation counter must have a name.");
+
+// Returns the index of the histogram bucket that counts `value`.
+static size_t BucketIndex(uint64_t value) {
+  if (!value) return 0;
+  auto index = static_cast<size_t>(64 - __builtin_clzll(value));
+  return GRANARY_MIN(index, kNumTranslationHistogramBuckets - 1);
+}
+
+// Add `value` to a histogram.
+static void AddSample(AtomicHistogram *hist, uint64_t value) {
+  hist->num_samples.fetch_add(1, std::memory_order_relaxed);
+  hist->sum.fetch_add(value, std::memory_order_relaxed);
+  hist->buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  auto max = hist->max.load(std::memory_order_relaxed);
+  while (max < value &&
+         !hist->max.compare_exchange_weak(max, value,
+                                          std::memory_order_relaxed)) {}
+}
+
+// Take a snapshot of a histogram.
+static void CopyHistogram(const AtomicHistogram *hist,
+                          TranslationHistogram *copy) {
+  copy->num_samples = hist->num_samples.load(std::memory_order_relaxed);
+  copy->sum = hist->sum.load(std::memory_order_relaxed);
+  copy->max = hist->max.load(std::memory_order_relaxed);
+  for (auto i = 0UL; i < kNumTranslationHistogramBuckets; ++i) {
+    copy->buckets[i] = hist->buckets[i].load(std::memory_order_relaxed);
+  }
+}
+
+// Log a histogram. Empty histograms aren't logged.
+static void LogHistogram(const char *name, const AtomicHistogram *hist) {
+  TranslationHistogram copy;
+  CopyHistogram(hist, &copy);
+  if (!copy.num_samples) return;
+  os::Log(os::LogOutput, "  %s: n=%lu sum=%lu mean=%lu max=%lu\n", name,
+          copy.num_samples, copy.sum, copy.sum / copy.num_samples, copy.max);
+  for (auto i = 0UL; i < kNumTranslationHistogramBuckets; ++i) {
+    if (!copy.buckets[i]) continue;
+    os::Log(os::LogOutput, "    <%lu: %lu (%lu%%)\n",
+            i ? (1UL << i) : 1UL, copy.buckets[i],
+            (copy.buckets[i] * 100) / copy.num_samples);
+  }
+}
+
+}  // namespace
+
+// Returns true if the translation pipeline is being profiled.
+bool TranslationProfilingIsEnabled(void) {
+  return FLAG_profile_translation;
+}
+
+// Get the histogram of the number of cycles spent in each run of `pass`.
+void GetTranslationPassHistogram(TranslationPass pass,
+                                 TranslationHistogram *hist) {
+  CopyHistogram(&(gPassHistograms[pass]), hist);
+}
+
+// Get the histogram of the per-trace values of `counter`.
+void GetTranslationCounterHistogram(TranslationCounter counter,
+                                    TranslationHistogram *hist) {
+  CopyHistogram(&(gCounterHistograms[counter]), hist);
+}
+
+// Get the histogram of the number of cycles spent in each call to one of the
+// instrumentation functions of the tool named `tool_name`. Returns `false` if
+// there is no active tool named `tool_name`.
+bool GetToolInstrumentationHistogram(const char *tool_name,
+                                     TranslationHistogram *hist) {
+  for (auto i = 0UL; i < kMaxNumTools; ++i) {
+    auto name = ActiveToolName(i);
+    if (!name) break;
+    if (StringsMatch(name, tool_name)) {
+      CopyHistogram(&(gToolHistograms[i]), hist);
+      return true;
+    }
+  }
+  return false;
+}
+
+TranslationTimer::TranslationTimer(void)
+    : start_cycles(FLAG_profile_translation ? arch::CycleCount() : 0) {}
+
+// Record the cycles spent in `pass`.
+void TranslationTimer::RecordPass(TranslationPass pass) {
+  if (!start_cycles) return;
+  AddSample(&(gPassHistograms[pass]), ElapsedCycles());
+}
+
+// Record the cycles spent in an instrumentation function of the
+// `tool_index`th active tool.
+void TranslationTimer::RecordTool(size_t tool_index) {
+  if (!start_cycles || tool_index >= kMaxNumTools) return;
+  AddSample(&(gToolHistograms[tool_index]), ElapsedCycles());
+}
+
+// Returns the cycles elapsed since the last recording.
+uint64_t TranslationTimer::ElapsedCycles(void) {
+  const uint64_t now = arch::CycleCount();
+  const auto elapsed = now - start_cycles;
+  start_cycles = now;
+  return elapsed;
+}
+
+// Record the value of `counter` for an assembled trace.
+void RecordTranslationCounter(TranslationCounter counter, uint64_t value) {
+  if (!FLAG_profile_translation) return;
+  AddSample(&(gCounterHistograms[counter]), value);
+}
+
+// Log the translation profile, if profiling is enabled.
+void LogTranslationProfile(void) {
+  if (!FLAG_profile_translation) return;
+  os::Log(os::LogOutput, "Translation profile (cycles per run):\n");
+  for (auto i = 0UL; i < kNumTranslationPasses; ++i) {
+    LogHistogram(kPassNames[i], &(gPassHistograms[i]));
+  }
+  os::Log(os::LogOutput, "Instrumentation profile (cycles per call):\n");
+  for (auto i = 0UL; i < kMaxNumTools; ++i) {
+    auto name = ActiveToolName(i);
+    if (!name) break;
+    LogHistogram(name, &(gToolHistograms[i]));
+  }
+  os::Log(os::LogOutput, "Trace profile:\n");
+  for (auto i = 0UL; i < kNumTranslationCounters; ++i) {
+    LogHistogram(kCounterNames[i], &(gCounterHistograms[i]));
+  }
+}
+
+}  // namespace granary
@@ -0,0 +1,107 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#ifndef GRANARY_PROFILE_H_
+#define GRANARY_PROFILE_H_
+
+#include "granary/base/base.h"
+
+namespace granary {
+
+// Parts of the translation pipeline whose execution time is profiled.
+enum TranslationPass {
+  kTranslationPassDecode,
+  kTranslationPassCompileInlineAssembly,
+  kTranslationPassLateMangle,
+  kTranslationPassBuildFragmentList,
+  kTranslationPassPartitionFragments,
+  kTranslationPassAddEntryExitFragments,
+  kTranslationPassSaveAndRestoreFlags,
+  kTranslationPassTrackVirtualRegs,
+  kTranslationPassPropagateCopies,
+  kTranslationPassScheduleRegisters,
+  kTranslationPassAllocateSlots,
+  kTranslationPassAddConnectingJumps,
+  kTranslationPassFindBlockEntrypoints,
+  kTranslationPassEncode,
+  kNumTranslationPasses
+};
+
+// Sizes of assembled traces that are profiled.
+enum TranslationCounter {
+  kTranslationCounterFragments,
+  kTranslationCounterInstructions,
+  kTranslationCounterVirtualRegs,
+  kTranslationCounterSpillSlots,
+  kTranslationCounterElidedSpillFills,
+  kTranslationCounterElidedFlagSaves,
+  kNumTranslationCounters
+};
+
+enum : size_t {
+  kNumTranslationHistogramBuckets = 32
+};
+
+// A histogram of profiled values. Bucket `0` counts values of `0`, and bucket
+// `i > 0` counts values in the range `[2^(i-1), 2^i)`. The last bucket also
+// counts all larger values.
+struct TranslationHistogram {
+  uint64_t num_samples;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[kNumTranslationHistogramBuckets];
+};
+
+// Returns true if the translation pipeline is being profiled.
+bool TranslationProfilingIsEnabled(void);
+
+// Get the histogram of the number of cycles spent in each run of `pass`.
+void GetTranslationPassHistogram(TranslationPass pass,
+                                 TranslationHistogram *hist);
+
+// Get the histogram of the per-trace values of `counter`.
+void GetTranslationCounterHistogram(TranslationCounter counter,
+                                    TranslationHistogram *hist);
+
+// Get the histogram of the number of cycles spent in each call to one of the
+// instrumentation functions of the tool named `tool_name`. Returns `false` if
+// there is no active tool named `tool_name`.
+bool GetToolInstrumentationHistogram(const char *tool_name,
+                                     TranslationHistogram *hist);
+
+#ifdef GRANARY_INTERNAL
+
+// Measures the number of cycles spent in consecutive parts of the translation
+// pipeline. Each `Record*` method records the cycles elapsed since the timer
+// was created or since the last recording, whichever is later.
+class TranslationTimer {
+ public:
+  TranslationTimer(void);
+
+  // Record the cycles spent in `pass`.
+  void RecordPass(TranslationPass pass);
+
+  // Record the cycles spent in an instrumentation function of the
+  // `tool_index`th active tool.
+  void RecordTool(size_t tool_index);
+
+ private:
+  // Returns the cycles elapsed since the last recording.
+  uint64_t ElapsedCycles(void);
+
+  // Zero if profiling is disabled.
+  uint64_t start_cycles;
+
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(TranslationTimer);
+};
+
+// Record the value of `counter` for an assembled trace.
+void RecordTranslationCounter(TranslationCounter counter, uint64_t value);
+
+// Log the translation profile, if profiling is enabled.
+void LogTranslationProfile(void);
+
+#endif  // GRANARY_INTERNAL
+
+}  // namespace granary
+
+#endif  // GRANARY_PROFILE_H_
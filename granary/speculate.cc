@@ -0,0 +1,235 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#define GRANARY_INTERNAL
+
+#include "granary/base/lock.h"
+#include "granary/base/option.h"
+
+#include "granary/cache.h"
+#include "granary/context.h"
+#include "granary/epoch.h"
+#include "granary/metadata.h"
+#include "granary/persist.h"
+#include "granary/speculate.h"
+#include "granary/translate.h"
+
+#include "os/logging.h"
+#include "os/thread.h"
+
+GRANARY_DEFINE_uint(num_speculative_translation_threads, 0,
+    "The number of worker threads that speculatively translate the direct "
+    "successors of newly translated blocks, so that the blocks are already in "
+    "the code cache index when the application reaches them. The default "
+    "value is `0`, which disables speculative translation."
+    GRANARY_IF_KERNEL("\n"
+    "\n"
+    "Note: Speculative translation is not supported in kernel space."));
+
+GRANARY_DECLARE_string(persistent_cache_file);
+
+GRANARY_DEFINE_bool(debug_log_speculation_stats, false,
+    "Log how many blocks were speculatively translated, and how many of those "
+    "were later used by the application, when Granary exits. The default is "
+    "`no`.");
+
+namespace granary {
+
+extern ReaderWriterLock gExitGranaryLock;
+
+namespace {
+enum : size_t {
+  // Maximum number of blocks waiting to be translated. Blocks queued beyond
+  // this are dropped.
+  kMaxNumQueuedBlocks = 1024
+};
+
+// Circular queue of blocks waiting to be translated.
+static SpinLock gQueueLock;
+static BlockMetaData *gQueue[kMaxNumQueuedBlocks] = {nullptr};
+static size_t gQueueHead = 0;
+static size_t gQueueSize = 0;
+
+// Changed whenever a block is queued, or when the workers should stop. Idle
+// workers wait for this to change.
+static std::atomic<uint32_t> gQueueVersion(ATOMIC_VAR_INIT(0));
+
+// Number of workers waiting for `gQueueVersion` to change.
+static std::atomic<size_t> gNumIdleWorkers(ATOMIC_VAR_INIT(0));
+
+// Whether or not any worker threads are running, and whether or not they
+// speculatively translate the successors of translated blocks.
+static std::atomic<bool> gHasWorkers(ATOMIC_VAR_INIT(false));
+static std::atomic<bool> gIsEnabled(ATOMIC_VAR_INIT(false));
+static std::atomic<bool> gStopWorkers(ATOMIC_VAR_INIT(false));
+
+// Statistics about speculative translation. The number of wasted translations
+// is the number of translated blocks that were never used.
+static std::atomic<size_t> gNumQueued(ATOMIC_VAR_INIT(0));
+static std::atomic<size_t> gNumDropped(ATOMIC_VAR_INIT(0));
+static std::atomic<size_t> gNumRedundant(ATOMIC_VAR_INIT(0));
+static std::atomic<size_t> gNumTranslated(ATOMIC_VAR_INIT(0));
+static std::atomic<size_t> gNumHits(ATOMIC_VAR_INIT(0));
+
+// Returns the address that idle workers wait on.
+static const uint32_t *QueueVersionAddress(void) {
+  return reinterpret_cast<const uint32_t *>(&gQueueVersion);
+}
+
+// Remove the oldest block from the queue. Returns `nullptr` if the queue is
+// empty.
+static BlockMetaData *Dequeue(void) {
+  SpinLockedRegion locker(&gQueueLock);
+  if (!gQueueSize) return nullptr;
+  auto meta = gQueue[gQueueHead];
+  gQueue[gQueueHead] = nullptr;
+  gQueueHead = (gQueueHead + 1) % kMaxNumQueuedBlocks;
+  --gQueueSize;
+  return meta;
+}
+
+// Wake up all idle workers.
+static void WakeWorkers(void) {
+  gQueueVersion.fetch_add(1);
+  if (gNumIdleWorkers.load()) os::WakeAddress(QueueVersionAddress());
+}
+
+#ifdef GRANARY_WHERE_user
+// Wait for a block to translate. Queued blocks are translated before any
+// hinted persisted blocks. Queued blocks are the targets of direct edges, and
+// so `is_direct_target` is set to `true` for them. Returns `nullptr` if the
+// worker should exit.
+static BlockMetaData *WaitForBlock(bool *is_direct_target) {
+  for (;;) {
+    const auto version = gQueueVersion.load();
+    if (gStopWorkers.load()) return nullptr;
+    if (auto meta = Dequeue()) {
+      *is_direct_target = true;
+      return meta;
+    }
+    if (auto meta = NextPersistentBlock()) {
+      *is_direct_target = false;
+      return meta;
+    }
+    gNumIdleWorkers.fetch_add(1);
+    os::WaitOnAddress(QueueVersionAddress(), version);
+    gNumIdleWorkers.fetch_sub(1);
+  }
+}
+
+// Main loop of a speculative translation worker thread. Workers observe
+// epochs while translating, as translation reads module indexes without
+// locks.
+static void TranslateSpeculativeBlocks(void) {
+  auto is_direct_target = false;
+  while (auto meta = WaitForBlock(&is_direct_target)) {
+    ReadLockedRegion exit_locker(&gExitGranaryLock);
+    ObserveEpoch();
+    if (TranslateSpeculatively(GlobalContext(), meta, is_direct_target)) {
+      gNumTranslated.fetch_add(1);
+    } else {
+      gNumRedundant.fetch_add(1);
+    }
+    IdleThreadEpoch();
+  }
+}
+#endif  // GRANARY_WHERE_user
+
+// Log the speculative translation statistics.
+static void LogSpeculationStatistics(void) {
+  const auto num_translated = gNumTranslated.load();
+  const auto num_hits = gNumHits.load();
+  os::Log(os::LogOutput,
+          "Speculative translation: %lu queued, %lu dropped, %lu redundant, "
+          "%lu translated, %lu used (%lu%% hit rate, %lu%% wasted)\n",
+          gNumQueued.load(), gNumDropped.load(), gNumRedundant.load(),
+          num_translated, num_hits,
+          num_translated ? (num_hits * 100) / num_translated : 0,
+          num_translated ? ((num_translated - num_hits) * 100) / num_translated
+                         : 0);
+}
+
+}  // namespace
+
+// Start the speculative translation worker threads. If there is a persistent
+// cache but no speculative translation threads, then one worker is started
+// that only translates persisted blocks.
+void InitSpeculation(void) {
+  gStopWorkers.store(false);
+#ifdef GRANARY_WHERE_user
+  auto num_workers = FLAG_num_speculative_translation_threads;
+  if (!num_workers && FLAG_persistent_cache_file[0]) num_workers = 1;
+  for (auto i = 0U; i < num_workers; ++i) {
+    if (!os::CreateWorkerThread(TranslateSpeculativeBlocks)) break;
+    gHasWorkers.store(true);
+  }
+  gIsEnabled.store(gHasWorkers.load() &&
+                   0 < FLAG_num_speculative_translation_threads);
+#endif  // GRANARY_WHERE_user
+}
+
+// Stop the speculative translation worker threads, and free any blocks that
+// are still queued.
+void ExitSpeculation(void) {
+  gIsEnabled.store(false);
+  if (!gHasWorkers.exchange(false)) return;
+  gStopWorkers.store(true);
+  WakeWorkers();
+  os::JoinWorkerThreads();
+  while (auto meta = Dequeue()) delete meta;
+  if (FLAG_debug_log_speculation_stats) LogSpeculationStatistics();
+}
+
+// Returns true if there are worker threads that speculatively translate the
+// successors of translated blocks.
+bool SpeculationIsEnabled(void) {
+  return gIsEnabled.load(std::memory_order_relaxed);
+}
+
+// Returns true if there are worker threads that can translate hinted
+// persisted blocks.
+bool HasSpeculationWorkers(void) {
+  return gHasWorkers.load(std::memory_order_relaxed);
+}
+
+// Queue the block described by `meta` to be speculatively translated by a
+// worker thread. This takes ownership of `meta`.
+void SpeculativelyTranslate(BlockMetaData *meta) {
+  do {
+    SpinLockedRegion locker(&gQueueLock);
+    if (gQueueSize < kMaxNumQueuedBlocks) {
+      gQueue[(gQueueHead + gQueueSize++) % kMaxNumQueuedBlocks] = meta;
+      meta = nullptr;
+    }
+  } while (false);
+
+  if (GRANARY_UNLIKELY(nullptr != meta)) {
+    gNumDropped.fetch_add(1);
+    delete meta;
+  } else {
+    gNumQueued.fetch_add(1);
+    WakeWorkers();
+  }
+}
+
+// Wake up any idle worker threads, e.g. because there are new persisted blocks
+// that they can translate.
+void WakeSpeculationWorkers(void) {
+  WakeWorkers();
+}
+
+// Record that an application thread found the block described by `meta` in
+// the code cache index. The first time that this happens to a speculatively
+// translated block counts as a speculation hit.
+void ObserveIndexedBlock(const BlockMetaData *meta) {
+  auto cache_meta = MetaDataCast<const CacheMetaData *>(meta);
+  if (GRANARY_LIKELY(!cache_meta->is_unused_speculation.load(
+          std::memory_order_relaxed))) {
+    return;
+  }
+  if (os::IsWorkerThread()) return;
+  if (cache_meta->is_unused_speculation.exchange(false)) {
+    gNumHits.fetch_add(1);
+  }
+}
+
+}  // namespace granary
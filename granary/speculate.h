@@ -0,0 +1,54 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#ifndef GRANARY_SPECULATE_H_
+#define GRANARY_SPECULATE_H_
+
+#ifndef GRANARY_INTERNAL
+# error "This code is internal to Granary."
+#endif
+
+#include "granary/base/base.h"
+
+namespace granary {
+
+// Forward declarations.
+class BlockMetaData;
+
+// Speculative translation lets worker threads translate blocks before the
+// application needs them. When an application thread translates the target of
+// a direct edge, the statically known direct successors of the translated
+// blocks are queued up, and idle workers translate and index them. Later, when
+// the application takes an edge to one of those successors, the block is
+// found in the code cache index instead of being decoded and compiled on the
+// application thread.
+
+// Start the speculative translation worker threads.
+void InitSpeculation(void);
+
+// Stop the speculative translation worker threads, and free any blocks that
+// are still queued.
+void ExitSpeculation(void);
+
+// Returns true if there are worker threads that speculatively translate the
+// successors of translated blocks.
+bool SpeculationIsEnabled(void);
+
+// Returns true if there are worker threads that can translate hinted
+// persisted blocks.
+bool HasSpeculationWorkers(void);
+
+// Queue the block described by `meta` to be speculatively translated by a
+// worker thread. This takes ownership of `meta`.
+void SpeculativelyTranslate(BlockMetaData *meta);
+
+// Wake up any idle worker threads, e.g. because there are new persisted blocks
+// that they can translate.
+void WakeSpeculationWorkers(void);
+
+// Record that an application thread found the block described by `meta` in
+// the code cache index.
+void ObserveIndexedBlock(const BlockMetaData *meta);
+
+}  // namespace granary
+
+#endif  // GRANARY_SPECULATE_H_
@@ -217,7 +217,8 @@ void InitToolManager(void) {
                         allocation_offset;
   auto max_num_allocs = (remaining_size - size + 1) / size;
   auto max_offset = allocation_offset + max_num_allocs * size;
-  gToolAllocator.Construct(allocation_offset, max_offset, size, size);
+  gToolAllocator.Construct("InstrumentationTool", allocation_offset,
+                           max_offset, size, size);
 }
 
 // Exit the tool manager.
@@ -281,4 +282,11 @@ void FreeTools(InstrumentationTool *tools) {
   gToolAllocator->Free(tools);
 }
 
+// Returns the name of the `index`th tool in the list of tools returned by
+// `AllocateTools`, or `nullptr` if there are fewer active tools.
+const char *ActiveToolName(size_t index) {
+  if (index >= kMaxNumTools || !gActiveTools[index]) return nullptr;
+  return gActiveTools[index]->name;
+}
+
 }  // namespace granary
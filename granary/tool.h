@@ -173,6 +173,10 @@ InstrumentationTool *AllocateTools(void);
 // Frees all tools, given a pointer to the first tool allocated.
 void FreeTools(InstrumentationTool *tools);
 
+// Returns the name of the `index`th tool in the list of tools returned by
+// `AllocateTools`, or `nullptr` if there are fewer active tools.
+const char *ActiveToolName(size_t index);
+
 #endif  // GRANARY_INTERNAL
 
 }  // namespace granary
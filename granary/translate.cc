@@ -2,6 +2,8 @@
 
 #define GRANARY_INTERNAL
 
+#include "granary/base/option.h"
+
 #include "granary/cfg/block.h"
 #include "granary/cfg/trace.h"
 
@@ -14,13 +16,41 @@
 #include "granary/context.h"
 #include "granary/index.h"
 #include "granary/instrument.h"
+#include "granary/persist.h"
+#include "granary/speculate.h"
 #include "granary/translate.h"
 
+GRANARY_DEFINE_bool(hot_cache_layout, false,
+    "Place blocks in the cold code cache until they become hot. When hot "
+    "traces are enabled (see `--hot_trace_threshold`), blocks that are "
+    "translated while the direct edges that target them are still being "
+    "profiled are placed in the cold code cache, and only hot traces are "
+    "placed in the hot code cache. This lays out hot blocks and their hot "
+    "successors contiguously, which reduces the instruction cache and TLB "
+    "footprint of hot code. The default is `no`.");
+
+GRANARY_DECLARE_uint(hot_trace_threshold);
+
 namespace granary {
 namespace {
 
-// Add the trace entrypoint to the index.
-static void Index(Trace *cfg) {
+// Place the entry block of `trace` into the cold code cache. This is only
+// done for entry blocks that are targeted by profiled direct edges, as those
+// are re-translated into the hot code cache as the heads of hot traces once
+// one of their incoming edges becomes hot. Other blocks (e.g. the targets of
+// indirect jumps or of function returns) are never re-translated, and so are
+// left in the hot code cache.
+static void PlaceUntilHot(Trace *trace) {
+  if (!FLAG_hot_cache_layout || !FLAG_hot_trace_threshold) return;
+  if (auto entry_block = DynamicCast<DecodedBlock *>(trace->EntryBlock())) {
+    entry_block->MarkAsColdCode();
+  }
+}
+
+// Add the trace entrypoint to the index. If `replace_head` is `true` then the
+// trace entrypoint replaces any indexed meta-data that it unifies with, e.g.
+// a hot trace replacing the cold block of its head.
+static void Index(Trace *cfg, bool replace_head=false) {
   const auto entry_block = cfg->EntryBlock();
   GRANARY_ASSERT(nullptr != entry_block);
 
@@ -29,8 +59,9 @@ static void Index(Trace *cfg) {
 
   // Only index the meta-data if there's not already some suitable meta-data in
   // the index.
-  const auto response = FindMetaDataInIndex(meta);
-  if (kUnificationStatusAccept != response.status) {
+  if (replace_head) {
+    ReplaceMetaDataInIndex(meta);
+  } else if (kUnificationStatusAccept != FindMetaDataInIndex(meta).status) {
     AddMetaDataToIndex(meta);
   } else {
     meta = nullptr;
@@ -48,11 +79,11 @@ static void Index(Trace *cfg) {
 
 // Compile and index blocks. This is used for direct edges and entrypoints.
 static CachePC CompileAndIndex(Context *context, Trace *trace,
-                               BlockMetaData *meta) {
+                               BlockMetaData *meta, bool replace_head=false) {
   auto cache_meta = MetaDataCast<CacheMetaData *>(meta);
   if (!cache_meta->start_pc) {  // Only compile if we decoded the first block.
     auto encoded_pc = Compile(context, trace);
-    Index(trace);
+    Index(trace, replace_head);
     GRANARY_ASSERT(nullptr != cache_meta->start_pc);
     return encoded_pc;
   } else {
@@ -60,6 +91,20 @@ static CachePC CompileAndIndex(Context *context, Trace *trace,
   }
 }
 
+// Queue up the direct successors of the blocks in `trace` that haven't been
+// translated, so that worker threads can translate them before the
+// application reaches them.
+static void SpeculateSuccessors(Trace *trace) {
+  if (!SpeculationIsEnabled()) return;
+  for (auto block : trace->Blocks()) {
+    if (auto direct_block = DynamicCast<DirectBlock *>(block)) {
+      if (auto meta = direct_block->UnsafeMetaData()) {
+        SpeculativelyTranslate(meta->Copy());
+      }
+    }
+  }
+}
+
 }  // namespace
 
 // Instrument, compile, and index some basic blocks.
@@ -67,14 +112,55 @@ CachePC Translate(Context *context, AppPC pc) {
   return Translate(context, new BlockMetaData(pc));
 }
 
-// Instrument, compile, and index some basic blocks.
-CachePC Translate(Context *context, BlockMetaData *meta) {
+// Instrument, compile, and index some basic blocks. If `is_profiled_target`
+// is `true` then the entry block is the target of a profiled direct edge.
+CachePC Translate(Context *context, BlockMetaData *meta,
+                  bool is_profiled_target) {
+  HintPersistentBlocks(MetaDataCast<AppMetaData *>(meta)->start_pc);
   Trace cfg(context);
   BinaryInstrumenter inst(&cfg, &meta);
   inst.InstrumentDirect();
+  SpeculateSuccessors(&cfg);
+  if (is_profiled_target) PlaceUntilHot(&cfg);
   return CompileAndIndex(context, &cfg, meta);
 }
 
+// Speculatively instrument, compile, and index some basic blocks on a worker
+// thread. If `is_profiled_target` is `true` then the entry block is the target
+// of a profiled direct edge. Returns `false` if an existing block can be used
+// in place of the block described by `meta`, i.e. if nothing was translated.
+bool TranslateSpeculatively(Context *context, BlockMetaData *meta,
+                            bool is_profiled_target) {
+  Trace cfg(context);
+  BinaryInstrumenter inst(&cfg, &meta);
+  inst.InstrumentDirect();
+  auto cache_meta = MetaDataCast<CacheMetaData *>(meta);
+  if (cache_meta->start_pc) return false;  // Found in the index.
+  cache_meta->is_unused_speculation.store(true, std::memory_order_relaxed);
+  if (is_profiled_target) PlaceUntilHot(&cfg);
+  CompileAndIndex(context, &cfg, meta);
+  return true;
+}
+
+// Instrument, compile, and index a hot trace, whose head block is described
+// by `meta`. If a hot trace with the same head has already been translated
+// (e.g. because another edge to the head became hot), then it is reused.
+//
+// The hot trace replaces the head's cold block in the index, so that later
+// lookups of the head (e.g. by indirect edges) find the hot trace.
+CachePC TranslateHotTrace(Context *context, BlockMetaData *meta) {
+  if (auto cache_pc = context->FindHotTrace(meta)) {
+    delete meta;
+    return cache_pc;
+  }
+  Trace cfg(context);
+  BinaryInstrumenter inst(&cfg, &meta);
+  inst.InstrumentHotTrace();
+  auto cache_pc = CompileAndIndex(context, &cfg, meta, true);
+  context->AddHotTrace(meta, cache_pc);
+  return cache_pc;
+}
+
 // Instrument, compile, and index some basic blocks, where the entry block
 // is targeted by an indirect control-transfer instruction.
 //
@@ -99,6 +185,7 @@ CachePC Translate(Context *context, IndirectEdge *edge, BlockMetaData *meta) {
 // to some native code.
 CachePC TranslateEntryPoint(Context *context, BlockMetaData *meta,
                             EntryPointKind kind, int category) {
+  context->PinCodeCache();  // The entrypoint's address escapes.
   Trace cfg(context);
   BinaryInstrumenter inst(&cfg, &meta);
   inst.InstrumentEntryPoint(kind, category);
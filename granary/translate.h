@@ -22,8 +22,22 @@ class IndirectEdge;
 // Instrument, compile, and index some basic blocks.
 CachePC Translate(Context *context, AppPC pc);
 
-// Instrument, compile, and index some basic blocks.
-CachePC Translate(Context *context, BlockMetaData *meta);
+// Instrument, compile, and index some basic blocks. If `is_profiled_target`
+// is `true` then the entry block is the target of a profiled direct edge, and
+// might be placed in the cold code cache until the edge becomes hot.
+CachePC Translate(Context *context, BlockMetaData *meta,
+                  bool is_profiled_target=false);
+
+// Speculatively instrument, compile, and index some basic blocks on a worker
+// thread. If `is_profiled_target` is `true` then the entry block is the target
+// of a profiled direct edge. Returns `false` if an existing block can be used
+// in place of the block described by `meta`, i.e. if nothing was translated.
+bool TranslateSpeculatively(Context *context, BlockMetaData *meta,
+                            bool is_profiled_target);
+
+// Instrument, compile, and index a hot trace, whose head block is described
+// by `meta`.
+CachePC TranslateHotTrace(Context *context, BlockMetaData *meta);
 
 // Instrument, compile, and index some basic blocks, where the entry block
 // is targeted by an indirect control-transfer instruction.
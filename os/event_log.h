@@ -0,0 +1,65 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#ifndef OS_EVENT_LOG_H_
+#define OS_EVENT_LOG_H_
+
+#include "granary/base/base.h"
+
+namespace granary {
+namespace os {
+
+// The event log is a binary alternative to `os::Log`. Each thread appends
+// fixed-size event records to its own ring buffer, and a Granary worker
+// thread drains the buffers into the `--event_log_file`. Logging an event
+// never formats a string or acquires a lock. The log file can be decoded with
+// `scripts/decode_event_log.py`.
+
+enum : size_t {
+  // Maximum number of arguments of a logged event.
+  kMaxNumEventArgs = 8
+};
+
+enum : uint32_t {
+  // Returned by `RegisterEventKind` if no more kinds of events can be
+  // registered.
+  kInvalidEventKind = ~0U
+};
+
+// Initialize the event log.
+GRANARY_INTERNAL_DEFINITION void InitEventLog(void);
+
+// Exit the event log. This stops the event log's worker thread, and then
+// writes out all buffered events. Events logged after this are dropped.
+GRANARY_INTERNAL_DEFINITION void ExitEventLog(void);
+
+// Release the current thread's event buffer, so that a later thread can
+// re-use it.
+GRANARY_INTERNAL_DEFINITION void ExitThreadEventLog(void);
+
+// Returns true if events are being written to an event log file.
+bool EventLogIsEnabled(void);
+
+// Register a kind of event. `name` names the kind, and `format` is a
+// `printf`-style format string that the decoder uses to print the arguments
+// of events of this kind. Both strings must remain valid until Granary exits.
+// Returns the ID of the new kind of event.
+uint32_t RegisterEventKind(const char *name, const char *format);
+
+// Log an event of kind `kind` with `num_args` arguments. Returns `false` if
+// the event was dropped, e.g. because the current thread's buffer is full.
+bool LogEventArgs(uint32_t kind, const uint64_t *args, size_t num_args);
+
+// Log an event of kind `kind` with up to `kMaxNumEventArgs` integer
+// arguments.
+template <typename... Args>
+inline static bool LogEvent(uint32_t kind, Args... args) {
+  static_assert(kMaxNumEventArgs >= sizeof...(Args),
+                "Too many arguments to `os::LogEvent`.");
+  const uint64_t arg_array[] = {static_cast<uint64_t>(args)..., 0};
+  return LogEventArgs(kind, arg_array, sizeof...(Args));
+}
+
+}  // namespace os
+}  // namespace granary
+
+#endif  // OS_EVENT_LOG_H_
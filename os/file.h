@@ -0,0 +1,71 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#ifndef OS_FILE_H_
+#define OS_FILE_H_
+
+#ifndef GRANARY_INTERNAL
+# error "This code is internal to Granary."
+#endif
+
+#include "granary/base/base.h"
+
+namespace granary {
+namespace os {
+
+// Map the file at `path` into memory as read-only. Returns `nullptr` if the
+// file doesn't exist or can't be mapped. On success, `*num_bytes` is the size
+// of the file.
+const void *MapFile(const char *path, size_t *num_bytes);
+
+// Unmap a file that was mapped with `MapFile`.
+void UnmapFile(const void *addr, size_t num_bytes);
+
+// Returns a number that changes whenever the file at `path` is replaced or
+// modified. Returns `0` if the file doesn't exist.
+uint64_t FileVersion(const char *path);
+
+// Get the path of the file open as the descriptor `fd`. Returns `false` if
+// the path can't be found (e.g. because `fd` isn't an open descriptor).
+bool FilePathOfDescriptor(int fd, char *path, size_t max_path_length);
+
+// Writes out a new version of a file. The file's contents are only replaced
+// when the writer is committed, so that readers of the file never observe a
+// partially written file.
+class FileWriter {
+ public:
+  enum {
+    kMaxPathLength = 256
+  };
+
+  // Open a temporary file that will replace the file at `path_`.
+  explicit FileWriter(const char *path_);
+
+  // Discards the written data if the writer wasn't committed.
+  ~FileWriter(void);
+
+  // Returns true if all writes so far have succeeded.
+  inline bool IsValid(void) const {
+    return -1 != fd;
+  }
+
+  // Append `num_bytes` bytes from `data` to the file.
+  void Write(const void *data, size_t num_bytes);
+
+  // Atomically replace the file with the written data. Returns `false` if
+  // the file couldn't be written.
+  bool Commit(void);
+
+ private:
+  FileWriter(void) = delete;
+
+  char path[kMaxPathLength];
+  char temp_path[kMaxPathLength];
+  int fd;
+
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(FileWriter);
+};
+
+}  // namespace os
+}  // namespace granary
+
+#endif  // OS_FILE_H_
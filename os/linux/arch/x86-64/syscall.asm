@@ -116,6 +116,28 @@ L(granary_write_error):
     ret
 END_FUNC(write)
 
+DEFINE_FUNC(rename)
+    mov    eax, 82  // `__NR_rename`.
+    syscall
+    cmp    rax,0xfffffffffffff001
+    jae    L(granary_rename_error)
+    ret
+L(granary_rename_error):
+    or     rax,0xffffffffffffffff
+    ret
+END_FUNC(rename)
+
+DEFINE_FUNC(unlink)
+    mov    eax, 87  // `__NR_unlink`.
+    syscall
+    cmp    rax,0xfffffffffffff001
+    jae    L(granary_unlink_error)
+    ret
+L(granary_unlink_error):
+    or     rax,0xffffffffffffffff
+    ret
+END_FUNC(unlink)
+
 DEFINE_FUNC(getpid)
     mov    eax, 39  // `__NR_getpid`.
     syscall
@@ -145,6 +167,13 @@ DEFINE_FUNC(generic_sigaction)
     ret
 END_FUNC(generic_sigaction)
 
+DEFINE_FUNC(rt_sigprocmask)
+    mov     r10, rcx  // arg4, `sigsetsize`.
+    mov     eax, 14  // `__NR_rt_sigprocmask`.
+    syscall
+    ret
+END_FUNC(rt_sigprocmask)
+
 DEFINE_FUNC(sigaltstack)
     mov     eax, 131  // `__NR_sigaltstack`.
     syscall
@@ -175,7 +204,7 @@ END_FUNC(sys_exit)
 //      char * newsp ,                  RSI
 //      int * parent_tidptr ,           RDX
 //      int * child_tidptr ,            RCX
-//      int tls_val ,                   R8
+//      unsigned long tls_val ,         R8
 //      void (*func)()                  R9
 //
 DEFINE_FUNC(sys_clone)
@@ -203,6 +232,12 @@ DEFINE_FUNC(sys_futex)
     ret
 END_FUNC(sys_futex)
 
+DEFINE_FUNC(sys_membarrier)
+    mov     eax, 324  // `__NR_membarrier`.
+    syscall
+    ret
+END_FUNC(sys_membarrier)
+
 DEFINE_FUNC(ptrace)
     mov     r10, rcx  // arg4, `data`.
     mov     eax, 101  // `__NR_ptrace`.
@@ -0,0 +1,39 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#define GRANARY_INTERNAL
+
+#include "granary/base/base.h"
+
+#include "os/event_log.h"
+
+namespace granary {
+namespace os {
+
+// Initialize the event log.
+void InitEventLog(void) {}
+
+// Exit the event log.
+void ExitEventLog(void) {}
+
+// Release the current thread's event buffer.
+void ExitThreadEventLog(void) {}
+
+// Returns true if events are being written to an event log file.
+//
+// TODO(pag): The event log is not supported in kernel space.
+bool EventLogIsEnabled(void) {
+  return false;
+}
+
+// Register a kind of event.
+uint32_t RegisterEventKind(const char *, const char *) {
+  return kInvalidEventKind;
+}
+
+// Log an event. Always drops the event.
+bool LogEventArgs(uint32_t, const uint64_t *, size_t) {
+  return false;
+}
+
+}  // namespace os
+}  // namespace granary
@@ -0,0 +1,49 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#define GRANARY_INTERNAL
+
+#include "granary/base/string.h"
+
+#include "os/file.h"
+
+namespace granary {
+namespace os {
+
+// Map the file at `path` into memory as read-only. Returns `nullptr` if the
+// file doesn't exist or can't be mapped.
+//
+// TODO(pag): Implement using `filp_open` and `kernel_read`.
+const void *MapFile(const char *, size_t *) {
+  return nullptr;
+}
+
+// Unmap a file that was mapped with `MapFile`.
+void UnmapFile(const void *, size_t) {}
+
+// Returns a number that changes whenever the file at `path` is replaced or
+// modified. Returns `0` if the file doesn't exist.
+uint64_t FileVersion(const char *) {
+  return 0;
+}
+
+// Open a temporary file that will replace the file at `path_`.
+FileWriter::FileWriter(const char *path_)
+    : fd(-1) {
+  CopyString(path, path_);
+  temp_path[0] = '\0';
+}
+
+// Discards the written data if the writer wasn't committed.
+FileWriter::~FileWriter(void) {}
+
+// Append `num_bytes` bytes from `data` to the file.
+void FileWriter::Write(const void *, size_t) {}
+
+// Atomically replace the file with the written data. Returns `false` if the
+// file couldn't be written.
+bool FileWriter::Commit(void) {
+  return false;
+}
+
+}  // namespace os
+}  // namespace granary
@@ -35,7 +35,11 @@ intptr_t Slot(SlotCategory category, size_t sub_category) {
       return reinterpret_cast<uintptr_t>(&(granary_slots->stack_slot));
     case SLOT_SAVED_FLAGS:
       return reinterpret_cast<uintptr_t>(&(granary_slots->flags));
+    case SLOT_SHADOW_STACK:
+      break;  // Shadow stacks are only supported in user space.
   }
+  GRANARY_ASSERT(false);
+  return 0;
 }
 
 }  // namespace os
@@ -16,6 +16,9 @@ void InitThread(void) {
   // TODO(pag): ????
 }
 
+// Notify Granary that the current thread is about to create a new thread.
+void BeforeCreateThread(void) {}
+
 // Notify Granary tools that a thread has been destroyed.
 void ExitThread(void) {
   ExitTools(kExitThread);
@@ -28,5 +31,44 @@ void YieldThread(void) {
   arch::Relax();
 }
 
+// Wait for all worker threads to exit.
+//
+// Note: Worker threads are not supported in kernel space.
+void JoinWorkerThreads(void) {}
+
+// Returns true if the current thread is a Granary-private worker thread.
+bool IsWorkerThread(void) {
+  return false;
+}
+
+// Block the current thread while `*addr == val`. This can return spuriously.
+void WaitOnAddress(const uint32_t *, uint32_t) {
+  arch::Relax();
+}
+
+// Block the current thread while `*addr == val`, for at most `num_millis`
+// milliseconds. This can return spuriously.
+void TimedWaitOnAddress(const uint32_t *, uint32_t, uint64_t) {
+  arch::Relax();
+}
+
+// Wake up all threads waiting on `addr`.
+void WakeAddress(const uint32_t *) {}
+
+// Returns true if `SynchronizeAllThreads` is supported.
+//
+// Note: Synchronizing all CPUs is not yet supported in kernel space.
+bool CanSynchronizeAllThreads(void) {
+  return false;
+}
+
+// Make every other thread execute a serializing instruction before it next
+// executes any code. Returns `false` if this isn't supported.
+//
+// Note: Synchronizing all CPUs is not yet supported in kernel space.
+bool SynchronizeAllThreads(void) {
+  return false;
+}
+
 }  // namespace os
 }  // namespace granary
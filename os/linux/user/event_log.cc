@@ -0,0 +1,469 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#define GRANARY_INTERNAL
+
+#include "generated/linux_user/types.h"
+
+#include "arch/base.h"
+#include "arch/cpu.h"
+
+#include "granary/base/base.h"
+#include "granary/base/lock.h"
+#include "granary/base/option.h"
+#include "granary/base/string.h"
+
+#include "os/event_log.h"
+#include "os/logging.h"
+#include "os/memory.h"
+#include "os/thread.h"
+
+GRANARY_DEFINE_string(event_log_file, "",
+    "Path to a file to which Granary writes the binary events logged with "
+    "`os::LogEvent`. Events are buffered per thread and written out by a "
+    "worker thread, which makes logging an event much cheaper than logging "
+    "a message with `os::Log`. The file can be decoded with "
+    "`scripts/decode_event_log.py`. The default value is `` (empty), which "
+    "disables the event log.");
+
+GRANARY_DEFINE_positive_uint(event_log_drain_interval, 100,
+    "The maximum number of milliseconds that events stay buffered before "
+    "they are written to the event log file. The worker thread also writes "
+    "out the buffered events as soon as any thread's buffer is half full. The "
+    "default value is `100` milliseconds.");
+
+GRANARY_DEFINE_bool(compact_event_log, true,
+    "Compress the event log by variable-length encoding the fields of each "
+    "event, and by delta-encoding the timestamps of events. The default is "
+    "`yes`.");
+
+namespace granary {
+namespace os {
+namespace {
+
+enum : size_t {
+  // Number of events that can be buffered by each thread. This must be a
+  // power of two.
+  kNumBufferedEvents = 2048,
+
+  // Size of the buffer in which the worker thread encodes events before it
+  // writes them to the event log file.
+  kNumStagingPages = 16,
+  kNumStagingBytes = kNumStagingPages * arch::PAGE_SIZE_BYTES,
+
+  // Maximum number of kinds of events.
+  kMaxNumEventKinds = 1024,
+
+  // Maximum number of bytes needed to encode one event. Compact events are
+  // made of at most `kMaxNumEventArgs + 3` variable-length integers.
+  kMaxNumEncodedEventBytes = (kMaxNumEventArgs + 3) * 10
+};
+
+enum : uint32_t {
+  kEventLogVersion = 1,
+
+  // Flags of the event log file.
+  kEventLogIsCompact = 1,
+
+  // Types of chunks in the event log file.
+  kEventKindChunk = 1,
+  kEventChunk = 2
+};
+
+// A logged event.
+struct EventRecord {
+  uint64_t timestamp;
+  uint32_t kind;
+  uint32_t num_args;
+  uint64_t args[kMaxNumEventArgs];
+};
+
+// A single-producer, single-consumer ring buffer of events. The producer is
+// the thread that owns the buffer, and the consumer is the worker thread.
+struct EventBuffer {
+  // Next buffer in the list of all buffers.
+  EventBuffer *next;
+
+  // Identifies the thread that owns this buffer. Buffers are re-used after
+  // their threads exit, and each new owner gets a new number.
+  uint32_t thread_number;
+
+  // Is this buffer owned by a thread?
+  std::atomic<bool> is_owned;
+
+  // Number of events dropped because this buffer was full.
+  std::atomic<uint64_t> num_dropped;
+
+  // Total number of events ever written to and read from this buffer. Only
+  // the owning thread writes to `head`, and only the worker thread writes to
+  // `tail`.
+  alignas(arch::CACHE_LINE_SIZE_BYTES) std::atomic<uint64_t> head;
+  alignas(arch::CACHE_LINE_SIZE_BYTES) std::atomic<uint64_t> tail;
+
+  alignas(arch::CACHE_LINE_SIZE_BYTES) EventRecord events[kNumBufferedEvents];
+};
+
+enum : size_t {
+  kEventBufferNumPages = (sizeof(EventBuffer) + arch::PAGE_SIZE_BYTES - 1) /
+                         arch::PAGE_SIZE_BYTES
+};
+
+// Header of the event log file.
+struct EventLogHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+};
+
+// Header of every chunk of the event log file.
+struct ChunkHeader {
+  uint32_t type;
+  uint32_t num_bytes;  // Number of bytes that follow the header.
+};
+
+// Header of a chunk of events that were logged by the same thread.
+struct EventChunkHeader {
+  ChunkHeader chunk;
+  uint32_t thread_number;
+  uint32_t num_events;
+};
+
+// A registered kind of event.
+struct EventKind {
+  const char *name;
+  const char *format;
+};
+
+// Registered kinds of events.
+static SpinLock gEventKindsLock;
+static EventKind gEventKinds[kMaxNumEventKinds];
+static std::atomic<uint32_t> gNumEventKinds(ATOMIC_VAR_INIT(0));
+
+// List of all event buffers. Buffers are never freed, as a thread might be
+// logging an event while Granary exits.
+static std::atomic<EventBuffer *> gEventBuffers(ATOMIC_VAR_INIT(nullptr));
+static std::atomic<uint32_t> gNextThreadNumber(ATOMIC_VAR_INIT(1));
+
+static std::atomic<bool> gIsEnabled(ATOMIC_VAR_INIT(false));
+
+// State owned by the worker thread. The worker's thread-local state is shared
+// with the thread that created it, so this state is global.
+static int gEventLogFd = -1;
+static uint8_t *gStagingBytes = nullptr;
+static size_t gNumStagedBytes = 0;
+static uint32_t gNumWrittenEventKinds = 0;
+
+// Changed whenever the worker should drain the buffers, or when the worker
+// should stop. An idle worker waits for this to change, or for the drain
+// interval to elapse.
+static std::atomic<uint32_t> gDrainVersion(ATOMIC_VAR_INIT(0));
+static std::atomic<bool> gWorkerIsIdle(ATOMIC_VAR_INIT(false));
+static std::atomic<bool> gStopWorker(ATOMIC_VAR_INIT(false));
+
+// Non-zero while the worker is running.
+static std::atomic<uint32_t> gWorkerIsRunning(ATOMIC_VAR_INIT(0));
+
+// The current thread's event buffer.
+static __thread EventBuffer *tEventBuffer = nullptr;
+
+// Is the current thread logging an event? This stops a signal handler from
+// logging into a buffer while the interrupted code is logging into it.
+static __thread bool tIsLoggingEvent = false;
+
+// Returns the address that an idle worker waits on.
+static const uint32_t *DrainVersionAddress(void) {
+  return reinterpret_cast<const uint32_t *>(&gDrainVersion);
+}
+
+// Returns the address that `ExitEventLog` waits on.
+static const uint32_t *WorkerIsRunningAddress(void) {
+  return reinterpret_cast<const uint32_t *>(&gWorkerIsRunning);
+}
+
+// Wake up the worker if it's idle.
+static void WakeWorker(void) {
+  gDrainVersion.fetch_add(1);
+  if (gWorkerIsIdle.load()) WakeAddress(DrainVersionAddress());
+}
+
+// Write out all staged bytes.
+static void FlushStagedBytes(void) {
+  for (size_t i = 0; i < gNumStagedBytes; ) {
+    auto ret = write(gEventLogFd, gStagingBytes + i, gNumStagedBytes - i);
+    if (0 >= ret) break;
+    i += static_cast<size_t>(ret);
+  }
+  gNumStagedBytes = 0;
+}
+
+// Make sure that at least `num_bytes` bytes can be staged.
+static void ReserveStagedBytes(size_t num_bytes) {
+  if (gNumStagedBytes + num_bytes > kNumStagingBytes) FlushStagedBytes();
+}
+
+// Stage `num_bytes` bytes from `data`.
+static void StageBytes(const void *data, size_t num_bytes) {
+  ReserveStagedBytes(num_bytes);
+  memcpy(gStagingBytes + gNumStagedBytes, data, num_bytes);
+  gNumStagedBytes += num_bytes;
+}
+
+// Encode `val` as a variable-length integer.
+static uint8_t *EncodeVarInt(uint8_t *bytes, uint64_t val) {
+  for (; val >= 0x80; val >>= 7) {
+    *bytes++ = static_cast<uint8_t>(val | 0x80);
+  }
+  *bytes++ = static_cast<uint8_t>(val);
+  return bytes;
+}
+
+// Stage an event. In the compact form, the timestamp of the event is encoded
+// relative to the timestamp of the previous event in the same chunk.
+static void StageEvent(const EventRecord &event, uint64_t *last_timestamp) {
+  if (!FLAG_compact_event_log) {
+    StageBytes(&event, sizeof event);
+    return;
+  }
+  const auto begin = gStagingBytes + gNumStagedBytes;
+  const auto delta = event.timestamp - *last_timestamp;
+  const auto delta_sign = static_cast<uint64_t>(
+      static_cast<int64_t>(delta) >> 63);
+  auto bytes = EncodeVarInt(begin, (delta << 1) ^ delta_sign);  // Zig-zag.
+  bytes = EncodeVarInt(bytes, event.kind);
+  bytes = EncodeVarInt(bytes, event.num_args);
+  for (auto i = 0U; i < event.num_args; ++i) {
+    bytes = EncodeVarInt(bytes, event.args[i]);
+  }
+  gNumStagedBytes += static_cast<size_t>(bytes - begin);
+  *last_timestamp = event.timestamp;
+}
+
+// Stage the kinds of events that were registered since kinds were last
+// staged.
+static void StageEventKinds(void) {
+  const auto num_kinds = gNumEventKinds.load(std::memory_order_acquire);
+  for (; gNumWrittenEventKinds < num_kinds; ++gNumWrittenEventKinds) {
+    const auto &kind(gEventKinds[gNumWrittenEventKinds]);
+    const auto name_len = StringLength(kind.name) + 1;
+    const auto format_len = StringLength(kind.format) + 1;
+    const ChunkHeader header = {
+      kEventKindChunk,
+      static_cast<uint32_t>(sizeof(uint32_t) + name_len + format_len)
+    };
+    ReserveStagedBytes(sizeof header + header.num_bytes);
+    StageBytes(&header, sizeof header);
+    StageBytes(&gNumWrittenEventKinds, sizeof(uint32_t));
+    StageBytes(kind.name, name_len);
+    StageBytes(kind.format, format_len);
+  }
+}
+
+// Stage the events of `buffer` as one or more chunks of events.
+static void StageEvents(EventBuffer *buffer) {
+  auto tail = buffer->tail.load(std::memory_order_relaxed);
+  const auto head = buffer->head.load(std::memory_order_acquire);
+  while (tail < head) {
+    ReserveStagedBytes(sizeof(EventChunkHeader) + kMaxNumEncodedEventBytes);
+    const auto header_offset = gNumStagedBytes;
+    gNumStagedBytes += sizeof(EventChunkHeader);
+
+    EventChunkHeader header;
+    header.chunk.type = kEventChunk;
+    header.thread_number = buffer->thread_number;
+    header.num_events = 0;
+
+    uint64_t last_timestamp(0);
+    for (; tail < head; ++tail, ++header.num_events) {
+      if (gNumStagedBytes + kMaxNumEncodedEventBytes > kNumStagingBytes) {
+        break;
+      }
+      StageEvent(buffer->events[tail % kNumBufferedEvents], &last_timestamp);
+    }
+
+    // The events have been copied, so the owning thread can overwrite them.
+    buffer->tail.store(tail, std::memory_order_release);
+
+    header.chunk.num_bytes = static_cast<uint32_t>(
+        gNumStagedBytes - header_offset - sizeof(ChunkHeader));
+    memcpy(gStagingBytes + header_offset, &header, sizeof header);
+  }
+}
+
+// Write out all registered kinds of events, and all buffered events.
+static void DrainEventBuffers(void) {
+  StageEventKinds();
+  auto buffer = gEventBuffers.load(std::memory_order_acquire);
+  for (; buffer; buffer = buffer->next) {
+    StageEvents(buffer);
+  }
+  FlushStagedBytes();
+}
+
+// Main loop of the event log's worker thread. The buffers are drained
+// periodically, so that events written by threads that rarely log still make
+// it to the log file in a timely way, and early whenever a buffer fills up.
+static void DrainEventLog(void) {
+  for (;;) {
+    const auto version = gDrainVersion.load();
+    const auto stop = gStopWorker.load();
+    DrainEventBuffers();
+    if (stop) break;
+    gWorkerIsIdle.store(true);
+    TimedWaitOnAddress(DrainVersionAddress(), version,
+                       FLAG_event_log_drain_interval);
+    gWorkerIsIdle.store(false);
+  }
+  gWorkerIsRunning.store(0);
+  WakeAddress(WorkerIsRunningAddress());
+}
+
+// Returns the current thread's event buffer. If the current thread doesn't
+// have a buffer, then it takes over the empty buffer of an exited thread, or
+// allocates a new buffer.
+static EventBuffer *CurrentEventBuffer(void) {
+  if (GRANARY_LIKELY(nullptr != tEventBuffer)) return tEventBuffer;
+
+  auto buffer = gEventBuffers.load(std::memory_order_acquire);
+  for (; buffer; buffer = buffer->next) {
+    if (buffer->is_owned.load()) continue;
+    if (buffer->head.load() != buffer->tail.load()) continue;
+    auto is_owned = false;
+    if (buffer->is_owned.compare_exchange_strong(is_owned, true)) break;
+  }
+
+  if (!buffer) {
+    buffer = reinterpret_cast<EventBuffer *>(
+        AllocateDataPages(kEventBufferNumPages));
+    buffer->is_owned.store(true);
+    buffer->num_dropped.store(0);
+    buffer->head.store(0);
+    buffer->tail.store(0);
+    buffer->next = gEventBuffers.load();
+    while (!gEventBuffers.compare_exchange_weak(buffer->next, buffer)) {}
+  }
+
+  buffer->thread_number = gNextThreadNumber.fetch_add(1);
+  tEventBuffer = buffer;
+  return buffer;
+}
+
+}  // namespace
+
+// Initialize the event log.
+void InitEventLog(void) {
+  if (!FLAG_event_log_file[0]) return;
+  gEventLogFd = open(FLAG_event_log_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (-1 == gEventLogFd) return;
+
+  gStagingBytes = reinterpret_cast<uint8_t *>(
+      AllocateDataPages(kNumStagingPages));
+  gNumStagedBytes = 0;
+  gNumWrittenEventKinds = 0;
+
+  const EventLogHeader header = {
+    {'G', 'R', 'E', 'V', 'E', 'N', 'T', 'S'},
+    kEventLogVersion,
+    FLAG_compact_event_log ? kEventLogIsCompact : 0U
+  };
+  StageBytes(&header, sizeof header);
+
+  // If the worker can't be created, then events are only written out when
+  // Granary exits, and events are dropped once a thread's buffer is full.
+  gStopWorker.store(false);
+  gWorkerIsRunning.store(1);
+  if (!CreateWorkerThread(DrainEventLog)) gWorkerIsRunning.store(0);
+  gIsEnabled.store(true);
+}
+
+// Exit the event log. This stops the event log's worker thread, and then
+// writes out all buffered events. Events logged after this are dropped.
+void ExitEventLog(void) {
+  if (!gIsEnabled.exchange(false)) return;
+  gStopWorker.store(true);
+  WakeWorker();
+  for (uint32_t is_running; (is_running = gWorkerIsRunning.load()); ) {
+    WaitOnAddress(WorkerIsRunningAddress(), is_running);
+  }
+  DrainEventBuffers();
+  close(gEventLogFd);
+  gEventLogFd = -1;
+  FreeDataPages(gStagingBytes, kNumStagingPages);
+  gStagingBytes = nullptr;
+  gNumEventKinds.store(0);
+
+  uint64_t num_dropped(0);
+  auto buffer = gEventBuffers.load(std::memory_order_acquire);
+  for (; buffer; buffer = buffer->next) {
+    num_dropped += buffer->num_dropped.exchange(0);
+  }
+  if (num_dropped) {
+    Log(LogDebug, "Event log: %lu events were dropped.\n", num_dropped);
+  }
+}
+
+// Release the current thread's event buffer, so that a later thread can
+// re-use it.
+void ExitThreadEventLog(void) {
+  if (auto buffer = tEventBuffer) {
+    tEventBuffer = nullptr;
+    buffer->is_owned.store(false, std::memory_order_release);
+  }
+}
+
+// Returns true if events are being written to an event log file.
+bool EventLogIsEnabled(void) {
+  return gIsEnabled.load(std::memory_order_relaxed);
+}
+
+// Register a kind of event. `name` names the kind, and `format` is a
+// `printf`-style format string that the decoder uses to print the arguments
+// of events of this kind. Both strings must remain valid until Granary exits.
+// Returns the ID of the new kind of event.
+uint32_t RegisterEventKind(const char *name, const char *format) {
+  SpinLockedRegion locker(&gEventKindsLock);
+  const auto kind = gNumEventKinds.load(std::memory_order_relaxed);
+  if (kMaxNumEventKinds <= kind) return kInvalidEventKind;
+  gEventKinds[kind].name = name;
+  gEventKinds[kind].format = format;
+  gNumEventKinds.store(kind + 1, std::memory_order_release);
+  return kind;
+}
+
+// Log an event of kind `kind` with `num_args` arguments. Returns `false` if
+// the event was dropped, e.g. because the current thread's buffer is full.
+//
+// Note: Worker threads share thread-local state with application threads,
+//       and so they can't log events.
+bool LogEventArgs(uint32_t kind, const uint64_t *args, size_t num_args) {
+  if (!gIsEnabled.load(std::memory_order_relaxed)) return false;
+  if (kind >= gNumEventKinds.load(std::memory_order_relaxed)) return false;
+  if (tIsLoggingEvent || IsWorkerThread()) return false;
+
+  tIsLoggingEvent = true;
+  auto buffer = CurrentEventBuffer();
+  const auto head = buffer->head.load(std::memory_order_relaxed);
+  const auto tail = buffer->tail.load(std::memory_order_acquire);
+  const auto logged = kNumBufferedEvents > (head - tail);
+  if (GRANARY_LIKELY(logged)) {
+    auto &event(buffer->events[head % kNumBufferedEvents]);
+    event.timestamp = arch::CycleCount();
+    event.kind = kind;
+    event.num_args = static_cast<uint32_t>(
+        GRANARY_MIN(num_args, static_cast<size_t>(kMaxNumEventArgs)));
+    memcpy(&(event.args[0]), args, event.num_args * sizeof args[0]);
+    buffer->head.store(head + 1, std::memory_order_release);
+
+    // Wake the worker once the buffer is half full, rather than on every
+    // event, so that logging rarely needs a system call. Otherwise, the
+    // worker drains the buffer after at most `--event_log_drain_interval`
+    // milliseconds.
+    if ((kNumBufferedEvents / 2) == (head + 1 - tail)) WakeWorker();
+  } else {
+    buffer->num_dropped.fetch_add(1, std::memory_order_relaxed);
+    WakeWorker();
+  }
+  tIsLoggingEvent = false;
+  return logged;
+}
+
+}  // namespace os
+}  // namespace granary
@@ -0,0 +1,124 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#define GRANARY_INTERNAL
+
+#include "generated/linux_user/types.h"
+
+#include "granary/base/base.h"
+#include "granary/base/string.h"
+
+#include "os/file.h"
+
+namespace granary {
+namespace os {
+
+// Map the file at `path` into memory as read-only. Returns `nullptr` if the
+// file doesn't exist or can't be mapped. On success, `*num_bytes` is the size
+// of the file.
+const void *MapFile(const char *path, size_t *num_bytes) {
+  auto fd = open(path, O_RDONLY);
+  if (0 > fd) return nullptr;
+
+  struct stat info;
+  void *addr = MAP_FAILED;
+  if (!fstat(fd, &info) && 0 < info.st_size) {
+    addr = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ,
+                MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+
+  if (MAP_FAILED == addr) return nullptr;
+  *num_bytes = static_cast<size_t>(info.st_size);
+  return addr;
+}
+
+// Unmap a file that was mapped with `MapFile`.
+void UnmapFile(const void *addr, size_t num_bytes) {
+  munmap(const_cast<void *>(addr), num_bytes);
+}
+
+// Returns a number that changes whenever the file at `path` is replaced or
+// modified. Returns `0` if the file doesn't exist.
+uint64_t FileVersion(const char *path) {
+  auto fd = open(path, O_RDONLY);
+  if (0 > fd) return 0;
+
+  struct stat info;
+  uint64_t version = 0;
+  if (!fstat(fd, &info)) {
+    const uint64_t parts[] = {
+      static_cast<uint64_t>(info.st_dev),
+      static_cast<uint64_t>(info.st_ino),
+      static_cast<uint64_t>(info.st_size),
+      static_cast<uint64_t>(info.st_mtim.tv_sec),
+      static_cast<uint64_t>(info.st_mtim.tv_nsec)
+    };
+    version = 14695981039346656037ULL;  // FNV-1a.
+    for (auto part : parts) {
+      version = (version ^ part) * 1099511628211ULL;
+    }
+    version |= 1ULL;  // Never zero.
+  }
+  close(fd);
+  return version;
+}
+
+// Get the path of the file open as the descriptor `fd`. Returns `false` if
+// the path can't be found (e.g. because `fd` isn't an open descriptor).
+bool FilePathOfDescriptor(int fd, char *path, size_t max_path_length) {
+  char fd_path[32];
+  Format(fd_path, "/proc/self/fd/%d", fd);
+  auto len = readlink(fd_path, path, max_path_length - 1);
+  if (0 >= len) return false;
+  path[len] = '\0';
+  return true;
+}
+
+// Open a temporary file that will replace the file at `path_`.
+FileWriter::FileWriter(const char *path_)
+    : fd(-1) {
+  CopyString(path, path_);
+  if (path_[0] && StringLength(path_) + 16 < sizeof temp_path) {
+    Format(temp_path, "%s.%d.tmp", path_, getpid());
+    fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (0 > fd) fd = -1;
+  }
+}
+
+// Discards the written data if the writer wasn't committed.
+FileWriter::~FileWriter(void) {
+  if (IsValid()) {
+    close(fd);
+    unlink(temp_path);
+  }
+}
+
+// Append `num_bytes` bytes from `data` to the file.
+void FileWriter::Write(const void *data, size_t num_bytes) {
+  auto bytes = reinterpret_cast<const char *>(data);
+  while (IsValid() && num_bytes) {
+    auto ret = write(fd, bytes, num_bytes);
+    if (0 >= ret) {
+      close(fd);
+      unlink(temp_path);
+      fd = -1;
+    } else {
+      bytes += ret;
+      num_bytes -= static_cast<size_t>(ret);
+    }
+  }
+}
+
+// Atomically replace the file with the written data. Returns `false` if the
+// file couldn't be written.
+bool FileWriter::Commit(void) {
+  if (!IsValid()) return false;
+  close(fd);
+  fd = -1;
+  if (!rename(temp_path, path)) return true;
+  unlink(temp_path);
+  return false;
+}
+
+}  // namespace os
+}  // namespace granary
@@ -164,8 +164,11 @@ static void ParseMapsFile(ModuleManager *manager) {
 // Find all built-in modules. In user space, this will go and find things like
 // libc. In kernel space, this will identify already loaded modules.
 void ModuleManager::RegisterAllBuiltIn(void) {
-  SpinLockedRegion locker(&file_buffer_lock);
-  ParseMapsFile(this);
+  do {
+    SpinLockedRegion locker(&file_buffer_lock);
+    ParseMapsFile(this);
+  } while (false);
+  UpdateIndex();
 }
 
 // Find and register all built-in modules.
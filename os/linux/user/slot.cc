@@ -36,6 +36,9 @@ uintptr_t Slot(SlotCategory category, size_t sub_category) {
     case SLOT_SAVED_FLAGS:
       slot_ptr = &(granary_slots.flags);
       break;
+    case SLOT_SHADOW_STACK:
+      slot_ptr = &(granary_slots.shadow_stack);
+      break;
   }
   return reinterpret_cast<uintptr_t>(slot_ptr) - ThreadBase();
 }
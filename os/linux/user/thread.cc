@@ -4,13 +4,163 @@
 
 #include "generated/linux_user/types.h"
 
+#include "arch/base.h"
+
+#include "os/event_log.h"
+#include "os/memory.h"
 #include "os/thread.h"
 
+#include "granary/base/base.h"
+#include "granary/base/new.h"
+
+#include "granary/epoch.h"
 #include "granary/init.h"
 #include "granary/tool.h"
 
+extern "C" {
+
+int sys_futex(uint32_t *uaddr, int op, uint32_t val,
+              const struct timespec *timeout, uint32_t *uaddr2, uint32_t val3);
+
+int sys_membarrier(int cmd, int flags);
+
+// ELF header of `libgranary.so`. This is defined by the linker.
+extern const Elf64_Ehdr __ehdr_start;
+
+// The first thread-local variable of Granary's TLS block. `linker.lds` places
+// this variable at the beginning of Granary's TLS segment.
+__thread __attribute__((tls_model("initial-exec"),
+                        section(".tdata.granary_begin_tls")))
+uint8_t granary_begin_tls = 0;
+
+}  // extern C
 namespace granary {
 namespace os {
+namespace {
+
+enum : size_t {
+  kMaxNumWorkerThreads = 16,
+  kWorkerStackNumPages = 64,
+  kWorkerStackNumBytes = kWorkerStackNumPages * arch::PAGE_SIZE_BYTES,
+
+  // Number of bytes of the thread control block (`tcbhead_t`) that is pointed
+  // to by the thread base. This covers the self-pointers and the stack guard.
+  kTCBNumBytes = 64
+};
+
+// Commands of the `membarrier` system call.
+enum : int {
+  kMembarrierPrivateExpeditedSyncCore = 1 << 5,
+  kMembarrierRegisterPrivateExpeditedSyncCore = 1 << 6
+};
+
+// Whether or not this process is registered to use core-serializing
+// `membarrier`s. This is `0` if we haven't tried to register yet, and
+// negative if registering failed, e.g. because the kernel is too old.
+static std::atomic<int> gSyncCoreStatus(ATOMIC_VAR_INIT(0));
+
+// A Granary-private worker thread.
+struct WorkerThread {
+  // Thread ID of the worker. This is set by the kernel when the thread is
+  // created, and cleared by the kernel when the thread exits.
+  int tid;
+
+  // Stack of the worker.
+  uint8_t *stack;
+
+  // Thread-local storage of the worker.
+  uint8_t *tls;
+  size_t tls_num_pages;
+};
+
+static WorkerThread gWorkerThreads[kMaxNumWorkerThreads];
+static std::atomic<size_t> gNumWorkerThreads(ATOMIC_VAR_INIT(0));
+
+// Is the current thread a worker thread? This is only ever set in the initial
+// TLS image of a worker.
+static __thread bool tIsWorkerThread = false;
+
+// The function that the current worker thread executes.
+static __thread void (*tWorkerFunc)(void) = nullptr;
+
+// Returns Granary's PT_TLS program header.
+static const Elf64_Phdr *FindTLSProgramHeader(void) {
+  auto base = reinterpret_cast<const uint8_t *>(&__ehdr_start);
+  auto phdrs = reinterpret_cast<const Elf64_Phdr *>(
+      base + __ehdr_start.e_phoff);
+  for (auto i = 0; i < __ehdr_start.e_phnum; ++i) {
+    if (PT_TLS == phdrs[i].p_type) return &(phdrs[i]);
+  }
+  return nullptr;
+}
+
+// Returns the address of the thread-local variable `var` within the TLS
+// block that begins at `block`.
+template <typename T>
+static T *AddressInTLSBlock(uint8_t *block, T *var) {
+  auto offset = reinterpret_cast<uintptr_t>(var) -
+                reinterpret_cast<uintptr_t>(&granary_begin_tls);
+  return reinterpret_cast<T *>(block + offset);
+}
+
+// Allocate and initialize the thread-local storage of a worker that will
+// execute `func`. Returns the thread base of the worker.
+//
+// Note: The TLS of the worker only contains Granary's TLS block and the start
+//       of the thread control block. The TLS blocks of other modules are
+//       zeroed, but workers never execute code from other modules.
+static uintptr_t AllocateWorkerTLS(WorkerThread *worker, void (*func)(void)) {
+  const auto phdr = FindTLSProgramHeader();
+  const auto thread_base = ThreadBase();
+  const auto block_offset = thread_base - reinterpret_cast<uintptr_t>(
+      &granary_begin_tls);
+  const auto num_bytes = block_offset + kTCBNumBytes;
+
+  worker->tls_num_pages = (num_bytes + arch::PAGE_SIZE_BYTES - 1) /
+                          arch::PAGE_SIZE_BYTES;
+  worker->tls = reinterpret_cast<uint8_t *>(
+      AllocateDataPages(worker->tls_num_pages));
+  memset(worker->tls, 0, worker->tls_num_pages * arch::PAGE_SIZE_BYTES);
+
+  // Initialize Granary's TLS block from the TLS initialization image. The
+  // rest of the block (i.e. `.tbss`) is already zeroed.
+  auto base = reinterpret_cast<const uint8_t *>(&__ehdr_start);
+  memcpy(worker->tls, base + phdr->p_vaddr, phdr->p_filesz);
+  *AddressInTLSBlock(worker->tls, &tIsWorkerThread) = true;
+  *AddressInTLSBlock(worker->tls, &tWorkerFunc) = func;
+
+  // Initialize the thread control block. The first and third quadwords of
+  // the TCB point to the TCB itself.
+  auto worker_base = worker->tls + block_offset;
+  memcpy(worker_base, reinterpret_cast<void *>(thread_base), kTCBNumBytes);
+  auto tcb = reinterpret_cast<uintptr_t *>(worker_base);
+  tcb[0] = reinterpret_cast<uintptr_t>(worker_base);
+  tcb[2] = reinterpret_cast<uintptr_t>(worker_base);
+  return reinterpret_cast<uintptr_t>(worker_base);
+}
+
+// Free the stack and thread-local storage of a worker.
+static void FreeWorker(WorkerThread *worker) {
+  FreeDataPages(worker->stack, kWorkerStackNumPages);
+  FreeDataPages(worker->tls, worker->tls_num_pages);
+  worker->stack = nullptr;
+  worker->tls = nullptr;
+}
+
+// Entry point of every worker thread. This runs the worker's function, and
+// then releases the worker's thread-private memory.
+//
+// Note: Workers start out idle, so that they don't hold back the reclamation
+//       of retired code and module indexes until they have work to do.
+static void RunWorkerThread(void) {
+  IdleThreadEpoch();
+  tWorkerFunc();
+  ExitThreadEpoch();
+  FreeTranslationArena();
+  FreeThreadMagazines();
+}
+
+}  // namespace
 
 // Notify Granary tools that a thread has been created.
 //
@@ -22,9 +172,18 @@ void InitThread(void) {
   InitTools(kInitThread);
 }
 
+// Notify Granary that the current thread is about to create a new thread.
+void BeforeCreateThread(void) {
+  BeforeCreateThreadEpoch();
+}
+
 // Notify Granary tools that a thread has been destroyed.
 void ExitThread(void) {
   ExitTools(kExitThread);
+  ExitThreadEventLog();
+  ExitThreadEpoch();
+  FreeTranslationArena();
+  FreeThreadMagazines();
 }
 
 // Yield the thread.
@@ -32,6 +191,114 @@ void YieldThread(void) {
   sched_yield();
 }
 
+// Create a Granary-private worker thread that executes `func`. Worker threads
+// never execute instrumented code, and have all signals blocked. Returns
+// `false` if the thread couldn't be created.
+//
+// Note: This is not thread-safe, and is expected to be invoked during
+//       initialization.
+bool CreateWorkerThread(void (*func)(void)) {
+  const auto index = gNumWorkerThreads.load();
+  if (kMaxNumWorkerThreads <= index) return false;
+  auto &worker(gWorkerThreads[index]);
+  worker.stack = reinterpret_cast<uint8_t *>(
+      AllocateDataPages(kWorkerStackNumPages));
+  const auto worker_base = AllocateWorkerTLS(&worker, func);
+  gNumWorkerThreads.store(index + 1);
+  BeforeCreateThreadEpoch();
+
+  // `sys_clone` stores `RunWorkerThread` at the top of the new stack, and the
+  // worker pops it before calling it, so the stack is aligned when it is
+  // called.
+  auto stack_top = reinterpret_cast<char *>(
+      worker.stack + kWorkerStackNumBytes - sizeof(func));
+
+  // Block all signals while the worker is created, so that the worker starts
+  // with all signals blocked, and so that signals directed at the process are
+  // always delivered to application threads.
+  unsigned long all_signals = ~0UL;
+  unsigned long old_signals = 0;
+  rt_sigprocmask(SIG_SETMASK, &all_signals, &old_signals, sizeof all_signals);
+  auto ret = sys_clone(CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND |
+                       CLONE_THREAD | CLONE_SYSVSEM | CLONE_SETTLS |
+                       CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID,
+                       stack_top, &(worker.tid), &(worker.tid), worker_base,
+                       RunWorkerThread);
+  rt_sigprocmask(SIG_SETMASK, &old_signals, nullptr, sizeof old_signals);
+
+  if (0 >= ret) {
+    gNumWorkerThreads.store(index);
+    FreeWorker(&worker);
+    return false;
+  }
+  return true;
+}
+
+// Wait for all worker threads to exit.
+void JoinWorkerThreads(void) {
+  const auto num_workers = gNumWorkerThreads.exchange(0);
+  for (auto i = 0UL; i < num_workers; ++i) {
+    auto &worker(gWorkerThreads[i]);
+    auto tid_ptr = reinterpret_cast<volatile int *>(&(worker.tid));
+    for (int tid; (tid = *tid_ptr); ) {
+      WaitOnAddress(reinterpret_cast<uint32_t *>(&(worker.tid)),
+                    static_cast<uint32_t>(tid));
+    }
+    FreeWorker(&worker);
+  }
+}
+
+// Returns true if the current thread is a Granary-private worker thread.
+bool IsWorkerThread(void) {
+  return tIsWorkerThread;
+}
+
+// Block the current thread while `*addr == val`. This can return spuriously.
+void WaitOnAddress(const uint32_t *addr, uint32_t val) {
+  sys_futex(const_cast<uint32_t *>(addr), FUTEX_WAIT, val, nullptr, nullptr, 0);
+}
+
+// Block the current thread while `*addr == val`, for at most `num_millis`
+// milliseconds. This can return spuriously.
+void TimedWaitOnAddress(const uint32_t *addr, uint32_t val,
+                        uint64_t num_millis) {
+  struct timespec timeout;
+  timeout.tv_sec = static_cast<decltype(timeout.tv_sec)>(num_millis / 1000);
+  timeout.tv_nsec = static_cast<decltype(timeout.tv_nsec)>(
+      (num_millis % 1000) * 1000000);
+  sys_futex(const_cast<uint32_t *>(addr), FUTEX_WAIT, val, &timeout, nullptr,
+            0);
+}
+
+// Wake up all threads waiting on `addr`.
+void WakeAddress(const uint32_t *addr) {
+  sys_futex(const_cast<uint32_t *>(addr), FUTEX_WAKE,
+            std::numeric_limits<int>::max(), nullptr, nullptr, 0);
+}
+
+// Returns true if `SynchronizeAllThreads` is supported.
+bool CanSynchronizeAllThreads(void) {
+  auto status = gSyncCoreStatus.load(std::memory_order_acquire);
+  if (GRANARY_UNLIKELY(!status)) {
+    status = sys_membarrier(kMembarrierRegisterPrivateExpeditedSyncCore, 0);
+    status = status ? -1 : 1;
+    gSyncCoreStatus.store(status, std::memory_order_release);
+  }
+  return 0 < status;
+}
+
+// Make every other thread execute a serializing instruction before it next
+// executes any code. This is used after modifying code that other threads
+// might be executing. Returns `false` if this isn't supported.
+//
+// Note: The kernel interrupts every CPU that is running one of this
+//       process's threads, and serializes the CPU before returning to user
+//       space.
+bool SynchronizeAllThreads(void) {
+  if (!CanSynchronizeAllThreads()) return false;
+  return !sys_membarrier(kMembarrierPrivateExpeditedSyncCore, 0);
+}
+
 }  // namespace os
 }  // namespace granary
 
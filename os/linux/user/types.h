@@ -60,6 +60,7 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <dlfcn.h>
+#include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fenv.h>
@@ -168,10 +169,13 @@ extern int rt_sigaction(int sig, const struct kernel_sigaction *new_act,
 
 extern void rt_sigreturn(void);
 
+extern int rt_sigprocmask(int how, const unsigned long *new_set,
+                          unsigned long *old_set, size_t sigsetsize);
+
 // Raw clone system call, plus an extra parameter :-D
 extern long sys_clone(unsigned long clone_flags, char *newsp,
-                      int *parent_tidptr, int *child_tidptr, int tls_val,
-                      void (*func)(void));
+                      int *parent_tidptr, int *child_tidptr,
+                      unsigned long tls_val, void (*func)(void));
 
 extern int arch_prctl(int option, ...);
 
@@ -7,14 +7,42 @@
 
 #include "granary/breakpoint.h"
 #include "granary/context.h"
+#include "granary/epoch.h"
 
+#include "os/file.h"
+#include "os/memory.h"
 #include "os/module.h"
 
 namespace granary {
+
+// Lock that is write-held when Granary is at a safe point.
+extern ReaderWriterLock gExitGranaryLock;
+
 namespace os {
 
 GRANARY_IMPLEMENT_NEW_ALLOCATOR(Module)
 
+namespace {
+
+enum : size_t {
+  // Number of failed lookups remembered by each thread.
+  kNumFailedLookups = 8
+};
+
+// Version number of the next address range to be created or changed.
+static std::atomic<uint64_t> gNextRangeVersion(ATOMIC_VAR_INIT(1));
+
+// Generation number of the next module index. Generation numbers are unique
+// across all module managers.
+static std::atomic<uint64_t> gNextIndexGeneration(ATOMIC_VAR_INIT(1));
+
+// Returns a new, globally unique, address range version number.
+static uint64_t NextRangeVersion(void) {
+  return gNextRangeVersion.fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace
+
 // Represents a range of code/data within a module.
 class ModuleAddressRange {
  public:
@@ -28,7 +56,8 @@ class ModuleAddressRange {
         end_addr(end_addr_),
         begin_offset(begin_offset_),
         end_offset(begin_offset + (end_addr - begin_addr)),
-        perms(perms_) {}
+        perms(perms_),
+        version(NextRangeVersion()) {}
 
   ~ModuleAddressRange(void) {
     next = nullptr;
@@ -52,6 +81,10 @@ class ModuleAddressRange {
   // Permissions (e.g. readable, writable, executable).
   unsigned perms;
 
+  // Uniquely identifies this range. This changes whenever the bounds of the
+  // range change.
+  uint64_t version;
+
   GRANARY_DEFINE_INTERNAL_NEW_ALLOCATOR(ModuleAddressRange, {
     kAlignment = arch::CACHE_LINE_SIZE_BYTES
   })
@@ -72,8 +105,209 @@ typedef LinkedListZipper<ModuleAddressRange> ModuleAddressRangeZipper;
 
 typedef LinkedListIterator<Module> ModuleIterator;
 
+// A copy of one range of one module, as stored in a `ModuleIndex`.
+struct ModuleIndexEntry {
+  // Runtime offsets in the virtual address space.
+  uintptr_t begin_addr;
+  uintptr_t end_addr;
+
+  // Static offset of `begin_addr` within the module.
+  uintptr_t begin_offset;
+
+  // The maximum `end_addr` of this entry and of all entries before it. This
+  // bounds how far back a lookup must scan to find overlapping entries.
+  uintptr_t max_end_addr;
+
+  // Version of the copied range.
+  uint64_t version;
+
+  // Module containing the range.
+  Module *module;
+
+  // Position of `module` in the list of modules. If the ranges of different
+  // modules overlap, then the entry with the lowest rank wins, just as if the
+  // list of modules were searched in order.
+  unsigned rank;
+
+  // Permissions (e.g. readable, writable, executable).
+  unsigned perms;
+
+  // Does this entry overlap with any other entry?
+  bool overlaps;
+};
+
+// An immutable snapshot of the ranges of all modules, sorted by their
+// beginning addresses.
+class ModuleIndex {
+ public:
+  // Next retired index.
+  ModuleIndex *next;
+
+  // The epoch in which this index was retired. The index is freed once every
+  // thread has observed this epoch.
+  uint64_t retired_epoch;
+
+  // Number of pages allocated to this index, including its entries.
+  size_t num_pages;
+
+  // Uniquely identifies this index.
+  uint64_t generation;
+
+  // Value of `gNextRangeVersion` when this index was built. If any range is
+  // created or changed after this index was built, then this index is stale.
+  uint64_t range_version;
+
+  // The number of entries in this index, and the number of entries that
+  // could be stored in this index.
+  size_t num_entries;
+  size_t max_num_entries;
+
+  // Sorted entries of this index.
+  ModuleIndexEntry *entries;
+};
+
 namespace {
 
+// Returns true if a range with the permissions `perms` contains immutable
+// code.
+static bool IsImmutableCode(unsigned perms) {
+  return (perms & MODULE_EXECUTABLE) && !(perms & MODULE_WRITABLE);
+}
+
+// Allocate an empty index that can hold at least `num_entries` entries.
+static ModuleIndex *AllocateIndex(size_t num_entries) {
+  const auto num_bytes = sizeof(ModuleIndex) +
+                         num_entries * sizeof(ModuleIndexEntry);
+  const auto num_pages = (num_bytes + arch::PAGE_SIZE_BYTES - 1) /
+                         arch::PAGE_SIZE_BYTES;
+  auto index = reinterpret_cast<ModuleIndex *>(AllocateDataPages(num_pages));
+  index->next = nullptr;
+  index->retired_epoch = 0;
+  index->num_pages = num_pages;
+  index->generation = 0;
+  index->range_version = 0;
+  index->num_entries = 0;
+  index->max_num_entries = (num_pages * arch::PAGE_SIZE_BYTES -
+                            sizeof(ModuleIndex)) / sizeof(ModuleIndexEntry);
+  index->entries = reinterpret_cast<ModuleIndexEntry *>(index + 1);
+  return index;
+}
+
+// Free a list of indexes.
+static void FreeIndexes(ModuleIndex *index) {
+  for (ModuleIndex *next_index(nullptr); index; index = next_index) {
+    next_index = index->next;
+    FreeDataPages(index, index->num_pages);
+  }
+}
+
+// Free every index in `*indexes` that was retired in an epoch `<= epoch`.
+static void FreeRetiredIndexes(ModuleIndex **indexes, uint64_t epoch) {
+  while (auto index = *indexes) {
+    if (index->retired_epoch <= epoch) {
+      *indexes = index->next;
+      FreeDataPages(index, index->num_pages);
+    } else {
+      indexes = &(index->next);
+    }
+  }
+}
+
+// Sort the entries of `index`, and then figure out which entries overlap.
+static void FinalizeIndex(ModuleIndex *index) {
+  auto entries = index->entries;
+  const auto num_entries = index->num_entries;
+  std::sort(entries, entries + num_entries,
+            [] (const ModuleIndexEntry &a, const ModuleIndexEntry &b) {
+    return a.begin_addr < b.begin_addr ||
+           (a.begin_addr == b.begin_addr && a.rank < b.rank);
+  });
+  uintptr_t max_end_addr(0);
+  for (auto i = 0UL; i < num_entries; ++i) {
+    auto &entry(entries[i]);
+    entry.overlaps = max_end_addr > entry.begin_addr ||
+                     (i + 1 < num_entries &&
+                      entries[i + 1].begin_addr < entry.end_addr);
+    max_end_addr = std::max(max_end_addr, entry.end_addr);
+    entry.max_end_addr = max_end_addr;
+  }
+}
+
+// Find the entry of `index` that contains `addr`. If `code_only` is `true`,
+// then only entries for executable, non-writable ranges are considered.
+static const ModuleIndexEntry *FindEntry(const ModuleIndex *index,
+                                         uintptr_t addr, bool code_only) {
+  // Find the first entry that begins after `addr`.
+  size_t first(0);
+  size_t last(index->num_entries);
+  while (first < last) {
+    const auto mid = first + (last - first) / 2;
+    if (index->entries[mid].begin_addr <= addr) {
+      first = mid + 1;
+    } else {
+      last = mid;
+    }
+  }
+
+  // Scan backward over every entry that could contain `addr`. Usually this
+  // is only the first entry that we look at.
+  const ModuleIndexEntry *found(nullptr);
+  for (auto i = first; i-- > 0; ) {
+    const auto entry = &(index->entries[i]);
+    if (entry->max_end_addr <= addr) break;
+    if (addr >= entry->end_addr) continue;
+    if (code_only && !IsImmutableCode(entry->perms)) continue;
+    if (!found || entry->rank < found->rank) found = entry;
+  }
+  return found;
+}
+
+#ifdef GRANARY_WHERE_user
+// A lookup that failed to find the page `page` in the index `generation`.
+struct FailedLookup {
+  uintptr_t page;
+  uint64_t generation;
+};
+
+// The entry found by this thread's most recent successful lookup, and the
+// generation of the index in which it was found. Only entries that don't
+// overlap with other entries are remembered.
+static __thread ModuleIndexEntry tLastFoundEntry;
+static __thread uint64_t tLastFoundGeneration = 0;
+
+// This thread's recent failed lookups.
+static __thread FailedLookup tFailedLookups[kNumFailedLookups];
+
+// Returns the failed lookup slot for the address `addr`.
+static FailedLookup *FailedLookupFor(uintptr_t addr) {
+  const auto page = addr / arch::PAGE_SIZE_BYTES;
+  return &(tFailedLookups[page % kNumFailedLookups]);
+}
+
+// Returns true if the built-in modules should be re-registered because a
+// lookup of `addr` failed. Re-registering is skipped if this thread already
+// failed to find `addr`'s page in the current index, so that repeated misses
+// don't repeatedly re-parse `/proc/self/maps`.
+static bool ShouldReRegister(const ModuleIndex *index, uintptr_t addr) {
+  auto lookup = FailedLookupFor(addr);
+  return lookup->page != addr / arch::PAGE_SIZE_BYTES ||
+         lookup->generation != index->generation;
+}
+
+// Record that a lookup of `addr` failed, even after re-registering the
+// built-in modules.
+static void RecordFailedLookup(const ModuleIndex *index, uintptr_t addr) {
+  auto lookup = FailedLookupFor(addr);
+  lookup->page = addr / arch::PAGE_SIZE_BYTES;
+  lookup->generation = index->generation;
+}
+#else
+static bool ShouldReRegister(const ModuleIndex *, uintptr_t) {
+  return true;
+}
+static void RecordFailedLookup(const ModuleIndex *, uintptr_t) {}
+#endif  // GRANARY_WHERE_user
+
 // Find the address range that contains a particular address. Returns
 // `nullptr` if no such range exists in the specified list.
 static const ModuleAddressRange *FindRange(const ModuleAddressRange *ranges,
@@ -95,6 +329,21 @@ static const ModuleAddressRange *FindRange(const ModuleAddressRange *ranges,
   return FindRange(ranges, reinterpret_cast<uintptr_t>(addr));
 }
 
+// Returns true if `ranges` contains a range that is identical to `range`.
+static bool ContainsIdenticalRange(const ModuleAddressRange *ranges,
+                                   const ModuleAddressRange *range) {
+  for (auto curr : ConstModuleAddressRangeIterator(ranges)) {
+    if (curr->begin_addr == range->begin_addr) {
+      return curr->end_addr == range->end_addr &&
+             curr->begin_offset == range->begin_offset &&
+             curr->perms == range->perms;
+    } else if (curr->begin_addr > range->begin_addr) {
+      break;
+    }
+  }
+  return false;
+}
+
 // Returns a pointer to the name of a module. For example, we want to extract
 // `libacl` from `/lib/x86_64-linux-gnu/libacl.so.1.1.0`.
 static void PathToName(const char *path, char *buff) {
@@ -151,6 +400,38 @@ ModuleOffset Module::OffsetOfPC(AppPC pc) const {
   }
 }
 
+// Return the program counter of the executable code at `offset` within this
+// module. This is the inverse of `OffsetOfPC`. Returns `nullptr` if no
+// executable range of the module contains `offset`.
+AppPC Module::PCOfOffset(uintptr_t offset) const {
+  ReadLockedRegion locker(&ranges_lock);
+  for (auto range : ConstModuleAddressRangeIterator(ranges)) {
+    if (range->begin_offset <= offset && offset < range->end_offset &&
+        (range->perms & MODULE_EXECUTABLE)) {
+      return reinterpret_cast<AppPC>(
+          range->begin_addr + (offset - range->begin_offset));
+    }
+  }
+  return nullptr;
+}
+
+// Find the immutable code range of this module that contains `pc`. Returns
+// `false` if `pc` is not in an executable, non-writable range of this module.
+bool Module::FindImmutableCodeRange(AppPC pc,
+                                    ImmutableCodeRange *code_range) const {
+  ReadLockedRegion locker(&ranges_lock);
+  auto range = FindRange(ranges, pc);
+  if (!range || !(range->perms & MODULE_EXECUTABLE) ||
+      (range->perms & MODULE_WRITABLE)) {
+    return false;
+  }
+  code_range->begin_addr = range->begin_addr;
+  code_range->end_addr = range->end_addr;
+  code_range->begin_offset = range->begin_offset;
+  code_range->version = range->version;
+  return true;
+}
+
 // Returns true if a module contains the code address `pc`, and if that code
 // address is marked as executable.
 bool Module::Contains(AppPC pc) const {
@@ -189,8 +470,47 @@ bool Module::RemoveRange(uintptr_t begin_addr, uintptr_t end_addr) {
   return RemoveRangeConflicts(begin_addr, end_addr);
 }
 
+// Returns true if any executable range of this module overlaps with the
+// range `[begin_addr, end_addr)`.
+bool Module::ContainsCode(uintptr_t begin_addr, uintptr_t end_addr) const {
+  ReadLockedRegion locker(&ranges_lock);
+  for (auto range : ConstModuleAddressRangeIterator(ranges)) {
+    if (range->begin_addr >= end_addr) break;
+    if (range->end_addr > begin_addr && (range->perms & MODULE_EXECUTABLE)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Change the permissions of the parts of this module's ranges that overlap
+// with `[begin_addr, end_addr)`. Changing the permissions of part of a range
+// splits the range.
+void Module::ProtectRange(uintptr_t begin_addr, uintptr_t end_addr,
+                          unsigned perms) {
+  WriteLockedRegion locker(&ranges_lock);
+  for (auto changed = true; changed; ) {
+    changed = false;
+    for (auto range : ConstModuleAddressRangeIterator(ranges)) {
+      if (range->begin_addr >= end_addr) break;
+      if (range->end_addr <= begin_addr) continue;
+      const auto new_perms = (range->perms & MODULE_COPY_ON_WRITE) | perms;
+      if (range->perms == new_perms) continue;
+      const auto new_begin_addr = std::max(begin_addr, range->begin_addr);
+      const auto new_end_addr = std::min(end_addr, range->end_addr);
+      const auto new_begin_offset = range->begin_offset +
+                                    (new_begin_addr - range->begin_addr);
+      AddRange(new ModuleAddressRange(new_begin_addr, new_end_addr,
+                                      new_begin_offset, new_perms));
+      changed = true;  // `AddRange` invalidates `range`.
+      break;
+    }
+  }
+}
+
 // Remove all ranges from this module.
 void Module::RemoveRanges(void) {
+  if (ranges) NextRangeVersion();  // Invalidate any indexes.
   for (ModuleAddressRange *next_range(nullptr); nullptr != ranges;
        ranges = next_range) {
     next_range = ranges->next;
@@ -203,9 +523,16 @@ void Module::RemoveRanges(void) {
 // re-added). If ranges are removed then these will result in code cache
 // flushing events.
 //
+// If an identical range already exists (e.g. because `/proc/self/maps` was
+// re-parsed), then the existing range, and its version, are kept.
+//
 // Note: This method is invoked within the context of a `WriteLocked` of the
 //       `ranges_lock`.
 void Module::AddRange(ModuleAddressRange *range) {
+  if (ContainsIdenticalRange(ranges, range)) {
+    delete range;
+    return;
+  }
   RemoveRangeConflicts(range->begin_addr, range->end_addr);
   AddRangeNoConflict(range);
 }
@@ -240,6 +567,7 @@ bool Module::RemoveRangeConflicts(uintptr_t begin_addr, uintptr_t end_addr) {
       } else {  // `curr` is contained in `range`.
         curr->end_addr = curr->begin_addr;
       }
+      curr->version = NextRangeVersion();
 
       if (curr->begin_addr >= curr->end_addr) {
         curr_elem.Unlink();  // Reap a range.
@@ -267,7 +595,10 @@ void Module::AddRangeNoConflict(ModuleAddressRange *range) {
 // Initialize the module tracker.
 ModuleManager::ModuleManager(void)
     : modules(nullptr),
-      modules_lock() {}
+      modules_lock(),
+      index(ATOMIC_VAR_INIT(nullptr)),
+      index_lock(),
+      retired_indexes(nullptr) {}
 
 ModuleManager::~ModuleManager(void) {
   Module *next_module(nullptr);
@@ -275,37 +606,150 @@ ModuleManager::~ModuleManager(void) {
     next_module = modules->next;
     delete modules;
   }
+  FreeIndexes(const_cast<ModuleIndex *>(index.load()));
+  FreeIndexes(retired_indexes);
 }
 
-// Find a module given a program counter.
-GRANARY_CONST Module *ModuleManager::FindByAppPC(AppPC pc) {
-  for (auto num_attempts = 0; num_attempts < 2; ++num_attempts) {
-    do {
-      ReadLockedRegion locker(&modules_lock);
-      for (auto module : ModuleIterator(modules)) {
-        if (module->Contains(pc)) {
-          return module;
+// Returns the current index of the ranges of all modules. The index is
+// re-built if the ranges of any module have changed since it was built.
+//
+// Note: Changes to module ranges don't re-build the index themselves, so a
+//       burst of changes (e.g. the `munmap` and `mmap` halves of a `mmap`)
+//       costs at most one re-build, which is done by the next lookup.
+const ModuleIndex *ModuleManager::CurrentIndex(void) {
+  auto current_index = index.load(std::memory_order_acquire);
+  if (GRANARY_LIKELY(current_index && current_index->range_version ==
+                     gNextRangeVersion.load(std::memory_order_relaxed))) {
+    return current_index;
+  }
+  return UpdateIndex();
+}
+
+// Build a new index of the ranges of all modules, and publish it. The old
+// index is retired, and freed once every thread has observed the epoch in
+// which it was retired, as other threads might still be reading it.
+const ModuleIndex *ModuleManager::UpdateIndex(void) {
+  SpinLockedRegion index_locker(&index_lock);
+  ReadLockedRegion modules_locker(&modules_lock);
+  auto old_index = index.load(std::memory_order_acquire);
+  const auto range_version = gNextRangeVersion.load();
+  if (old_index && old_index->range_version == range_version) {
+    return old_index;
+  }
+
+  // Copy the ranges of every module into the new index. If the ranges change
+  // while we're copying them and they no longer fit, then try again.
+  ModuleIndex *new_index(nullptr);
+  auto num_ranges = 0UL;
+  do {
+    if (new_index) FreeIndexes(new_index);
+    new_index = AllocateIndex(num_ranges);
+    num_ranges = 0;
+    auto rank = 0U;
+    for (auto module : ModuleIterator(modules)) {
+      ReadLockedRegion ranges_locker(&(module->ranges_lock));
+      for (auto range : ConstModuleAddressRangeIterator(module->ranges)) {
+        if (num_ranges < new_index->max_num_entries) {
+          auto &entry(new_index->entries[num_ranges]);
+          entry.begin_addr = range->begin_addr;
+          entry.end_addr = range->end_addr;
+          entry.begin_offset = range->begin_offset;
+          entry.version = range->version;
+          entry.module = module;
+          entry.rank = rank;
+          entry.perms = range->perms;
         }
+        ++num_ranges;
       }
-    } while (false);
-    if (!num_attempts) ReRegisterAllBuiltIn();
+      ++rank;
+    }
+  } while (num_ranges > new_index->max_num_entries);
+
+  new_index->num_entries = num_ranges;
+  new_index->range_version = range_version;
+  new_index->generation = gNextIndexGeneration.fetch_add(1);
+  FinalizeIndex(new_index);
+  index.store(new_index, std::memory_order_release);
+
+  if (old_index) {
+    auto retired_index = const_cast<ModuleIndex *>(old_index);
+    retired_index->retired_epoch = AdvanceEpoch();
+    retired_index->next = retired_indexes;
+    retired_indexes = retired_index;
   }
-  return nullptr;
+  FreeRetiredIndexes(&retired_indexes, OldestObservedEpoch());
+  return new_index;
+}
+
+// Find the indexed range that contains `pc`. If `code_only` is `true`, then
+// only executable, non-writable ranges are considered.
+bool ModuleManager::FindIndexedRange(AppPC pc, bool code_only,
+                                     ModuleIndexEntry *entry) {
+  const auto addr = reinterpret_cast<uintptr_t>(pc);
+  const auto current_index = CurrentIndex();
+#ifdef GRANARY_WHERE_user
+  // The last found entry doesn't overlap with any other entry, so if it
+  // contains `addr` then it's the only entry that can.
+  if (tLastFoundGeneration == current_index->generation &&
+      tLastFoundEntry.begin_addr <= addr && addr < tLastFoundEntry.end_addr) {
+    if (code_only && !IsImmutableCode(tLastFoundEntry.perms)) return false;
+    *entry = tLastFoundEntry;
+    return true;
+  }
+#endif  // GRANARY_WHERE_user
+  auto found_entry = FindEntry(current_index, addr, code_only);
+  if (!found_entry) return false;
+  *entry = *found_entry;
+#ifdef GRANARY_WHERE_user
+  if (!found_entry->overlaps) {
+    tLastFoundEntry = *found_entry;
+    tLastFoundGeneration = current_index->generation;
+  }
+#endif  // GRANARY_WHERE_user
+  return true;
+}
+
+// Find the indexed range that contains `pc`. If no range contains `pc`, then
+// the built-in modules are re-registered, unless a recent lookup of the
+// same page also failed.
+bool ModuleManager::FindIndexedRangeOrReRegister(AppPC pc,
+                                                 ModuleIndexEntry *entry) {
+  const auto addr = reinterpret_cast<uintptr_t>(pc);
+  if (FindIndexedRange(pc, false, entry)) return true;
+  if (!ShouldReRegister(CurrentIndex(), addr)) return false;
+  ReRegisterAllBuiltIn();
+  if (FindIndexedRange(pc, false, entry)) return true;
+  RecordFailedLookup(CurrentIndex(), addr);
+  return false;
+}
+
+// Find a module given a program counter.
+GRANARY_CONST Module *ModuleManager::FindByAppPC(AppPC pc) {
+  ModuleIndexEntry entry;
+  if (!FindIndexedRangeOrReRegister(pc, &entry)) return nullptr;
+  return entry.module;
 }
 
 // Find the module and offset associated with a given program counter.
 ModuleOffset ModuleManager::FindOffsetOfPC(AppPC pc) {
-  for (auto num_attempts = 0; num_attempts < 2; ++num_attempts) {
-    do {
-      ReadLockedRegion locker(&modules_lock);
-      for (auto module : ModuleIterator(modules)) {
-        auto offset = module->OffsetOfPC(pc);
-        if (offset.module == module) return offset;
-      }
-    } while (false);
-    if (!num_attempts) ReRegisterAllBuiltIn();
-  }
-  return ModuleOffset();
+  ModuleIndexEntry entry;
+  if (!FindIndexedRangeOrReRegister(pc, &entry)) return ModuleOffset();
+  const auto addr = reinterpret_cast<uintptr_t>(pc);
+  return ModuleOffset(entry.module,
+                      entry.begin_offset + (addr - entry.begin_addr));
+}
+
+// Find the immutable code range of some module that contains `pc`. Returns
+// `false` if `pc` is not in an executable, non-writable range of any module.
+bool ModuleManager::FindImmutableCodeRange(AppPC pc,
+                                           ImmutableCodeRange *range) {
+  ModuleIndexEntry entry;
+  if (!FindIndexedRange(pc, true, &entry)) return false;
+  range->begin_addr = entry.begin_addr;
+  range->end_addr = entry.end_addr;
+  range->begin_offset = entry.begin_offset;
+  range->version = entry.version;
+  return true;
 }
 
 // Find a module given its path.
@@ -335,6 +779,7 @@ void ModuleManager::Register(Module *module) {
   WriteLockedRegion locker(&modules_lock);
   module->next = modules;
   modules = module;
+  NextRangeVersion();  // The ranks of the indexed modules have changed.
 }
 
 #define ROUND_DOWN_TO_PAGE(x) ((x) >> 12) << 12
@@ -350,11 +795,90 @@ bool ModuleManager::RemoveRange(uintptr_t begin_addr, uintptr_t end_addr) {
   return ret;
 }
 
+// Remove a range of addresses that may be part of one or more modules.
+// Returns `true` if any of the removed addresses were executable.
+bool ModuleManager::RemoveCodeRange(uintptr_t begin_addr, uintptr_t end_addr) {
+  WriteLockedRegion locker(&modules_lock);
+  auto removed_code = false;
+  for (auto module : ModuleIterator(modules)) {
+    if (module->ContainsCode(begin_addr, end_addr)) removed_code = true;
+    module->RemoveRange(begin_addr, end_addr);
+  }
+  return removed_code;
+}
+
+// Add the range `[begin_addr, end_addr)` to the module with the path `path`,
+// registering a new module if necessary. The range is removed from all
+// other modules.
+void ModuleManager::AddRange(const char *path, uintptr_t begin_addr,
+                             uintptr_t end_addr, uintptr_t begin_offset,
+                             unsigned perms) {
+  WriteLockedRegion locker(&modules_lock);
+  Module *path_module(nullptr);
+  for (auto module : ModuleIterator(modules)) {
+    if (!path_module && StringsMatch(module->path, path)) {
+      path_module = module;
+    } else {
+      module->RemoveRange(begin_addr, end_addr);
+    }
+  }
+  if (!path_module) {
+    path_module = new Module(path);
+    path_module->next = modules;
+    modules = path_module;
+    NextRangeVersion();  // The ranks of the indexed modules have changed.
+  }
+  path_module->AddRange(begin_addr, end_addr, begin_offset, perms);
+}
+
+// Change the permissions of a range of addresses that may be part of one or
+// more modules.
+void ModuleManager::ProtectRange(uintptr_t begin_addr, uintptr_t end_addr,
+                                 unsigned perms) {
+  WriteLockedRegion locker(&modules_lock);
+  for (auto module : ModuleIterator(modules)) {
+    module->ProtectRange(begin_addr, end_addr, perms);
+  }
+}
+
+// Move the range of addresses `[old_begin_addr, old_end_addr)` to
+// `[new_begin_addr, new_end_addr)`, keeping its module, offset, and
+// permissions. Returns `true` if any of the old addresses were executable.
+//
+// Note: If no module contains `old_begin_addr`, then the new range is left
+//       for the next parse of the built-in modules to discover.
+bool ModuleManager::MoveRange(uintptr_t old_begin_addr, uintptr_t old_end_addr,
+                              uintptr_t new_begin_addr,
+                              uintptr_t new_end_addr) {
+  ModuleIndexEntry entry;
+  const auto found_range = FindIndexedRange(
+      reinterpret_cast<AppPC>(old_begin_addr), false, &entry);
+  const auto removed_code = RemoveCodeRange(old_begin_addr, old_end_addr);
+  if (found_range) {
+    const auto begin_offset = entry.begin_offset +
+                              (old_begin_addr - entry.begin_addr);
+    AddRange(entry.module->path, new_begin_addr, new_end_addr, begin_offset,
+             entry.perms);
+  }
+  return removed_code;
+}
+
 namespace {
 
 // Global module manager.
 GRANARY_EARLY_GLOBAL static Container<ModuleManager> gModuleManager;
 
+// Invalidate all cache code translated from `[begin_addr, end_addr)`.
+//
+// Note: This doesn't wait for other threads to leave Granary. The invalidated
+//       code is retired, and reclaimed once every thread has observed a newer
+//       epoch.
+static bool InvalidateCode(uintptr_t begin_addr, uintptr_t end_addr) {
+  ReadLockedRegion locker(&gExitGranaryLock);
+  return GlobalContext()->InvalidateCode(
+      reinterpret_cast<AppPC>(begin_addr), reinterpret_cast<AppPC>(end_addr));
+}
+
 }  // namespace
 
 // Initializes the module manager.
@@ -377,6 +901,12 @@ ModuleOffset ModuleOffsetOfPC(AppPC pc) {
   return gModuleManager->FindOffsetOfPC(pc);
 }
 
+// Find the immutable code range of some module that contains `pc`. Returns
+// `false` if `pc` is not in an executable, non-writable range of any module.
+bool FindImmutableCodeRange(AppPC pc, ImmutableCodeRange *range) {
+  return gModuleManager->FindImmutableCodeRange(pc, range);
+}
+
 // Returns a pointer to the first module whose name matches `name`.
 const Module *ModuleByName(const char *name) {
   return gModuleManager->FindByName(name);
@@ -387,5 +917,67 @@ ConstModuleIterator LoadedModules(void) {
   return gModuleManager->Modules();
 }
 
+// Invalidate all cache code related belonging to some module code. Returns
+// true if any module code was invalidated as a result of this operation.
+//
+// Note: This doesn't wait for other threads to leave Granary. The invalidated
+//       code is retired, and reclaimed once every thread has observed a newer
+//       epoch.
+bool InvalidateModuleCode(AppPC start_pc, uintptr_t num_bytes) {
+  auto begin_addr = reinterpret_cast<uintptr_t>(start_pc);
+  auto end_addr = begin_addr + num_bytes;
+  if (!gModuleManager->RemoveCodeRange(begin_addr, end_addr)) return false;
+  return InvalidateCode(begin_addr, end_addr);
+}
+
+// Notify Granary that `num_bytes` of memory starting at `start_pc` have been
+// mapped with the permissions `perms` (a combination of `MODULE_*` flags). If
+// the memory is backed by a file, then `fd` is the file's descriptor, and
+// `file_offset` is the offset of the mapping within the file. Otherwise, `fd`
+// is `-1`.
+//
+// Note: If a file-backed mapping's path can't be found, then the mapping is
+//       left for the next parse of the built-in modules to discover.
+void NotifyMemoryMapped(AppPC start_pc, uintptr_t num_bytes, unsigned perms,
+                        int fd, uintptr_t file_offset) {
+  const auto begin_addr = reinterpret_cast<uintptr_t>(start_pc);
+  const auto end_addr = GRANARY_ALIGN_TO(begin_addr + num_bytes,
+                                         arch::PAGE_SIZE_BYTES);
+  char path[Module::kMaxModulePathLength] = "[anon]";
+  InvalidateModuleCode(start_pc, end_addr - begin_addr);
+#ifdef GRANARY_WHERE_user
+  if (-1 != fd && !FilePathOfDescriptor(fd, path, sizeof path)) return;
+#else
+  if (-1 != fd) return;
+#endif  // GRANARY_WHERE_user
+  gModuleManager->AddRange(path, begin_addr, end_addr, file_offset, perms);
+}
+
+// Notify Granary that the permissions of `num_bytes` of memory starting at
+// `start_pc` have been changed to `perms`.
+void NotifyMemoryProtected(AppPC start_pc, uintptr_t num_bytes,
+                           unsigned perms) {
+  const auto begin_addr = reinterpret_cast<uintptr_t>(start_pc);
+  const auto end_addr = GRANARY_ALIGN_TO(begin_addr + num_bytes,
+                                         arch::PAGE_SIZE_BYTES);
+  gModuleManager->ProtectRange(begin_addr, end_addr, perms);
+}
+
+// Notify Granary that `old_num_bytes` of memory starting at `old_pc` have been
+// moved and/or resized to `new_num_bytes` of memory starting at `new_pc`.
+void NotifyMemoryRemapped(AppPC old_pc, uintptr_t old_num_bytes,
+                          AppPC new_pc, uintptr_t new_num_bytes) {
+  const auto old_begin_addr = reinterpret_cast<uintptr_t>(old_pc);
+  const auto old_end_addr = GRANARY_ALIGN_TO(old_begin_addr + old_num_bytes,
+                                             arch::PAGE_SIZE_BYTES);
+  const auto new_begin_addr = reinterpret_cast<uintptr_t>(new_pc);
+  const auto new_end_addr = GRANARY_ALIGN_TO(new_begin_addr + new_num_bytes,
+                                             arch::PAGE_SIZE_BYTES);
+  if (gModuleManager->MoveRange(old_begin_addr, old_end_addr,
+                                new_begin_addr, new_end_addr)) {
+    InvalidateCode(old_begin_addr, old_end_addr);
+  }
+}
+
 }  // namespace os
 }  // namespace granary
@@ -49,6 +49,7 @@ class ModuleOffset {
 
  private:
   friend class Module;
+  friend class ModuleManager;
 
   // Initialize a `ModuleOffset` instances.
   GRANARY_INTERNAL_DEFINITION
@@ -59,6 +60,25 @@ class ModuleOffset {
 
 #ifdef GRANARY_INTERNAL
 class ModuleAddressRange;
+class ModuleIndex;
+struct ModuleIndexEntry;
+
+// A range of executable, non-writable code within a module. The code in such a
+// range can only change if the range itself changes, e.g. if it's unmapped.
+struct ImmutableCodeRange {
+  // Runtime bounds of the range in the virtual address space.
+  uintptr_t begin_addr;
+  uintptr_t end_addr;
+
+  // Offset of `begin_addr` within the module.
+  uintptr_t begin_offset;
+
+  // Uniquely identifies this range. Every time that a module range is added or
+  // changed, it is given a new version number, so a version number never
+  // identifies more than one mapping of code.
+  uint64_t version;
+};
+
 enum {
   MODULE_READABLE = (1 << 0),
   MODULE_WRITABLE = (1 << 1),
@@ -87,6 +107,17 @@ class Module {
   // the module then the returned object is all nulled.
   ModuleOffset OffsetOfPC(AppPC pc) const;
 
+  // Return the program counter of the executable code at `offset` within this
+  // module. This is the inverse of `OffsetOfPC`. Returns `nullptr` if no
+  // executable range of the module contains `offset`.
+  AppPC PCOfOffset(uintptr_t offset) const;
+
+  // Find the immutable code range of this module that contains `pc`. Returns
+  // `false` if `pc` is not in an executable, non-writable range of this
+  // module.
+  GRANARY_INTERNAL_DEFINITION
+  bool FindImmutableCodeRange(AppPC pc, ImmutableCodeRange *code_range) const;
+
   // Returns true if a module contains the code address `pc`, and if that code
   // address is marked as executable.
   bool Contains(AppPC pc) const;
@@ -108,9 +139,19 @@ class Module {
   GRANARY_INTERNAL_DEFINITION
   bool RemoveRange(uintptr_t begin_addr, uintptr_t end_addr);
 
+  // Returns true if any executable range of this module overlaps with the
+  // range `[begin_addr, end_addr)`.
+  GRANARY_INTERNAL_DEFINITION
+  bool ContainsCode(uintptr_t begin_addr, uintptr_t end_addr) const;
+
   // Remove all ranges from this module.
   GRANARY_INTERNAL_DEFINITION void RemoveRanges(void);
 
+  // Change the permissions of the parts of this module's ranges that overlap
+  // with `[begin_addr, end_addr)`.
+  GRANARY_INTERNAL_DEFINITION
+  void ProtectRange(uintptr_t begin_addr, uintptr_t end_addr, unsigned perms);
+
   GRANARY_DECLARE_INTERNAL_NEW_ALLOCATOR(Module, {
     kAlignment = arch::CACHE_LINE_SIZE_BYTES
   })
@@ -188,6 +229,10 @@ class ModuleManager {
   // Find the module and offset associated with a given program counter.
   ModuleOffset FindOffsetOfPC(AppPC pc);
 
+  // Find the immutable code range of some module that contains `pc`. Returns
+  // `false` if `pc` is not in an executable, non-writable range of any module.
+  bool FindImmutableCodeRange(AppPC pc, ImmutableCodeRange *range);
+
   // Find a module given its path.
   Module *FindByPath(const char *path);
 
@@ -213,18 +258,72 @@ class ModuleManager {
   // Returns `true` if changes were made.
   bool RemoveRange(uintptr_t begin_addr, uintptr_t end_addr);
 
+  // Remove a range of addresses that may be part of one or more modules.
+  // Returns `true` if any of the removed addresses were executable.
+  bool RemoveCodeRange(uintptr_t begin_addr, uintptr_t end_addr);
+
+  // Add the range `[begin_addr, end_addr)` to the module with the path `path`,
+  // registering a new module if necessary. The range is removed from all
+  // other modules.
+  void AddRange(const char *path, uintptr_t begin_addr, uintptr_t end_addr,
+                uintptr_t begin_offset, unsigned perms);
+
+  // Change the permissions of a range of addresses that may be part of one or
+  // more modules.
+  void ProtectRange(uintptr_t begin_addr, uintptr_t end_addr, unsigned perms);
+
+  // Move the range of addresses `[old_begin_addr, old_end_addr)` to
+  // `[new_begin_addr, new_end_addr)`, keeping its module, offset, and
+  // permissions. Returns `true` if any of the old addresses were executable.
+  bool MoveRange(uintptr_t old_begin_addr, uintptr_t old_end_addr,
+                 uintptr_t new_begin_addr, uintptr_t new_end_addr);
+
   // Returns an iterator over all loaded modules.
   inline ConstModuleIterator Modules(void) const {
     return ConstModuleIterator(modules);
   }
 
  private:
+  // Returns the current index of the ranges of all modules. The index is
+  // re-built if the ranges of any module have changed since it was built.
+  //
+  // Note: Changes to module ranges don't re-build the index themselves, so a
+  //       burst of changes (e.g. the `munmap` and `mmap` halves of a `mmap`)
+  //       costs at most one re-build, which is done by the next lookup.
+  const ModuleIndex *CurrentIndex(void);
+
+  // Build a new index of the ranges of all modules, and publish it. The old
+  // index is retired, and freed once every thread has observed the epoch in
+  // which it was retired, as other threads might still be reading it.
+  const ModuleIndex *UpdateIndex(void);
+
+  // Find the indexed range that contains `pc`. If `code_only` is `true`, then
+  // only executable, non-writable ranges are considered.
+  bool FindIndexedRange(AppPC pc, bool code_only, ModuleIndexEntry *entry);
+
+  // Find the indexed range that contains `pc`. If no range contains `pc`, then
+  // the built-in modules are re-registered, unless a recent lookup of the
+  // same page also failed.
+  bool FindIndexedRangeOrReRegister(AppPC pc, ModuleIndexEntry *entry);
+
   // Linked list of modules. Modules in the list are stored in no particular
   // order because they can have discontiguous segments.
   Module *modules;
 
   // Lock on updating the modules list.
   ReaderWriterLock modules_lock;
+
+  // Sorted, immutable index of the ranges of all modules. Lookups read the
+  // index without acquiring any locks. The index is replaced whenever the
+  // ranges of any module change.
+  std::atomic<const ModuleIndex *> index;
+
+  // Lock that serializes the building of new indexes.
+  SpinLock index_lock;
+
+  // Indexes that have been replaced by newer indexes, but that might still be
+  // read by some thread.
+  ModuleIndex *retired_indexes;
 };
 
 // Initializes the module manager.
@@ -233,6 +332,10 @@ void InitModuleManager(void);
 // Exits the module manager.
 void ExitModuleManager(void);
 
+// Find the immutable code range of some module that contains `pc`. Returns
+// `false` if `pc` is not in an executable, non-writable range of any module.
+bool FindImmutableCodeRange(AppPC pc, ImmutableCodeRange *range);
+
 #endif  // GRANARY_INTERNAL
 
 // Returns a pointer to the module containing some program counter.
@@ -249,7 +352,24 @@ ConstModuleIterator LoadedModules(void);
 
 // Invalidate all cache code related belonging to some module code. Returns
 // true if any module code was invalidated as a result of this operation.
-bool InvalidateModuleCode(void *context, AppPC start_pc, uintptr_t num_bytes);
+bool InvalidateModuleCode(AppPC start_pc, uintptr_t num_bytes);
+
+// Notify Granary that `num_bytes` of memory starting at `start_pc` have been
+// mapped with the permissions `perms` (a combination of `MODULE_*` flags). If
+// the memory is backed by a file, then `fd` is the file's descriptor, and
+// `file_offset` is the offset of the mapping within the file. Otherwise, `fd`
+// is `-1`.
+void NotifyMemoryMapped(AppPC start_pc, uintptr_t num_bytes, unsigned perms,
+                        int fd, uintptr_t file_offset);
+
+// Notify Granary that the permissions of `num_bytes` of memory starting at
+// `start_pc` have been changed to `perms`.
+void NotifyMemoryProtected(AppPC start_pc, uintptr_t num_bytes, unsigned perms);
+
+// Notify Granary that `old_num_bytes` of memory starting at `old_pc` have been
+// moved and/or resized to `new_num_bytes` of memory starting at `new_pc`.
+void NotifyMemoryRemapped(AppPC old_pc, uintptr_t old_num_bytes,
+                          AppPC new_pc, uintptr_t new_num_bytes);
 
 }  // namespace os
 }  // namespace granary
@@ -16,9 +16,41 @@ namespace os {
 enum SlotCategory : size_t {
   SLOT_VIRTUAL_REGISTER,
   SLOT_PRIVATE_STACK,
-  SLOT_SAVED_FLAGS
+  SLOT_SAVED_FLAGS,
+  SLOT_SHADOW_STACK
 };
 
+// Thread-private stack of the return sites of translated function calls. This
+// is used by `--shadow_return_stack` to resolve function returns without
+// going through an indirect edge.
+//
+// Note: Only the low byte of `top` is updated, so the stack wraps around after
+//       `kNumEntries` calls, overwriting the oldest entries instead of
+//       overflowing.
+struct ShadowStack {
+  enum : size_t {
+    kNumEntries = 256
+  };
+
+  // Index of the most recently pushed return site in `entries`.
+  uint8_t top;
+
+  // The most recently popped return site whose return address matched, but
+  // whose code cache address was not yet known.
+  void *unresolved_site;
+
+  // Pushed return sites.
+  void *entries[kNumEntries];
+};
+
+static_assert(8 == offsetof(ShadowStack, unresolved_site),
+    "Field `ShadowStack::unresolved_site` must be at offset `8`, as assembly "
+    "routines depend on this.");
+
+static_assert(16 == offsetof(ShadowStack, entries),
+    "Field `ShadowStack::entries` must be at offset `16`, as assembly "
+    "routines depend on this.");
+
 struct SlotSet {
   // Pointer to a thread- or CPU-private stack.
   uintptr_t stack_slot;
@@ -29,6 +61,10 @@ struct SlotSet {
   // Used for spilling general-purpose registers, so that a spilled GPR can be
   // used to hold the value of a virtual register.
   uintptr_t spill_slots[arch::MAX_NUM_SPILL_SLOTS];
+
+  // Return sites of translated function calls. Shadow stacks are only
+  // supported in user space.
+  GRANARY_IF_USER( ShadowStack shadow_stack; )
 };
 
 // Access the value of some kind of private slot (by reference). This is an
@@ -11,12 +11,50 @@ namespace os {
 // Notify Granary tools that a thread has been created.
 void InitThread(void);
 
+// Notify Granary that the current thread is about to create a new thread.
+void BeforeCreateThread(void);
+
 // Notify Granary tools that a thread has been destroyed.
 void ExitThread(void);
 
 // Yield this thread. This might not actually yield the thread.
 void YieldThread(void);
 
+#ifdef GRANARY_WHERE_user
+// Create a Granary-private worker thread that executes `func`. Worker threads
+// never execute instrumented code, and have all signals blocked. Returns
+// `false` if the thread couldn't be created.
+//
+// Note: Worker threads have their own thread-local storage, in which all of
+//       Granary's thread-local variables start with their initial values.
+bool CreateWorkerThread(void (*func)(void));
+#endif  // GRANARY_WHERE_user
+
+// Wait for all worker threads to exit.
+void JoinWorkerThreads(void);
+
+// Returns true if the current thread is a Granary-private worker thread.
+bool IsWorkerThread(void);
+
+// Block the current thread while `*addr == val`. This can return spuriously.
+void WaitOnAddress(const uint32_t *addr, uint32_t val);
+
+// Block the current thread while `*addr == val`, for at most `num_millis`
+// milliseconds. This can return spuriously.
+void TimedWaitOnAddress(const uint32_t *addr, uint32_t val,
+                        uint64_t num_millis);
+
+// Wake up all threads waiting on `addr`.
+void WakeAddress(const uint32_t *addr);
+
+// Returns true if `SynchronizeAllThreads` is supported.
+bool CanSynchronizeAllThreads(void);
+
+// Make every other thread execute a serializing instruction before it next
+// executes any code. This is used after modifying code that other threads
+// might be executing. Returns `false` if this isn't supported.
+bool SynchronizeAllThreads(void);
+
 // Get the thread/CPU base address.
 //
 // Note: This has an architecture-specific implementation.
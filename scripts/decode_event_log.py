@@ -0,0 +1,105 @@
+"""Decode a binary event log written by Granary's `--event_log_file` option,
+and print one line per event, ordered by timestamp.
+
+Usage:      python decode_event_log.py <event log file>
+
+Author:     Peter Goodman (peter.goodman@gmail.com)
+Copyright:  Copyright 2014 Peter Goodman, all rights reserved."""
+
+import struct
+import sys
+
+MAGIC = b"GREVENTS"
+VERSION = 1
+FLAG_IS_COMPACT = 1
+
+EVENT_KIND_CHUNK = 1
+EVENT_CHUNK = 2
+
+MAX_NUM_EVENT_ARGS = 8
+
+FILE_HEADER = struct.Struct("<8sII")
+CHUNK_HEADER = struct.Struct("<II")
+EVENT_CHUNK_HEADER = struct.Struct("<II")
+EVENT_RECORD = struct.Struct("<QII%dQ" % MAX_NUM_EVENT_ARGS)
+
+# Decode a variable-length integer from `data` at `offset`. Returns the
+# integer and the offset of the next byte.
+def decode_varint(data, offset):
+  val = 0
+  shift = 0
+  while True:
+    byte = ord(data[offset:offset + 1])
+    offset += 1
+    val |= (byte & 0x7F) << shift
+    shift += 7
+    if not (byte & 0x80):
+      return val, offset
+
+# Decode the events of one event chunk.
+def decode_events(data, is_compact, thread_number, num_events, events):
+  offset = 0
+  timestamp = 0
+  for _ in range(num_events):
+    if is_compact:
+      delta, offset = decode_varint(data, offset)
+      timestamp += (delta >> 1) ^ -(delta & 1)  # Zig-zag.
+      kind, offset = decode_varint(data, offset)
+      num_args, offset = decode_varint(data, offset)
+      args = []
+      for _ in range(num_args):
+        arg, offset = decode_varint(data, offset)
+        args.append(arg)
+    else:
+      fields = EVENT_RECORD.unpack_from(data, offset)
+      offset += EVENT_RECORD.size
+      timestamp, kind, num_args = fields[0:3]
+      args = list(fields[3:3 + num_args])
+    events.append((timestamp, thread_number, kind, args))
+
+# Decode an event log file. Returns the registered kinds of events, and the
+# logged events.
+def decode_file(path):
+  with open(path, "rb") as log_file:
+    data = log_file.read()
+
+  magic, version, flags = FILE_HEADER.unpack_from(data, 0)
+  if MAGIC != magic or VERSION != version:
+    raise Exception("{} is not a version {} event log.".format(path, VERSION))
+
+  is_compact = bool(flags & FLAG_IS_COMPACT)
+  kinds = {}
+  events = []
+  offset = FILE_HEADER.size
+  while offset + CHUNK_HEADER.size <= len(data):
+    chunk_type, num_bytes = CHUNK_HEADER.unpack_from(data, offset)
+    offset += CHUNK_HEADER.size
+    chunk = data[offset:offset + num_bytes]
+    offset += num_bytes
+
+    if EVENT_KIND_CHUNK == chunk_type:
+      kind, = struct.unpack_from("<I", chunk, 0)
+      name, format_str = chunk[4:].split(b"\0")[0:2]
+      kinds[kind] = (name.decode(), format_str.decode())
+
+    elif EVENT_CHUNK == chunk_type:
+      thread_number, num_events = EVENT_CHUNK_HEADER.unpack_from(chunk, 0)
+      decode_events(chunk[EVENT_CHUNK_HEADER.size:], is_compact,
+                    thread_number, num_events, events)
+
+  events.sort(key=lambda event: event[0])
+  return kinds, events
+
+# Format the arguments of an event using the format string of its kind.
+def format_args(format_str, args):
+  try:
+    return format_str % tuple(args)
+  except (TypeError, ValueError):
+    return " ".join("{:x}".format(arg) for arg in args)
+
+if "__main__" == __name__:
+  kinds, events = decode_file(sys.argv[1])
+  for timestamp, thread_number, kind, args in events:
+    name, format_str = kinds.get(kind, ("kind{}".format(kind), ""))
+    print("{}\tT{}\t{}\t{}".format(
+        timestamp, thread_number, name, format_args(format_str, args)))
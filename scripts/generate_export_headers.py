@@ -41,10 +41,12 @@ EXPORT_HEADERS = [
   "granary/client.h",
   "granary/entry.h",
   "granary/index.h",
+  "granary/profile.h",
   "granary/tool.h",
   "granary/util.h",
 
   "os/abi.h",
+  "os/event_log.h",
   "os/logging.h",
   "os/module.h",
   "os/lock.h",
@@ -7,6 +7,11 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
 #include "arch/driver.h"
 
 #include "granary/base/cast.h"
@@ -19,6 +24,70 @@ extern "C" {
   extern void TestDecode_Instructions_End(void);
 }
 
+namespace {
+enum {
+  kNumEncodeRounds = 1000,
+  kEncodeBufferSize = 1 << 16
+};
+
+// Buffers into which instructions are staged and committed. These are globals
+// so that they are likely to be within +/- 2 GiB of `TestDecode_Instructions`,
+// which keeps relative branches into that code reachable.
+static uint8_t gStageBuffer[kEncodeBufferSize];
+static uint8_t gCommitBuffer[kEncodeBufferSize];
+static uint8_t gCommitStagedBuffer[kEncodeBufferSize];
+
+// `JMP rel32` followed by `JZ rel32`.
+static const uint8_t gBranches[] = {
+  0xE9, 0x00, 0x01, 0x00, 0x00,
+  0x0F, 0x84, 0x00, 0xFF, 0xFF, 0xFF
+};
+
+// Decode all instructions in `[begin, end)`.
+static std::vector<granary::arch::Instruction> DecodeInstructions(
+    granary::AppPC begin, granary::AppPC end) {
+  std::vector<granary::arch::Instruction> instrs;
+  granary::arch::Instruction instr;
+  while (begin < end) {
+    if (!granary::arch::InstructionDecoder::DecodeNext(&instr, &begin)) break;
+    instrs.push_back(instr);
+  }
+  return instrs;
+}
+
+// Returns the number of operations per second.
+static double OpsPerSecond(size_t num_ops,
+                           std::chrono::steady_clock::duration duration) {
+  auto seconds = std::chrono::duration<double>(duration).count();
+  return seconds ? static_cast<double>(num_ops) / seconds : 0.0;
+}
+
+// Stage encode every instruction in `instrs` into `gStageBuffer`, and then
+// commit them into `buffer` with an encoder of kind `kind`. If `keep_staged`
+// is true then the commit encoder re-uses the staged bytes. Returns the number
+// of committed bytes.
+static size_t StageAndCommit(std::vector<granary::arch::Instruction> *instrs,
+                             granary::arch::InstructionEncodeKind kind,
+                             bool keep_staged, uint8_t *buffer) {
+  using namespace granary;
+  std::vector<uint8_t> staged_bytes(
+      instrs->size() * arch::MAX_INSTRUCTION_SIZE_BYTES);
+  auto staged_bytes_buffer = keep_staged ? staged_bytes.data() : nullptr;
+  arch::InstructionEncoder staged_encoder(arch::InstructionEncodeKind::STAGED,
+                                          staged_bytes_buffer);
+  arch::InstructionEncoder commit_encoder(kind, staged_bytes_buffer);
+  auto staged_pc = &(gStageBuffer[0]);
+  for (auto &instr : *instrs) {
+    EXPECT_TRUE(staged_encoder.EncodeNext(&instr, &staged_pc));
+  }
+  auto pc = buffer;
+  for (auto &instr : *instrs) {
+    EXPECT_TRUE(commit_encoder.EncodeNext(&instr, &pc));
+  }
+  return static_cast<size_t>(pc - buffer);
+}
+}  // namespace
+
 TEST(EncodeTest, EncodeCommonInstructions) {
   using namespace granary;
   Init(kInitAttach);
@@ -45,3 +114,89 @@ TEST(EncodeTest, EncodeCommonInstructions) {
   }
   Exit(kExitDetach);
 }
+
+TEST(EncodeTest, CommitStagedMatchesCommit) {
+  using namespace granary;
+  Init(kInitAttach);
+
+  auto instrs = DecodeInstructions(
+      UnsafeCast<AppPC>(TestDecode_Instructions),
+      UnsafeCast<AppPC>(TestDecode_Instructions_End));
+  ASSERT_FALSE(instrs.empty());
+
+  // Committing the staged bytes must produce exactly what re-encoding does.
+  auto num_bytes = StageAndCommit(&instrs, arch::InstructionEncodeKind::COMMIT,
+                                  false, gCommitBuffer);
+  ASSERT_GT(static_cast<size_t>(kEncodeBufferSize), num_bytes);
+  EXPECT_EQ(num_bytes, StageAndCommit(
+      &instrs, arch::InstructionEncodeKind::COMMIT_STAGED, true,
+      gCommitStagedBuffer));
+  EXPECT_EQ(0, memcmp(gCommitBuffer, gCommitStagedBuffer, num_bytes));
+
+  // Without staged bytes, committing re-encodes every instruction.
+  memset(gCommitStagedBuffer, 0, num_bytes);
+  EXPECT_EQ(num_bytes, StageAndCommit(
+      &instrs, arch::InstructionEncodeKind::COMMIT_STAGED, false,
+      gCommitStagedBuffer));
+  EXPECT_EQ(0, memcmp(gCommitBuffer, gCommitStagedBuffer, num_bytes));
+  Exit(kExitDetach);
+}
+
+TEST(EncodeTest, CommitStagedPatchesBranchDisplacements) {
+  using namespace granary;
+  Init(kInitAttach);
+
+  auto begin = &(gBranches[0]);
+  auto instrs = DecodeInstructions(begin, begin + sizeof gBranches);
+  ASSERT_EQ(2UL, instrs.size());
+  const auto jmp_target = instrs[0].BranchTargetPC();
+  const auto jz_target = instrs[1].BranchTargetPC();
+
+  // The branches are staged and committed at different addresses, so their
+  // staged displacements must be patched to keep the same targets.
+  auto num_bytes = StageAndCommit(
+      &instrs, arch::InstructionEncodeKind::COMMIT_STAGED, true,
+      gCommitStagedBuffer);
+  ASSERT_EQ(sizeof gBranches, num_bytes);
+
+  auto committed = DecodeInstructions(gCommitStagedBuffer,
+                                      gCommitStagedBuffer + num_bytes);
+  ASSERT_EQ(2UL, committed.size());
+  EXPECT_TRUE(committed[0].IsUnconditionalJump());
+  EXPECT_TRUE(committed[1].IsConditionalJump());
+  EXPECT_EQ(jmp_target, committed[0].BranchTargetPC());
+  EXPECT_EQ(jz_target, committed[1].BranchTargetPC());
+  Exit(kExitDetach);
+}
+
+// Measures how many instructions per second are committed by re-encoding
+// them, and by re-using their staged bytes. This is a benchmark, and so only
+// runs with `make bench`.
+TEST(EncodeTest, DISABLED_CommitStagedEncodingThroughputBenchmark) {
+  using namespace granary;
+  Init(kInitAttach);
+
+  auto instrs = DecodeInstructions(
+      UnsafeCast<AppPC>(TestDecode_Instructions),
+      UnsafeCast<AppPC>(TestDecode_Instructions_End));
+  ASSERT_FALSE(instrs.empty());
+
+  const auto num_encodes = kNumEncodeRounds * instrs.size();
+  auto commit_begin = std::chrono::steady_clock::now();
+  for (auto i = 0; i < kNumEncodeRounds; ++i) {
+    StageAndCommit(&instrs, arch::InstructionEncodeKind::COMMIT, false,
+                   gCommitBuffer);
+  }
+  auto commit_end = std::chrono::steady_clock::now();
+  for (auto i = 0; i < kNumEncodeRounds; ++i) {
+    StageAndCommit(&instrs, arch::InstructionEncodeKind::COMMIT_STAGED, true,
+                   gCommitStagedBuffer);
+  }
+  auto commit_staged_end = std::chrono::steady_clock::now();
+
+  printf("[ %-9s ] instructions/s=%12.0f\n", "commit",
+         OpsPerSecond(num_encodes, commit_end - commit_begin));
+  printf("[ %-9s ] instructions/s=%12.0f\n", "staged",
+         OpsPerSecond(num_encodes, commit_staged_end - commit_end));
+  Exit(kExitDetach);
+}
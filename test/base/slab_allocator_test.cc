@@ -0,0 +1,91 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#define GRANARY_INTERNAL
+#define GRANARY_TEST
+
+#include "granary/base/base.h"
+#include "granary/base/new.h"
+
+using namespace granary;
+
+namespace {
+enum : size_t {
+  kObjectSize = 64,
+  kStartOffset = GRANARY_ALIGN_TO(sizeof(internal::SlabList), kObjectSize),
+  kNumObjsPerSlab = (internal::kNewAllocatorNumBytesPerSlab - kStartOffset) /
+                    kObjectSize,
+  kEndOffset = kStartOffset + kNumObjsPerSlab * kObjectSize,
+  kNumObjectsPerThread = 1024,
+  kNumThreads = 8
+};
+
+// Allocates `kNumObjectsPerThread` objects, tags each one, then checks that no
+// other thread overwrote the tags before freeing the objects.
+static bool AllocateAndFree(internal::SlabAllocator *allocator, uintptr_t tag) {
+  std::vector<uintptr_t *> objects;
+  for (auto i = 0UL; i < kNumObjectsPerThread; ++i) {
+    auto object = reinterpret_cast<uintptr_t *>(allocator->Allocate());
+    *object = tag;
+    objects.push_back(object);
+  }
+  auto all_tagged = true;
+  for (auto object : objects) {
+    all_tagged = all_tagged && tag == *object;
+    allocator->Free(object);
+  }
+  FreeThreadMagazines();
+  return all_tagged;
+}
+}  // namespace
+
+TEST(SlabAllocatorTest, ObjectsAreReusedAfterThreadExit) {
+  internal::SlabAllocator allocator("Test", kStartOffset, kEndOffset,
+                                    kObjectSize, kObjectSize);
+  std::thread([&] { EXPECT_TRUE(AllocateAndFree(&allocator, 1)); }).join();
+
+  internal::SlabAllocatorStatistics before;
+  allocator.GetStatistics(&before);
+  EXPECT_EQ(static_cast<size_t>(kNumObjectsPerThread),
+            before.num_free_list_frees);
+
+  // The second thread should get all of its objects from the free list.
+  std::thread([&] { EXPECT_TRUE(AllocateAndFree(&allocator, 2)); }).join();
+
+  internal::SlabAllocatorStatistics after;
+  allocator.GetStatistics(&after);
+  EXPECT_EQ(before.num_slabs, after.num_slabs);
+  EXPECT_EQ(before.num_slab_allocations, after.num_slab_allocations);
+  EXPECT_EQ(static_cast<size_t>(kNumObjectsPerThread),
+            after.num_free_list_allocations);
+}
+
+TEST(SlabAllocatorTest, ConcurrentThreadsGetDistinctObjects) {
+  internal::SlabAllocator allocator("Test", kStartOffset, kEndOffset,
+                                    kObjectSize, kObjectSize);
+  std::vector<std::thread> threads;
+  std::vector<bool> all_tagged(kNumThreads, false);
+  for (auto t = 0UL; t < kNumThreads; ++t) {
+    threads.emplace_back([=, &allocator, &all_tagged] {
+      auto tagged = true;
+      for (auto round = 0; round < 4; ++round) {
+        tagged = AllocateAndFree(&allocator, t + 1) && tagged;
+      }
+      all_tagged[t] = tagged;
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  for (auto tagged : all_tagged) EXPECT_TRUE(tagged);
+
+  // Objects are moved in bulk, so there should be far fewer trips to the
+  // global depot than there are allocations.
+  internal::SlabAllocatorStatistics stats;
+  allocator.GetStatistics(&stats);
+  const auto num_allocs = 4UL * kNumThreads * kNumObjectsPerThread;
+  EXPECT_GT(num_allocs / 4, stats.num_magazine_refills);
+}
@@ -0,0 +1,173 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#include <gmock/gmock.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define GRANARY_INTERNAL
+#define GRANARY_TEST
+
+#include "granary/base/base.h"
+#include "granary/base/option.h"
+
+#include "granary/exit.h"
+#include "granary/init.h"
+
+#include "os/event_log.h"
+
+GRANARY_DECLARE_string(event_log_file);
+GRANARY_DECLARE_bool(compact_event_log);
+
+using namespace granary;
+using namespace ::testing;
+
+namespace {
+enum : uint64_t {
+  kNumThreads = 4,
+
+  // More events than fit in a thread's ring buffer, so that the buffers wrap
+  // around while the worker drains them.
+  kNumEventsPerThread = 5000,
+
+  // Multiplier that makes the last argument of each event need all ten bytes
+  // of a variable-length integer.
+  kBigArgMultiplier = 0x9E3779B97F4A7C15ULL
+};
+
+// Logged events, indexed by the logging thread, and then by the sequence
+// number of the event.
+typedef std::vector<std::vector<uint64_t>> LoggedEvents;
+
+// Returns the path to the event log decoder script.
+static std::string DecoderPath(void) {
+  std::string path(__FILE__);
+  path = path.substr(0, path.rfind('/'));  // Removes `/event_log_test.cc`.
+  path = path.substr(0, path.rfind('/') + 1);  // Removes `test`.
+  return path + "scripts/decode_event_log.py";
+}
+
+// Log `kNumEventsPerThread` events, and record the sequence numbers of the
+// events that weren't dropped.
+static void LogEvents(uint32_t kind, uint64_t thread_id,
+                      std::vector<uint64_t> *logged) {
+  for (uint64_t seq = 0; seq < kNumEventsPerThread; ++seq) {
+    if (os::LogEvent(kind, thread_id, seq, seq * kBigArgMultiplier)) {
+      logged->push_back(seq);
+    }
+    if (!(seq % 64)) std::this_thread::yield();
+  }
+  os::ExitThreadEventLog();
+}
+}  // namespace
+
+class EventLogTest : public Test {
+ protected:
+  EventLogTest(void)
+      : path(),
+        kind(os::kInvalidEventKind),
+        logged(kNumThreads) {}
+
+  virtual void SetUp(void) {
+    char path_template[] = "/tmp/granary_event_log_XXXXXX";
+    auto fd = mkstemp(path_template);
+    ASSERT_NE(-1, fd);
+    close(fd);
+    path = path_template;
+  }
+
+  virtual void TearDown(void) {
+    unlink(path.c_str());
+    FLAG_event_log_file = "";
+    FLAG_compact_event_log = true;
+  }
+
+  // Log events from several threads into a new event log file.
+  void WriteEventLog(bool is_compact) {
+    FLAG_event_log_file = path.c_str();
+    FLAG_compact_event_log = is_compact;
+    Init(kInitAttach);
+    ASSERT_TRUE(os::EventLogIsEnabled());
+    kind = os::RegisterEventKind("test_event", "%d %d %x");
+    ASSERT_NE(os::kInvalidEventKind, kind);
+
+    std::vector<std::thread> threads;
+    for (uint64_t i = 0; i < kNumThreads; ++i) {
+      threads.push_back(std::thread(LogEvents, kind, i, &(logged[i])));
+    }
+    for (auto &thread : threads) thread.join();
+    Exit(kExitDetach);
+    EXPECT_FALSE(os::EventLogIsEnabled());
+  }
+
+  // Decode the event log file with `scripts/decode_event_log.py`, and make
+  // sure that every logged event was decoded exactly once, and that the
+  // arguments of the events survived the round trip.
+  void CheckDecodedEventLog(void) {
+    auto command = "python3 " + DecoderPath() + " " + path;
+    auto output = popen(command.c_str(), "r");
+    ASSERT_TRUE(nullptr != output);
+
+    LoggedEvents decoded(kNumThreads);
+    char line[256];
+    while (fgets(line, sizeof line, output)) {
+      unsigned long long timestamp(0), thread_id(0), seq(0), big_arg(0);
+      unsigned thread_number(0);
+      char name[32];
+      ASSERT_EQ(6, sscanf(line, "%llu\tT%u\t%31s\t%llu %llu %llx", &timestamp,
+                          &thread_number, name, &thread_id, &seq, &big_arg))
+          << line;
+      EXPECT_STREQ("test_event", name);
+      ASSERT_GT(kNumThreads, thread_id);
+      EXPECT_EQ(seq * kBigArgMultiplier, big_arg);
+      decoded[thread_id].push_back(seq);
+    }
+    ASSERT_EQ(0, pclose(output));
+
+    for (auto i = 0UL; i < kNumThreads; ++i) {
+      std::sort(decoded[i].begin(), decoded[i].end());
+      EXPECT_FALSE(logged[i].empty());
+      EXPECT_EQ(logged[i], decoded[i]);
+    }
+  }
+
+  // Returns the size of the event log file.
+  size_t EventLogSize(void) {
+    struct stat info;
+    if (stat(path.c_str(), &info)) return 0;
+    return static_cast<size_t>(info.st_size);
+  }
+
+  std::string path;
+  uint32_t kind;
+  LoggedEvents logged;
+};
+
+TEST_F(EventLogTest, CompactEventsRoundTrip) {
+  WriteEventLog(true);
+  CheckDecodedEventLog();
+}
+
+TEST_F(EventLogTest, FixedSizeEventsRoundTrip) {
+  WriteEventLog(false);
+  CheckDecodedEventLog();
+}
+
+TEST_F(EventLogTest, CompactEventsAreSmaller) {
+  WriteEventLog(true);
+  auto compact_size = EventLogSize();
+  auto num_events = 0UL;
+  for (const auto &thread_logged : logged) num_events += thread_logged.size();
+
+  // Each fixed-size event is 80 bytes. Compact events have a small timestamp
+  // delta, three small integers, and one ten-byte integer.
+  EXPECT_LT(0UL, compact_size);
+  EXPECT_GT(num_events * 32, compact_size);
+}
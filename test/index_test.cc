@@ -0,0 +1,200 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#include <gmock/gmock.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#define GRANARY_INTERNAL
+#define GRANARY_TEST
+
+#include "granary/base/base.h"
+#include "granary/base/option.h"
+
+#include "granary/app.h"
+#include "granary/exit.h"
+#include "granary/index.h"
+#include "granary/init.h"
+#include "granary/metadata.h"
+
+GRANARY_DECLARE_bool(index_with_radix_tree);
+
+using namespace granary;
+using namespace ::testing;
+
+namespace {
+enum {
+  kNumMetaDataPerThread = 1024,
+  kNumThreads = 8,
+  kNumLookupsPerMetaData = 16
+};
+
+// Returns a fake, but unique, application program counter.
+static AppPC FakePC(uintptr_t thread_id, uintptr_t i) {
+  return reinterpret_cast<AppPC>(
+      0x400000UL + (thread_id * kNumMetaDataPerThread + i) * 16);
+}
+
+// Returns the number of operations per second.
+static double OpsPerSecond(size_t num_ops,
+                           std::chrono::steady_clock::duration duration) {
+  auto seconds = std::chrono::duration<double>(duration).count();
+  return seconds ? static_cast<double>(num_ops) / seconds : 0.0;
+}
+}  // namespace
+
+class IndexTest : public TestWithParam<bool> {
+ protected:
+  static void SetUpTestCase(void) {
+    Init(kInitAttach);
+  }
+
+  static void TearDownTestCase(void) {
+    Exit(kExitDetach);
+  }
+
+  // Switch the index engine being tested.
+  virtual void SetUp(void) {
+    ExitIndex();
+    FLAG_index_with_radix_tree = GetParam();
+    InitIndex();
+  }
+
+  virtual void TearDown(void) {
+    ExitIndex();
+    FLAG_index_with_radix_tree = false;
+    InitIndex();
+  }
+
+  // Inserts and then looks up meta-data from `num_threads` threads at once.
+  void Benchmark(uintptr_t num_threads) {
+    std::vector<std::thread> threads;
+    std::vector<bool> all_found(num_threads, false);
+
+    auto insert_begin = std::chrono::steady_clock::now();
+    for (auto t = 0UL; t < num_threads; ++t) {
+      threads.emplace_back([=] {
+        for (auto i = 0UL; i < kNumMetaDataPerThread; ++i) {
+          AddMetaDataToIndex(new BlockMetaData(FakePC(t, i)));
+        }
+      });
+    }
+    for (auto &thread : threads) thread.join();
+    auto insert_end = std::chrono::steady_clock::now();
+    threads.clear();
+
+    auto lookup_begin = std::chrono::steady_clock::now();
+    for (auto t = 0UL; t < num_threads; ++t) {
+      threads.emplace_back([=, &all_found] {
+        auto found = true;
+        for (auto n = 0UL; n < kNumLookupsPerMetaData; ++n) {
+          for (auto i = 0UL; i < kNumMetaDataPerThread; ++i) {
+            BlockMetaData search(FakePC((t + n) % num_threads, i));
+            auto response = FindMetaDataInIndex(&search);
+            found = found && kUnificationStatusAccept == response.status;
+          }
+        }
+        all_found[t] = found;
+      });
+    }
+    for (auto &thread : threads) thread.join();
+    auto lookup_end = std::chrono::steady_clock::now();
+
+    for (auto found : all_found) EXPECT_TRUE(found);
+
+    const auto num_inserts = num_threads * kNumMetaDataPerThread;
+    const auto num_lookups = num_inserts * kNumLookupsPerMetaData;
+    printf("[ %-9s ] threads=%-2lu inserts/s=%12.0f lookups/s=%12.0f\n",
+           GetParam() ? "radix" : "hash", num_threads,
+           OpsPerSecond(num_inserts, insert_end - insert_begin),
+           OpsPerSecond(num_lookups, lookup_end - lookup_begin));
+  }
+};
+
+TEST_P(IndexTest, EmptyIndexRejects) {
+  BlockMetaData search(FakePC(0, 0));
+  auto response = FindMetaDataInIndex(&search);
+  EXPECT_EQ(kUnificationStatusReject, response.status);
+  EXPECT_TRUE(nullptr == response.meta);
+}
+
+TEST_P(IndexTest, FindsIndexedMetaData) {
+  auto meta = new BlockMetaData(FakePC(0, 1));
+  AddMetaDataToIndex(meta);
+
+  BlockMetaData search(FakePC(0, 1));
+  auto response = FindMetaDataInIndex(&search);
+  EXPECT_EQ(kUnificationStatusAccept, response.status);
+  EXPECT_EQ(meta, response.meta);
+
+  BlockMetaData miss(FakePC(0, 2));
+  EXPECT_EQ(kUnificationStatusReject, FindMetaDataInIndex(&miss).status);
+}
+
+TEST_P(IndexTest, ForEachVisitsAllMetaData) {
+  for (auto i = 0UL; i < kNumMetaDataPerThread; ++i) {
+    AddMetaDataToIndex(new BlockMetaData(FakePC(0, i)));
+  }
+  auto num_indexed = 0UL;
+  detail::ForEachMetaData([&] (const BlockMetaData *, IndexedStatus status) {
+    if (kMetaDataIndexed == status) ++num_indexed;
+  });
+  EXPECT_EQ(static_cast<unsigned long>(kNumMetaDataPerThread), num_indexed);
+}
+
+TEST_P(IndexTest, ConcurrentInsertsAreFound) {
+  std::vector<std::thread> threads;
+  for (auto t = 0UL; t < kNumThreads; ++t) {
+    threads.emplace_back([=] {
+      for (auto i = 0UL; i < kNumMetaDataPerThread; ++i) {
+        AddMetaDataToIndex(new BlockMetaData(FakePC(t, i)));
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  threads.clear();
+
+  // Every thread looks up the meta-data inserted by every other thread, while
+  // the other threads are also looking things up.
+  std::atomic<unsigned long> num_found(ATOMIC_VAR_INIT(0));
+  for (auto t = 0UL; t < kNumThreads; ++t) {
+    threads.emplace_back([=, &num_found] {
+      for (auto n = 0UL; n < kNumThreads; ++n) {
+        for (auto i = 0UL; i < kNumMetaDataPerThread; ++i) {
+          const auto pc = FakePC((t + n) % kNumThreads, i);
+          BlockMetaData search(pc);
+          auto response = FindMetaDataInIndex(&search);
+          if (kUnificationStatusAccept != response.status) continue;
+          auto app_meta = MetaDataCast<const AppMetaData *>(response.meta);
+          if (pc == app_meta->start_pc) num_found.fetch_add(1);
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  EXPECT_EQ(static_cast<unsigned long>(
+                kNumThreads * kNumThreads * kNumMetaDataPerThread),
+            num_found.load());
+
+  auto num_indexed = 0UL;
+  detail::ForEachMetaData([&] (const BlockMetaData *, IndexedStatus status) {
+    if (kMetaDataIndexed == status) ++num_indexed;
+  });
+  EXPECT_EQ(static_cast<unsigned long>(kNumThreads * kNumMetaDataPerThread),
+            num_indexed);
+}
+
+// Measures insert and lookup throughput with 1 to 64 threads. This is a
+// benchmark, and so only runs with `make bench`.
+TEST_P(IndexTest, DISABLED_ConcurrentThroughputBenchmark) {
+  for (auto num_threads : {1UL, 2UL, 4UL, 8UL, 16UL, 32UL, 64UL}) {
+    Benchmark(num_threads);
+    ExitIndex();
+    InitIndex();
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(HashAndRadixTree, IndexTest, Bool());
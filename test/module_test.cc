@@ -82,6 +82,79 @@ TEST_F(ModuleManagerTest, FindRegisteredModulePC) {
   }
 }
 
+TEST_F(ModuleManagerTest, FindOffsetOfRegisteredModulePC) {
+  m1.Register(mod);
+  mod->AddRange(100, 200, 1000, 0);
+  auto offset = m1.FindOffsetOfPC(UnsafeCast<AppPC>(150UL));
+  EXPECT_EQ(mod, offset.module);
+  EXPECT_EQ(1050UL, offset.offset);
+}
+
+// Lookups must not find stale ranges after the ranges have been removed.
+TEST_F(ModuleManagerTest, FindRemovedModulePC) {
+  m1.Register(mod);
+  mod->AddRange(100, 200, 0, 0);
+  EXPECT_EQ(mod, m1.FindByAppPC(UnsafeCast<AppPC>(150UL)));
+  m1.RemoveRange(125, 175);
+  EXPECT_TRUE(nullptr == m1.FindByAppPC(UnsafeCast<AppPC>(150UL)));
+  EXPECT_EQ(mod, m1.FindByAppPC(UnsafeCast<AppPC>(120UL)));
+  EXPECT_EQ(mod, m1.FindByAppPC(UnsafeCast<AppPC>(180UL)));
+}
+
+// If the ranges of two modules overlap, then the most recently registered
+// module wins.
+TEST_F(ModuleManagerTest, FindOverlappingModulePC) {
+  auto other_mod = new os::Module("other");
+  m1.Register(mod);
+  mod->AddRange(100, 200, 0, 0);
+  m1.Register(other_mod);
+  other_mod->AddRange(150, 250, 0, 0);
+  EXPECT_EQ(mod, m1.FindByAppPC(UnsafeCast<AppPC>(120UL)));
+  EXPECT_EQ(other_mod, m1.FindByAppPC(UnsafeCast<AppPC>(160UL)));
+  EXPECT_EQ(other_mod, m1.FindByAppPC(UnsafeCast<AppPC>(220UL)));
+}
+
+// Mapping a range over part of another module's range takes over that part.
+TEST_F(ModuleManagerTest, AddRangeByPath) {
+  m1.Register(mod);
+  mod->AddRange(100, 200, 0, 0);
+  m1.AddRange("other", 150, 250, 0, os::MODULE_READABLE);
+  auto other_mod = m1.FindByPath("other");
+  ASSERT_TRUE(nullptr != other_mod);
+  EXPECT_EQ(mod, m1.FindByAppPC(UnsafeCast<AppPC>(120UL)));
+  EXPECT_EQ(other_mod, m1.FindByAppPC(UnsafeCast<AppPC>(160UL)));
+
+  m1.AddRange(GRANARY_NAME_STRING, 200, 300, 100, 0);
+  EXPECT_EQ(mod, m1.FindByAppPC(UnsafeCast<AppPC>(220UL)));
+  EXPECT_EQ(other_mod, m1.FindByAppPC(UnsafeCast<AppPC>(180UL)));
+}
+
+// Changing the permissions of part of a range splits the range.
+TEST_F(ModuleManagerTest, ProtectRange) {
+  os::ImmutableCodeRange range;
+  m1.Register(mod);
+  mod->AddRange(100, 200, 0, os::MODULE_READABLE | os::MODULE_WRITABLE);
+  EXPECT_FALSE(m1.FindImmutableCodeRange(UnsafeCast<AppPC>(150UL), &range));
+
+  m1.ProtectRange(125, 175, os::MODULE_READABLE | os::MODULE_EXECUTABLE);
+  EXPECT_FALSE(m1.FindImmutableCodeRange(UnsafeCast<AppPC>(120UL), &range));
+  ASSERT_TRUE(m1.FindImmutableCodeRange(UnsafeCast<AppPC>(150UL), &range));
+  EXPECT_EQ(125UL, range.begin_addr);
+  EXPECT_EQ(175UL, range.end_addr);
+  EXPECT_EQ(25UL, range.begin_offset);
+}
+
+// Moving a range keeps its module and offsets.
+TEST_F(ModuleManagerTest, MoveRange) {
+  m1.Register(mod);
+  mod->AddRange(100, 200, 1000, 0);
+  m1.MoveRange(100, 200, 300, 450);
+  EXPECT_FALSE(mod->Contains(UnsafeCast<AppPC>(150UL)));
+  auto offset = m1.FindOffsetOfPC(UnsafeCast<AppPC>(350UL));
+  EXPECT_EQ(mod, offset.module);
+  EXPECT_EQ(1050UL, offset.offset);
+}
+
 class ModuleTest : public Test {
  protected:
   ModuleTest(void)
@@ -211,3 +284,32 @@ TEST_F(ModuleRangeTest, SplitRangeCross) {
   TestPCMembership();
   TestOffsetsInRange();
 }
+
+// Only executable, non-writable ranges are immutable code ranges.
+TEST_F(ModuleRangeTest, ImmutableCodeRangeRequiresReadOnlyCode) {
+  os::ImmutableCodeRange range;
+  EXPECT_FALSE(mod.FindImmutableCodeRange(UnsafeCast<AppPC>(150UL), &range));
+
+  mod.AddRange(100, 200, 0, os::MODULE_EXECUTABLE | os::MODULE_WRITABLE);
+  EXPECT_FALSE(mod.FindImmutableCodeRange(UnsafeCast<AppPC>(150UL), &range));
+
+  mod.AddRange(100, 200, 0, os::MODULE_EXECUTABLE | os::MODULE_READABLE);
+  ASSERT_TRUE(mod.FindImmutableCodeRange(UnsafeCast<AppPC>(150UL), &range));
+  EXPECT_EQ(100UL, range.begin_addr);
+  EXPECT_EQ(200UL, range.end_addr);
+  EXPECT_EQ(0UL, range.begin_offset);
+  EXPECT_NE(0UL, range.version);
+}
+
+// Changing a range changes its version, even if the same code is mapped.
+TEST_F(ModuleRangeTest, ImmutableCodeRangeVersionChanges) {
+  mod.AddRange(100, 200, 0, os::MODULE_EXECUTABLE);
+  os::ImmutableCodeRange before;
+  ASSERT_TRUE(mod.FindImmutableCodeRange(UnsafeCast<AppPC>(110UL), &before));
+
+  mod.RemoveRange(150, 200);
+  os::ImmutableCodeRange after;
+  ASSERT_TRUE(mod.FindImmutableCodeRange(UnsafeCast<AppPC>(110UL), &after));
+  EXPECT_EQ(150UL, after.end_addr);
+  EXPECT_NE(before.version, after.version);
+}
@@ -0,0 +1,158 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#include <gmock/gmock.h>
+
+#define GRANARY_INTERNAL
+#define GRANARY_TEST
+
+#include "granary/base/option.h"
+
+#include "granary/cfg/block.h"
+#include "granary/cfg/instruction.h"
+#include "granary/cfg/lir.h"
+#include "granary/cfg/operand.h"
+
+#include "granary/tool.h"
+
+#include "test/util/simple_encoder.h"
+
+using namespace granary;
+using namespace testing;
+
+GRANARY_DECLARE_string(tools);
+
+namespace {
+
+// Non-zero if a VR didn't hold its expected value when it was checked.
+static uint64_t gLostValues = 0;
+
+}  // namespace
+
+// Defines a VR at the beginning of every block, and checks its value at the
+// end of the block. In between, a conditional jump splits the block into
+// several fragments so that the VR gets a preferred GPR, and lots of VRs are
+// simultaneously live so that registers need to be locally stolen to home
+// them. This makes sure that stealing a GPR in the live range of a VR that is
+// homed to a preferred GPR (whose native value might be dead) doesn't clobber
+// either the VR or the GPR's native value.
+class ManyLiveVRsTool : public InstrumentationTool {
+ public:
+  virtual ~ManyLiveVRsTool(void) = default;
+
+  virtual void InstrumentBlock(DecodedBlock *block) {
+    Instruction *last_instr(nullptr);
+    for (auto instr : block->ReversedAppInstructions()) {
+      last_instr = instr;
+      break;
+    }
+    if (!last_instr) return;
+
+    MemoryOperand lost_values(&gLostValues);
+    lir::InlineAssembly asm_(lost_values);
+    asm_.InlineAfter(block->FirstInstruction(),
+        "MOV r64 %1, i64 0x5A5A;"
+        "TEST r64 %1, r64 %1;"
+        "JZ l %2;"
+        "@LABEL %2:"_x86_64);
+
+    // `3 + 4 + ... + 14 == 102`.
+    asm_.InlineBefore(last_instr,
+        "MOV r64 %3, i64 3;"
+        "MOV r64 %4, i64 4;"
+        "MOV r64 %5, i64 5;"
+        "MOV r64 %6, i64 6;"
+        "MOV r64 %7, i64 7;"
+        "MOV r64 %8, i64 8;"
+        "MOV r64 %9, i64 9;"
+        "MOV r64 %10, i64 10;"
+        "MOV r64 %11, i64 11;"
+        "MOV r64 %12, i64 12;"
+        "MOV r64 %13, i64 13;"
+        "MOV r64 %14, i64 14;"
+        "ADD r64 %3, r64 %4;"
+        "ADD r64 %3, r64 %5;"
+        "ADD r64 %3, r64 %6;"
+        "ADD r64 %3, r64 %7;"
+        "ADD r64 %3, r64 %8;"
+        "ADD r64 %3, r64 %9;"
+        "ADD r64 %3, r64 %10;"
+        "ADD r64 %3, r64 %11;"
+        "ADD r64 %3, r64 %12;"
+        "ADD r64 %3, r64 %13;"
+        "ADD r64 %3, r64 %14;"
+        "SUB r64 %3, i32 102;"
+        "OR m64 %0, r64 %3;"
+        "SUB r64 %1, i32 0x5A5A;"
+        "OR m64 %0, r64 %1;"_x86_64);
+  }
+};
+
+class RegisterScheduleTest : public SimpleEncoderTest {
+ public:
+  virtual ~RegisterScheduleTest(void) = default;
+
+  static void SetUpTestCase(void) {
+    AddInstrumentationTool<ManyLiveVRsTool>("ManyLiveVRsTool");
+    FLAG_tools = "ManyLiveVRsTool";
+    SimpleEncoderTest::SetUpTestCase();
+  }
+
+ protected:
+  virtual void SetUp(void) {
+    gLostValues = 0;
+  }
+};
+
+namespace {
+
+GRANARY_TEST_CASE
+static int fibonacci_iter(int n) {
+  if (!n) return n;
+  if (1 == n) return 1;
+  int result = 0;
+  int prev = 0;
+  int prev_prev = 1;
+  for (auto i = 2; i <= n; ++i) {
+    result = prev + prev_prev;
+    prev_prev = prev;
+    prev = result;
+  }
+  return result;
+}
+
+GRANARY_TEST_CASE
+static int factorial_rec(int n) {
+  if (1 >= n) return 1;
+  return n * factorial_rec(n - 1);
+}
+
+template <typename RetT, typename... Args>
+GRANARY_EXPORT_TO_INSTRUMENTATION
+RetT CallInstrumentedTest(RetT (*func)(Args...), Args... args) {
+  RetT ret(func(args...));
+  asm("":::"memory");
+  return ret;
+}
+}  // namespace
+
+TEST_F(RegisterScheduleTest, IterativeFibonacci) {
+  auto inst = TranslateEntryPoint(this->context, fibonacci_iter,
+                                  kEntryPointTestCase);
+  auto fibonacci_iter_inst = UnsafeCast<int(*)(int)>(inst);
+  for (auto i = 0; i < 10; ++i) {
+    auto ret = CallInstrumentedTest(fibonacci_iter_inst, i);
+    EXPECT_EQ(fibonacci_iter(i), ret);
+  }
+  EXPECT_EQ(0UL, gLostValues);
+}
+
+TEST_F(RegisterScheduleTest, RecursiveFactorial) {
+  auto inst = TranslateEntryPoint(this->context, factorial_rec,
+                                  kEntryPointTestCase);
+  auto factorial_rec_inst = UnsafeCast<int(*)(int)>(inst);
+  for (auto i = 0; i < 10; ++i) {
+    auto ret = CallInstrumentedTest(factorial_rec_inst, i);
+    EXPECT_EQ(factorial_rec(i), ret);
+  }
+  EXPECT_EQ(0UL, gLostValues);
+}
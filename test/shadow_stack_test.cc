@@ -0,0 +1,123 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#include <gmock/gmock.h>
+
+#include <chrono>
+#include <cstdio>
+
+#define GRANARY_INTERNAL
+#define GRANARY_TEST
+
+#include "granary/base/option.h"
+
+#include "test/util/simple_encoder.h"
+
+using namespace granary;
+using namespace testing;
+
+GRANARY_DECLARE_bool(shadow_return_stack);
+GRANARY_DECLARE_bool(transparent_returns);
+
+namespace {
+enum {
+  kFibonacciN = 20,
+  kNumIterations = 100
+};
+
+// Two identical call/return-heavy functions, so that the translations made
+// with and without the shadow stack don't share code cache entries.
+GRANARY_TEST_CASE
+static int fibonacci_edges(int n) {
+  if (!n) return n;
+  if (1 == n) return 1;
+  return fibonacci_edges(n - 1) + fibonacci_edges(n - 2);
+}
+
+GRANARY_TEST_CASE
+static int fibonacci_shadow_stack(int n) {
+  if (!n) return n;
+  if (1 == n) return 1;
+  return fibonacci_shadow_stack(n - 1) + fibonacci_shadow_stack(n - 2);
+}
+
+template <typename RetT, typename... Args>
+GRANARY_EXPORT_TO_INSTRUMENTATION
+RetT CallInstrumentedTest(RetT (*func)(Args...), Args... args) {
+  RetT ret(func(args...));
+  asm("":::"memory");
+  return ret;
+}
+
+// Returns the number of function calls made by `fibonacci_*(n)`.
+static unsigned long NumCalls(int n) {
+  if (1 >= n) return 1;
+  return 1 + NumCalls(n - 1) + NumCalls(n - 2);
+}
+}  // namespace
+
+class ShadowStackTest : public SimpleEncoderTest {
+ public:
+  virtual ~ShadowStackTest(void) = default;
+
+ protected:
+  virtual void TearDown(void) {
+    FLAG_shadow_return_stack = false;
+  }
+
+  // Translate and repeatedly run `func`, and report the number of
+  // call/return pairs executed per second.
+  void Benchmark(int (*func)(int), bool use_shadow_stack) {
+    FLAG_shadow_return_stack = use_shadow_stack;
+    auto inst = TranslateEntryPoint(this->context, func, kEntryPointTestCase);
+    auto func_inst = UnsafeCast<int(*)(int)>(inst);
+    const auto expected = func(kFibonacciN);
+
+    // Warm up, so that return sites are resolved and all blocks translated.
+    EXPECT_EQ(expected, CallInstrumentedTest(func_inst, +kFibonacciN));
+
+    auto begin = std::chrono::steady_clock::now();
+    for (auto i = 0; i < kNumIterations; ++i) {
+      EXPECT_EQ(expected, CallInstrumentedTest(func_inst, +kFibonacciN));
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    auto seconds = std::chrono::duration<double>(end - begin).count();
+    auto num_calls = NumCalls(kFibonacciN) * kNumIterations;
+    printf("[ %-12s ] calls/s=%12.0f\n",
+           use_shadow_stack ? "shadow stack" : "edges",
+           seconds ? static_cast<double>(num_calls) / seconds : 0.0);
+  }
+};
+
+TEST_F(ShadowStackTest, ReturnsUseShadowStack) {
+  if (!FLAG_transparent_returns) return;  // Shadow stack isn't used.
+  FLAG_shadow_return_stack = true;
+  const auto num_old_sites = this->context->NumReturnSites();
+  auto inst = TranslateEntryPoint(this->context, fibonacci_shadow_stack,
+                                  kEntryPointTestCase);
+  auto func_inst = UnsafeCast<int(*)(int)>(inst);
+  const auto expected = fibonacci_shadow_stack(kFibonacciN);
+  EXPECT_EQ(expected, CallInstrumentedTest(func_inst, +kFibonacciN));
+
+  // The recursive calls pushed return sites. Every return to them missed the
+  // shadow stack at most once, which resolved their code cache addresses.
+  // The recursion is shallower than the shadow stack, so every later return
+  // pops its own return site, and goes directly to its code cache address.
+  const auto num_sites = this->context->NumReturnSites();
+  EXPECT_LT(num_old_sites, num_sites);
+  EXPECT_EQ(num_sites, this->context->NumResolvedReturnSites());
+
+  for (auto i = 0; i < kNumIterations; ++i) {
+    EXPECT_EQ(expected, CallInstrumentedTest(func_inst, +kFibonacciN));
+  }
+  EXPECT_EQ(num_sites, this->context->NumReturnSites());
+  EXPECT_EQ(num_sites, this->context->NumResolvedReturnSites());
+}
+
+// Compares the call/return throughput with and without the shadow stack. This
+// is a benchmark, and so only runs with `make bench`.
+TEST_F(ShadowStackTest, DISABLED_RecursiveCallsAndReturnsBenchmark) {
+  if (!FLAG_transparent_returns) return;  // Shadow stack isn't used.
+  Benchmark(fibonacci_edges, false);
+  Benchmark(fibonacci_shadow_stack, true);
+}
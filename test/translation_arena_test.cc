@@ -0,0 +1,143 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#include <gmock/gmock.h>
+
+#include <chrono>
+#include <cstdio>
+
+#define GRANARY_INTERNAL
+#define GRANARY_TEST
+
+#include "granary/base/base.h"
+#include "granary/base/cast.h"
+#include "granary/base/new.h"
+#include "granary/base/option.h"
+
+#include "granary/cfg/instruction.h"
+
+#include "granary/context.h"
+#include "granary/exit.h"
+#include "granary/init.h"
+#include "granary/translate.h"
+
+GRANARY_DECLARE_bool(translation_arena);
+
+using namespace granary;
+using namespace ::testing;
+
+namespace {
+enum {
+  kNumTranslations = 16,
+  kNumBenchmarkTranslations = 1024,
+
+  // Enough labels to outgrow the region of a translation arena.
+  kNumLabels = 8192
+};
+
+GRANARY_TEST_CASE
+static int sum_to(int n) {
+  auto sum = 0;
+  for (auto i = 1; i <= n; ++i) {
+    if (i & 1) {
+      sum += i;
+    } else {
+      sum += i * 2;
+    }
+  }
+  return sum;
+}
+
+// Returns the number of operations per second.
+static double OpsPerSecond(size_t num_ops,
+                           std::chrono::steady_clock::duration duration) {
+  auto seconds = std::chrono::duration<double>(duration).count();
+  return seconds ? static_cast<double>(num_ops) / seconds : 0.0;
+}
+}  // namespace
+
+class TranslationArenaTest : public TestWithParam<bool> {
+ protected:
+  static void SetUpTestCase(void) {
+    Init(kInitAttach);
+  }
+
+  static void TearDownTestCase(void) {
+    Exit(kExitDetach);
+  }
+
+  // Switch between the translation arena and the slab allocators.
+  virtual void SetUp(void) {
+    FLAG_translation_arena = GetParam();
+  }
+
+  virtual void TearDown(void) {
+    FLAG_translation_arena = true;
+  }
+};
+
+TEST_P(TranslationArenaTest, ArenaOnlyUsedWhenTranslating) {
+  auto label = new LabelInstruction;
+  EXPECT_FALSE(granary::internal::IsTranslationArenaAddress(label));
+  delete label;
+
+  EnterTranslationArena();
+  label = new LabelInstruction;
+  EXPECT_EQ(GetParam(), granary::internal::IsTranslationArenaAddress(label));
+  delete label;
+  LeaveTranslationArena();
+}
+
+TEST_P(TranslationArenaTest, ArenaIsReusedAfterTranslating) {
+  EnterTranslationArena();
+  auto first_label = new LabelInstruction;
+  delete first_label;
+  LeaveTranslationArena();
+
+  EnterTranslationArena();
+  auto second_label = new LabelInstruction;
+  EXPECT_EQ(GetParam(), first_label == second_label);
+  delete second_label;
+  LeaveTranslationArena();
+}
+
+TEST_P(TranslationArenaTest, OverflowFallsBackToSlabs) {
+  static LabelInstruction *labels[kNumLabels];
+  EnterTranslationArena();
+  for (auto &label : labels) label = new LabelInstruction;
+  EXPECT_EQ(GetParam(),
+            granary::internal::IsTranslationArenaAddress(labels[0]));
+  EXPECT_FALSE(granary::internal::IsTranslationArenaAddress(
+      labels[kNumLabels - 1]));
+  for (auto label : labels) delete label;
+  LeaveTranslationArena();
+}
+
+TEST_P(TranslationArenaTest, RepeatedTranslationsAreCorrect) {
+  auto context = GlobalContext();
+  for (auto i = 0; i < kNumTranslations; ++i) {
+    auto cache_pc = TranslateEntryPoint(context, sum_to, kEntryPointTestCase);
+    auto sum_to_inst = UnsafeCast<int(*)(int)>(cache_pc);
+    EXPECT_EQ(sum_to(100), sum_to_inst(100));
+  }
+}
+
+// Measures translation throughput with and without the translation arena.
+// This is a benchmark, and so only runs with `make bench`.
+TEST_P(TranslationArenaTest, DISABLED_TranslationThroughputBenchmark) {
+  auto context = GlobalContext();
+  auto begin = std::chrono::steady_clock::now();
+  CachePC cache_pc(nullptr);
+  for (auto i = 0; i < kNumBenchmarkTranslations; ++i) {
+    cache_pc = TranslateEntryPoint(context, sum_to, kEntryPointTestCase);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  auto sum_to_inst = UnsafeCast<int(*)(int)>(cache_pc);
+  EXPECT_EQ(sum_to(100), sum_to_inst(100));
+
+  printf("[ %-9s ] translations/s=%12.0f\n",
+         GetParam() ? "arena" : "slab",
+         OpsPerSecond(kNumBenchmarkTranslations, end - begin));
+}
+
+INSTANTIATE_TEST_CASE_P(SlabAndArena, TranslationArenaTest, Bool());